@@ -0,0 +1,177 @@
+// =========================================================
+// 状態ベクトルの近似最近傍探索 (HNSW) の再現率と速度
+//
+//   ビルド例:
+//     gcc -O2 -march=native -pthread -o bench_ann bench/bench_ann.c -lm
+//   実行例:
+//     ./bench_ann --workload words --keys 100000 --threads 8 --ef 16,64,256
+//
+//   登録 key の葉の状態で索引を作り (hnsw_build_leaves)、別に生成した key の
+//   状態を問い合わせにして、ef ごとに
+//     recall@k (全件比較の k 近傍との一致率), ns/query, 全件比較に対する速度比
+//   を並べる。構築時間は --threads 本で測る。最後に索引を保存して mmap で
+//   読み直し (hnsw_save / hnsw_load)、同じ検索結果になることを確かめる
+//   (一致しなければ終了コード 1)。
+// =========================================================
+#define TRLM_NO_MAIN
+#include "../trlm.c"
+#include "bench_common.h"
+
+typedef struct {
+    const Hnsw* ix;
+    const float* Q;      // n_q x RESERVOIR_SIZE
+    long n_q;
+    int k;
+    int ef;              // 0 なら全件比較
+} AnnCtx;
+
+static double bench_ann_query(void* p, long iters) {
+    AnnCtx* c = (AnnCtx*)p;
+    long labels[256];
+    float dist[256];
+    long sum = 0;
+    for(long it = 0; it < iters; it++) {
+        const float* q = c->Q + (it % c->n_q) * RESERVOIR_SIZE;
+        int n = c->ef? hnsw_search(c->ix, q, c->k, c->ef, labels, dist) : hnsw_search_exact(c->ix, q, c->k, labels, dist);
+        sum += n? labels[0] : 0;
+    }
+    bench_sink = (float)sum;
+    return 0.0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [--workload words|ident|url|log] [--keys N] [--queries N] [--k N]\n"
+        "          [--m N] [--ef-construction N] [--ef E1,E2,...] [--threads N]\n"
+        "          [--index PATH] [--reps N] [--seed N]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    WorkloadKind wl = WL_WORDS;
+    long n_keys = 50000, n_q = 500;
+    int k = 10, M = 16, ef_c = 200, threads = 4;
+    char ef_list[128] = "10,32,64,128,256";
+    const char* index_path = "/tmp/trlm_bench_ann.hnsw";
+    unsigned long long seed = 42;
+    BenchConfig cfg = { 5, 0.05, 0.05 };
+    for(int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        const char* v = (i + 1 < argc)? argv[i + 1] : NULL;
+        if(!v) { usage(argv[0]); return 1; }
+        if(strcmp(a, "--keys") == 0) n_keys = atol(v);
+        else if(strcmp(a, "--queries") == 0) n_q = atol(v);
+        else if(strcmp(a, "--k") == 0) k = atoi(v);
+        else if(strcmp(a, "--m") == 0) M = atoi(v);
+        else if(strcmp(a, "--ef-construction") == 0) ef_c = atoi(v);
+        else if(strcmp(a, "--ef") == 0) snprintf(ef_list, sizeof(ef_list), "%s", v);
+        else if(strcmp(a, "--threads") == 0) threads = atoi(v);
+        else if(strcmp(a, "--index") == 0) index_path = v;
+        else if(strcmp(a, "--reps") == 0) cfg.reps = atoi(v);
+        else if(strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else if(strcmp(a, "--workload") == 0) {
+            if(workload_parse(v, &wl) != 0) { usage(argv[0]); return 1; }
+        } else { usage(argv[0]); return 1; }
+        i++;
+    }
+    if(cfg.reps < 1) cfg.reps = 1;
+    if(k < 1) k = 1;
+    if(k > 256) k = 256;
+    if(n_q < 1) n_q = 1;
+
+    KeySet ks, qs;
+    bench_make_workload(&ks, wl, n_keys, seed);
+    bench_make_workload(&qs, wl, n_q, seed + 101);
+    TrieNode* root = create_trie_node(0);
+    for(long i = 0; i < ks.n; i++) trie_insert(root, keyset_get(&ks, i));
+    TrieBackend tb;
+    trie_backend_pointer(&tb, root);
+    init_reservoir_weights_seeded(MAX_DEPTH, (unsigned int)seed);
+    noise_seed((unsigned int)seed);
+
+    Hnsw ix;
+    double t0 = now_seconds();
+    hnsw_build_leaves(&ix, &tb, NULL, M, ef_c, threads, (unsigned int)seed);
+    double build = now_seconds() - t0;
+
+    float* Q = (float*)calloc((size_t)qs.n * RESERVOIR_SIZE, sizeof(float));
+    for(long i = 0; i < qs.n; i++) trie_backend_forward(&tb, keyset_get(&qs, i), Q + i * RESERVOIR_SIZE);
+    long* truth = (long*)malloc(sizeof(long) * k * qs.n);
+    for(long i = 0; i < qs.n; i++) hnsw_search_exact(&ix, Q + i * RESERVOIR_SIZE, k, truth + i * k, NULL);
+
+    printf("# workload=%s keys=%ld leaves=%ld queries=%ld k=%d M=%d ef_construction=%d\n",
+           workload_name(wl), ks.n, ix.n, qs.n, k, M, ef_c);
+    printf("# build: %.3f s with %d threads (%.0f inserts/s), index %zu bytes (%.1f bytes/leaf)\n",
+           build, threads, ix.n / build, hnsw_bytes(&ix), (double)hnsw_bytes(&ix) / (ix.n? ix.n : 1));
+    printf("%-8s %10s %12s %10s\n", "ef", "recall@k", "ns/query", "speedup");
+
+    double* samples = (double*)malloc(sizeof(double) * cfg.reps);
+    AnnCtx ctx = { &ix, Q, qs.n, k, 0 };
+    bench_measure(&cfg, bench_ann_query, &ctx, samples);
+    const double exact_ns = bench_stats(samples, cfg.reps).median;
+    printf("%-8s %9.2f%% %12.1f %10.2f\n", "exact", 100.0, exact_ns, 1.0);
+
+    long labels[256];
+    int max_ef = k;
+    char* save = NULL;
+    for(char* t = strtok_r(ef_list, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        int ef = atoi(t);
+        if(ef < k) ef = k;
+        if(ef > max_ef) max_ef = ef;
+        long found = 0;
+        for(long i = 0; i < qs.n; i++) {
+            int n = hnsw_search(&ix, Q + i * RESERVOIR_SIZE, k, ef, labels, NULL);
+            for(int a = 0; a < n; a++) {
+                for(int b = 0; b < k; b++) {
+                    if(labels[a] == truth[i * k + b]) {
+                        found++;
+                        break;
+                    }
+                }
+            }
+        }
+        ctx.ef = ef;
+        bench_measure(&cfg, bench_ann_query, &ctx, samples);
+        double ns = bench_stats(samples, cfg.reps).median;
+        printf("%-8d %9.2f%% %12.1f %10.2f\n", ef, 100.0 * found / ((double)qs.n * k), ns, exact_ns / ns);
+    }
+
+    // 保存して mmap で読み直し、検索結果が変わらないことを確かめる
+    int failures = 0;
+    if(hnsw_save(&ix, index_path) != 0) {
+        fprintf(stderr, "cannot write %s\n", index_path);
+        failures++;
+    } else {
+        Hnsw mapped;
+        t0 = now_seconds();
+        int rc = hnsw_load(&mapped, index_path);
+        double load_ms = (now_seconds() - t0) * 1e3;
+        if(rc != 0) {
+            fprintf(stderr, "cannot load %s\n", index_path);
+            failures++;
+        } else {
+            long other[256];
+            float da[256], db[256];
+            for(long i = 0; i < qs.n; i++) {
+                const float* q = Q + i * RESERVOIR_SIZE;
+                int na = hnsw_search(&ix, q, k, max_ef, labels, da);
+                int nb = hnsw_search(&mapped, q, k, max_ef, other, db);
+                if(na != nb || memcmp(labels, other, sizeof(long) * na) != 0 || memcmp(da, db, sizeof(float) * na) != 0) {
+                    failures++;
+                }
+            }
+            printf("# mmap: %s %zu bytes, load %.3f ms, %s\n", index_path, mapped.map_bytes, load_ms,
+                   failures? "MISMATCH" : "identical results");
+            hnsw_free(&mapped);
+        }
+    }
+
+    free(samples);
+    free(truth);
+    free(Q);
+    hnsw_thread_release();
+    hnsw_free(&ix);
+    trie_free(root);
+    keyset_free(&qs);
+    keyset_free(&ks);
+    return failures? 1 : 0;
+}
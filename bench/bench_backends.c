@@ -0,0 +1,253 @@
+// =========================================================
+// Trie バックエンドの適合性チェック + 性能比較
+//
+//   ビルド例:
+//     gcc -O2 -pthread -o bench_backends bench/bench_backends.c -lm
+//   実行例:
+//     ./bench_backends --workloads words,url --size 50000
+//     ./bench_backends --backends frozen --reps 5
+//
+//   ワークロードごとに同じコーパスから pointer (基準) と各バックエンドを作り、
+//     - ノード数, 子の列挙順 (バイト, is_leaf, depth) が基準と一致するか
+//     - node_id が 0..node_count-1 で重複しないか
+//     - 登録 key と未登録 key の実効深度が一致するか
+//     - 同じノイズシードで trie_backend_forward / forward_batch の状態が
+//       ビット単位で一致するか
+//   を確かめ、走査 (実効深度) と forward の ns/key を並べる。
+//   1 つでも不一致があれば終了コード 1。
+//   hash は登録表の作り方 (TrieNode から複写) に加えて、key から --threads 本で
+//   並列に挿入した場合 (hash-par, trie_backend_hash_from_keys) も同じ検査にかける。
+// =========================================================
+#define TRLM_NO_MAIN
+#include "../trlm.c"
+#include "bench_common.h"
+
+typedef struct {
+    const TrieBackend* tb;
+    const KeySet* queries;
+    float h[RESERVOIR_SIZE];
+} BackendCtx;
+
+static double bench_walk(void* p, long iters) {
+    BackendCtx* c = (BackendCtx*)p;
+    long sum = 0;
+    for(long it = 0; it < iters; it++) {
+        sum += trie_backend_effective_depth(c->tb, keyset_get(c->queries, it % c->queries->n));
+    }
+    bench_sink = (float)sum;
+    return 0.0;
+}
+
+static double bench_forward(void* p, long iters) {
+    BackendCtx* c = (BackendCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        memset(c->h, 0, sizeof(c->h));
+        trie_backend_forward(c->tb, keyset_get(c->queries, it % c->queries->n), c->h);
+    }
+    bench_sink = c->h[0];
+    return 0.0;
+}
+
+// 基準と同じ形の木か: 子をバイト昇順に並べて同時に深さ優先で辿る
+static int check_structure(const TrieBackend* ref, TrieRef rn, const TrieBackend* tb, TrieRef tn,
+                           unsigned char* seen_id, const char** why) {
+    if(ref->is_leaf(ref->impl, rn) != tb->is_leaf(tb->impl, tn)) { *why = "is_leaf"; return 0; }
+    if(ref->depth(ref->impl, rn) != tb->depth(tb->impl, tn)) { *why = "depth"; return 0; }
+    long id = tb->node_id(tb->impl, tn);
+    if(id < 0 || id >= tb->node_count(tb->impl) || seen_id[id]) { *why = "node_id"; return 0; }
+    seen_id[id] = 1;
+
+    TrieRef rc, tc;
+    int rb = ref->child_next(ref->impl, rn, 0, &rc);
+    int b = tb->child_next(tb->impl, tn, 0, &tc);
+    while(rb >= 0 || b >= 0) {
+        if(rb != b) { *why = "child_next"; return 0; }
+        if(tb->step(tb->impl, tn, (unsigned char)b) != tc) { *why = "step"; return 0; }
+        if(!check_structure(ref, rc, tb, tc, seen_id, why)) return 0;
+        rb = ref->child_next(ref->impl, rn, rb + 1, &rc);
+        b = tb->child_next(tb->impl, tn, b + 1, &tc);
+    }
+    return 1;
+}
+
+static int check_states(const TrieBackend* ref, const TrieBackend* tb, const KeySet* ks,
+                        long limit, const char** why) {
+    long n = (ks->n < limit)? ks->n : limit;
+    float a[RESERVOIR_SIZE], b[RESERVOIR_SIZE];
+    for(long i = 0; i < ks->n; i++) {
+        const char* k = keyset_get(ks, i);
+        if(trie_backend_effective_depth(ref, k) != trie_backend_effective_depth(tb, k)) {
+            *why = "effective_depth";
+            return 0;
+        }
+    }
+    for(long i = 0; i < n; i++) {
+        const char* k = keyset_get(ks, i);
+        memset(a, 0, sizeof(a));
+        memset(b, 0, sizeof(b));
+        noise_seed((unsigned int)i + 1);
+        trie_backend_forward(ref, k, a);
+        noise_seed((unsigned int)i + 1);
+        trie_backend_forward(tb, k, b);
+        if(memcmp(a, b, sizeof(a)) != 0) { *why = "forward"; return 0; }
+    }
+
+    const char** keys = (const char**)malloc(sizeof(char*) * (n > 0? n : 1));
+    for(long i = 0; i < n; i++) keys[i] = keyset_get(ks, i);
+    float* HA = (float*)calloc((size_t)n * RESERVOIR_SIZE + 1, sizeof(float));
+    float* HB = (float*)calloc((size_t)n * RESERVOIR_SIZE + 1, sizeof(float));
+    noise_seed(12345);
+    long sa = trie_backend_forward_batch(ref, keys, (int)n, HA);
+    noise_seed(12345);
+    long sb = trie_backend_forward_batch(tb, keys, (int)n, HB);
+    int ok = (sa == sb) && memcmp(HA, HB, sizeof(float) * n * RESERVOIR_SIZE) == 0;
+    if(!ok) *why = "forward_batch";
+    free(HB);
+    free(HA);
+    free(keys);
+    return ok;
+}
+
+// tb を検査して測り、1 行出す。不一致なら 0
+static int report_backend(const char* wl_name, const char* name, TrieBackend* tb, const TrieBackend* ref,
+                          const KeySet* queries, long check_limit, double build_ms,
+                          const BenchConfig* cfg, double* samples) {
+    const char* why = "ok";
+    int ok = tb->node_count(tb->impl) == ref->node_count(ref->impl);
+    if(!ok) why = "node_count";
+    if(ok) {
+        unsigned char* seen = (unsigned char*)calloc(tb->node_count(tb->impl), 1);
+        ok = check_structure(ref, ref->root(ref->impl), tb, tb->root(tb->impl), seen, &why);
+        free(seen);
+    }
+    if(ok) ok = check_states(ref, tb, queries, check_limit, &why);
+
+    BackendCtx ctx;
+    ctx.tb = tb;
+    ctx.queries = queries;
+    bench_measure(cfg, bench_walk, &ctx, samples);
+    double walk = bench_stats(samples, cfg->reps).median;
+    bench_measure(cfg, bench_forward, &ctx, samples);
+    double fwd = bench_stats(samples, cfg->reps).median;
+
+    size_t bytes = tb->bytes(tb->impl);
+    printf("%-6s %-10s %9ld %12zu %10.1f %9.2f %12.1f %12.1f  %s%s\n",
+           wl_name, name, tb->node_count(tb->impl), bytes,
+           (double)bytes / tb->node_count(tb->impl), build_ms, walk, fwd,
+           ok? "" : "FAIL: ", why);
+    return ok;
+}
+
+static int backend_selected(const char* list, const char* name) {
+    if(list == NULL) return 1;
+    size_t len = strlen(name);
+    for(const char* p = list; *p; ) {
+        const char* e = strchr(p, ',');
+        size_t n = e? (size_t)(e - p) : strlen(p);
+        if(n == len && strncmp(p, name, len) == 0) return 1;
+        if(!e) break;
+        p = e + 1;
+    }
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [--workloads words,ident,url,log] [--size N] [--backends a,b]\n"
+        "          [--check-limit N] [--threads N] [--reps N] [--warmup SEC] [--sample SEC]\n"
+        "          [--seed N]\n",
+        prog);
+}
+
+int main(int argc, char** argv) {
+    const char* workloads = "words,ident,url,log";
+    const char* backends = NULL;
+    long size = 20000;
+    long check_limit = 2000;
+    int threads = 4;
+    unsigned long long seed = 42;
+    BenchConfig cfg = { 7, 0.1, 0.05 };
+    for(int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        const char* v = (i + 1 < argc)? argv[i + 1] : NULL;
+        if(v == NULL) { usage(argv[0]); return 1; }
+        if(strcmp(a, "--workloads") == 0) workloads = v;
+        else if(strcmp(a, "--size") == 0) size = atol(v);
+        else if(strcmp(a, "--backends") == 0) backends = v;
+        else if(strcmp(a, "--check-limit") == 0) check_limit = atol(v);
+        else if(strcmp(a, "--threads") == 0) threads = atoi(v);
+        else if(strcmp(a, "--reps") == 0) cfg.reps = atoi(v);
+        else if(strcmp(a, "--warmup") == 0) cfg.warmup_sec = atof(v);
+        else if(strcmp(a, "--sample") == 0) cfg.sample_sec = atof(v);
+        else if(strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else { usage(argv[0]); return 1; }
+        i++;
+    }
+    if(size < 1) size = 1;
+    if(cfg.reps < 1) cfg.reps = 1;
+
+    init_reservoir_weights_seeded(MAX_DEPTH, (unsigned int)seed);
+    double* samples = (double*)malloc(sizeof(double) * cfg.reps);
+    int failures = 0;
+
+    printf("%-6s %-10s %9s %12s %10s %9s %12s %12s  %s\n", "wl", "backend", "nodes", "bytes",
+           "bytes/node", "build ms", "walk ns/key", "fwd ns/key", "conformance");
+    char list[256];
+    snprintf(list, sizeof(list), "%s", workloads);
+    for(char* tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        WorkloadKind wl;
+        if(workload_parse(tok, &wl) != 0) { usage(argv[0]); return 1; }
+        KeySet ks, miss, queries;
+        bench_make_workload(&ks, wl, size, seed);
+        bench_make_workload(&miss, wl, size / 4 + 1, seed + 7);
+        // 問い合わせは登録 key と (多くは) 未登録の key を 4:1 で混ぜる
+        memset(&queries, 0, sizeof(queries));
+        queries.off = (size_t*)malloc(sizeof(size_t) * (ks.n + miss.n));
+        for(long i = 0; i < ks.n; i++) {
+            const char* k = keyset_get(&ks, i);
+            keyset_push(&queries, k, strlen(k));
+            if(i % 4 == 3 && i / 4 < miss.n) {
+                k = keyset_get(&miss, i / 4);
+                keyset_push(&queries, k, strlen(k));
+            }
+        }
+
+        TrieNode* root = create_trie_node(0);
+        for(long i = 0; i < ks.n; i++) trie_insert(root, keyset_get(&ks, i));
+        TrieBackend ref;
+        trie_backend_pointer(&ref, root);
+
+        for(int b = 0; b < TRIE_BACKEND_COUNT; b++) {
+            const char* name = trie_backend_registry[b].name;
+            if(!backend_selected(backends, name)) continue;
+            TrieBackend tb;
+            double t0 = now_seconds();
+            trie_backend_build(&tb, name, root);
+            double build_ms = (now_seconds() - t0) * 1e3;
+            if(!report_backend(workload_name(wl), name, &tb, &ref, &queries, check_limit, build_ms, &cfg, samples)) {
+                failures++;
+            }
+            trie_backend_destroy(&tb);
+        }
+        if(backend_selected(backends, "hash")) {
+            const char** keys = (const char**)malloc(sizeof(char*) * ks.n);
+            for(long i = 0; i < ks.n; i++) keys[i] = keyset_get(&ks, i);
+            TrieBackend tb;
+            double t0 = now_seconds();
+            int rc = trie_backend_hash_from_keys(&tb, keys, ks.n, threads);
+            double build_ms = (now_seconds() - t0) * 1e3;
+            if(rc != 0 || !report_backend(workload_name(wl), "hash-par", &tb, &ref, &queries, check_limit, build_ms,
+                                          &cfg, samples)) {
+                failures++;
+            }
+            trie_backend_destroy(&tb);
+            free(keys);
+        }
+        trie_free(root);
+        keyset_free(&queries);
+        keyset_free(&miss);
+        keyset_free(&ks);
+    }
+    free(samples);
+    return failures? 1 : 0;
+}
@@ -0,0 +1,448 @@
+// =========================================================
+// ベンチマーク共通ヘルパー
+//   trlm.c を (TRLM_NO_MAIN 付きで) #include した後に読み込む
+//   - 再現可能な乱数 (splitmix64) と key 生成
+//   - ウォームアップ + 繰り返し計測 + 統計量
+// =========================================================
+#ifndef TRLM_BENCH_COMMON_H
+#define TRLM_BENCH_COMMON_H
+
+#include <unistd.h>
+
+// -------------------------
+// 乱数 (シード固定で同じ系列を再現できる)
+// -------------------------
+typedef struct {
+    unsigned long long s;
+} BenchRng;
+
+static inline unsigned long long bench_rng_next(BenchRng* r) {
+    unsigned long long z = (r->s += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// [0, 1) の一様乱数
+static inline double bench_rng_uniform(BenchRng* r) {
+    return (double)(bench_rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// -------------------------
+// Zipf 分布 (順位 1..n, 指数 s) を累積分布の二分探索でサンプルする
+// -------------------------
+typedef struct {
+    double* cdf;
+    int n;
+} ZipfTable;
+
+static inline void zipf_init(ZipfTable* z, int n, double s) {
+    z->n = n;
+    z->cdf = (double*)malloc(sizeof(double) * n);
+    double sum = 0.0;
+    for(int i = 0; i < n; i++) {
+        sum += 1.0 / pow((double)(i + 1), s);
+        z->cdf[i] = sum;
+    }
+    for(int i = 0; i < n; i++) z->cdf[i] /= sum;
+}
+
+static inline int zipf_sample(const ZipfTable* z, BenchRng* r) {
+    double u = bench_rng_uniform(r);
+    int lo = 0, hi = z->n - 1;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(z->cdf[mid] < u) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+static inline void zipf_free(ZipfTable* z) {
+    free(z->cdf);
+    z->cdf = NULL;
+}
+
+// -------------------------
+// key 分布
+//   uniform: 長さ len のランダム英小文字列 (共有接頭辞がほぼ無い)
+//   zipf   : 語彙 (n/8 語) から Zipf(1.0) で引いた語 (同じ key が繰り返し出る)
+//   prefix : 長さ len/2 の共通接頭辞 + ランダム接尾辞 (深い共有経路)
+// -------------------------
+typedef enum {
+    KEYS_UNIFORM = 0,
+    KEYS_ZIPF,
+    KEYS_PREFIX
+} KeyDist;
+
+static inline const char* key_dist_name(KeyDist d) {
+    switch(d) {
+    case KEYS_UNIFORM: return "uniform";
+    case KEYS_ZIPF:    return "zipf";
+    case KEYS_PREFIX:  return "prefix";
+    }
+    return "?";
+}
+
+static inline int key_dist_parse(const char* s, KeyDist* out) {
+    for(int d = KEYS_UNIFORM; d <= KEYS_PREFIX; d++) {
+        if(strcmp(s, key_dist_name((KeyDist)d)) == 0) {
+            *out = (KeyDist)d;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static inline void bench_random_word(BenchRng* r, char* out, int len) {
+    for(int i = 0; i < len; i++) out[i] = (char)('a' + bench_rng_next(r) % 26);
+    out[len] = '\0';
+}
+
+// n 個の key を生成する (各 key は malloc, bench_free_keys で解放)
+static inline char** bench_make_keys(KeyDist dist, int n, int len, unsigned long long seed) {
+    BenchRng r = { seed };
+    char** keys = (char**)malloc(sizeof(char*) * n);
+    if(dist == KEYS_ZIPF) {
+        int vocab = (n / 8 > 1)? n / 8 : 1;
+        char** words = bench_make_keys(KEYS_UNIFORM, vocab, len, seed ^ 0x5A5AULL);
+        ZipfTable z;
+        zipf_init(&z, vocab, 1.0);
+        for(int i = 0; i < n; i++) keys[i] = strdup(words[zipf_sample(&z, &r)]);
+        zipf_free(&z);
+        for(int i = 0; i < vocab; i++) free(words[i]);
+        free(words);
+        return keys;
+    }
+    char prefix[MAX_DEPTH + 1];
+    int plen = (dist == KEYS_PREFIX)? len / 2 : 0;
+    bench_random_word(&r, prefix, plen);
+    for(int i = 0; i < n; i++) {
+        keys[i] = (char*)malloc(len + 1);
+        memcpy(keys[i], prefix, plen);
+        bench_random_word(&r, keys[i] + plen, len - plen);
+    }
+    return keys;
+}
+
+static inline void bench_free_keys(char** keys, int n) {
+    for(int i = 0; i < n; i++) free(keys[i]);
+    free(keys);
+}
+
+// -------------------------
+// 実運用に近い合成コーパス (end-to-end ベンチ用)
+//   words: Zipf(1.0) に従う英単語風の語 (語彙 50k)
+//   ident: snake_case / camelCase 識別子 + 16 進接尾辞
+//   url  : Zipf で選んだドメイン + パス + クエリ
+//   log  : タイムスタンプ + レベル + サービス名 + メッセージ
+//   key は 1 本のアリーナに連結して持つ (1 億件でも malloc を 1 億回しない)
+// -------------------------
+typedef enum {
+    WL_WORDS = 0,
+    WL_IDENT,
+    WL_URL,
+    WL_LOG,
+    WL_COUNT
+} WorkloadKind;
+
+static inline const char* workload_name(WorkloadKind w) {
+    static const char* names[WL_COUNT] = { "words", "ident", "url", "log" };
+    return ((int)w >= 0 && w < WL_COUNT)? names[w] : "?";
+}
+
+static inline int workload_parse(const char* s, WorkloadKind* out) {
+    for(int w = 0; w < WL_COUNT; w++) {
+        if(strcmp(s, workload_name((WorkloadKind)w)) == 0) {
+            *out = (WorkloadKind)w;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+typedef struct {
+    char* data;      // '\0' 区切りで連結した key
+    size_t* off;     // key i の開始位置
+    long n;
+    size_t used;
+    size_t cap;
+} KeySet;
+
+static inline const char* keyset_get(const KeySet* ks, long i) {
+    return ks->data + ks->off[i];
+}
+
+static inline void keyset_push(KeySet* ks, const char* key, size_t len) {
+    if(ks->used + len + 1 > ks->cap) {
+        while(ks->used + len + 1 > ks->cap) ks->cap = ks->cap? ks->cap * 2 : 1 << 16;
+        ks->data = (char*)realloc(ks->data, ks->cap);
+    }
+    memcpy(ks->data + ks->used, key, len);
+    ks->data[ks->used + len] = '\0';
+    ks->off[ks->n++] = ks->used;
+    ks->used += len + 1;
+}
+
+static inline void keyset_free(KeySet* ks) {
+    free(ks->data);
+    free(ks->off);
+    memset(ks, 0, sizeof(*ks));
+}
+
+// 英単語風の語 (子音/母音を交互に並べる, 長さ 3..12)
+static inline int bench_pseudo_word(BenchRng* r, char* out) {
+    static const char* cons = "bcdfghklmnprstvwz";
+    static const char* vows = "aeiou";
+    int len = 3 + (int)(bench_rng_next(r) % 10);
+    for(int i = 0; i < len; i++) {
+        out[i] = (i % 2 == 0)? cons[bench_rng_next(r) % 17] : vows[bench_rng_next(r) % 5];
+    }
+    out[len] = '\0';
+    return len;
+}
+
+static inline void bench_make_workload(KeySet* ks, WorkloadKind w, long n, unsigned long long seed) {
+    static const char* levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char* services[] = { "api", "auth", "billing", "search", "worker", "gateway" };
+    static const char* tlds[] = { "com", "net", "org", "io", "jp" };
+    enum { VOCAB = 50000, DOMAINS = 1000 };
+
+    memset(ks, 0, sizeof(*ks));
+    ks->off = (size_t*)malloc(sizeof(size_t) * (n > 0? n : 1));
+    BenchRng r = { seed * 0x100000001B3ULL + (unsigned long long)w };
+
+    // 語彙 (全ワークロードで共有する単語表)
+    BenchRng vr = { seed };
+    char (*vocab)[16] = (char (*)[16])malloc(sizeof(*vocab) * VOCAB);
+    for(int i = 0; i < VOCAB; i++) bench_pseudo_word(&vr, vocab[i]);
+    ZipfTable zw, zd;
+    zipf_init(&zw, VOCAB, 1.0);
+    zipf_init(&zd, DOMAINS, 1.1);
+
+    char buf[256];
+    for(long i = 0; i < n; i++) {
+        int len = 0;
+        switch(w) {
+        case WL_WORDS:
+            len = snprintf(buf, sizeof(buf), "%s", vocab[zipf_sample(&zw, &r)]);
+            break;
+        case WL_IDENT:
+            if(bench_rng_next(&r) % 2) {
+                len = snprintf(buf, sizeof(buf), "%s_%s_%08llx", vocab[zipf_sample(&zw, &r)],
+                               vocab[bench_rng_next(&r) % VOCAB], bench_rng_next(&r) & 0xFFFFFFFFULL);
+            } else {
+                char a[16];
+                snprintf(a, sizeof(a), "%s", vocab[bench_rng_next(&r) % VOCAB]);
+                a[0] = (char)(a[0] - 'a' + 'A');
+                len = snprintf(buf, sizeof(buf), "get%s%llu", a, bench_rng_next(&r) % 100000);
+            }
+            break;
+        case WL_URL: {
+            int d = zipf_sample(&zd, &r);
+            len = snprintf(buf, sizeof(buf), "https://www.%s%d.%s/%s/%s?id=%llu",
+                           vocab[d], d, tlds[d % 5], vocab[zipf_sample(&zw, &r)],
+                           vocab[bench_rng_next(&r) % VOCAB], bench_rng_next(&r) % 1000000);
+            break;
+        }
+        case WL_LOG: {
+            unsigned long long t = 1700000000ULL + i / 50 + bench_rng_next(&r) % 5;
+            len = snprintf(buf, sizeof(buf), "2026-10-%02llu %02llu:%02llu:%02llu %s %s: %s %s",
+                           1 + (t / 86400) % 28, (t / 3600) % 24, (t / 60) % 60, t % 60,
+                           levels[bench_rng_next(&r) % 6], services[zipf_sample(&zd, &r) % 6],
+                           vocab[zipf_sample(&zw, &r)], vocab[zipf_sample(&zw, &r)]);
+            break;
+        }
+        default:
+            break;
+        }
+        if(len >= (int)sizeof(buf)) len = (int)sizeof(buf) - 1;
+        keyset_push(ks, buf, (size_t)len);
+    }
+    zipf_free(&zd);
+    zipf_free(&zw);
+    free(vocab);
+}
+
+// -------------------------
+// Trie のノード数 / プロセスの常駐メモリ
+// -------------------------
+static inline long bench_count_nodes(const TrieNode* node) {
+    long n = 1;
+    for(int i = 0; i < MAX_CHILDREN; i++) {
+        if(node->children[i]) n += bench_count_nodes(node->children[i]);
+    }
+    return n;
+}
+
+static inline long bench_rss_bytes(void) {
+    long pages = 0, rss = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if(!fp) return -1;
+    if(fscanf(fp, "%ld %ld", &pages, &rss) != 2) rss = -1;
+    fclose(fp);
+    return (rss < 0)? -1 : rss * sysconf(_SC_PAGESIZE);
+}
+
+// -------------------------
+// 実行環境の指紋 (ベースライン比較で環境の違いを検出する)
+//   "machine": CPU 名, 論理コア数, カーネル
+//   "build"  : コンパイラ, 最適化/命令セット/計測系のマクロ, 次元
+// -------------------------
+static inline void bench_json_string(FILE* fp, const char* s) {
+    fputc('"', fp);
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\') fputc('\\', fp);
+        if((unsigned char)*s >= 0x20) fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static inline void bench_write_fingerprint(FILE* fp) {
+    char cpu[256] = "unknown";
+    FILE* ci = fopen("/proc/cpuinfo", "r");
+    if(ci) {
+        char line[512];
+        while(fgets(line, sizeof(line), ci)) {
+            if(strncmp(line, "model name", 10) == 0) {
+                char* c = strchr(line, ':');
+                if(c) {
+                    snprintf(cpu, sizeof(cpu), "%s", c + 2);
+                    cpu[strcspn(cpu, "\n")] = '\0';
+                }
+                break;
+            }
+        }
+        fclose(ci);
+    }
+    char kernel[256] = "unknown";
+    FILE* kv = fopen("/proc/sys/kernel/osrelease", "r");
+    if(kv) {
+        if(fgets(kernel, sizeof(kernel), kv)) kernel[strcspn(kernel, "\n")] = '\0';
+        fclose(kv);
+    }
+    fprintf(fp, "\"machine\":{\"cpu\":");
+    bench_json_string(fp, cpu);
+    fprintf(fp, ",\"cores\":%ld,\"kernel\":", sysconf(_SC_NPROCESSORS_ONLN));
+    bench_json_string(fp, kernel);
+    fprintf(fp, "},\"build\":{\"compiler\":");
+#ifdef __VERSION__
+    bench_json_string(fp, __VERSION__);
+#else
+    bench_json_string(fp, "unknown");
+#endif
+    fprintf(fp, ",\"flags\":[");
+    const char* flags[] = {
+#ifdef __OPTIMIZE__
+        "__OPTIMIZE__",
+#endif
+#ifdef __FAST_MATH__
+        "__FAST_MATH__",
+#endif
+#ifdef __AVX2__
+        "__AVX2__",
+#endif
+#ifdef __FMA__
+        "__FMA__",
+#endif
+#ifdef __F16C__
+        "__F16C__",
+#endif
+#ifdef __AVX512F__
+        "__AVX512F__",
+#endif
+#ifdef TRLM_INSTRUMENT
+        "TRLM_INSTRUMENT",
+#endif
+        NULL
+    };
+    for(int i = 0; flags[i]; i++) fprintf(fp, "%s\"%s\"", i? "," : "", flags[i]);
+    fprintf(fp, "],\"reservoir_size\":%d,\"out_dim\":%d,\"max_depth\":%d}",
+            RESERVOIR_SIZE, OUT_DIM, MAX_DEPTH);
+}
+
+// -------------------------
+// 統計量
+// -------------------------
+typedef struct {
+    double median;
+    double mean;
+    double stddev;
+    double min;
+    double max;
+} BenchStats;
+
+static inline int bench_cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static inline BenchStats bench_stats(const double* v, int n) {
+    BenchStats st;
+    memset(&st, 0, sizeof(st));
+    if(n <= 0) return st;
+    double* sorted = (double*)malloc(sizeof(double) * n);
+    memcpy(sorted, v, sizeof(double) * n);
+    qsort(sorted, n, sizeof(double), bench_cmp_double);
+    st.min = sorted[0];
+    st.max = sorted[n - 1];
+    st.median = (n % 2)? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+    for(int i = 0; i < n; i++) st.mean += v[i];
+    st.mean /= n;
+    for(int i = 0; i < n; i++) st.stddev += (v[i] - st.mean) * (v[i] - st.mean);
+    st.stddev = (n > 1)? sqrt(st.stddev / (n - 1)) : 0.0;
+    free(sorted);
+    return st;
+}
+
+// -------------------------
+// 計測ハーネス
+//   fn(ctx, iters) が iters 回の操作を行い、計測から除外したい時間
+//   (後始末など, 秒) を返す。通常は 0。
+//   1 サンプルが sample_sec 程度になるよう iters を較正し、
+//   warmup_sec だけ空回ししてから reps 個のサンプル (ns/op) を取る
+// -------------------------
+typedef double (*BenchFn)(void* ctx, long iters);
+
+typedef struct {
+    int reps;
+    double warmup_sec;
+    double sample_sec;
+} BenchConfig;
+
+static volatile float bench_sink;   // 最適化で計算が消えないようにする
+
+static inline long bench_calibrate(BenchFn fn, void* ctx, double sample_sec) {
+    long iters = 1;
+    for(;;) {
+        double t0 = now_seconds();
+        double excluded = fn(ctx, iters);
+        double dt = now_seconds() - t0 - excluded;
+        if(dt >= sample_sec * 0.5 || iters >= (1L << 30)) {
+            double scaled = (dt > 0.0)? iters * (sample_sec / dt) : iters * 2.0;
+            return (scaled < 1.0)? 1 : (long)scaled;
+        }
+        iters *= 2;
+    }
+}
+
+// samples に reps 個の ns/op を書き込む
+static inline void bench_measure(const BenchConfig* cfg, BenchFn fn, void* ctx, double* samples) {
+    long iters = bench_calibrate(fn, ctx, cfg->sample_sec);
+    double t_end = now_seconds() + cfg->warmup_sec;
+    while(now_seconds() < t_end) fn(ctx, iters);
+    for(int r = 0; r < cfg->reps; r++) {
+        double t0 = now_seconds();
+        double excluded = fn(ctx, iters);
+        samples[r] = (now_seconds() - t0 - excluded) * 1e9 / (double)iters;
+    }
+}
+
+// ハードウェアカウンタを有効にして fn を iters 回だけ実行する
+// (除外時間の区間もカウンタには含まれる)
+static inline void bench_perf(PerfGroup* g, BenchFn fn, void* ctx, long iters, PerfSample* out) {
+    perf_group_start(g);
+    fn(ctx, iters);
+    perf_group_stop(g, out);
+}
+
+#endif // TRLM_BENCH_COMMON_H
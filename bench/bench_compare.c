@@ -0,0 +1,365 @@
+// =========================================================
+// ベンチマーク結果のベースライン比較 (回帰検出)
+//
+//   ビルド例:
+//     gcc -O2 -o bench_compare bench/bench_compare.c -lm
+//   実行例:
+//     ./bench_kernels --json base.json            # ベースラインを保存
+//     ./bench_kernels --json cur.json             # 変更後に再計測
+//     ./bench_compare base.json cur.json --threshold 0.05 --alpha 0.01
+//
+//   各ベンチの生サンプル (ns/op) を Mann-Whitney U 検定 (正規近似,
+//   同順位補正あり, 両側) で比べ、中央値の悪化が threshold を超え、かつ
+//   p < alpha のものを REGRESSION とする。1 件でもあれば終了コード 1。
+//   machine / build / config が違う場合は比較自体の妥当性を警告する。
+//
+//   JSON は bench_kernels --json の出力だけを読めればよいので、
+//   オブジェクト / 配列 / 文字列 / 数値 / true,false,null の最小パーサで読む。
+// =========================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// -------------------------
+// 最小 JSON パーサ
+// -------------------------
+typedef enum { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT } JsonType;
+
+typedef struct JsonValue {
+    JsonType type;
+    double number;
+    char* string;             // JSON_STRING
+    int count;                // 配列 / オブジェクトの要素数
+    char** keys;              // JSON_OBJECT
+    struct JsonValue** items; // JSON_ARRAY / JSON_OBJECT
+} JsonValue;
+
+typedef struct {
+    const char* p;
+    const char* err;
+} JsonParser;
+
+static void json_skip_ws(JsonParser* jp) {
+    while(*jp->p == ' ' || *jp->p == '\t' || *jp->p == '\n' || *jp->p == '\r') jp->p++;
+}
+
+static JsonValue* json_new(JsonType t) {
+    JsonValue* v = (JsonValue*)calloc(1, sizeof(JsonValue));
+    v->type = t;
+    return v;
+}
+
+static void json_free(JsonValue* v) {
+    if(!v) return;
+    free(v->string);
+    for(int i = 0; i < v->count; i++) {
+        if(v->keys) free(v->keys[i]);
+        json_free(v->items[i]);
+    }
+    free(v->keys);
+    free(v->items);
+    free(v);
+}
+
+static char* json_parse_string_raw(JsonParser* jp) {
+    if(*jp->p != '"') { jp->err = "expected string"; return NULL; }
+    jp->p++;
+    size_t cap = 32, len = 0;
+    char* s = (char*)malloc(cap);
+    while(*jp->p && *jp->p != '"') {
+        char c = *jp->p++;
+        if(c == '\\') {
+            if(*jp->p == '\0') break;  // 末尾の '\' (終端を越えて読まない)
+            c = *jp->p++;
+            switch(c) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'u':  // 比較には不要なので '?' に潰す
+                for(int i = 0; i < 4 && *jp->p; i++) jp->p++;
+                c = '?';
+                break;
+            default: break;
+            }
+        }
+        if(len + 1 >= cap) s = (char*)realloc(s, cap *= 2);
+        s[len++] = c;
+    }
+    if(*jp->p != '"') { jp->err = "unterminated string"; free(s); return NULL; }
+    jp->p++;
+    s[len] = '\0';
+    return s;
+}
+
+static JsonValue* json_parse_value(JsonParser* jp);
+
+static void json_append(JsonValue* v, char* key, JsonValue* item) {
+    v->items = (JsonValue**)realloc(v->items, sizeof(JsonValue*) * (v->count + 1));
+    if(v->type == JSON_OBJECT) v->keys = (char**)realloc(v->keys, sizeof(char*) * (v->count + 1));
+    if(v->type == JSON_OBJECT) v->keys[v->count] = key;
+    v->items[v->count++] = item;
+}
+
+static JsonValue* json_parse_value(JsonParser* jp) {
+    json_skip_ws(jp);
+    char c = *jp->p;
+    if(c == '{' || c == '[') {
+        int is_obj = (c == '{');
+        JsonValue* v = json_new(is_obj? JSON_OBJECT : JSON_ARRAY);
+        jp->p++;
+        json_skip_ws(jp);
+        if(*jp->p == (is_obj? '}' : ']')) { jp->p++; return v; }
+        for(;;) {
+            char* key = NULL;
+            if(is_obj) {
+                json_skip_ws(jp);
+                key = json_parse_string_raw(jp);
+                if(!key) break;
+                json_skip_ws(jp);
+                if(*jp->p != ':') { jp->err = "expected ':'"; free(key); break; }
+                jp->p++;
+            }
+            JsonValue* item = json_parse_value(jp);
+            if(!item) { free(key); break; }
+            json_append(v, key, item);
+            json_skip_ws(jp);
+            if(*jp->p == ',') { jp->p++; continue; }
+            if(*jp->p == (is_obj? '}' : ']')) { jp->p++; return v; }
+            jp->err = "expected ',' or closing bracket";
+            break;
+        }
+        json_free(v);
+        return NULL;
+    }
+    if(c == '"') {
+        char* s = json_parse_string_raw(jp);
+        if(!s) return NULL;
+        JsonValue* v = json_new(JSON_STRING);
+        v->string = s;
+        return v;
+    }
+    if(strncmp(jp->p, "true", 4) == 0 || strncmp(jp->p, "false", 5) == 0) {
+        JsonValue* v = json_new(JSON_BOOL);
+        v->number = (c == 't');
+        jp->p += (c == 't')? 4 : 5;
+        return v;
+    }
+    if(strncmp(jp->p, "null", 4) == 0) {
+        jp->p += 4;
+        return json_new(JSON_NULL);
+    }
+    char* end;
+    double d = strtod(jp->p, &end);
+    if(end == jp->p) { jp->err = "unexpected character"; return NULL; }
+    jp->p = end;
+    JsonValue* v = json_new(JSON_NUMBER);
+    v->number = d;
+    return v;
+}
+
+static JsonValue* json_get(const JsonValue* obj, const char* key) {
+    if(!obj || obj->type != JSON_OBJECT) return NULL;
+    for(int i = 0; i < obj->count; i++)
+        if(strcmp(obj->keys[i], key) == 0) return obj->items[i];
+    return NULL;
+}
+
+// 2 つの値が同じか (指紋の比較用)。数値は完全一致で比べる。
+static int json_equal(const JsonValue* a, const JsonValue* b) {
+    if(!a || !b) return a == b;
+    if(a->type != b->type) return 0;
+    switch(a->type) {
+        case JSON_NULL: return 1;
+        case JSON_BOOL:
+        case JSON_NUMBER: return a->number == b->number;
+        case JSON_STRING: return strcmp(a->string, b->string) == 0;
+        case JSON_ARRAY:
+            if(a->count != b->count) return 0;
+            for(int i = 0; i < a->count; i++) if(!json_equal(a->items[i], b->items[i])) return 0;
+            return 1;
+        case JSON_OBJECT:
+            if(a->count != b->count) return 0;
+            for(int i = 0; i < a->count; i++)
+                if(!json_equal(a->items[i], json_get(b, a->keys[i]))) return 0;
+            return 1;
+    }
+    return 0;
+}
+
+static JsonValue* json_load(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if(!fp) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long n = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char* buf = (char*)malloc(n + 1);
+    size_t got = fread(buf, 1, n, fp);
+    buf[got] = '\0';
+    fclose(fp);
+
+    JsonParser jp = { buf, NULL };
+    JsonValue* v = json_parse_value(&jp);
+    if(!v) fprintf(stderr, "%s: parse error at offset %ld: %s\n", path, (long)(jp.p - buf), jp.err);
+    free(buf);
+    return v;
+}
+
+// -------------------------
+// Mann-Whitney U 検定 (両側, 正規近似 + 同順位補正)
+//   戻り値は p 値。標本が 2 未満なら 1.0。
+// -------------------------
+typedef struct {
+    double v;
+    int group;
+} RankItem;
+
+static int cmp_rank_item(const void* a, const void* b) {
+    double x = ((const RankItem*)a)->v, y = ((const RankItem*)b)->v;
+    return (x > y) - (x < y);
+}
+
+static double mann_whitney_p(const double* a, int na, const double* b, int nb) {
+    if(na < 2 || nb < 2) return 1.0;
+    int n = na + nb;
+    RankItem* it = (RankItem*)malloc(sizeof(RankItem) * n);
+    for(int i = 0; i < na; i++) it[i] = (RankItem){ a[i], 0 };
+    for(int i = 0; i < nb; i++) it[na + i] = (RankItem){ b[i], 1 };
+    qsort(it, n, sizeof(RankItem), cmp_rank_item);
+
+    // 同順位には平均順位を与え, 同順位補正項 sum(t^3 - t) を集める
+    double rank_sum_a = 0.0, tie_term = 0.0;
+    for(int i = 0; i < n; ) {
+        int j = i;
+        while(j + 1 < n && it[j + 1].v == it[i].v) j++;
+        double avg_rank = 0.5 * (i + j) + 1.0;
+        for(int k = i; k <= j; k++) if(it[k].group == 0) rank_sum_a += avg_rank;
+        double t = j - i + 1;
+        tie_term += t * t * t - t;
+        i = j + 1;
+    }
+    free(it);
+
+    double u = rank_sum_a - 0.5 * na * (na + 1.0);
+    double mu = 0.5 * na * nb;
+    double var = na * nb / 12.0 * ((n + 1.0) - tie_term / ((double)n * (n - 1.0)));
+    if(var <= 0.0) return 1.0;
+    double diff = fabs(u - mu) - 0.5; // 連続性補正
+    if(diff < 0.0) diff = 0.0;
+    double z = diff / sqrt(var);
+    return erfc(z / sqrt(2.0));
+}
+
+static int cmp_double_asc(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double median_of(const JsonValue* arr) {
+    int n = arr->count;
+    double* v = (double*)malloc(sizeof(double) * n);
+    for(int i = 0; i < n; i++) v[i] = arr->items[i]->number;
+    qsort(v, n, sizeof(double), cmp_double_asc);
+    double m = (n % 2)? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+    free(v);
+    return m;
+}
+
+static double* samples_of(const JsonValue* arr) {
+    double* v = (double*)malloc(sizeof(double) * (arr->count? arr->count : 1));
+    for(int i = 0; i < arr->count; i++) v[i] = arr->items[i]->number;
+    return v;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s BASELINE.json CURRENT.json [--threshold FRAC] [--alpha P]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    const char* paths[2] = { NULL, NULL };
+    int n_paths = 0;
+    double threshold = 0.05;
+    double alpha = 0.01;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) threshold = atof(argv[++i]);
+        else if(strcmp(argv[i], "--alpha") == 0 && i + 1 < argc) alpha = atof(argv[++i]);
+        else if(argv[i][0] != '-' && n_paths < 2) paths[n_paths++] = argv[i];
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if(n_paths != 2) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    JsonValue* base = json_load(paths[0]);
+    JsonValue* cur = json_load(paths[1]);
+    if(!base || !cur) {
+        json_free(base);
+        json_free(cur);
+        return 2;
+    }
+
+    const char* sections[] = { "machine", "build", "config" };
+    for(int s = 0; s < 3; s++) {
+        if(!json_equal(json_get(base, sections[s]), json_get(cur, sections[s])))
+            fprintf(stderr, "warning: %s differs between baseline and current run\n", sections[s]);
+    }
+
+    JsonValue* base_res = json_get(base, "results");
+    JsonValue* cur_res = json_get(cur, "results");
+    if(!base_res || !cur_res || base_res->type != JSON_ARRAY || cur_res->type != JSON_ARRAY) {
+        fprintf(stderr, "missing \"results\" array\n");
+        json_free(base);
+        json_free(cur);
+        return 2;
+    }
+
+    printf("%-20s %12s %12s %9s %10s  %s\n", "benchmark", "base med", "cur med", "change", "p", "verdict");
+    int regressions = 0;
+    for(int i = 0; i < cur_res->count; i++) {
+        const JsonValue* cr = cur_res->items[i];
+        const JsonValue* name = json_get(cr, "name");
+        const JsonValue* cs = json_get(cr, "samples");
+        if(!name || name->type != JSON_STRING || !cs || cs->type != JSON_ARRAY || cs->count == 0) continue;
+
+        const JsonValue* bs = NULL;
+        for(int j = 0; j < base_res->count && !bs; j++) {
+            const JsonValue* bn = json_get(base_res->items[j], "name");
+            if(bn && bn->type == JSON_STRING && strcmp(bn->string, name->string) == 0)
+                bs = json_get(base_res->items[j], "samples");
+        }
+        if(!bs || bs->type != JSON_ARRAY || bs->count == 0) {
+            printf("%-20s %12s %12.1f %9s %10s  new\n", name->string, "-", median_of(cs), "-", "-");
+            continue;
+        }
+
+        double bm = median_of(bs), cm = median_of(cs);
+        double change = (cm - bm) / bm;
+        double* a = samples_of(bs);
+        double* b = samples_of(cs);
+        double p = mann_whitney_p(a, bs->count, b, cs->count);
+        free(a);
+        free(b);
+
+        // 値は ns/op なので増加が悪化
+        const char* verdict = "ok";
+        if(p < alpha && change > threshold) {
+            verdict = "REGRESSION";
+            regressions++;
+        }
+        else if(p < alpha && change < -threshold) verdict = "improved";
+        else if(p < alpha) verdict = "changed (within threshold)";
+        printf("%-20s %12.1f %12.1f %+8.1f%% %10.2g  %s\n",
+               name->string, bm, cm, 100.0 * change, p, verdict);
+    }
+
+    printf("\n%d regression(s) (threshold %.1f%%, alpha %g)\n", regressions, 100.0 * threshold, alpha);
+    json_free(base);
+    json_free(cur);
+    return regressions? 1 : 0;
+}
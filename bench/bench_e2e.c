@@ -0,0 +1,410 @@
+// =========================================================
+// end-to-end ベンチマーク (合成コーパス)
+//
+//   ビルド例:
+//     gcc -O2 -pthread -o bench_e2e bench/bench_e2e.c -lm
+//   実行例:
+//     ./bench_e2e --workloads words,url --sizes 10000,100000 --threads 8
+//
+//   ワークロード (words/ident/url/log) × サイズごとに
+//     build  : Trie 構築時間, ノード数, Trie のバイト数, RSS
+//     extract: 特徴抽出 (trie_reservoir_forward) のスループット
+//     train  : readout_train のスループット (ラベルは key のハッシュ)
+//     serve  : 1..N スレッドでの推論スループットと p50/p99/p999 レイテンシ
+//   を 1 行 1 JSON オブジェクト (JSON Lines) で標準出力に出す。
+//   -DTRLM_INSTRUMENT でビルドすると serve ごとに段階別の内訳 (profile) も出す。
+//     pipeline: pipeline_score (max スレッド) を NUMA 無効/有効 x バッチの作り方
+//               (入力順 / 実効深度のバケット "bucket") で比べる
+//               ("rows_per_gemm" は深度ステップ 1 回の GEMM の平均行数)
+//               (NUMA 有効時はノードごとの複製 + ワーカー固定, "nodes" は検出ノード数。
+//                無効時も同じ frozen 表現の Trie を 1 つ共有するので、差は複製と固定だけ)
+//     sched   : Zipf(s=1) の問い合わせを Scheduler でバッチ処理し、上位 key の
+//               事前計算なし (off) / 追跡しながら定期更新 (track) / track の保存した
+//               一覧から起動時に温める (warm) / warm に加えて表に無い key を
+//               プレフィックスの状態キャッシュから計算する (prefix, 上位 key の
+//               全プレフィックスを固定) を比べる ("early_hit_rate" は最初の 1 割,
+//               "prefix_hit_rate" / "steps_saved" はキャッシュの祖先ヒット率と省いたステップ)
+//   --perf を付けると Trie 走査 / リザバー 1 ステップ / リードアウトを別々に
+//   回してハードウェアカウンタを 1 操作あたりで出す (phase "perf")。
+//   乱数シードを固定すれば同じコーパスが再生成される。
+// =========================================================
+#define TRLM_NO_MAIN
+#include "../trlm.c"
+#include "bench_common.h"
+#include <pthread.h>
+
+typedef struct {
+    TrieNode* root;
+    const KeySet* ks;
+    long requests;
+    unsigned long long seed;
+    float* lat_ns;          // requests 個のレイテンシ (ns)
+} ServeWorker;
+
+static void* serve_worker(void* p) {
+    ServeWorker* w = (ServeWorker*)p;
+    BenchRng r = { w->seed };
+    float h_state[RESERVOIR_SIZE];
+    float probs[OUT_DIM] = {0};
+    for(long i = 0; i < w->requests; i++) {
+        const char* key = keyset_get(w->ks, (long)(bench_rng_next(&r) % (unsigned long long)w->ks->n));
+        double t0 = now_seconds();
+        memset(h_state, 0, sizeof(h_state));
+        trie_reservoir_forward(w->root, key, h_state);
+        readout_forward(h_state, probs);
+        w->lat_ns[i] = (float)((now_seconds() - t0) * 1e9);
+    }
+    bench_sink = probs[0];
+    return NULL;
+}
+
+#ifdef TRLM_INSTRUMENT
+// 段階別計測 (-DTRLM_INSTRUMENT) の結果を 1 段階 1 行で出す
+static void print_profile_json(const char* wname, long size, int threads) {
+    ProfSnapshot snap;
+    prof_snapshot(&snap);
+    for(int s = 0; s < PROF_STAGE_COUNT; s++) {
+        const ProfStageStats* st = &snap.stage[s];
+        double ns = (double)st->cycles / snap.cycles_per_ns;
+        printf("{\"bench\":\"e2e\",\"workload\":\"%s\",\"size\":%ld,\"phase\":\"profile\","
+               "\"threads\":%d,\"stage\":\"%s\",\"count\":%llu,\"total_ns\":%.0f,"
+               "\"avg_ns\":%.1f,\"p50_ns_le\":%.0f,\"p99_ns_le\":%.0f}\n",
+               wname, size, threads, prof_stage_names[s], st->count, ns,
+               st->count? ns / (double)st->count : 0.0,
+               prof_quantile_cycles(st, 0.50) / snap.cycles_per_ns,
+               prof_quantile_cycles(st, 0.99) / snap.cycles_per_ns);
+    }
+}
+#endif
+
+static int opt_perf = 0;
+
+static void print_perf_json(const char* wname, long size, const char* stage,
+                            const PerfSample* smp, double ops) {
+    printf("{\"bench\":\"e2e\",\"workload\":\"%s\",\"size\":%ld,\"phase\":\"perf\","
+           "\"stage\":\"%s\",\"ops\":%.0f", wname, size, stage, ops);
+    for(int e = 0; e < PERF_EV_COUNT; e++) {
+        if(smp->v[e] < 0 || ops <= 0.0) printf(",\"%s_per_op\":null", perf_event_names[e]);
+        else printf(",\"%s_per_op\":%.3f", perf_event_names[e], (double)smp->v[e] / ops);
+    }
+    printf("}\n");
+}
+
+// 段階ごとにハードウェアカウンタを取る (X は key 0..n-1 の最終状態)
+static void perf_phases(const char* wname, long size, TrieNode* root, const KeySet* ks,
+                        const float* X, long n) {
+    PerfGroup g;
+    if(perf_group_open(&g) == 0) {
+        printf("{\"bench\":\"e2e\",\"workload\":\"%s\",\"size\":%ld,\"phase\":\"perf\","
+               "\"available\":false}\n", wname, size);
+        return;
+    }
+    int* depth = (int*)malloc(sizeof(int) * (n > 0? n : 1));
+    long steps = 0;
+    for(long i = 0; i < n; i++) {
+        depth[i] = trie_effective_depth(root, keyset_get(ks, i));
+        steps += depth[i];
+    }
+
+    PerfSample walk, step, ro;
+    long check = 0;
+    perf_group_start(&g);
+    for(long i = 0; i < n; i++) check += trie_effective_depth(root, keyset_get(ks, i));
+    perf_group_stop(&g, &walk);
+
+    float h_state[RESERVOIR_SIZE];
+    perf_group_start(&g);
+    for(long i = 0; i < n; i++) {
+        memset(h_state, 0, sizeof(h_state));
+        for(int l = 0; l < depth[i]; l++) reservoir_update(reservoir_weights[l], h_state);
+    }
+    perf_group_stop(&g, &step);
+
+    float probs[OUT_DIM] = {0};
+    perf_group_start(&g);
+    for(long i = 0; i < n; i++) readout_forward(X + i * RESERVOIR_SIZE, probs);
+    perf_group_stop(&g, &ro);
+    bench_sink = probs[0] + h_state[0] + (float)check;
+
+    print_perf_json(wname, size, "trie_walk", &walk, (double)steps);
+    print_perf_json(wname, size, "reservoir_step", &step, (double)steps);
+    print_perf_json(wname, size, "readout_forward", &ro, (double)n);
+    free(depth);
+    perf_group_close(&g);
+}
+
+static double percentile_sorted(const float* v, long n, double q) {
+    if(n <= 0) return 0.0;
+    long idx = (long)(q * (double)(n - 1) + 0.5);
+    return v[idx];
+}
+
+// Scheduler に Zipf 順で requests 件を流す。mode 0 = off, 1 = track, 2 = warm, 3 = prefix
+static void sched_phase(const char* wname, long size, TrieNode* root, const KeySet* ks,
+                        long requests, unsigned long long seed, int mode, const char* hot_path) {
+    const int batch = 64, hot_k = 256;
+    ZipfTable zt;
+    zipf_init(&zt, (int)ks->n, 1.0);
+    BenchRng r = { seed ^ 0x40fULL };
+    ServeRequest* reqs = (ServeRequest*)calloc(batch, sizeof(ServeRequest));
+    float* lat = (float*)malloc(sizeof(float) * (requests > 0? requests : 1));
+
+    Scheduler s;
+    sched_init(&s, batch, 1.0);
+    HeavyHitters hh;
+    HotSetHandle hot;
+    HotRefresher rf;
+    PrefixStateCache pc;
+    PrefixStateCache* cache = NULL;
+    hh_init(&hh, hot_k * 8, 0);
+    hot_handle_init(&hot);
+    if(mode >= 1) {
+        s.heavy = &hh;
+        s.hot = &hot;
+    }
+    if(mode == 3) {
+        // 固定 (容量の半分まで) で上位 key の全プレフィックスが入る大きさ
+        prefix_cache_init(&pc, (long)hot_k * MAX_DEPTH * 4);
+        cache = &pc;
+        s.prefix = cache;
+    }
+    if(mode >= 2) {
+        hh_load(&hh, hot_path);
+        hot_refresh(&hot, &hh, hot_k, root, cache);
+    }
+    if(mode == 1) hot_refresher_start(&rf, &hot, &hh, root, NULL, hot_k, 0.02);
+
+    long done = 0, early_hits = 0, early_lookups = 0;
+    double t0 = now_seconds();
+    while(done < requests) {
+        int n = (requests - done < batch)? (int)(requests - done) : batch;
+        for(int i = 0; i < n; i++) {
+            memset(&reqs[i], 0, sizeof(ServeRequest));
+            reqs[i].key = keyset_get(ks, zipf_sample(&zt, &r));
+            reqs[i].deadline = now_seconds() + 10.0;
+            sched_submit(&s, root, &reqs[i]);
+        }
+        while(s.size > 0) sched_dispatch(&s, root);
+        for(int i = 0; i < n; i++) lat[done + i] = (float)((reqs[i].finish_time - reqs[i].enqueue_time) * 1e9);
+        done += n;
+        if(early_lookups == 0 && done >= requests / 10) {
+            early_hits = atomic_load(&hot.hits);
+            early_lookups = atomic_load(&hot.lookups);
+        }
+    }
+    double wall = now_seconds() - t0;
+    if(mode == 1) {
+        hot_refresher_stop(&rf);
+        hh_save(&hh, hot_path, hot_k);
+    }
+    long hits = atomic_load(&hot.hits), lookups = atomic_load(&hot.lookups);
+    PrefixCacheMetrics pm;
+    memset(&pm, 0, sizeof(pm));
+    if(cache) prefix_cache_metrics(cache, &pm);
+    qsort(lat, requests, sizeof(float), cmp_float_asc);
+    static const char* const mode_names[] = { "off", "track", "warm", "prefix" };
+    printf("{\"bench\":\"e2e\",\"workload\":\"%s\",\"size\":%ld,\"phase\":\"sched\","
+           "\"hot\":\"%s\",\"requests\":%ld,\"seconds\":%.6f,\"qps\":%.1f,"
+           "\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"hit_rate\":%.4f,\"early_hit_rate\":%.4f,"
+           "\"refreshes\":%ld,\"prefix_hit_rate\":%.4f,\"steps_saved\":%.4f,\"pinned\":%ld}\n",
+           wname, size, mode_names[mode], requests, wall, requests / wall,
+           percentile_sorted(lat, requests, 0.50), percentile_sorted(lat, requests, 0.99),
+           lookups? (double)hits / lookups : 0.0,
+           early_lookups? (double)early_hits / early_lookups : 0.0,
+           (long)atomic_load(&hot.refreshes), pm.forward_hit_rate, pm.step_saving, pm.pinned);
+    fflush(stdout);
+    if(cache) prefix_cache_free(cache);
+
+    hot_handle_free(&hot);
+    hh_free(&hh);
+    free(lat);
+    free(reqs);
+    zipf_free(&zt);
+}
+
+static void run_one(WorkloadKind wl, long size, int max_threads, long requests,
+                    long extract_limit, int epochs, unsigned long long seed) {
+    const char* wname = workload_name(wl);
+    KeySet ks;
+    bench_make_workload(&ks, wl, size, seed);
+
+    // --- build ---
+    long rss0 = bench_rss_bytes();
+    double t0 = now_seconds();
+    TrieNode* root = create_trie_node(0);
+    for(long i = 0; i < ks.n; i++) trie_insert(root, keyset_get(&ks, i));
+    double build = now_seconds() - t0;
+    long nodes = bench_count_nodes(root);
+    long rss1 = bench_rss_bytes();
+    printf("{\"bench\":\"e2e\",\"workload\":\"%s\",\"size\":%ld,\"phase\":\"build\","
+           "\"seconds\":%.6f,\"keys_per_sec\":%.1f,\"nodes\":%ld,\"trie_bytes\":%ld,"
+           "\"rss_delta_bytes\":%ld}\n",
+           wname, size, build, ks.n / build, nodes, nodes * (long)sizeof(TrieNode),
+           (rss0 >= 0 && rss1 >= 0)? rss1 - rss0 : -1L);
+
+    // --- extract ---
+    long n_feat = (ks.n < extract_limit)? ks.n : extract_limit;
+    float* X = (float*)calloc((size_t)n_feat * RESERVOIR_SIZE, sizeof(float));
+    int* y = (int*)malloc(sizeof(int) * (n_feat > 0? n_feat : 1));
+    t0 = now_seconds();
+    for(long i = 0; i < n_feat; i++) {
+        trie_reservoir_forward(root, keyset_get(&ks, i), X + i * RESERVOIR_SIZE);
+    }
+    double extract = now_seconds() - t0;
+    printf("{\"bench\":\"e2e\",\"workload\":\"%s\",\"size\":%ld,\"phase\":\"extract\","
+           "\"keys\":%ld,\"seconds\":%.6f,\"keys_per_sec\":%.1f}\n",
+           wname, size, n_feat, extract, n_feat / extract);
+
+    if(opt_perf) perf_phases(wname, size, root, &ks, X, n_feat);
+
+    // --- train ---
+    for(long i = 0; i < n_feat; i++) {
+        const char* k = keyset_get(&ks, i);
+        y[i] = (int)(fnv1a(k, strlen(k)) % OUT_DIM);
+    }
+    init_readout();
+    t0 = now_seconds();
+    for(int e = 0; e < epochs; e++) {
+        for(long i = 0; i < n_feat; i++) readout_train(X + i * RESERVOIR_SIZE, y[i], 0.01f);
+    }
+    double train = now_seconds() - t0;
+    printf("{\"bench\":\"e2e\",\"workload\":\"%s\",\"size\":%ld,\"phase\":\"train\","
+           "\"samples\":%ld,\"epochs\":%d,\"seconds\":%.6f,\"samples_per_sec\":%.1f}\n",
+           wname, size, n_feat, epochs, train, (double)n_feat * epochs / train);
+    free(y);
+    free(X);
+
+    // --- serve (1, 2, 4, ..., max_threads) ---
+    for(int t = 1; t <= max_threads; t = (t < max_threads && t * 2 > max_threads)? max_threads : t * 2) {
+        ServeWorker* ws = (ServeWorker*)calloc(t, sizeof(ServeWorker));
+        pthread_t* th = (pthread_t*)malloc(sizeof(pthread_t) * t);
+        float* lat = (float*)malloc(sizeof(float) * requests * t);
+        for(int k = 0; k < t; k++) {
+            ws[k].root = root;
+            ws[k].ks = &ks;
+            ws[k].requests = requests;
+            ws[k].seed = seed + 1000 + k;
+            ws[k].lat_ns = lat + (long)k * requests;
+        }
+        prof_reset();
+        t0 = now_seconds();
+        for(int k = 0; k < t; k++) pthread_create(&th[k], NULL, serve_worker, &ws[k]);
+        for(int k = 0; k < t; k++) pthread_join(th[k], NULL);
+        double wall = now_seconds() - t0;
+        long total = requests * t;
+        qsort(lat, total, sizeof(float), cmp_float_asc);
+        printf("{\"bench\":\"e2e\",\"workload\":\"%s\",\"size\":%ld,\"phase\":\"serve\","
+               "\"threads\":%d,\"requests\":%ld,\"seconds\":%.6f,\"qps\":%.1f,"
+               "\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"p999_ns\":%.0f}\n",
+               wname, size, t, total, wall, total / wall,
+               percentile_sorted(lat, total, 0.50), percentile_sorted(lat, total, 0.99),
+               percentile_sorted(lat, total, 0.999));
+#ifdef TRLM_INSTRUMENT
+        print_profile_json(wname, size, t);
+#endif
+        fflush(stdout);
+        free(lat);
+        free(th);
+        free(ws);
+    }
+
+    // --- pipeline (NUMA 無効 / 有効 x 入力順 / 深度バケットのバッチ) ---
+    char* text = (char*)malloc(ks.used + 1);
+    memcpy(text, ks.data, ks.used);
+    for(size_t i = 0; i < ks.used; i++) if(text[i] == '\0') text[i] = '\n';
+    NumaTopology topo;
+    numa_topology_detect(&topo);
+    for(int run = 0; run < 4; run++) {
+        int numa = run / 2, bucket = run % 2;
+        PipelineStats st;
+        memset(&st, 0, sizeof(st));
+        PipelineConfig pc = { root, max_threads, 64, numa, bucket, &st, 42 };
+        FILE* in = fmemopen(text, ks.used, "r");
+        FILE* out = fopen("/dev/null", "w");
+        if(!in || !out) {
+            if(in) fclose(in);
+            if(out) fclose(out);
+            break;
+        }
+        t0 = now_seconds();
+        long rows = pipeline_score(&pc, in, out);
+        double wall = now_seconds() - t0;
+        fclose(in);
+        fclose(out);
+        printf("{\"bench\":\"e2e\",\"workload\":\"%s\",\"size\":%ld,\"phase\":\"pipeline\","
+               "\"threads\":%d,\"numa\":%d,\"bucket\":%d,\"nodes\":%d,\"rows\":%ld,\"seconds\":%.6f,"
+               "\"rows_per_sec\":%.1f,\"batches\":%ld,\"rows_per_gemm\":%.2f}\n",
+               wname, size, max_threads, numa, bucket, topo.n_nodes, rows, wall, rows / wall,
+               atomic_load(&st.batches), (double)atomic_load(&st.row_steps) / (atomic_load(&st.gemm_steps) + 1e-9));
+        fflush(stdout);
+    }
+    numa_topology_free(&topo);
+    free(text);
+
+    // --- sched (上位 key の事前計算なし / 追跡 / 保存した一覧から温める / + プレフィックスキャッシュ) ---
+    char hot_path[] = "/tmp/trlm_hotXXXXXX";
+    int fd = mkstemp(hot_path);
+    if(fd >= 0) {
+        close(fd);
+        for(int mode = 0; mode <= 3; mode++) sched_phase(wname, size, root, &ks, requests, seed, mode, hot_path);
+        unlink(hot_path);
+    }
+
+    trie_free(root);
+    keyset_free(&ks);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [--workloads words,ident,url,log] [--sizes 10000,100000,...]\n"
+        "          [--threads N] [--requests N] [--extract-limit N] [--epochs N] [--seed N] [--perf]\n",
+        prog);
+}
+
+int main(int argc, char** argv) {
+    char workloads[256] = "words,ident,url,log";
+    char sizes[256] = "10000";
+    int max_threads = 4, epochs = 3;
+    long requests = 20000, extract_limit = 100000;
+    unsigned long long seed = 42;
+
+    for(int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        if(strcmp(a, "--perf") == 0) { opt_perf = 1; continue; }
+        const char* v = (i + 1 < argc)? argv[i + 1] : NULL;
+        if(!v) { usage(argv[0]); return 1; }
+        if(strcmp(a, "--workloads") == 0) snprintf(workloads, sizeof(workloads), "%s", v);
+        else if(strcmp(a, "--sizes") == 0) snprintf(sizes, sizeof(sizes), "%s", v);
+        else if(strcmp(a, "--threads") == 0) max_threads = atoi(v);
+        else if(strcmp(a, "--requests") == 0) requests = atol(v);
+        else if(strcmp(a, "--extract-limit") == 0) extract_limit = atol(v);
+        else if(strcmp(a, "--epochs") == 0) epochs = atoi(v);
+        else if(strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else { usage(argv[0]); return 1; }
+        i++;
+    }
+    if(max_threads < 1) max_threads = 1;
+    if(requests < 1) requests = 1;
+
+    srand((unsigned int)seed);
+    init_reservoir_weights(MAX_DEPTH);
+    printf("{\"bench\":\"e2e\",\"phase\":\"config\",\"reservoir_size\":%d,\"out_dim\":%d,"
+           "\"max_depth\":%d,\"sizeof_trie_node\":%d,\"seed\":%llu}\n",
+           RESERVOIR_SIZE, OUT_DIM, MAX_DEPTH, (int)sizeof(TrieNode), seed);
+
+    char* wsave = NULL;
+    for(char* w = strtok_r(workloads, ",", &wsave); w; w = strtok_r(NULL, ",", &wsave)) {
+        WorkloadKind wl;
+        if(workload_parse(w, &wl) != 0) {
+            fprintf(stderr, "unknown workload: %s\n", w);
+            return 1;
+        }
+        char sbuf[256];
+        snprintf(sbuf, sizeof(sbuf), "%s", sizes);
+        char* ssave = NULL;
+        for(char* sz = strtok_r(sbuf, ",", &ssave); sz; sz = strtok_r(NULL, ",", &ssave)) {
+            run_one(wl, atol(sz), max_threads, requests, extract_limit, epochs, seed);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+// =========================================================
+// 完全一致の近道 (最小完全ハッシュ -> 事前計算した上位 k 件) の速度と正しさ
+//
+//   ビルド例:
+//     gcc -O2 -march=native -pthread -o bench_exact bench/bench_exact.c -lm
+//   実行例:
+//     ./bench_exact --workload words --keys 50000 --k 4 --miss 0.2
+//
+//   登録 key の Trie (frozen) の全ての葉に exact_index_build で索引を作り、
+//     段数, ハッシュの bit/key, 索引の bytes/key, 構築時間,
+//     既知の key だけを引く exact_lookup の ns/query,
+//     既知 (Zipf) と未登録 (--miss の割合) を混ぜた問い合わせでの
+//     exact_predict と通常の経路 (forward + readout + 上位 k 件) の ns/query
+//   を並べる。ノイズは 0 にして、
+//     - 全ての葉が当たり、上位 k 件が通常の経路とビット単位で一致するか
+//     - 葉でない key が当たらないか (指紋の誤一致)
+//   を確かめる (不一致があれば終了コード 1)。
+// =========================================================
+#define TRLM_NO_MAIN
+#include "../trlm.c"
+#include "bench_common.h"
+
+typedef struct {
+    const ExactIndex* ex;
+    const TrieBackend* tb;
+    const char* const* queries;
+    long n;
+    int mode;                // 0: 通常の経路, 1: exact_predict, 2: exact_lookup だけ
+} ExactCtx;
+
+static double bench_exact_query(void* p, long iters) {
+    ExactCtx* c = (ExactCtx*)p;
+    int idx[OUT_DIM];
+    float prob[OUT_DIM], h[RESERVOIR_SIZE], probs[OUT_DIM];
+    long sum = 0;
+    for(long it = 0; it < iters; it++) {
+        const char* key = c->queries[it % c->n];
+        if(c->mode == 0) {
+            memset(h, 0, sizeof(h));
+            trie_backend_forward(c->tb, key, h);
+            readout_forward(h, probs);
+            readout_top_k(probs, c->ex->k, idx, prob);
+        } else if(c->mode == 1) {
+            exact_predict(c->ex, c->tb, key, idx, prob);
+        } else {
+            exact_lookup(c->ex, key, idx, prob, NULL);
+        }
+        sum += idx[0];
+    }
+    bench_sink = (float)sum;
+    return 0.0;
+}
+
+// key (先頭 MAX_DEPTH バイト) を最後まで辿れて、そこが葉なら 1
+static int is_leaf_key(const TrieBackend* tb, const char* key) {
+    TrieRef cur = tb->root(tb->impl);
+    int i = 0;
+    for(; key[i] != '\0' && i < MAX_DEPTH; i++) {
+        cur = tb->step(tb->impl, cur, (unsigned char)key[i]);
+        if(cur == TRIE_REF_NONE) return 0;
+    }
+    return i > 0 && tb->is_leaf(tb->impl, cur);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [--workload words|ident|url|log] [--keys N] [--k N] [--miss F]\n"
+        "          [--states 0|1] [--queries N] [--reps N] [--seed N]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    WorkloadKind wl = WL_WORDS;
+    long n_keys = 20000, n_q = 1 << 16;
+    int k = 4, keep_states = 0;
+    double miss = 0.2;
+    unsigned long long seed = 42;
+    BenchConfig cfg = { 5, 0.05, 0.05 };
+    for(int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        const char* v = (i + 1 < argc)? argv[i + 1] : NULL;
+        if(!v) { usage(argv[0]); return 1; }
+        if(strcmp(a, "--keys") == 0) n_keys = atol(v);
+        else if(strcmp(a, "--k") == 0) k = atoi(v);
+        else if(strcmp(a, "--miss") == 0) miss = atof(v);
+        else if(strcmp(a, "--states") == 0) keep_states = atoi(v);
+        else if(strcmp(a, "--queries") == 0) n_q = atol(v);
+        else if(strcmp(a, "--reps") == 0) cfg.reps = atoi(v);
+        else if(strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else if(strcmp(a, "--workload") == 0) {
+            if(workload_parse(v, &wl) != 0) { usage(argv[0]); return 1; }
+        } else { usage(argv[0]); return 1; }
+        i++;
+    }
+    if(cfg.reps < 1) cfg.reps = 1;
+    if(n_q < 1) n_q = 1;
+
+    KeySet ks, unknown;
+    bench_make_workload(&ks, wl, n_keys, seed);
+    bench_make_workload(&unknown, wl, n_keys / 4 + 1, seed + 7);
+    TrieNode* root = create_trie_node(0);
+    for(long i = 0; i < ks.n; i++) trie_insert(root, keyset_get(&ks, i));
+    TrieBackend tb;
+    trie_backend_frozen(&tb, root);
+
+    init_reservoir_weights_seeded(MAX_DEPTH, (unsigned int)seed);
+    srand((unsigned int)seed);
+    init_readout();
+    ReservoirConfig rc = reservoir_get_config();
+    rc.noise = 0.0f;   // 同じ key は常に同じ出力になる
+    reservoir_set_config(&rc);
+
+    ExactIndex ex;
+    double t0 = now_seconds();
+    long leaves = exact_index_build(&ex, &tb, k, keep_states);
+    double build = now_seconds() - t0;
+
+    // 全ての葉が当たり、通常の経路と同じ上位 k 件になるか
+    long mismatches = 0, false_hits = 0, n_unknown = 0;
+    int idx[OUT_DIM], ref_idx[OUT_DIM];
+    float prob[OUT_DIM], ref_prob[OUT_DIM], h[RESERVOIR_SIZE], probs[OUT_DIM];
+    for(long i = 0; i < ks.n; i++) {
+        const char* key = keyset_get(&ks, i);
+        memset(h, 0, sizeof(h));
+        trie_backend_forward(&tb, key, h);
+        readout_forward(h, probs);
+        int n = readout_top_k(probs, ex.k, ref_idx, ref_prob);
+        if(!exact_lookup(&ex, key, idx, prob, NULL) || memcmp(idx, ref_idx, sizeof(int) * n) != 0
+           || memcmp(prob, ref_prob, sizeof(float) * n) != 0) {
+            mismatches++;
+        }
+    }
+    for(long i = 0; i < unknown.n; i++) {
+        const char* key = keyset_get(&unknown, i);
+        if(is_leaf_key(&tb, key)) continue;
+        n_unknown++;
+        false_hits += exact_lookup(&ex, key, NULL, NULL, NULL);
+    }
+
+    // 問い合わせ: 既知の key を Zipf で、--miss の割合で未登録の key を混ぜる
+    const char** hits = (const char**)malloc(sizeof(char*) * n_q);
+    const char** mixed = (const char**)malloc(sizeof(char*) * n_q);
+    ZipfTable zt;
+    zipf_init(&zt, (int)ks.n, 1.0);
+    BenchRng r = { seed ^ 0xe8ac7ull };
+    for(long i = 0; i < n_q; i++) {
+        hits[i] = keyset_get(&ks, zipf_sample(&zt, &r));
+        if(bench_rng_uniform(&r) < miss) {
+            mixed[i] = keyset_get(&unknown, (long)(bench_rng_next(&r) % (unsigned long long)unknown.n));
+        } else {
+            mixed[i] = keyset_get(&ks, zipf_sample(&zt, &r));
+        }
+    }
+    zipf_free(&zt);
+
+    printf("# workload=%s keys=%ld leaves=%ld k=%d states=%d miss=%.2f RESERVOIR_SIZE=%d OUT_DIM=%d\n",
+           workload_name(wl), ks.n, leaves, ex.k, keep_states, miss, RESERVOIR_SIZE, OUT_DIM);
+    printf("# index: %d levels, %.2f bits/key hash, %zu-byte rows, %.1f bytes/key total, build %.3f s\n",
+           ex.mph.levels, 8.0 * mphf_bytes(&ex.mph) / (leaves? leaves : 1), ex.row_bytes,
+           (double)exact_index_bytes(&ex) / (leaves? leaves : 1), build);
+    printf("%-14s %12s %10s\n", "path", "ns/query", "speedup");
+
+    double* samples = (double*)malloc(sizeof(double) * cfg.reps);
+    ExactCtx ctx = { &ex, &tb, mixed, n_q, 0 };
+    bench_measure(&cfg, bench_exact_query, &ctx, samples);
+    const double base = bench_stats(samples, cfg.reps).median;
+    printf("%-14s %12.1f %10.2f\n", "forward", base, 1.0);
+    ctx.mode = 1;
+    bench_measure(&cfg, bench_exact_query, &ctx, samples);
+    double ns = bench_stats(samples, cfg.reps).median;
+    printf("%-14s %12.1f %10.2f\n", "exact_predict", ns, base / ns);
+    ctx.mode = 2;
+    ctx.queries = hits;
+    bench_measure(&cfg, bench_exact_query, &ctx, samples);
+    ns = bench_stats(samples, cfg.reps).median;
+    printf("%-14s %12.1f %10.2f\n", "exact_lookup", ns, base / ns);
+
+    printf("# check: %ld/%ld known keys mismatched, %ld/%ld unknown keys hit\n",
+           mismatches, ks.n, false_hits, n_unknown);
+
+    free(samples);
+    free(mixed);
+    free(hits);
+    exact_index_free(&ex);
+    trie_backend_destroy(&tb);
+    trie_free(root);
+    keyset_free(&unknown);
+    keyset_free(&ks);
+    return (mismatches || false_hits)? 1 : 0;
+}
@@ -0,0 +1,324 @@
+// =========================================================
+// コアカーネルのマイクロベンチマーク
+//
+//   ビルド例 (次元はコンパイル時に振る):
+//     gcc -O2 -pthread -o bench_kernels bench/bench_kernels.c -lm
+//     gcc -O2 -pthread -DRESERVOIR_SIZE=256 -DOUT_DIM=32 -o bench_kernels bench/bench_kernels.c -lm
+//   実行例 (深度と key 分布は実行時に振る):
+//     ./bench_kernels --depth 8 --dist zipf --keys 4096 --reps 15
+//
+//   各カーネルについて ns/op (中央値, 標準偏差, 最小), GFLOP/s, bytes/op を出す。
+//   bytes/op は 1 操作が読み書きする最小データ量の見積もり
+//   (trie 系は 1 ホップ = 1 キャッシュライン, trie_insert は確保したノードのバイト数)
+//   --json FILE で生サンプル・実行環境の指紋・設定を JSON に保存する
+//   (bench_compare でベースラインとの比較に使う)。
+//   --perf を付けると perf_event_open のカウンタ (cycles, instructions,
+//   LLC/dTLB/分岐ミス) も 1 操作あたりで出す (trie_insert は解放分も含む)
+// =========================================================
+#define TRLM_NO_MAIN
+#include "../trlm.c"
+#include "bench_common.h"
+
+#define KERNEL_GEMM_ROWS 64  // matmat 系の 1 回の行数 (pipeline_score の既定バッチ)
+
+typedef struct {
+    int depth;              // 使う深度数 (リザバー重みを循環させる層数 / key 長)
+    int n_keys;
+    char** keys;
+    TrieNode* root;         // keys を挿入済みの Trie (lookup 用)
+    unsigned short* w_f16[MAX_DEPTH];   // reservoir_weights の fp16 / bf16 版
+    unsigned short* w_bf16[MAX_DEPTH];
+    float x[RESERVOIR_SIZE];
+    float y[RESERVOIR_SIZE];
+    float A[KERNEL_GEMM_ROWS * RESERVOIR_SIZE];  // バッチ GEMM の入力 / 出力
+    float T[KERNEL_GEMM_ROWS * RESERVOIR_SIZE];
+} KernelCtx;
+
+typedef struct {
+    const char* name;
+    BenchFn fn;
+    double flops_per_op;    // 0 なら GFLOP/s は表示しない
+    double bytes_per_op;
+} KernelBench;
+
+static double bench_matvec(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        matvec(reservoir_weights[it % c->depth], c->x, c->y);
+        c->x[it % RESERVOIR_SIZE] = 0.5f * c->y[it % RESERVOIR_SIZE];
+    }
+    bench_sink = c->y[0];
+    return 0.0;
+}
+
+static double bench_matvec_f16(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        matvec_half(c->w_f16[it % c->depth], 0, c->x, c->y);
+        c->x[it % RESERVOIR_SIZE] = 0.5f * c->y[it % RESERVOIR_SIZE];
+    }
+    bench_sink = c->y[0];
+    return 0.0;
+}
+
+static double bench_matvec_bf16(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        matvec_half(c->w_bf16[it % c->depth], 1, c->x, c->y);
+        c->x[it % RESERVOIR_SIZE] = 0.5f * c->y[it % RESERVOIR_SIZE];
+    }
+    bench_sink = c->y[0];
+    return 0.0;
+}
+
+// バッチ推論の 1 深度ステップ: fp32 の GEMM / 16 bit の GEMM / 16 bit の行ごとの matvec
+static double bench_matmat(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        matmat(reservoir_weights[it % c->depth], c->A, c->T, KERNEL_GEMM_ROWS);
+        c->A[it % RESERVOIR_SIZE] = 0.5f * c->T[it % RESERVOIR_SIZE];
+    }
+    bench_sink = c->T[0];
+    return 0.0;
+}
+
+static double bench_matmat_f16(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        matmat_half(c->w_f16[it % c->depth], 0, c->A, c->T, KERNEL_GEMM_ROWS);
+        c->A[it % RESERVOIR_SIZE] = 0.5f * c->T[it % RESERVOIR_SIZE];
+    }
+    bench_sink = c->T[0];
+    return 0.0;
+}
+
+static double bench_matvec_f16_rows(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        const unsigned short* w = c->w_f16[it % c->depth];
+        for(int r = 0; r < KERNEL_GEMM_ROWS; r++) {
+            matvec_half(w, 0, c->A + r * RESERVOIR_SIZE, c->T + r * RESERVOIR_SIZE);
+        }
+        c->A[it % RESERVOIR_SIZE] = 0.5f * c->T[it % RESERVOIR_SIZE];
+    }
+    bench_sink = c->T[0];
+    return 0.0;
+}
+
+static double bench_tanh(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        for(int i = 0; i < RESERVOIR_SIZE; i++) {
+            c->y[i] = activate_tanh(c->x[i]);
+        }
+        c->x[it % RESERVOIR_SIZE] += 1e-3f * c->y[0];
+    }
+    bench_sink = c->y[0];
+    return 0.0;
+}
+
+static double bench_reservoir_update(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        reservoir_update(reservoir_weights[it % c->depth], c->x);
+    }
+    bench_sink = c->x[0];
+    return 0.0;
+}
+
+static double bench_readout_forward(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    float probs[OUT_DIM] = {0};
+    for(long it = 0; it < iters; it++) {
+        readout_forward(c->x, probs);
+        c->x[it % RESERVOIR_SIZE] += 1e-6f * probs[0];
+    }
+    bench_sink = probs[0];
+    return 0.0;
+}
+
+static double bench_readout_train(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        readout_train(c->x, (int)(it % OUT_DIM), 1e-6f);
+    }
+    bench_sink = readout_weights[0][0];
+    return 0.0;
+}
+
+static double bench_trie_insert(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    TrieNode* root = create_trie_node(0);
+    for(long it = 0; it < iters; it++) {
+        trie_insert(root, c->keys[it % c->n_keys]);
+    }
+    // 解放時間は計測から除外する
+    double t0 = now_seconds();
+    trie_free(root);
+    return now_seconds() - t0;
+}
+
+static double bench_trie_lookup(void* p, long iters) {
+    KernelCtx* c = (KernelCtx*)p;
+    int sum = 0;
+    for(long it = 0; it < iters; it++) {
+        sum += trie_effective_depth(c->root, c->keys[it % c->n_keys]);
+    }
+    bench_sink = (float)sum;
+    return 0.0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [--depth N] [--dist uniform|zipf|prefix] [--keys N]\n"
+        "          [--reps N] [--warmup SEC] [--sample SEC] [--seed N] [--filter NAME] [--perf]\n"
+        "          [--json FILE]\n",
+        prog);
+}
+
+int main(int argc, char** argv) {
+    int depth = 8, n_keys = 4096;
+    KeyDist dist = KEYS_UNIFORM;
+    unsigned long long seed = 42;
+    const char* filter = NULL;
+    const char* json_path = NULL;
+    int use_perf = 0;
+    BenchConfig cfg = { 15, 0.2, 0.02 };
+
+    for(int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        if(strcmp(a, "--perf") == 0) { use_perf = 1; continue; }
+        const char* v = (i + 1 < argc)? argv[i + 1] : NULL;
+        if(!v) { usage(argv[0]); return 1; }
+        if(strcmp(a, "--depth") == 0) depth = atoi(v);
+        else if(strcmp(a, "--keys") == 0) n_keys = atoi(v);
+        else if(strcmp(a, "--reps") == 0) cfg.reps = atoi(v);
+        else if(strcmp(a, "--warmup") == 0) cfg.warmup_sec = atof(v);
+        else if(strcmp(a, "--sample") == 0) cfg.sample_sec = atof(v);
+        else if(strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else if(strcmp(a, "--filter") == 0) filter = v;
+        else if(strcmp(a, "--json") == 0) json_path = v;
+        else if(strcmp(a, "--dist") == 0) {
+            if(key_dist_parse(v, &dist) != 0) { usage(argv[0]); return 1; }
+        } else { usage(argv[0]); return 1; }
+        i++;
+    }
+    if(depth < 1) depth = 1;
+    if(depth > MAX_DEPTH) depth = MAX_DEPTH;
+    if(n_keys < 1) n_keys = 1;
+    if(cfg.reps < 1) cfg.reps = 1;
+
+    init_reservoir_weights(MAX_DEPTH);
+    init_readout();
+    srand((unsigned int)seed);
+
+    static KernelCtx ctx;
+    ctx.depth = depth;
+    ctx.n_keys = n_keys;
+    ctx.keys = bench_make_keys(dist, n_keys, depth, seed);
+    ctx.root = create_trie_node(0);
+    for(int i = 0; i < n_keys; i++) trie_insert(ctx.root, ctx.keys[i]);
+    for(int i = 0; i < RESERVOIR_SIZE; i++) ctx.x[i] = 0.5f * rand_float();
+    for(int i = 0; i < KERNEL_GEMM_ROWS * RESERVOIR_SIZE; i++) ctx.A[i] = 0.5f * rand_float();
+    for(int l = 0; l < depth; l++) {
+        ctx.w_f16[l] = (unsigned short*)malloc(sizeof(unsigned short) * RESERVOIR_SIZE * RESERVOIR_SIZE);
+        ctx.w_bf16[l] = (unsigned short*)malloc(sizeof(unsigned short) * RESERVOIR_SIZE * RESERVOIR_SIZE);
+        for(int i = 0; i < RESERVOIR_SIZE * RESERVOIR_SIZE; i++) {
+            ctx.w_f16[l][i] = float_to_half(reservoir_weights[l][i]);
+            ctx.w_bf16[l][i] = float_to_bf16(reservoir_weights[l][i]);
+        }
+    }
+
+    long nodes = bench_count_nodes(ctx.root);
+    double avg_depth = 0.0;
+    for(int i = 0; i < n_keys; i++) avg_depth += trie_effective_depth(ctx.root, ctx.keys[i]);
+    avg_depth /= n_keys;
+
+    const double R = RESERVOIR_SIZE, O = OUT_DIM, G = KERNEL_GEMM_ROWS;
+    const KernelBench benches[] = {
+        { "matvec",           bench_matvec,           2 * R * R,       4 * R * R + 8 * R },
+        { "matvec_f16",       bench_matvec_f16,       2 * R * R,       2 * R * R + 8 * R },
+        { "matvec_bf16",      bench_matvec_bf16,      2 * R * R,       2 * R * R + 8 * R },
+        { "matmat[x64]",      bench_matmat,           2 * G * R * R,   4 * R * R + 8 * G * R },
+        { "matmat_f16[x64]",  bench_matmat_f16,       2 * G * R * R,   2 * R * R + 8 * G * R },
+        { "matvec_f16[x64]",  bench_matvec_f16_rows,  2 * G * R * R,   2 * R * R + 8 * G * R },
+        { "activate_tanh[xR]", bench_tanh,            0.0,             8 * R },
+        { "reservoir_update", bench_reservoir_update, 2 * R * R + 3 * R, 4 * R * R + 8 * R },
+        { "readout_forward",  bench_readout_forward,  2 * O * R + 2 * O, 4 * O * R + 4 * R + 4 * O },
+        { "readout_train",    bench_readout_train,    5 * O * R + 2 * O, 12 * O * R + 4 * R },
+        { "trie_insert",      bench_trie_insert,      0.0,             (double)nodes * sizeof(TrieNode) / n_keys },
+        { "trie_lookup",      bench_trie_lookup,      0.0,             avg_depth * 64.0 },
+    };
+
+    printf("# RESERVOIR_SIZE=%d OUT_DIM=%d MAX_DEPTH=%d depth=%d dist=%s keys=%d nodes=%ld reps=%d\n",
+           RESERVOIR_SIZE, OUT_DIM, MAX_DEPTH, depth, key_dist_name(dist), n_keys, nodes, cfg.reps);
+    printf("%-18s %12s %8s %12s %10s %12s %10s\n",
+           "kernel", "ns/op(med)", "stddev%", "ns/op(min)", "GFLOP/s", "bytes/op", "GB/s");
+
+    const int n_bench = (int)(sizeof(benches) / sizeof(benches[0]));
+    PerfSample perf[sizeof(benches) / sizeof(benches[0])];
+    long perf_iters[sizeof(benches) / sizeof(benches[0])];
+    PerfGroup pg;
+    if(use_perf && perf_group_open(&pg) == 0) {
+        fprintf(stderr, "perf_event_open: no hardware counters available\n");
+    }
+
+    FILE* jf = NULL;
+    if(json_path) {
+        jf = fopen(json_path, "w");
+        if(!jf) {
+            fprintf(stderr, "cannot write %s\n", json_path);
+            return 1;
+        }
+        fprintf(jf, "{\"tool\":\"bench_kernels\",");
+        bench_write_fingerprint(jf);
+        fprintf(jf, ",\"config\":{\"depth\":%d,\"dist\":\"%s\",\"keys\":%d,\"seed\":%llu,\"reps\":%d},"
+                    "\"results\":[", depth, key_dist_name(dist), n_keys, seed, cfg.reps);
+    }
+
+    double* samples = (double*)malloc(sizeof(double) * cfg.reps);
+    int n_written = 0;
+    for(int b = 0; b < n_bench; b++) {
+        const KernelBench* kb = &benches[b];
+        perf_iters[b] = 0;
+        if(filter && !strstr(kb->name, filter)) continue;
+        bench_measure(&cfg, kb->fn, &ctx, samples);
+        if(use_perf) {
+            perf_iters[b] = bench_calibrate(kb->fn, &ctx, cfg.sample_sec);
+            bench_perf(&pg, kb->fn, &ctx, perf_iters[b], &perf[b]);
+        }
+        BenchStats st = bench_stats(samples, cfg.reps);
+        printf("%-18s %12.2f %8.2f %12.2f ", kb->name, st.median,
+               (st.mean > 0.0)? 100.0 * st.stddev / st.mean : 0.0, st.min);
+        if(kb->flops_per_op > 0.0) printf("%10.2f ", kb->flops_per_op / st.median);
+        else printf("%10s ", "-");
+        printf("%12.1f %10.2f\n", kb->bytes_per_op, kb->bytes_per_op / st.median);
+        if(jf) {
+            fprintf(jf, "%s\n{\"name\":\"%s\",\"unit\":\"ns/op\",\"median\":%.4f,\"samples\":[",
+                    n_written++? "," : "", kb->name, st.median);
+            for(int r = 0; r < cfg.reps; r++) fprintf(jf, "%s%.4f", r? "," : "", samples[r]);
+            fprintf(jf, "]}");
+        }
+    }
+
+    if(use_perf) {
+        printf("\n# hardware counters per op\n");
+        for(int b = 0; b < n_bench; b++) {
+            if(perf_iters[b] > 0) perf_sample_print_per_op(stdout, benches[b].name, &perf[b], (double)perf_iters[b]);
+        }
+        perf_group_close(&pg);
+    }
+
+    if(jf) {
+        fprintf(jf, "\n]}\n");
+        fclose(jf);
+    }
+    free(samples);
+    for(int l = 0; l < depth; l++) {
+        free(ctx.w_f16[l]);
+        free(ctx.w_bf16[l]);
+    }
+    trie_free(ctx.root);
+    bench_free_keys(ctx.keys, n_keys);
+    return 0;
+}
@@ -0,0 +1,204 @@
+// =========================================================
+// 近似カーネルの精度 vs 速度 (パレート) ハーネス
+//
+//   ビルド例:
+//     gcc -O2 -pthread -o bench_pareto bench/bench_pareto.c -lm
+//   実行例:
+//     ./bench_pareto --data labeled.tsv          # 1 行 "key<TAB>label"
+//     ./bench_pareto --workload url --keys 20000  # 合成データ (ラベルは key 長 mod OUT_DIM)
+//
+//   データを学習 80% / 評価 20% に分け、参照経路 (fp32 重み + expf tanh +
+//   ノイズ 0.01 = 元の matvec / activate_tanh / readout_forward) で
+//   リードアウトを学習する。評価データを参照経路と各近似設定で流し、
+//     正解率, log-loss, 参照状態からの最大/平均偏差, スループット
+//   を並べて出す。各 key のノイズ系列は設定間で同じシードに固定する。
+//   fp16 / bf16 の設定ではリードアウト重みも同じ形式に詰め直して使う。
+// =========================================================
+#define TRLM_NO_MAIN
+#include "../trlm.c"
+#include "bench_common.h"
+
+typedef struct {
+    const char* name;
+    ReservoirConfig cfg;
+} ParetoConfig;
+
+static const ParetoConfig pareto_configs[] = {
+    { "exact",               { 0.01f, 0, RES_WEIGHTS_F32,    1.0f,  0 } },
+    { "no_noise",            { 0.0f,  0, RES_WEIGHTS_F32,    1.0f,  0 } },
+    { "fast_tanh",           { 0.01f, 1, RES_WEIGHTS_F32,    1.0f,  0 } },
+    { "int8",                { 0.01f, 0, RES_WEIGHTS_INT8,   1.0f,  0 } },
+    { "sparse50",            { 0.01f, 0, RES_WEIGHTS_SPARSE, 0.5f,  0 } },
+    { "sparse25",            { 0.01f, 0, RES_WEIGHTS_SPARSE, 0.25f, 0 } },
+    { "int8+fast_tanh",      { 0.01f, 1, RES_WEIGHTS_INT8,   1.0f,  0 } },
+    { "int8+fast+no_noise",  { 0.0f,  1, RES_WEIGHTS_INT8,   1.0f,  0 } },
+    { "fp16",                { 0.01f, 0, RES_WEIGHTS_F16,    1.0f,  0 } },
+    { "bf16",                { 0.01f, 0, RES_WEIGHTS_BF16,   1.0f,  0 } },
+    { "bf16+fast_tanh",      { 0.01f, 1, RES_WEIGHTS_BF16,   1.0f,  0 } },
+};
+
+typedef struct {
+    KeySet keys;
+    int* labels;
+} LabeledSet;
+
+static int load_labeled(const char* path, LabeledSet* ds) {
+    FILE* fp = fopen(path, "r");
+    if(!fp) return -1;
+    memset(ds, 0, sizeof(*ds));
+    long cap = 1024;
+    ds->keys.off = (size_t*)malloc(sizeof(size_t) * cap);
+    ds->labels = (int*)malloc(sizeof(int) * cap);
+    char* line;
+    while((line = read_key_line(fp)) != NULL) {
+        char* tab = strrchr(line, '\t');
+        if(tab) {
+            *tab = '\0';
+            if(ds->keys.n == cap) {
+                cap *= 2;
+                ds->keys.off = (size_t*)realloc(ds->keys.off, sizeof(size_t) * cap);
+                ds->labels = (int*)realloc(ds->labels, sizeof(int) * cap);
+            }
+            int y = atoi(tab + 1);
+            ds->labels[ds->keys.n] = (y >= 0 && y < OUT_DIM)? y : 0;
+            keyset_push(&ds->keys, line, strlen(line));
+        }
+        free(line);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void make_synthetic(LabeledSet* ds, WorkloadKind wl, long n, unsigned long long seed) {
+    bench_make_workload(&ds->keys, wl, n, seed);
+    ds->labels = (int*)malloc(sizeof(int) * (n > 0? n : 1));
+    // リザバー状態は辿った深度 (と重み/ノイズ) で決まるので、
+    // MAX_DEPTH で打ち切った key 長をクラスにする
+    for(long i = 0; i < ds->keys.n; i++) {
+        size_t len = strlen(keyset_get(&ds->keys, i));
+        ds->labels[i] = (int)((len < MAX_DEPTH? len : MAX_DEPTH) % OUT_DIM);
+    }
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [--data FILE | --workload words|ident|url|log --keys N]\n"
+        "          [--epochs N] [--seed N] [--json]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    const char* data = NULL;
+    WorkloadKind wl = WL_WORDS;
+    long n_keys = 20000;
+    int epochs = 20, json = 0;
+    unsigned long long seed = 42;
+    for(int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        if(strcmp(a, "--json") == 0) { json = 1; continue; }
+        const char* v = (i + 1 < argc)? argv[i + 1] : NULL;
+        if(!v) { usage(argv[0]); return 1; }
+        if(strcmp(a, "--data") == 0) data = v;
+        else if(strcmp(a, "--keys") == 0) n_keys = atol(v);
+        else if(strcmp(a, "--epochs") == 0) epochs = atoi(v);
+        else if(strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else if(strcmp(a, "--workload") == 0) {
+            if(workload_parse(v, &wl) != 0) { usage(argv[0]); return 1; }
+        } else { usage(argv[0]); return 1; }
+        i++;
+    }
+
+    LabeledSet ds;
+    if(data) {
+        if(load_labeled(data, &ds) != 0) {
+            fprintf(stderr, "cannot read %s\n", data);
+            return 1;
+        }
+    } else {
+        make_synthetic(&ds, wl, n_keys, seed);
+    }
+    const long n = ds.keys.n;
+    const long n_train = n * 8 / 10;
+    const long n_test = n - n_train;
+    if(n_train == 0 || n_test == 0) {
+        fprintf(stderr, "not enough labeled keys (%ld)\n", n);
+        return 1;
+    }
+
+    TrieNode* root = create_trie_node(0);
+    for(long i = 0; i < n; i++) trie_insert(root, keyset_get(&ds.keys, i));
+    init_reservoir_weights_seeded(MAX_DEPTH, (unsigned int)seed);
+    reservoir_set_config(&pareto_configs[0].cfg);
+
+    // 参照経路で学習
+    float* X = (float*)calloc((size_t)n_train * RESERVOIR_SIZE, sizeof(float));
+    for(long i = 0; i < n_train; i++) {
+        noise_seed((unsigned int)i);
+        trie_reservoir_forward(root, keyset_get(&ds.keys, i), X + i * RESERVOIR_SIZE);
+    }
+    init_readout();
+    for(int e = 0; e < epochs; e++) {
+        float lr = 0.05f / (1.0f + 0.2f * e);
+        for(long i = 0; i < n_train; i++) readout_train(X + i * RESERVOIR_SIZE, ds.labels[i], lr);
+    }
+    free(X);
+    ReadoutHalf ro_half;
+
+    // 評価: 先頭の設定 (exact) の状態を参照として保持する
+    float* ref = (float*)calloc((size_t)n_test * RESERVOIR_SIZE, sizeof(float));
+    double ref_kps = 0.0;
+    if(!json) {
+        printf("# keys=%ld train=%ld test=%ld RESERVOIR_SIZE=%d OUT_DIM=%d epochs=%d\n",
+               n, n_train, n_test, RESERVOIR_SIZE, OUT_DIM, epochs);
+        printf("%-20s %9s %9s %12s %12s %12s %8s\n",
+               "config", "accuracy", "logloss", "max_dev", "mean_dev", "keys/s", "speedup");
+    }
+    for(size_t c = 0; c < sizeof(pareto_configs) / sizeof(pareto_configs[0]); c++) {
+        const ParetoConfig* pc = &pareto_configs[c];
+        reservoir_set_config(&pc->cfg);
+        const int half = (pc->cfg.format == RES_WEIGHTS_F16 || pc->cfg.format == RES_WEIGHTS_BF16);
+        if(half) readout_pack_half(&ro_half, &readout_weights[0][0], pc->cfg.format);
+        long correct = 0;
+        double logloss = 0.0, max_dev = 0.0, sum_dev = 0.0;
+        float h[RESERVOIR_SIZE], probs[OUT_DIM];
+
+        double t0 = now_seconds();
+        for(long k = 0; k < n_test; k++) {
+            long i = n_train + k;
+            noise_seed((unsigned int)i);
+            memset(h, 0, sizeof(h));
+            trie_reservoir_forward(root, keyset_get(&ds.keys, i), h);
+            if(half) readout_forward_half(&ro_half, h, probs);
+            else readout_forward(h, probs);
+            if(c == 0) memcpy(ref + k * RESERVOIR_SIZE, h, sizeof(h));
+            int best = 0;
+            for(int o = 1; o < OUT_DIM; o++) if(probs[o] > probs[best]) best = o;
+            correct += (best == ds.labels[i]);
+            logloss -= log((double)probs[ds.labels[i]] + 1e-12);
+            for(int j = 0; j < RESERVOIR_SIZE; j++) {
+                double d = fabs((double)h[j] - ref[k * RESERVOIR_SIZE + j]);
+                if(d > max_dev) max_dev = d;
+                sum_dev += d;
+            }
+        }
+        double kps = n_test / (now_seconds() - t0);
+        if(c == 0) ref_kps = kps;
+        double acc = (double)correct / n_test;
+        double mean_dev = sum_dev / ((double)n_test * RESERVOIR_SIZE);
+        if(json) {
+            printf("{\"bench\":\"pareto\",\"config\":\"%s\",\"noise\":%g,\"fast_tanh\":%d,\"format\":%d,"
+                   "\"density\":%g,\"test\":%ld,\"accuracy\":%.6f,\"logloss\":%.6f,\"max_state_dev\":%.6g,"
+                   "\"mean_state_dev\":%.6g,\"keys_per_sec\":%.1f,\"speedup\":%.3f}\n",
+                   pc->name, pc->cfg.noise, pc->cfg.fast_tanh, (int)pc->cfg.format, pc->cfg.density,
+                   n_test, acc, logloss / n_test, max_dev, mean_dev, kps, kps / ref_kps);
+        } else {
+            printf("%-20s %9.4f %9.4f %12.3g %12.3g %12.0f %8.2f\n",
+                   pc->name, acc, logloss / n_test, max_dev, mean_dev, kps, kps / ref_kps);
+        }
+    }
+
+    free(ref);
+    free(ds.labels);
+    keyset_free(&ds.keys);
+    trie_free(root);
+    return 0;
+}
@@ -0,0 +1,212 @@
+// =========================================================
+// 疎なランダム射影の距離の歪みと速度
+//
+//   ビルド例:
+//     gcc -O2 -march=native -pthread -o bench_projection bench/bench_projection.c -lm
+//   実行例:
+//     ./bench_projection --workload words --keys 20000 --dims 8,16,32 --density 1,3,0
+//
+//   key の状態 (trie_reservoir_forward) を射影後の次元 k × 疎さ s ごとに射影し、
+//     ランダムな組の二乗距離の比 (射影後 / 射影前) の平均・標準偏差・最大の |1 - 比|,
+//     比が 1 ± eps に収まる組の割合,
+//     全件比較の k 近傍 (--knn) が射影後にどれだけ残るか,
+//     rp_project の ns/回 (比較用に同じ大きさの密な行列積も)
+//   を並べる。--density 0 は very sparse (s = sqrt(RESERVOIR_SIZE))。
+// =========================================================
+#define TRLM_NO_MAIN
+#include "../trlm.c"
+#include "bench_common.h"
+
+typedef struct {
+    const RandomProjection* rp;
+    const float* dense;      // k x RESERVOIR_SIZE (NULL なら rp_project)
+    const float* X;
+    long n;
+    float z[RESERVOIR_SIZE];
+} ProjCtx;
+
+static double bench_project(void* p, long iters) {
+    ProjCtx* c = (ProjCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        const float* h = c->X + (it % c->n) * RESERVOIR_SIZE;
+        if(c->dense) {
+            for(int j = 0; j < c->rp->k; j++) {
+                float s = 0.0f;
+                for(int i = 0; i < RESERVOIR_SIZE; i++) s += c->dense[j * RESERVOIR_SIZE + i] * h[i];
+                c->z[j] = s;
+            }
+        } else {
+            rp_project(c->rp, h, c->z);
+        }
+    }
+    bench_sink = c->z[0];
+    return 0.0;
+}
+
+static float l2sq(const float* a, const float* b, int n) {
+    float s = 0.0f;
+    for(int i = 0; i < n; i++) s += (a[i] - b[i]) * (a[i] - b[i]);
+    return s;
+}
+
+// X (n x dim) の中で q 番目に近い knn 個 (自分を除く) を out に書く
+static void knn_brute(const float* X, long n, int dim, long q, int knn, long* out) {
+    float* best = (float*)malloc(sizeof(float) * knn);
+    for(int i = 0; i < knn; i++) {
+        best[i] = INFINITY;
+        out[i] = -1;
+    }
+    for(long j = 0; j < n; j++) {
+        if(j == q) continue;
+        float d = l2sq(X + q * dim, X + j * dim, dim);
+        if(d >= best[knn - 1]) continue;
+        int p = knn - 1;
+        while(p > 0 && best[p - 1] > d) {
+            best[p] = best[p - 1];
+            out[p] = out[p - 1];
+            p--;
+        }
+        best[p] = d;
+        out[p] = j;
+    }
+    free(best);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [--workload words|ident|url|log] [--keys N] [--dims K1,K2,...]\n"
+        "          [--density S1,S2,...] [--pairs N] [--eps F] [--knn N] [--knn-queries N]\n"
+        "          [--reps N] [--seed N]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    WorkloadKind wl = WL_WORDS;
+    long n_keys = 10000, pairs = 20000, knn_q = 100;
+    int knn = 10;
+    double eps = 0.2;
+    char dims[128] = "8,16,32";
+    char densities[64] = "1,3,0";
+    unsigned long long seed = 42;
+    BenchConfig cfg = { 5, 0.05, 0.05 };
+    for(int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        const char* v = (i + 1 < argc)? argv[i + 1] : NULL;
+        if(!v) { usage(argv[0]); return 1; }
+        if(strcmp(a, "--keys") == 0) n_keys = atol(v);
+        else if(strcmp(a, "--dims") == 0) snprintf(dims, sizeof(dims), "%s", v);
+        else if(strcmp(a, "--density") == 0) snprintf(densities, sizeof(densities), "%s", v);
+        else if(strcmp(a, "--pairs") == 0) pairs = atol(v);
+        else if(strcmp(a, "--eps") == 0) eps = atof(v);
+        else if(strcmp(a, "--knn") == 0) knn = atoi(v);
+        else if(strcmp(a, "--knn-queries") == 0) knn_q = atol(v);
+        else if(strcmp(a, "--reps") == 0) cfg.reps = atoi(v);
+        else if(strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else if(strcmp(a, "--workload") == 0) {
+            if(workload_parse(v, &wl) != 0) { usage(argv[0]); return 1; }
+        } else { usage(argv[0]); return 1; }
+        i++;
+    }
+    if(cfg.reps < 1) cfg.reps = 1;
+    if(knn < 1) knn = 1;
+
+    KeySet ks;
+    bench_make_workload(&ks, wl, n_keys, seed);
+    TrieNode* root = create_trie_node(0);
+    for(long i = 0; i < ks.n; i++) trie_insert(root, keyset_get(&ks, i));
+    init_reservoir_weights_seeded(MAX_DEPTH, (unsigned int)seed);
+    noise_seed((unsigned int)seed);
+    const long n = ks.n;
+    float* X = (float*)calloc((size_t)n * RESERVOIR_SIZE, sizeof(float));
+    for(long i = 0; i < n; i++) trie_reservoir_forward(root, keyset_get(&ks, i), X + i * RESERVOIR_SIZE);
+    if(knn_q > n) knn_q = n;
+    if(knn >= n) knn = (n > 1)? (int)n - 1 : 1;
+    long* truth = (long*)malloc(sizeof(long) * knn * (knn_q > 0? knn_q : 1));
+    for(long q = 0; q < knn_q; q++) knn_brute(X, n, RESERVOIR_SIZE, q, knn, truth + q * knn);
+
+    printf("# workload=%s keys=%ld RESERVOIR_SIZE=%d pairs=%ld eps=%.2f knn=%d\n",
+           workload_name(wl), n, RESERVOIR_SIZE, pairs, eps, knn);
+    printf("%5s %4s %8s %10s %10s %10s %9s %9s %10s %10s\n", "k", "s", "nnz/row", "mean", "stddev",
+           "max|1-r|", "in_eps", "knn_keep", "ns/proj", "dense ns");
+
+    double* samples = (double*)malloc(sizeof(double) * cfg.reps);
+    float* Z = (float*)malloc(sizeof(float) * RESERVOIR_SIZE * n);
+    long* found = (long*)malloc(sizeof(long) * knn);
+    char* save_k = NULL;
+    for(char* tk = strtok_r(dims, ",", &save_k); tk; tk = strtok_r(NULL, ",", &save_k)) {
+        int k = atoi(tk);
+        char dlist[64];
+        snprintf(dlist, sizeof(dlist), "%s", densities);
+        char* save_s = NULL;
+        for(char* ts = strtok_r(dlist, ",", &save_s); ts; ts = strtok_r(NULL, ",", &save_s)) {
+            RandomProjection rp;
+            rp_init(&rp, k, atoi(ts), seed);
+            for(long i = 0; i < n; i++) rp_project(&rp, X + i * RESERVOIR_SIZE, Z + i * rp.k);
+
+            // ランダムな組の距離比
+            BenchRng r = { seed ^ 0xd157ull };
+            double sum = 0.0, sum2 = 0.0, worst = 0.0;
+            long inside = 0, used = 0;
+            for(long p = 0; p < pairs && n > 1; p++) {
+                long a = (long)(bench_rng_next(&r) % (unsigned long long)n);
+                long b = (long)(bench_rng_next(&r) % (unsigned long long)n);
+                float d0 = l2sq(X + a * RESERVOIR_SIZE, X + b * RESERVOIR_SIZE, RESERVOIR_SIZE);
+                if(a == b || d0 <= 0.0f) continue;
+                double ratio = l2sq(Z + a * rp.k, Z + b * rp.k, rp.k) / d0;
+                sum += ratio;
+                sum2 += ratio * ratio;
+                if(fabs(1.0 - ratio) > worst) worst = fabs(1.0 - ratio);
+                inside += (fabs(1.0 - ratio) <= eps);
+                used++;
+            }
+            double mean = used? sum / used : 0.0;
+            double sd = used? sqrt(fmax(sum2 / used - mean * mean, 0.0)) : 0.0;
+
+            // 近傍の保存率
+            long keep = 0;
+            for(long q = 0; q < knn_q; q++) {
+                knn_brute(Z, n, rp.k, q, knn, found);
+                for(int i = 0; i < knn; i++) {
+                    for(int j = 0; j < knn; j++) {
+                        if(found[i] == truth[q * knn + j]) {
+                            keep++;
+                            break;
+                        }
+                    }
+                }
+            }
+
+            ProjCtx ctx;
+            ctx.rp = &rp;
+            ctx.dense = NULL;
+            ctx.X = X;
+            ctx.n = n;
+            bench_measure(&cfg, bench_project, &ctx, samples);
+            double ns = bench_stats(samples, cfg.reps).median;
+            float* dense = (float*)malloc(sizeof(float) * rp.k * RESERVOIR_SIZE);
+            for(int j = 0; j < rp.k; j++) {
+                for(int i = 0; i < RESERVOIR_SIZE; i++) {
+                    dense[j * RESERVOIR_SIZE + i] = rp.scale * (float)rp_entry(rp.seed, rp.s, j, i);
+                }
+            }
+            ctx.dense = dense;
+            bench_measure(&cfg, bench_project, &ctx, samples);
+            double dense_ns = bench_stats(samples, cfg.reps).median;
+            free(dense);
+
+            printf("%5d %4d %8.1f %10.4f %10.4f %10.4f %8.2f%% %8.2f%% %10.1f %10.1f\n",
+                   rp.k, rp.s, (double)rp.row_ptr[rp.k] / rp.k, mean, sd, worst,
+                   used? 100.0 * inside / used : 0.0,
+                   knn_q? 100.0 * keep / ((double)knn_q * knn) : 0.0, ns, dense_ns);
+            rp_free(&rp);
+        }
+    }
+
+    free(found);
+    free(Z);
+    free(samples);
+    free(truth);
+    free(X);
+    trie_free(root);
+    keyset_free(&ks);
+    return 0;
+}
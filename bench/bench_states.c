@@ -0,0 +1,247 @@
+// =========================================================
+// ノード状態の圧縮保存 (fp16 / int8 / PQ) の容量・誤差・速度
+//
+//   ビルド例:
+//     gcc -O2 -march=native -pthread -o bench_states bench/bench_states.c -lm
+//   実行例:
+//     ./bench_states --workload words --keys 50000 --pq-m 8,16
+//
+//   同じ Trie の全ノード状態を fp32 で一度だけ計算し、それを各形式に詰め直して
+//   (リザバーの入力はノイズだけなので、毎回計算すると状態が変わるため)
+//     bytes/node, fp32 の保存値からの最大/平均誤差,
+//     argmax がリードアウト (fp32 状態) と一致する割合,
+//     key -> 状態 -> リードアウトの ns/key
+//   を並べる。PQ は復号してからのリードアウトと、符号のまま
+//   表引きするリードアウト (pq-lut) の両方を測る。
+//   比較用に forward で状態を計算する場合 (recompute) も出す。
+//   --cache-frac で、全ノードを持たずにノード数 x frac の容量の
+//   プレフィックス状態キャッシュ (CLOCK) で forward する場合の
+//   ns/key, 祖先ヒット率, 省けたステップの割合も出す
+//   (問い合わせは key を Zipf(s=1) で選ぶ)。
+// =========================================================
+#define TRLM_NO_MAIN
+#include "../trlm.c"
+#include "bench_common.h"
+
+typedef struct {
+    const NodeStateStore* st;
+    const TrieBackend* tb;
+    const KeySet* ks;
+    const PqReadoutLut* lut;     // NULL なら復号してリードアウト
+    int recompute;               // 1 なら保存値を使わず forward する
+} StateCtx;
+
+typedef struct {
+    const TrieBackend* tb;
+    const KeySet* ks;
+    PrefixStateCache* cache;
+    const int* order;            // 問い合わせる key の番号 (Zipf)
+    long n_order;
+} CacheCtx;
+
+static double bench_cached_forward(void* p, long iters) {
+    CacheCtx* c = (CacheCtx*)p;
+    float h[RESERVOIR_SIZE], probs[OUT_DIM] = {0};
+    for(long it = 0; it < iters; it++) {
+        memset(h, 0, sizeof(h));
+        trie_backend_forward_cached(c->tb, c->cache, keyset_get(c->ks, c->order[it % c->n_order]), h);
+        readout_forward(h, probs);
+    }
+    bench_sink = probs[0];
+    return 0.0;
+}
+
+static double bench_state_readout(void* p, long iters) {
+    StateCtx* c = (StateCtx*)p;
+    float h[RESERVOIR_SIZE], probs[OUT_DIM] = {0};
+    for(long it = 0; it < iters; it++) {
+        const char* k = keyset_get(c->ks, it % c->ks->n);
+        if(c->recompute) {
+            memset(h, 0, sizeof(h));
+            trie_backend_forward(c->tb, k, h);
+            readout_forward(h, probs);
+        } else if(c->lut) {
+            TrieRef cur = c->tb->root(c->tb->impl);
+            for(int i = 0; k[i] != '\0' && i < MAX_DEPTH; i++) {
+                TrieRef next = c->tb->step(c->tb->impl, cur, (unsigned char)k[i]);
+                if(next == TRIE_REF_NONE) break;
+                cur = next;
+            }
+            pq_readout_forward(c->lut, c->st, c->tb->node_id(c->tb->impl, cur), probs);
+        } else {
+            node_state_lookup(c->st, c->tb, k, h);
+            readout_forward(h, probs);
+        }
+    }
+    bench_sink = probs[0];
+    return 0.0;
+}
+
+static int argmax(const float* p) {
+    int best = 0;
+    for(int o = 1; o < OUT_DIM; o++) if(p[o] > p[best]) best = o;
+    return best;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [--workload words|ident|url|log] [--keys N] [--pq-m M1,M2,...]\n"
+        "          [--train N] [--cache-frac F1,F2,...] [--reps N] [--seed N]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    WorkloadKind wl = WL_WORDS;
+    long n_keys = 20000, train = 16384;
+    char pq_list[128] = "8,16";
+    char cache_list[128] = "0.01,0.1";
+    unsigned long long seed = 42;
+    BenchConfig cfg = { 5, 0.05, 0.05 };
+    for(int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        const char* v = (i + 1 < argc)? argv[i + 1] : NULL;
+        if(!v) { usage(argv[0]); return 1; }
+        if(strcmp(a, "--keys") == 0) n_keys = atol(v);
+        else if(strcmp(a, "--pq-m") == 0) snprintf(pq_list, sizeof(pq_list), "%s", v);
+        else if(strcmp(a, "--train") == 0) train = atol(v);
+        else if(strcmp(a, "--cache-frac") == 0) snprintf(cache_list, sizeof(cache_list), "%s", v);
+        else if(strcmp(a, "--reps") == 0) cfg.reps = atoi(v);
+        else if(strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else if(strcmp(a, "--workload") == 0) {
+            if(workload_parse(v, &wl) != 0) { usage(argv[0]); return 1; }
+        } else { usage(argv[0]); return 1; }
+        i++;
+    }
+    if(cfg.reps < 1) cfg.reps = 1;
+
+    KeySet ks;
+    bench_make_workload(&ks, wl, n_keys, seed);
+    TrieNode* root = create_trie_node(0);
+    for(long i = 0; i < ks.n; i++) trie_insert(root, keyset_get(&ks, i));
+    TrieBackend tb;
+    trie_backend_pointer(&tb, root);
+
+    init_reservoir_weights_seeded(MAX_DEPTH, (unsigned int)seed);
+    noise_seed((unsigned int)seed);
+    srand((unsigned int)seed);
+    init_readout();
+
+    NodeStateStore ref;
+    double t_ref = now_seconds();
+    node_state_store_build(&ref, &tb, STATE_F32, 0, 0);
+    double ref_build = now_seconds() - t_ref;
+    const long n = ref.n;
+    const double f32_bytes = (double)node_state_store_bytes(&ref) / n;
+    float* ref_probs = (float*)malloc(sizeof(float) * OUT_DIM * n);
+    float h[RESERVOIR_SIZE], g[RESERVOIR_SIZE];
+    for(long id = 0; id < n; id++) node_state_readout(&ref, id, &readout_weights[0][0], ref_probs + id * OUT_DIM);
+
+    printf("# workload=%s keys=%ld nodes=%ld RESERVOIR_SIZE=%d OUT_DIM=%d\n",
+           workload_name(wl), ks.n, n, RESERVOIR_SIZE, OUT_DIM);
+    printf("%-12s %10s %8s %12s %12s %9s %12s %10s\n",
+           "codec", "bytes/node", "ratio", "max_err", "mean_err", "argmax=", "ns/key", "build s");
+
+    double* samples = (double*)malloc(sizeof(double) * cfg.reps);
+    StateCtx ctx = { &ref, &tb, &ks, NULL, 1 };
+    bench_measure(&cfg, bench_state_readout, &ctx, samples);
+    printf("%-12s %10.1f %8.2f %12s %12s %9s %12.1f %10s\n", "recompute", 0.0, 0.0, "-", "-", "-",
+           bench_stats(samples, cfg.reps).median, "-");
+    ctx.recompute = 0;
+    bench_measure(&cfg, bench_state_readout, &ctx, samples);
+    printf("%-12s %10.1f %8.2f %12s %12s %9s %12.1f %10.3f\n", "f32", f32_bytes, 1.0, "0", "0", "100.00%",
+           bench_stats(samples, cfg.reps).median, ref_build);
+
+    // f16, int8, 各 pq_m の順に測る (f32 は上の参照そのもの)
+    int pq_ms[16], n_pq = 0;
+    char* save = NULL;
+    for(char* t = strtok_r(pq_list, ",", &save); t && n_pq < 16; t = strtok_r(NULL, ",", &save)) pq_ms[n_pq++] = atoi(t);
+    const int n_runs = 3 + n_pq;
+    for(int r = 1; r < n_runs; r++) {
+        StateCodec codec = (r < 3)? (StateCodec)r : STATE_PQ;
+        int pq_m = (r < 3)? 0 : pq_ms[r - 3];
+        NodeStateStore st;
+        double t0 = now_seconds();
+        if(node_state_store_recode(&st, &ref, codec, pq_m, train) != 0) {
+            fprintf(stderr, "pq-m %d must divide RESERVOIR_SIZE (%d)\n", pq_m, RESERVOIR_SIZE);
+            continue;
+        }
+        double build = now_seconds() - t0;
+
+        double max_err = 0.0, sum_err = 0.0;
+        long agree = 0;
+        float probs[OUT_DIM];
+        for(long id = 0; id < n; id++) {
+            node_state_decode(&ref, id, h);
+            node_state_decode(&st, id, g);
+            for(int j = 0; j < RESERVOIR_SIZE; j++) {
+                double d = fabs((double)h[j] - g[j]);
+                if(d > max_err) max_err = d;
+                sum_err += d;
+            }
+            readout_forward(g, probs);
+            agree += (argmax(probs) == argmax(ref_probs + id * OUT_DIM));
+        }
+
+        char label[32];
+        if(codec == STATE_PQ) snprintf(label, sizeof(label), "pq%d", pq_m);
+        else snprintf(label, sizeof(label), "%s", state_codec_name(codec));
+        double bpn = (double)node_state_store_bytes(&st) / n;
+        ctx = (StateCtx){ &st, &tb, &ks, NULL, 0 };
+        bench_measure(&cfg, bench_state_readout, &ctx, samples);
+        printf("%-12s %10.1f %8.2f %12.3g %12.3g %8.2f%% %12.1f %10.3f\n",
+               label, bpn, f32_bytes / bpn, max_err, sum_err / ((double)n * RESERVOIR_SIZE),
+               100.0 * agree / n, bench_stats(samples, cfg.reps).median, build);
+
+        if(codec == STATE_PQ) {
+            PqReadoutLut lut;
+            pq_readout_lut_build(&lut, &st, &readout_weights[0][0]);
+            long agree_lut = 0;
+            for(long id = 0; id < n; id++) {
+                pq_readout_forward(&lut, &st, id, probs);
+                agree_lut += (argmax(probs) == argmax(ref_probs + id * OUT_DIM));
+            }
+            ctx.lut = &lut;
+            bench_measure(&cfg, bench_state_readout, &ctx, samples);
+            snprintf(label, sizeof(label), "pq%d-lut", pq_m);
+            printf("%-12s %10.1f %8.2f %12s %12s %8.2f%% %12.1f %10s\n",
+                   label, bpn, f32_bytes / bpn, "-", "-", 100.0 * agree_lut / n,
+                   bench_stats(samples, cfg.reps).median, "-");
+            pq_readout_lut_free(&lut);
+        }
+        node_state_store_free(&st);
+    }
+
+    // 有界キャッシュで forward する場合
+    const long n_order = 1 << 16;
+    int* order = (int*)malloc(sizeof(int) * n_order);
+    ZipfTable zt;
+    zipf_init(&zt, (int)ks.n, 1.0);
+    BenchRng rng = { seed ^ 0x5eedull };
+    for(long i = 0; i < n_order; i++) order[i] = zipf_sample(&zt, &rng);
+    zipf_free(&zt);
+    printf("\n%-12s %10s %12s %10s %10s %12s %12s\n",
+           "cache", "capacity", "bytes", "fwd_hit", "step_save", "ns/key", "evictions");
+    save = NULL;
+    for(char* t = strtok_r(cache_list, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        double frac = atof(t);
+        PrefixStateCache pc;
+        prefix_cache_init(&pc, (long)(frac * n));
+        CacheCtx cc = { &tb, &ks, &pc, order, n_order };
+        bench_measure(&cfg, bench_cached_forward, &cc, samples);
+        PrefixCacheMetrics m;
+        prefix_cache_metrics(&pc, &m);
+        char label[32];
+        snprintf(label, sizeof(label), "clock%g", frac);
+        printf("%-12s %10ld %12zu %9.2f%% %9.2f%% %12.1f %12ld\n",
+               label, m.capacity, prefix_cache_bytes(&pc), 100.0 * m.forward_hit_rate,
+               100.0 * m.step_saving, bench_stats(samples, cfg.reps).median, m.evictions);
+        prefix_cache_free(&pc);
+    }
+    free(order);
+
+    free(samples);
+    free(ref_probs);
+    node_state_store_free(&ref);
+    trie_free(root);
+    keyset_free(&ks);
+    return 0;
+}
@@ -0,0 +1,174 @@
+// =========================================================
+// トークン列の Trie とバイトの Trie の比較
+//
+//   ビルド例:
+//     gcc -O2 -pthread -o bench_tokens bench/bench_tokens.c -lm
+//   実行例:
+//     ./bench_tokens --sentences 50000 --vocab 20000
+//
+//   Zipf(s=1) で選んだ単語を 2..12 個空白でつないだ文を作り、同じ文から
+//   バイトの Trie (trie_insert) とトークンの Trie (token_dict_encode +
+//   token_trie_insert) を作って
+//     ノード数, バイト数, 1 文あたりの forward のステップ数と ns,
+//     MAX_DEPTH ステップで状態に入る文の割合 (バイト数比)
+//   を並べる。挿入した文がすべてトークンの Trie の葉に辿り着くかも確かめる
+//   (辿り着かなければ終了コード 1)。
+// =========================================================
+#define TRLM_NO_MAIN
+#include "../trlm.c"
+#include "bench_common.h"
+
+typedef struct {
+    TrieNode* root;
+    const TokenTrie* tt;
+    const KeySet* sentences;
+    const unsigned int* tokens;   // 文ごとに MAX_DEPTH 個ずつ
+    const int* n_tokens;
+    float h[RESERVOIR_SIZE];
+} TokenCtx;
+
+static double bench_byte_forward(void* p, long iters) {
+    TokenCtx* c = (TokenCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        memset(c->h, 0, sizeof(c->h));
+        trie_reservoir_forward(c->root, keyset_get(c->sentences, it % c->sentences->n), c->h);
+    }
+    bench_sink = c->h[0];
+    return 0.0;
+}
+
+static double bench_token_forward(void* p, long iters) {
+    TokenCtx* c = (TokenCtx*)p;
+    for(long it = 0; it < iters; it++) {
+        long i = it % c->sentences->n;
+        memset(c->h, 0, sizeof(c->h));
+        token_trie_forward(c->tt, c->tokens + i * MAX_DEPTH, c->n_tokens[i], c->h);
+    }
+    bench_sink = c->h[0];
+    return 0.0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [--sentences N] [--vocab N] [--reps N] [--seed N]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    long n_sent = 20000;
+    int vocab = 20000;
+    unsigned long long seed = 42;
+    BenchConfig cfg = { 5, 0.05, 0.05 };
+    for(int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        const char* v = (i + 1 < argc)? argv[i + 1] : NULL;
+        if(!v) { usage(argv[0]); return 1; }
+        if(strcmp(a, "--sentences") == 0) n_sent = atol(v);
+        else if(strcmp(a, "--vocab") == 0) vocab = atoi(v);
+        else if(strcmp(a, "--reps") == 0) cfg.reps = atoi(v);
+        else if(strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else { usage(argv[0]); return 1; }
+        i++;
+    }
+    if(cfg.reps < 1) cfg.reps = 1;
+    if(vocab < 1) vocab = 1;
+    if(n_sent < 1) n_sent = 1;
+
+    // 単語表と文
+    BenchRng r = { seed };
+    char (*words)[16] = malloc(sizeof(*words) * vocab);
+    for(int i = 0; i < vocab; i++) bench_pseudo_word(&r, words[i]);
+    ZipfTable zt;
+    zipf_init(&zt, vocab, 1.0);
+    KeySet sent;
+    memset(&sent, 0, sizeof(sent));
+    sent.off = (size_t*)malloc(sizeof(size_t) * n_sent);
+    char buf[12 * 16];
+    for(long s = 0; s < n_sent; s++) {
+        int nw = 2 + (int)(bench_rng_next(&r) % 11);
+        int len = 0;
+        for(int w = 0; w < nw; w++) {
+            const char* word = words[zipf_sample(&zt, &r)];
+            if(w) buf[len++] = ' ';
+            size_t wl = strlen(word);
+            memcpy(buf + len, word, wl);
+            len += (int)wl;
+        }
+        keyset_push(&sent, buf, (size_t)len);
+    }
+    zipf_free(&zt);
+
+    init_reservoir_weights_seeded(MAX_DEPTH, (unsigned int)seed);
+
+    double t0 = now_seconds();
+    TrieNode* root = create_trie_node(0);
+    for(long i = 0; i < sent.n; i++) trie_insert(root, keyset_get(&sent, i));
+    double byte_build = now_seconds() - t0;
+
+    TokenDict dict;
+    token_dict_init(&dict);
+    TokenTrie tt;
+    t0 = now_seconds();
+    token_trie_init(&tt);
+    unsigned int* tokens = (unsigned int*)malloc(sizeof(unsigned int) * MAX_DEPTH * sent.n);
+    int* n_tokens = (int*)malloc(sizeof(int) * sent.n);
+    long* leaf = (long*)malloc(sizeof(long) * sent.n);
+    for(long i = 0; i < sent.n; i++) {
+        n_tokens[i] = token_dict_encode(&dict, keyset_get(&sent, i), tokens + i * MAX_DEPTH, MAX_DEPTH, 1);
+        leaf[i] = token_trie_insert(&tt, tokens + i * MAX_DEPTH, n_tokens[i]);
+    }
+    double token_build = now_seconds() - t0;
+
+    // 挿入した文は葉に辿り着き、その深さはトークン数に等しいはず
+    long mismatches = 0;
+    double byte_steps = 0.0, token_steps = 0.0, byte_cover = 0.0, token_cover = 0.0;
+    for(long i = 0; i < sent.n; i++) {
+        int steps;
+        long id = token_trie_find(&tt, tokens + i * MAX_DEPTH, n_tokens[i], &steps);
+        if(id != leaf[i] || !tt.is_leaf[id] || tt.depth[id] != n_tokens[i]) mismatches++;
+        const char* s = keyset_get(&sent, i);
+        size_t len = strlen(s);
+        int bs = trie_effective_depth(root, s);
+        byte_steps += bs;
+        token_steps += steps;
+        byte_cover += (double)bs / len;
+        // 先頭 steps 語が占めるバイト数 (区切りの空白を含む)
+        size_t covered = steps? len : 0;
+        for(size_t c = 0, w = 0; c < len && steps > 0; c++) {
+            if(s[c] == ' ' && (int)++w == steps) {
+                covered = c;
+                break;
+            }
+        }
+        token_cover += (double)covered / len;
+    }
+
+    printf("# sentences=%ld vocab=%d distinct words=%u MAX_DEPTH=%d RESERVOIR_SIZE=%d\n",
+           sent.n, vocab, dict.n, MAX_DEPTH, RESERVOIR_SIZE);
+    printf("%-8s %10s %14s %9s %11s %10s %12s\n", "trie", "nodes", "bytes", "build s", "steps/key", "coverage",
+           "fwd ns/key");
+    double* samples = (double*)malloc(sizeof(double) * cfg.reps);
+    TokenCtx ctx;
+    ctx.root = root;
+    ctx.tt = &tt;
+    ctx.sentences = &sent;
+    ctx.tokens = tokens;
+    ctx.n_tokens = n_tokens;
+    bench_measure(&cfg, bench_byte_forward, &ctx, samples);
+    long nodes = bench_count_nodes(root);
+    printf("%-8s %10ld %14zu %9.3f %11.2f %9.1f%% %12.1f\n", "byte", nodes, nodes * sizeof(TrieNode),
+           byte_build, byte_steps / sent.n, 100.0 * byte_cover / sent.n, bench_stats(samples, cfg.reps).median);
+    bench_measure(&cfg, bench_token_forward, &ctx, samples);
+    printf("%-8s %10ld %14zu %9.3f %11.2f %9.1f%% %12.1f\n", "token", tt.n_nodes, token_trie_bytes(&tt),
+           token_build, token_steps / sent.n, 100.0 * token_cover / sent.n, bench_stats(samples, cfg.reps).median);
+    if(mismatches) printf("FAIL: %ld sentences did not reach their leaf\n", mismatches);
+
+    free(samples);
+    free(leaf);
+    free(n_tokens);
+    free(tokens);
+    token_trie_free(&tt);
+    token_dict_free(&dict);
+    trie_free(root);
+    keyset_free(&sent);
+    free(words);
+    return mismatches? 1 : 0;
+}
@@ -1,12 +1,35 @@
+#define _GNU_SOURCE  // clock_gettime, syscall(perf_event_open) 用
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
+// RESERVOIR_SIZE / MAX_DEPTH / OUT_DIM はコンパイル時に -D で上書きできる
+// (ベンチマークで次元を振るため)
 #define MAX_CHILDREN 256   // ASCII想定の最大子ノード数
+#ifndef RESERVOIR_SIZE
 #define RESERVOIR_SIZE 64  // リザバーの次元数 (論文例: 256 など)
+#endif
+#ifndef MAX_DEPTH
 #define MAX_DEPTH 16       // Trie の固定深度 (論文例: 16 や 64)
+#endif
 #define ALPHA 0.85f        // 減衰係数
 #define RHO 0.9f           // スペクトル半径 (簡易的にこの係数でスケーリング)
 
@@ -18,6 +41,460 @@ static float rand_float(void) {
     return (float)rand() / (float)(RAND_MAX/2) - 1.0f;
 }
 
+// リザバー更新のノイズ用乱数 (-1.0 ~ +1.0)
+//   推論は複数スレッドから呼ばれるので、rand() の内部ロックを避けて
+//   スレッドごとに独立した xorshift32 を使う
+static _Thread_local unsigned int noise_rng_state = 0;
+
+static float noise_float(void) {
+    unsigned int x = noise_rng_state;
+    if(x == 0) {
+        x = (unsigned int)rand() ^ (unsigned int)(size_t)&noise_rng_state;
+        if(x == 0) x = 0x9E3779B9u;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    noise_rng_state = x;
+    return (float)(x >> 8) * (1.0f / 8388608.0f) - 1.0f;
+}
+
+// 呼び出しスレッドのノイズ系列を固定する (近似設定どうしを同じノイズで比べる用)
+void noise_seed(unsigned int seed) {
+    unsigned int x = seed * 2654435761u ^ 0x5BD1E995u;
+    noise_rng_state = (x != 0)? x : 0x9E3779B9u;
+}
+
+// -------------------------
+// 単調増加クロック (秒)
+// -------------------------
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// =========================================================
+// ホットパスの段階別計測 (TRLM_INSTRUMENT を定義したときのみ有効)
+//   - 各段階 (Trie 走査, matvec, tanh, ノイズ生成, リードアウト) の前後で
+//     TSC を読み、スレッドごとのカウンタと log2 バケットのヒストグラムに積む
+//   - カウンタは書き込むスレッドが 1 つだけなので lock 命令を使わない
+//     relaxed な load/store で更新し、集計側はリストを辿って合算する
+//   - リセットは現在値を基準値として保存し、以後の差分を返すことで行う
+//     (計測中のスレッドを止めたり書き換えたりしない)
+// =========================================================
+typedef enum {
+    PROF_TRIE_WALK = 0,  // 子ノードの参照 (1 ステップ 1 サンプル)
+    PROF_MATVEC,         // matvec / matmat
+    PROF_TANH,           // tanh + alpha
+    PROF_NOISE,          // ノイズ生成と加算
+    PROF_READOUT,        // readout_forward
+    PROF_STAGE_COUNT
+} ProfStage;
+
+#define PROF_BUCKETS 48  // バケット b は [2^b, 2^(b+1)) サイクルのサンプル
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long cycles;
+    unsigned long long hist[PROF_BUCKETS];
+} ProfStageStats;
+
+typedef struct {
+    ProfStageStats stage[PROF_STAGE_COUNT];
+    double cycles_per_ns;   // TSC 周波数 (サイクル -> ns 変換用)
+} ProfSnapshot;
+
+static const char* const prof_stage_names[PROF_STAGE_COUNT] = {
+    "trie_walk", "matvec", "activate_tanh", "noise", "readout_forward"
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline unsigned long long prof_now(void) { return __rdtsc(); }
+#else
+static inline unsigned long long prof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+#endif
+
+typedef struct ProfThread {
+    _Atomic unsigned long long count[PROF_STAGE_COUNT];
+    _Atomic unsigned long long cycles[PROF_STAGE_COUNT];
+    _Atomic unsigned long long hist[PROF_STAGE_COUNT][PROF_BUCKETS];
+    struct ProfThread* next;
+} ProfThread;
+
+// スレッドごとのブロックは終了後も合計に残すため解放しない
+static _Atomic(ProfThread*) prof_threads = NULL;
+static _Thread_local ProfThread* prof_self = NULL;
+static ProfSnapshot prof_baseline;
+static unsigned long long prof_origin_tsc;
+static double prof_origin_sec;
+static atomic_flag prof_origin_set = ATOMIC_FLAG_INIT;
+
+static ProfThread* prof_register_thread(void) {
+    ProfThread* t = (ProfThread*)calloc(1, sizeof(ProfThread));
+    ProfThread* head = atomic_load_explicit(&prof_threads, memory_order_relaxed);
+    do {
+        t->next = head;
+    } while(!atomic_compare_exchange_weak_explicit(&prof_threads, &head, t,
+                                                   memory_order_release, memory_order_relaxed));
+    if(!atomic_flag_test_and_set(&prof_origin_set)) {
+        prof_origin_sec = now_seconds();
+        prof_origin_tsc = prof_now();
+    }
+    prof_self = t;
+    return t;
+}
+
+static inline void prof_bump(_Atomic unsigned long long* c, unsigned long long v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static inline void prof_record(ProfStage stage, unsigned long long cycles) {
+    ProfThread* t = prof_self? prof_self : prof_register_thread();
+    int b = 63 - __builtin_clzll(cycles | 1);
+    if(b >= PROF_BUCKETS) b = PROF_BUCKETS - 1;
+    prof_bump(&t->count[stage], 1);
+    prof_bump(&t->cycles[stage], cycles);
+    prof_bump(&t->hist[stage][b], 1);
+}
+
+#ifdef TRLM_INSTRUMENT
+#define PROF_BEGIN(var) unsigned long long var = prof_now()
+#define PROF_END(stage, var) prof_record((stage), prof_now() - (var))
+#else
+#define PROF_BEGIN(var) ((void)0)
+#define PROF_END(stage, var) ((void)0)
+#endif
+
+static void prof_collect(ProfSnapshot* out) {
+    memset(out, 0, sizeof(*out));
+    for(ProfThread* t = atomic_load_explicit(&prof_threads, memory_order_acquire); t; t = t->next) {
+        for(int s = 0; s < PROF_STAGE_COUNT; s++) {
+            out->stage[s].count += atomic_load_explicit(&t->count[s], memory_order_relaxed);
+            out->stage[s].cycles += atomic_load_explicit(&t->cycles[s], memory_order_relaxed);
+            for(int b = 0; b < PROF_BUCKETS; b++) {
+                out->stage[s].hist[b] += atomic_load_explicit(&t->hist[s][b], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+// 前回の prof_reset 以降の合計を返す (TRLM_INSTRUMENT 無しでは常に 0)
+void prof_snapshot(ProfSnapshot* out) {
+    prof_collect(out);
+    for(int s = 0; s < PROF_STAGE_COUNT; s++) {
+        out->stage[s].count -= prof_baseline.stage[s].count;
+        out->stage[s].cycles -= prof_baseline.stage[s].cycles;
+        for(int b = 0; b < PROF_BUCKETS; b++) {
+            out->stage[s].hist[b] -= prof_baseline.stage[s].hist[b];
+        }
+    }
+    out->cycles_per_ns = 1.0;
+#if defined(__x86_64__) || defined(__i386__)
+    double elapsed = now_seconds() - prof_origin_sec;
+    if(prof_origin_tsc != 0 && elapsed > 1e-3) {
+        out->cycles_per_ns = (double)(prof_now() - prof_origin_tsc) / (elapsed * 1e9);
+    }
+#endif
+}
+
+void prof_reset(void) {
+    prof_collect(&prof_baseline);
+}
+
+// ヒストグラムから分位点を求める (該当バケットの上端, サイクル)
+double prof_quantile_cycles(const ProfStageStats* st, double q) {
+    unsigned long long target = (unsigned long long)(q * (double)st->count);
+    unsigned long long acc = 0;
+    for(int b = 0; b < PROF_BUCKETS; b++) {
+        acc += st->hist[b];
+        if(acc > target) return (double)(2ULL << b);
+    }
+    return (double)(2ULL << (PROF_BUCKETS - 1));
+}
+
+void prof_print(FILE* fp, const ProfSnapshot* snap) {
+    fprintf(fp, "%-16s %12s %14s %10s %10s %10s\n",
+            "stage", "count", "total_ms", "avg_ns", "p50_ns<=", "p99_ns<=");
+    for(int s = 0; s < PROF_STAGE_COUNT; s++) {
+        const ProfStageStats* st = &snap->stage[s];
+        double ns = (double)st->cycles / snap->cycles_per_ns;
+        fprintf(fp, "%-16s %12llu %14.3f %10.1f %10.0f %10.0f\n",
+                prof_stage_names[s], st->count, ns * 1e-6,
+                st->count? ns / (double)st->count : 0.0,
+                prof_quantile_cycles(st, 0.50) / snap->cycles_per_ns,
+                prof_quantile_cycles(st, 0.99) / snap->cycles_per_ns);
+    }
+}
+
+// =========================================================
+// ハードウェア性能カウンタ (Linux の perf_event_open)
+//   cycles / instructions / LLC ミス / dTLB ミス / 分岐ミスを 1 つの
+//   グループとして同時に数える。呼び出しスレッドのユーザ空間のみが対象。
+//   Trie 走査・リザバー 1 ステップ・リードアウトの各段階をこれで囲み、
+//   操作数で割ると、ポインタ追跡 (LLC/dTLB ミス) と重み帯域
+//   (cycles/instructions) のどちらが律速かが分かる。
+//   PMU が無い環境 (VM など) や権限不足のイベントは -1 を返す。
+// =========================================================
+typedef enum {
+    PERF_EV_CYCLES = 0,
+    PERF_EV_INSTRUCTIONS,
+    PERF_EV_LLC_MISSES,
+    PERF_EV_DTLB_MISSES,
+    PERF_EV_BRANCH_MISSES,
+    PERF_EV_COUNT
+} PerfEvent;
+
+static const char* const perf_event_names[PERF_EV_COUNT] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses"
+};
+
+typedef struct {
+    int fd[PERF_EV_COUNT];      // -1 = 開けなかった
+    int slot[PERF_EV_COUNT];    // グループ読み出し結果の中での位置
+    int leader;                 // グループリーダーの fd
+    int nopen;
+} PerfGroup;
+
+typedef struct {
+    long long v[PERF_EV_COUNT]; // -1 = 計測不可
+} PerfSample;
+
+#ifdef __linux__
+static int perf_open_one(unsigned int type, unsigned long long config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (group_fd == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+// 呼び出しスレッド用のカウンタグループを開く。戻り値は開けたイベント数
+int perf_group_open(PerfGroup* g) {
+    memset(g, 0, sizeof(*g));
+    g->leader = -1;
+    for(int e = 0; e < PERF_EV_COUNT; e++) {
+        g->fd[e] = -1;
+        g->slot[e] = -1;
+    }
+#ifdef __linux__
+    static const struct { unsigned int type; unsigned long long config; } ev[PERF_EV_COUNT] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                              | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                              | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    };
+    for(int e = 0; e < PERF_EV_COUNT; e++) {
+        int fd = perf_open_one(ev[e].type, ev[e].config, g->leader);
+        if(fd < 0) continue;
+        if(g->leader < 0) g->leader = fd;
+        g->fd[e] = fd;
+        g->slot[e] = g->nopen++;
+    }
+#endif
+    return g->nopen;
+}
+
+void perf_group_start(PerfGroup* g) {
+#ifdef __linux__
+    if(g->leader < 0) return;
+    ioctl(g->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(g->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+    (void)g;
+#endif
+}
+
+// 計測を止めて値を読む。多重化で一部の時間しか数えられなかった場合は
+// time_enabled / time_running で補正する
+void perf_group_stop(PerfGroup* g, PerfSample* out) {
+    for(int e = 0; e < PERF_EV_COUNT; e++) out->v[e] = -1;
+#ifdef __linux__
+    if(g->leader < 0) return;
+    ioctl(g->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    unsigned long long buf[3 + PERF_EV_COUNT];
+    ssize_t n = read(g->leader, buf, sizeof(buf));
+    if(n < (ssize_t)(sizeof(unsigned long long) * 3) || buf[0] != (unsigned long long)g->nopen) return;
+    double scale = (buf[2] > 0)? (double)buf[1] / (double)buf[2] : 0.0;
+    for(int e = 0; e < PERF_EV_COUNT; e++) {
+        if(g->slot[e] >= 0) out->v[e] = (long long)((double)buf[3 + g->slot[e]] * scale);
+    }
+#else
+    (void)g;
+#endif
+}
+
+// 操作 1 回あたりの値に換算して出力する (計測不可のイベントは "-")
+void perf_sample_print_per_op(FILE* fp, const char* label, const PerfSample* smp, double ops) {
+    fprintf(fp, "%-18s", label);
+    for(int e = 0; e < PERF_EV_COUNT; e++) {
+        if(smp->v[e] < 0 || ops <= 0.0) fprintf(fp, " %s=-", perf_event_names[e]);
+        else fprintf(fp, " %s=%.2f", perf_event_names[e], (double)smp->v[e] / ops);
+    }
+    if(smp->v[PERF_EV_CYCLES] > 0 && smp->v[PERF_EV_INSTRUCTIONS] >= 0) {
+        fprintf(fp, " ipc=%.2f", (double)smp->v[PERF_EV_INSTRUCTIONS] / (double)smp->v[PERF_EV_CYCLES]);
+    }
+    fprintf(fp, "\n");
+}
+
+void perf_group_close(PerfGroup* g) {
+#ifdef __linux__
+    for(int e = 0; e < PERF_EV_COUNT; e++) {
+        if(g->fd[e] >= 0) close(g->fd[e]);
+    }
+#endif
+    memset(g, 0, sizeof(*g));
+    g->leader = -1;
+}
+
+// =========================================================
+// タイムライン トレース (Chrome trace-event 形式の JSON)
+//   - trace_start() で有効化、trace_stop(path) で書き出す。無効時の
+//     コストは各計測点でのフラグ確認 1 回のみ
+//   - イベントはスレッドごとのリングバッファに溜め (ロック無し)、
+//     書き出し時に 1 スレッド 1 トラックとして出力する。あふれた分は
+//     古いものから上書きされる
+//   - 計測は「単位」(バッチ/リクエスト) ごとにサンプリングする。
+//     trace_unit_begin() が 1/sample_every の確率で単位を選び、選ばれた
+//     単位の中の区間だけを記録する
+//   - trace_stop() は計測対象のスレッドが停止している状態で呼ぶこと
+// =========================================================
+#define TRACE_RING_SIZE 65536
+
+typedef struct {
+    const char* name;
+    const char* k0;       // 引数名 (NULL なら無し)
+    const char* k1;
+    double ts;            // 開始時刻 (秒, trace_start 基準)
+    double dur;
+    long v0;
+    long v1;
+} TraceEvent;
+
+typedef struct TraceThread {
+    TraceEvent ring[TRACE_RING_SIZE];
+    unsigned long long written;
+    unsigned long long units;
+    int tid;
+    char name[32];
+    struct TraceThread* next;
+} TraceThread;
+
+static _Atomic int trace_enabled = 0;
+static int trace_sample_every = 1;
+static double trace_origin = 0.0;
+static _Atomic(TraceThread*) trace_threads = NULL;
+static _Atomic int trace_next_tid = 1;
+static _Thread_local TraceThread* trace_self = NULL;
+static _Thread_local int trace_active = 0;
+
+static TraceThread* trace_thread(void) {
+    if(trace_self) return trace_self;
+    TraceThread* t = (TraceThread*)calloc(1, sizeof(TraceThread));
+    t->tid = atomic_fetch_add(&trace_next_tid, 1);
+    snprintf(t->name, sizeof(t->name), "thread-%d", t->tid);
+    TraceThread* head = atomic_load_explicit(&trace_threads, memory_order_relaxed);
+    do {
+        t->next = head;
+    } while(!atomic_compare_exchange_weak_explicit(&trace_threads, &head, t,
+                                                   memory_order_release, memory_order_relaxed));
+    trace_self = t;
+    return t;
+}
+
+// sample_every 単位に 1 つを記録する (1 なら全て)
+void trace_start(int sample_every) {
+    trace_sample_every = (sample_every > 0)? sample_every : 1;
+    trace_origin = now_seconds();
+    for(TraceThread* t = atomic_load(&trace_threads); t; t = t->next) t->written = 0;
+    atomic_store(&trace_enabled, 1);
+}
+
+// トラック名を付ける (トレース無効中は何もしない)
+void trace_set_thread_name(const char* name) {
+    if(!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) return;
+    snprintf(trace_thread()->name, sizeof(trace_self->name), "%s", name);
+}
+
+// 処理単位の開始。この単位を記録する場合は 1 を返す
+int trace_unit_begin(void) {
+    trace_active = 0;
+    if(!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) return 0;
+    TraceThread* t = trace_thread();
+    trace_active = (t->units++ % (unsigned long long)trace_sample_every) == 0;
+    return trace_active;
+}
+
+void trace_unit_end(void) {
+    trace_active = 0;
+}
+
+// 区間の開始時刻 (記録しない場合は 0)
+static inline double trace_span_begin(void) {
+    if(!trace_active || !atomic_load_explicit(&trace_enabled, memory_order_relaxed)) return 0.0;
+    return now_seconds();
+}
+
+static void trace_span_end2(const char* name, double t0, const char* k0, long v0, const char* k1, long v1) {
+    if(t0 == 0.0) return;
+    double t1 = now_seconds();
+    TraceThread* t = trace_thread();
+    TraceEvent* e = &t->ring[t->written++ % TRACE_RING_SIZE];
+    e->name = name;
+    e->ts = t0 - trace_origin;
+    e->dur = t1 - t0;
+    e->k0 = k0;
+    e->v0 = v0;
+    e->k1 = k1;
+    e->v1 = v1;
+}
+
+static inline void trace_span_end(const char* name, double t0, const char* k0, long v0) {
+    if(t0 != 0.0) trace_span_end2(name, t0, k0, v0, NULL, 0);
+}
+
+// トレースを止めて path に書き出す。成功で 0
+int trace_stop(const char* path) {
+    atomic_store(&trace_enabled, 0);
+    FILE* fp = fopen(path, "w");
+    if(!fp) return -1;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    int first = 1;
+    for(TraceThread* t = atomic_load(&trace_threads); t; t = t->next) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first? "" : ",\n", t->tid, t->name);
+        first = 0;
+        unsigned long long n = (t->written < TRACE_RING_SIZE)? t->written : TRACE_RING_SIZE;
+        for(unsigned long long i = t->written - n; i < t->written; i++) {
+            const TraceEvent* e = &t->ring[i % TRACE_RING_SIZE];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    e->name, t->tid, e->ts * 1e6, e->dur * 1e6);
+            if(e->k0) {
+                fprintf(fp, ",\"args\":{\"%s\":%ld", e->k0, e->v0);
+                if(e->k1) fprintf(fp, ",\"%s\":%ld", e->k1, e->v1);
+                fprintf(fp, "}");
+            }
+            fprintf(fp, "}");
+        }
+        t->written = 0;
+    }
+    fprintf(fp, "\n]}\n");
+    return fclose(fp) == 0? 0 : -1;
+}
+
 // -------------------------
 // tanh 活性化関数
 // -------------------------
@@ -28,6 +505,20 @@ static float activate_tanh(float x) {
     return (e1 - e2) / (e1 + e2);
 }
 
+// -------------------------
+// tanh の高速近似 (近似設定用)
+//   Padé(7,6) 有理関数。|x| > 4.97 では ±1 に飽和させる
+//   (expf 2 回と除算 1 回の代わりに積和と除算 1 回)
+// -------------------------
+static float activate_tanh_fast(float x) {
+    if(x > 4.97f) return 1.0f;
+    if(x < -4.97f) return -1.0f;
+    float x2 = x * x;
+    float num = x * (135135.0f + x2 * (17325.0f + x2 * (378.0f + x2)));
+    float den = 135135.0f + x2 * (62370.0f + x2 * (3150.0f + x2 * 28.0f));
+    return num / den;
+}
+
 // -------------------------
 // 行列 x ベクトル積 (サイズ: RESERVOIR_SIZE x RESERVOIR_SIZE)
 // out = W * in
@@ -43,184 +534,5745 @@ static void matvec(const float* W, const float* in, float* out) {
 }
 
 // -------------------------
-// Trieノード構造体
+// 行列 x 行列積 (複数状態ベクトルをまとめて処理)
+// out[r] = W * A[r]  (A, out は rows x RESERVOIR_SIZE の行優先配列)
+//  - 4 行ずつ同じ W の行を再利用して重みの読み込みを 1/4 にする
+// -------------------------
+static void matmat(const float* W, const float* A, float* out, int rows) {
+    int r = 0;
+    for(; r + 4 <= rows; r += 4) {
+        const float* a0 = A + (r + 0) * RESERVOIR_SIZE;
+        const float* a1 = A + (r + 1) * RESERVOIR_SIZE;
+        const float* a2 = A + (r + 2) * RESERVOIR_SIZE;
+        const float* a3 = A + (r + 3) * RESERVOIR_SIZE;
+        for(int i = 0; i < RESERVOIR_SIZE; i++) {
+            const float* w = W + i * RESERVOIR_SIZE;
+            float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+            for(int j = 0; j < RESERVOIR_SIZE; j++) {
+                s0 += w[j] * a0[j];
+                s1 += w[j] * a1[j];
+                s2 += w[j] * a2[j];
+                s3 += w[j] * a3[j];
+            }
+            out[(r + 0) * RESERVOIR_SIZE + i] = s0;
+            out[(r + 1) * RESERVOIR_SIZE + i] = s1;
+            out[(r + 2) * RESERVOIR_SIZE + i] = s2;
+            out[(r + 3) * RESERVOIR_SIZE + i] = s3;
+        }
+    }
+    for(; r < rows; r++) {
+        matvec(W, A + r * RESERVOIR_SIZE, out + r * RESERVOIR_SIZE);
+    }
+}
+
+// -------------------------
+// 半精度 (fp16 / bf16) の変換と内積
+//   重みだけを 16 bit で持ち、積和は fp32 で行う (重み帯域・容量が半分)。
+//   fp16 は F16C (_mm256_cvtph_ps)、bf16 は AVX-512 BF16 (vdpbf16ps,
+//   入力も bf16 に丸める) か AVX2 の 16 bit シフト展開で SIMD 化し、
+//   どちらも無ければスカラーで変換する
+// -------------------------
+static inline float bf16_to_float(unsigned short b) {
+    unsigned int u = (unsigned int)b << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// 最近接偶数丸め (NaN は静かな NaN のまま残す)
+static inline unsigned short float_to_bf16(float f) {
+    unsigned int u;
+    memcpy(&u, &f, sizeof(u));
+    if((u & 0x7fffffffu) > 0x7f800000u) return (unsigned short)((u >> 16) | 0x40);
+    u += 0x7fffu + ((u >> 16) & 1u);
+    return (unsigned short)(u >> 16);
+}
+
+static inline float half_to_float(unsigned short h) {
+    unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+    unsigned int exp = (h >> 10) & 0x1f;
+    unsigned int man = h & 0x3ff;
+    unsigned int u;
+    if(exp == 0x1f) {
+        u = sign | 0x7f800000u | (man << 13);       // inf / NaN
+    } else if(exp != 0) {
+        u = sign | ((exp + 112) << 23) | (man << 13);
+    } else if(man == 0) {
+        u = sign;                                     // ±0
+    } else {                                          // 非正規化数を正規化する
+        int e = -1;
+        do { man <<= 1; e++; } while(!(man & 0x400));
+        u = sign | ((unsigned int)(112 - e) << 23) | ((man & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// 最近接偶数丸め。範囲外は ±inf, 小さい値は非正規化数 / 0 になる
+static inline unsigned short float_to_half(float f) {
+    unsigned int u;
+    memcpy(&u, &f, sizeof(u));
+    unsigned short sign = (unsigned short)((u >> 16) & 0x8000);
+    unsigned int a = u & 0x7fffffffu;
+    if(a > 0x7f800000u) return sign | 0x7e00;        // NaN
+    if(a >= 0x477ff000u) return sign | 0x7c00;       // 65520 以上は inf
+    if(a < 0x38800000u) {                            // 2^-14 未満: 非正規化数
+        if(a < 0x33000000u) return sign;             // 2^-25 未満は 0
+        unsigned int man = (a & 0x7fffff) | 0x800000;
+        int shift = 126 - (int)(a >> 23);            // 14..24
+        unsigned int h = man >> shift;
+        unsigned int rem = man & ((1u << shift) - 1);
+        unsigned int half = 1u << (shift - 1);
+        if(rem > half || (rem == half && (h & 1))) h++;
+        return sign | (unsigned short)h;
+    }
+    a += 0xfffu + ((a >> 13) & 1u) - 0x38000000u;   // 指数を 127 -> 15 に付け替えて丸める
+    return sign | (unsigned short)(a >> 13);
+}
+
+static float dot_f16(const unsigned short* w, const float* x, int n) {
+    int j = 0;
+    float sum = 0.0f;
+#if defined(__F16C__) && defined(__AVX__)
+    __m256 acc = _mm256_setzero_ps();
+    for(; j + 8 <= n; j += 8) {
+        __m256 wf = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(w + j)));
+#ifdef __FMA__
+        acc = _mm256_fmadd_ps(wf, _mm256_loadu_ps(x + j), acc);
+#else
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(wf, _mm256_loadu_ps(x + j)));
+#endif
+    }
+    __m128 s4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+    s4 = _mm_add_ss(s4, _mm_movehdup_ps(s4));
+    sum = _mm_cvtss_f32(s4);
+#endif
+    for(; j < n; j++) sum += half_to_float(w[j]) * x[j];
+    return sum;
+}
+
+static float dot_bf16(const unsigned short* w, const float* x, int n) {
+    int j = 0;
+    float sum = 0.0f;
+#if defined(__AVX512BF16__) && defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    for(; j + 32 <= n; j += 32) {
+        __m512bh xb = _mm512_cvtne2ps_pbh(_mm512_loadu_ps(x + j + 16), _mm512_loadu_ps(x + j));
+        __m512bh wb = (__m512bh)_mm512_loadu_si512((const void*)(w + j));
+        acc = _mm512_dpbf16_ps(acc, wb, xb);
+    }
+    sum = _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+    for(; j + 8 <= n; j += 8) {
+        __m256i wi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(w + j)));
+        __m256 wf = _mm256_castsi256_ps(_mm256_slli_epi32(wi, 16));
+#ifdef __FMA__
+        acc = _mm256_fmadd_ps(wf, _mm256_loadu_ps(x + j), acc);
+#else
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(wf, _mm256_loadu_ps(x + j)));
+#endif
+    }
+    __m128 s4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+    s4 = _mm_add_ss(s4, _mm_movehdup_ps(s4));
+    sum = _mm_cvtss_f32(s4);
+#endif
+    for(; j < n; j++) sum += bf16_to_float(w[j]) * x[j];
+    return sum;
+}
+
+// 16 bit 重みの行列 x ベクトル積 (bf16 が 0 なら fp16)
+static void matvec_half(const unsigned short* Wh, int bf16, const float* in, float* out) {
+    for(int i = 0; i < RESERVOIR_SIZE; i++) {
+        const unsigned short* w = Wh + i * RESERVOIR_SIZE;
+        out[i] = bf16? dot_bf16(w, in, RESERVOIR_SIZE) : dot_f16(w, in, RESERVOIR_SIZE);
+    }
+}
+
+#ifdef __AVX__
+static inline float hsum256_ps(__m256 v) {
+    __m128 s4 = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+    s4 = _mm_add_ss(s4, _mm_movehdup_ps(s4));
+    return _mm_cvtss_f32(s4);
+}
+
+static inline __m256 fmadd256_ps(__m256 a, __m256 b, __m256 c) {
+#ifdef __FMA__
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(c, _mm256_mul_ps(a, b));
+#endif
+}
+#endif
+
+// 16 bit 重みの行列 x 行列積 (matmat の fp16 / bf16 版)
+//   重みを 1 行ずつ fp32 に展開し、その行を全ての状態ベクトルに使い回す
+//   (展開は 1 ステップで重み 1 回分だけ。行ごとの matvec_half だと行数回)。
+//   AVX があれば展開した行と 4 行の状態の内積を 8 要素ずつまとめて取る
+static void matmat_half(const unsigned short* Wh, int bf16, const float* A, float* out, int rows) {
+    float w[RESERVOIR_SIZE];
+    for(int i = 0; i < RESERVOIR_SIZE; i++) {
+        const unsigned short* h = Wh + i * RESERVOIR_SIZE;
+        int j = 0;
+#if defined(__F16C__) && defined(__AVX__)
+        if(!bf16) {
+            for(; j + 8 <= RESERVOIR_SIZE; j += 8) {
+                _mm256_storeu_ps(w + j, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h + j))));
+            }
+        }
+#endif
+        for(; j < RESERVOIR_SIZE; j++) w[j] = bf16? bf16_to_float(h[j]) : half_to_float(h[j]);
+        int r = 0;
+        for(; r + 4 <= rows; r += 4) {
+            const float* a0 = A + (r + 0) * RESERVOIR_SIZE;
+            const float* a1 = A + (r + 1) * RESERVOIR_SIZE;
+            const float* a2 = A + (r + 2) * RESERVOIR_SIZE;
+            const float* a3 = A + (r + 3) * RESERVOIR_SIZE;
+            float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+            int k = 0;
+#ifdef __AVX__
+            __m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps();
+            __m256 c2 = _mm256_setzero_ps(), c3 = _mm256_setzero_ps();
+            for(; k + 8 <= RESERVOIR_SIZE; k += 8) {
+                __m256 wk = _mm256_loadu_ps(w + k);
+                c0 = fmadd256_ps(wk, _mm256_loadu_ps(a0 + k), c0);
+                c1 = fmadd256_ps(wk, _mm256_loadu_ps(a1 + k), c1);
+                c2 = fmadd256_ps(wk, _mm256_loadu_ps(a2 + k), c2);
+                c3 = fmadd256_ps(wk, _mm256_loadu_ps(a3 + k), c3);
+            }
+            s0 = hsum256_ps(c0);
+            s1 = hsum256_ps(c1);
+            s2 = hsum256_ps(c2);
+            s3 = hsum256_ps(c3);
+#endif
+            for(; k < RESERVOIR_SIZE; k++) {
+                s0 += w[k] * a0[k];
+                s1 += w[k] * a1[k];
+                s2 += w[k] * a2[k];
+                s3 += w[k] * a3[k];
+            }
+            out[(r + 0) * RESERVOIR_SIZE + i] = s0;
+            out[(r + 1) * RESERVOIR_SIZE + i] = s1;
+            out[(r + 2) * RESERVOIR_SIZE + i] = s2;
+            out[(r + 3) * RESERVOIR_SIZE + i] = s3;
+        }
+        for(; r < rows; r++) {
+            const float* a = A + r * RESERVOIR_SIZE;
+            float sum = 0.0f;
+            int k = 0;
+#ifdef __AVX__
+            __m256 c = _mm256_setzero_ps();
+            for(; k + 8 <= RESERVOIR_SIZE; k += 8) c = fmadd256_ps(_mm256_loadu_ps(w + k), _mm256_loadu_ps(a + k), c);
+            sum = hsum256_ps(c);
+#endif
+            for(; k < RESERVOIR_SIZE; k++) sum += w[k] * a[k];
+            out[r * RESERVOIR_SIZE + i] = sum;
+        }
+    }
+}
+
+// -------------------------
+// Trieノード構造体
+// -------------------------
+typedef struct TrieNode {
+    struct TrieNode* children[MAX_CHILDREN];
+    // 固定深度管理 (rootのdepth=0, 1, 2, ..., D-1)
+    int depth;
+    // 子があるかどうかのフラグ
+    int is_leaf;
+    // ノード id (根=0 から作成順の通し番号, ノードごとの表の添字に使う)
+    int id;
+    // 根のみ有効: この Trie に作ったノード数 (= id の上限)
+    int node_count;
+} TrieNode;
+
+// -------------------------
+// Trieノード作成
+// -------------------------
+TrieNode* create_trie_node(int depth) {
+    TrieNode* node = (TrieNode*)calloc(1, sizeof(TrieNode));
+    node->depth = depth;
+    node->is_leaf = 0;
+    node->id = 0;
+    node->node_count = 1;
+    for(int i = 0; i < MAX_CHILDREN; i++) {
+        node->children[i] = NULL;
+    }
+    return node;
+}
+
+// -------------------------
+// Trie への挿入 (深度MAX_DEPTHで打ち切る)
+// -------------------------
+void trie_insert(TrieNode* root, const char* str) {
+    TrieNode* cur = root;
+    int length = (int)strlen(str);
+    for(int i = 0; i < length && i < MAX_DEPTH; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if(cur->children[c] == NULL) {
+            cur->children[c] = create_trie_node(cur->depth + 1);
+            cur->children[c]->id = root->node_count++;
+        }
+        cur = cur->children[c];
+    }
+    cur->is_leaf = 1;
+}
+
+// -------------------------
+// Trie の再帰解放 (深さは高々 MAX_DEPTH なので再帰で十分)
+// -------------------------
+void trie_free(TrieNode* node) {
+    if(node == NULL) return;
+    for(int i = 0; i < MAX_CHILDREN; i++) {
+        trie_free(node->children[i]);
+    }
+    free(node);
+}
+
+// ---------------------------------------------------------
+// Trie バックエンド (表現の差し替え口)
+//   リザバー / リードアウト側は TrieBackend 経由でしか Trie を触らない。
+//   ノードは TrieRef (不透明な整数) で表し、0 (TRIE_REF_NONE) は「子なし」。
+//     root       : 根
+//     step       : node から byte の辺を辿った子 (無ければ TRIE_REF_NONE)
+//     is_leaf    : key の終端か
+//     node_id    : 0..node_count-1 の一意な番号 (ノードごとの表の添字)
+//     depth      : 根=0 からの深さ
+//     child_next : byte >= from で子を持つ最小の byte を返し *child に子を入れる
+//                  (無ければ -1)。子をバイト昇順に列挙する
+//     step2      : (省略可, NULL) node から b0, b1 の 2 辺を一度に辿った孫を返し、
+//                  *mid に子を入れる。表に無ければ TRIE_REF_NONE で、
+//                  その時は step で 1 バイトずつ進む
+//   どの表現も pointer の TrieNode から作る (trie_backend_build)。
+// ---------------------------------------------------------
+typedef uintptr_t TrieRef;
+#define TRIE_REF_NONE ((TrieRef)0)
+
+typedef struct TrieBackend {
+    const char* name;
+    void* impl;
+    TrieRef (*root)(const void* impl);
+    TrieRef (*step)(const void* impl, TrieRef node, unsigned char byte);
+    TrieRef (*step2)(const void* impl, TrieRef node, unsigned char b0, unsigned char b1, TrieRef* mid);
+    int (*is_leaf)(const void* impl, TrieRef node);
+    long (*node_id)(const void* impl, TrieRef node);
+    int (*depth)(const void* impl, TrieRef node);
+    int (*child_next)(const void* impl, TrieRef node, int from, TrieRef* child);
+    long (*node_count)(const void* impl);
+    size_t (*bytes)(const void* impl);  // 表現が使うメモリ (バイト)
+    void (*destroy)(void* impl);
+} TrieBackend;
+
+// ---- pointer: 既存の TrieNode をそのまま使う ----
+static TrieRef trie_ptr_root(const void* impl) {
+    return (TrieRef)impl;
+}
+
+static TrieRef trie_ptr_step(const void* impl, TrieRef node, unsigned char byte) {
+    (void)impl;
+    return (TrieRef)((const TrieNode*)node)->children[byte];
+}
+
+static int trie_ptr_is_leaf(const void* impl, TrieRef node) {
+    (void)impl;
+    return ((const TrieNode*)node)->is_leaf;
+}
+
+static long trie_ptr_node_id(const void* impl, TrieRef node) {
+    (void)impl;
+    return ((const TrieNode*)node)->id;
+}
+
+static int trie_ptr_depth(const void* impl, TrieRef node) {
+    (void)impl;
+    return ((const TrieNode*)node)->depth;
+}
+
+static int trie_ptr_child_next(const void* impl, TrieRef node, int from, TrieRef* child) {
+    (void)impl;
+    const TrieNode* n = (const TrieNode*)node;
+    for(int c = from; c < MAX_CHILDREN; c++) {
+        if(n->children[c]) {
+            *child = (TrieRef)n->children[c];
+            return c;
+        }
+    }
+    return -1;
+}
+
+static long trie_ptr_node_count(const void* impl) {
+    return ((const TrieNode*)impl)->node_count;
+}
+
+static size_t trie_ptr_bytes(const void* impl) {
+    return (size_t)((const TrieNode*)impl)->node_count * sizeof(TrieNode);
+}
+
+static void trie_ptr_destroy(void* impl) {
+    (void)impl;  // TrieNode は呼び出し側の持ち物
+}
+
+// root の所有権は移さない (destroy しても trie_free は呼び出し側)
+void trie_backend_pointer(TrieBackend* tb, TrieNode* root) {
+    tb->name = "pointer";
+    tb->impl = root;
+    tb->root = trie_ptr_root;
+    tb->step = trie_ptr_step;
+    tb->step2 = NULL;
+    tb->is_leaf = trie_ptr_is_leaf;
+    tb->node_id = trie_ptr_node_id;
+    tb->depth = trie_ptr_depth;
+    tb->child_next = trie_ptr_child_next;
+    tb->node_count = trie_ptr_node_count;
+    tb->bytes = trie_ptr_bytes;
+    tb->destroy = trie_ptr_destroy;
+}
+
+// ---- frozen: 幅優先順に並べた読み取り専用の配列 ----
+//   ノード i (根=0) の子は辺 first[i] .. first[i+1]-1 で、辺 e の先は
+//   ノード e+1 (幅優先順では子が連続して並ぶため子の番号を持たなくてよい)。
+//   labels[e] は辺 e のバイト (ノード内で昇順)。TrieRef はノード番号 + 1。
+typedef struct {
+    long n;
+    unsigned int* first;     // n + 1
+    unsigned char* labels;   // n - 1
+    unsigned char* leaf;     // n
+    unsigned short* depth;   // n
+} FrozenTrie;
+
+static TrieRef trie_frozen_root(const void* impl) {
+    (void)impl;
+    return 1;
+}
+
+static TrieRef trie_frozen_step(const void* impl, TrieRef node, unsigned char byte) {
+    const FrozenTrie* f = (const FrozenTrie*)impl;
+    unsigned int lo = f->first[node - 1], hi = f->first[node];
+    const unsigned char* hit = (const unsigned char*)memchr(f->labels + lo, byte, hi - lo);
+    return hit? (TrieRef)(hit - f->labels) + 2 : TRIE_REF_NONE;
+}
+
+static int trie_frozen_is_leaf(const void* impl, TrieRef node) {
+    return ((const FrozenTrie*)impl)->leaf[node - 1];
+}
+
+static long trie_frozen_node_id(const void* impl, TrieRef node) {
+    (void)impl;
+    return (long)node - 1;
+}
+
+static int trie_frozen_depth(const void* impl, TrieRef node) {
+    return ((const FrozenTrie*)impl)->depth[node - 1];
+}
+
+static int trie_frozen_child_next(const void* impl, TrieRef node, int from, TrieRef* child) {
+    const FrozenTrie* f = (const FrozenTrie*)impl;
+    for(unsigned int e = f->first[node - 1]; e < f->first[node]; e++) {
+        if(f->labels[e] >= from) {
+            *child = (TrieRef)e + 2;
+            return f->labels[e];
+        }
+    }
+    return -1;
+}
+
+static long trie_frozen_node_count(const void* impl) {
+    return ((const FrozenTrie*)impl)->n;
+}
+
+static size_t trie_frozen_bytes(const void* impl) {
+    const FrozenTrie* f = (const FrozenTrie*)impl;
+    return sizeof(FrozenTrie) + (f->n + 1) * sizeof(unsigned int) + (f->n - 1)
+         + f->n * (sizeof(unsigned char) + sizeof(unsigned short));
+}
+
+static void trie_frozen_destroy(void* impl) {
+    FrozenTrie* f = (FrozenTrie*)impl;
+    free(f->first);
+    free(f->labels);
+    free(f->leaf);
+    free(f->depth);
+    free(f);
+}
+
+void trie_backend_frozen(TrieBackend* tb, const TrieNode* root) {
+    FrozenTrie* f = (FrozenTrie*)calloc(1, sizeof(FrozenTrie));
+    long n = root->node_count;
+    const TrieNode** queue = (const TrieNode**)malloc(sizeof(TrieNode*) * n);
+    f->first = (unsigned int*)malloc(sizeof(unsigned int) * (n + 1));
+    f->labels = (unsigned char*)malloc(n > 1? n - 1 : 1);
+    f->leaf = (unsigned char*)malloc(n);
+    f->depth = (unsigned short*)malloc(sizeof(unsigned short) * n);
+
+    long head = 0, tail = 0;
+    queue[tail++] = root;
+    while(head < tail) {
+        const TrieNode* node = queue[head];
+        f->first[head] = (unsigned int)(tail - 1);
+        f->leaf[head] = (unsigned char)node->is_leaf;
+        f->depth[head] = (unsigned short)node->depth;
+        for(int c = 0; c < MAX_CHILDREN; c++) {
+            if(node->children[c]) {
+                f->labels[tail - 1] = (unsigned char)c;
+                queue[tail++] = node->children[c];
+            }
+        }
+        head++;
+    }
+    f->first[tail] = (unsigned int)(tail - 1);
+    f->n = tail;
+    free(queue);
+
+    tb->name = "frozen";
+    tb->impl = f;
+    tb->root = trie_frozen_root;
+    tb->step = trie_frozen_step;
+    tb->step2 = NULL;
+    tb->is_leaf = trie_frozen_is_leaf;
+    tb->node_id = trie_frozen_node_id;
+    tb->depth = trie_frozen_depth;
+    tb->child_next = trie_frozen_child_next;
+    tb->node_count = trie_frozen_node_count;
+    tb->bytes = trie_frozen_bytes;
+    tb->destroy = trie_frozen_destroy;
+}
+
+// ---- hash: 辺を 1 つのハッシュ表 (親の id, バイト) -> 子の id に置く ----
+//   ノードごとの子の配列を持たないので、メモリは辺の数に比例する。
+//   表は Swiss table 式: 16 スロットのグループごとに制御バイト (空 0x80,
+//   挿入中 0xFE, 使用中はハッシュの下位 7 bit) を持ち、SSE2 で 16 個を一度に
+//   比べてから候補のスロットだけ key を確かめる。容量は作る時に決めて
+//   大きくしない (負荷率 7/8 まで)。hash_trie_insert は複数スレッドから
+//   呼べる (空きスロットを CAS で取り、key と子を書いてから制御バイトを公開する)。
+//   TrieRef はノード id + 1
+#define HASH_TRIE_EMPTY 0x80
+#define HASH_TRIE_BUSY 0xFE
+#define HASH_TRIE_GROUP 16
+
+typedef struct {
+    unsigned char* ctrl;          // capacity
+    unsigned long long* keys;     // (親 << 8 | バイト)
+    unsigned int* child;
+    long group_mask;              // グループ数 - 1
+    long max_nodes;
+    _Atomic long n_nodes;
+    unsigned short* depth;        // max_nodes
+    unsigned char* leaf;
+    unsigned short* n_children;   // child_next の打ち切り用
+} HashTrie;
+
+static inline unsigned long long hash_trie_mix(unsigned long long key) {
+    key *= 0x9E3779B97F4A7C15ull;
+    return key ^ (key >> 29);
+}
+
+// max_nodes 個までのノードを入れられる空の表を作る
+void hash_trie_init(HashTrie* ht, long max_nodes) {
+    memset(ht, 0, sizeof(*ht));
+    if(max_nodes < 1) max_nodes = 1;
+    long groups = 1;
+    while(groups * HASH_TRIE_GROUP * 7 / 8 < max_nodes) groups <<= 1;
+    long cap = groups * HASH_TRIE_GROUP;
+    ht->group_mask = groups - 1;
+    ht->ctrl = (unsigned char*)malloc(cap);
+    memset(ht->ctrl, HASH_TRIE_EMPTY, cap);
+    ht->keys = (unsigned long long*)malloc(sizeof(unsigned long long) * cap);
+    ht->child = (unsigned int*)malloc(sizeof(unsigned int) * cap);
+    ht->max_nodes = max_nodes;
+    ht->depth = (unsigned short*)calloc(max_nodes, sizeof(unsigned short));
+    ht->leaf = (unsigned char*)calloc(max_nodes, 1);
+    ht->n_children = (unsigned short*)calloc(max_nodes, sizeof(unsigned short));
+    atomic_init(&ht->n_nodes, 1);   // 根 = 0
+}
+
+void hash_trie_free(HashTrie* ht) {
+    free(ht->ctrl);
+    free(ht->keys);
+    free(ht->child);
+    free(ht->depth);
+    free(ht->leaf);
+    free(ht->n_children);
+    memset(ht, 0, sizeof(*ht));
+}
+
+// parent からバイト byte で進んだ子の id (無ければ -1)
+static inline long hash_trie_find(const HashTrie* ht, long parent, unsigned char byte) {
+    const unsigned long long key = ((unsigned long long)parent << 8) | byte;
+    const unsigned long long h = hash_trie_mix(key);
+    const unsigned char h2 = (unsigned char)(h & 0x7f);
+    long g = (long)(h >> 7) & ht->group_mask;
+    for(long i = 1; ; i++) {
+        const unsigned char* ctrl = ht->ctrl + g * HASH_TRIE_GROUP;
+#if defined(__SSE2__)
+        __m128i c = _mm_loadu_si128((const __m128i*)ctrl);
+        unsigned match = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8((char)h2)));
+        while(match) {
+            int s = __builtin_ctz(match);
+            if(ht->keys[g * HASH_TRIE_GROUP + s] == key) return ht->child[g * HASH_TRIE_GROUP + s];
+            match &= match - 1;
+        }
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8((char)HASH_TRIE_EMPTY)))) return -1;
+#else
+        int empty = 0;
+        for(int s = 0; s < HASH_TRIE_GROUP; s++) {
+            if(ctrl[s] == h2 && ht->keys[g * HASH_TRIE_GROUP + s] == key) return ht->child[g * HASH_TRIE_GROUP + s];
+            empty |= (ctrl[s] == HASH_TRIE_EMPTY);
+        }
+        if(empty) return -1;
+#endif
+        g = (g + i) & ht->group_mask;   // 三角数の間隔で次のグループへ
+    }
+}
+
+// parent の子 byte を返す。無ければ作る。表が一杯なら -1。複数スレッドから呼べる
+static long hash_trie_child(HashTrie* ht, long parent, unsigned char byte) {
+    const unsigned long long key = ((unsigned long long)parent << 8) | byte;
+    const unsigned long long h = hash_trie_mix(key);
+    const unsigned char h2 = (unsigned char)(h & 0x7f);
+    long g = (long)(h >> 7) & ht->group_mask;
+    for(long i = 1; i <= ht->group_mask + 1; i++) {
+        for(int s = 0; s < HASH_TRIE_GROUP; s++) {
+            long slot = g * HASH_TRIE_GROUP + s;
+            unsigned char c = __atomic_load_n(&ht->ctrl[slot], __ATOMIC_ACQUIRE);
+            if(c == HASH_TRIE_EMPTY) {
+                unsigned char expected = HASH_TRIE_EMPTY;
+                if(__atomic_compare_exchange_n(&ht->ctrl[slot], &expected, HASH_TRIE_BUSY, 0,
+                                               __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    long id = atomic_fetch_add(&ht->n_nodes, 1);
+                    if(id >= ht->max_nodes) {
+                        atomic_fetch_sub(&ht->n_nodes, 1);
+                        __atomic_store_n(&ht->ctrl[slot], HASH_TRIE_EMPTY, __ATOMIC_RELEASE);
+                        return -1;
+                    }
+                    ht->depth[id] = (unsigned short)(ht->depth[parent] + 1);
+                    __atomic_fetch_add(&ht->n_children[parent], 1, __ATOMIC_RELAXED);
+                    ht->keys[slot] = key;
+                    ht->child[slot] = (unsigned int)id;
+                    __atomic_store_n(&ht->ctrl[slot], h2, __ATOMIC_RELEASE);
+                    return id;
+                }
+                c = expected;   // 他のスレッドが先に取った
+            }
+            while(c == HASH_TRIE_BUSY) c = __atomic_load_n(&ht->ctrl[slot], __ATOMIC_ACQUIRE);
+            if(c == h2 && ht->keys[slot] == key) return ht->child[slot];
+            if(c == HASH_TRIE_EMPTY) {
+                s--;   // 取り消された (表が一杯) スロットをもう一度見る
+                continue;
+            }
+        }
+        g = (g + i) & ht->group_mask;
+    }
+    return -1;
+}
+
+// key を挿入する (MAX_DEPTH バイトで打ち切り)。複数スレッドから呼べる。
+// 表が一杯なら -1, それ以外は 0
+int hash_trie_insert(HashTrie* ht, const char* key) {
+    long cur = 0;
+    for(int i = 0; key[i] != '\0' && i < MAX_DEPTH; i++) {
+        cur = hash_trie_child(ht, cur, (unsigned char)key[i]);
+        if(cur < 0) return -1;
+    }
+    __atomic_store_n(&ht->leaf[cur], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// 挿入し終えた表を実際のノード数に合う大きさに詰め直す (並行挿入の最中には呼ばない)
+void hash_trie_compact(HashTrie* ht) {
+    HashTrie old = *ht;
+    long n = atomic_load(&old.n_nodes);
+    hash_trie_init(ht, n);
+    atomic_store(&ht->n_nodes, n);
+    memcpy(ht->depth, old.depth, sizeof(unsigned short) * n);
+    memcpy(ht->leaf, old.leaf, n);
+    memcpy(ht->n_children, old.n_children, sizeof(unsigned short) * n);
+    const long cap = (old.group_mask + 1) * HASH_TRIE_GROUP;
+    for(long slot = 0; slot < cap; slot++) {
+        if(old.ctrl[slot] & 0x80) continue;
+        const unsigned long long h = hash_trie_mix(old.keys[slot]);
+        long g = (long)(h >> 7) & ht->group_mask;
+        for(long i = 1; ; i++) {
+            unsigned char* ctrl = ht->ctrl + g * HASH_TRIE_GROUP;
+            int s = 0;
+            while(s < HASH_TRIE_GROUP && ctrl[s] != HASH_TRIE_EMPTY) s++;
+            if(s < HASH_TRIE_GROUP) {
+                ctrl[s] = old.ctrl[slot];
+                ht->keys[g * HASH_TRIE_GROUP + s] = old.keys[slot];
+                ht->child[g * HASH_TRIE_GROUP + s] = old.child[slot];
+                break;
+            }
+            g = (g + i) & ht->group_mask;
+        }
+    }
+    hash_trie_free(&old);
+}
+
+size_t hash_trie_bytes(const HashTrie* ht) {
+    size_t cap = (size_t)(ht->group_mask + 1) * HASH_TRIE_GROUP;
+    return sizeof(*ht) + cap * (1 + sizeof(unsigned long long) + sizeof(unsigned int))
+         + (size_t)ht->max_nodes * (2 * sizeof(unsigned short) + 1);
+}
+
+static TrieRef trie_hash_root(const void* impl) {
+    (void)impl;
+    return 1;
+}
+
+static TrieRef trie_hash_step(const void* impl, TrieRef node, unsigned char byte) {
+    long c = hash_trie_find((const HashTrie*)impl, (long)node - 1, byte);
+    return (c < 0)? TRIE_REF_NONE : (TrieRef)c + 1;
+}
+
+static int trie_hash_is_leaf(const void* impl, TrieRef node) {
+    return ((const HashTrie*)impl)->leaf[node - 1];
+}
+
+static long trie_hash_node_id(const void* impl, TrieRef node) {
+    (void)impl;
+    return (long)node - 1;
+}
+
+static int trie_hash_depth(const void* impl, TrieRef node) {
+    return ((const HashTrie*)impl)->depth[node - 1];
+}
+
+// 子の一覧は持たないので from からバイトを順に引く (子を全部見つけたら打ち切る)
+static int trie_hash_child_next(const void* impl, TrieRef node, int from, TrieRef* child) {
+    const HashTrie* ht = (const HashTrie*)impl;
+    int remaining = ht->n_children[node - 1];
+    for(int b = 0; b < from && remaining > 0; b++) remaining -= (hash_trie_find(ht, (long)node - 1, (unsigned char)b) >= 0);
+    for(int b = from; b < MAX_CHILDREN && remaining > 0; b++) {
+        long c = hash_trie_find(ht, (long)node - 1, (unsigned char)b);
+        if(c >= 0) {
+            *child = (TrieRef)c + 1;
+            return b;
+        }
+    }
+    return -1;
+}
+
+static long trie_hash_node_count(const void* impl) {
+    return atomic_load(&((HashTrie*)impl)->n_nodes);
+}
+
+static size_t trie_hash_bytes(const void* impl) {
+    return hash_trie_bytes((const HashTrie*)impl);
+}
+
+static void trie_hash_destroy(void* impl) {
+    hash_trie_free((HashTrie*)impl);
+    free(impl);
+}
+
+// ht の所有権は tb に移る (trie_backend_destroy で解放)
+void trie_backend_hash_wrap(TrieBackend* tb, HashTrie* ht) {
+    tb->name = "hash";
+    tb->impl = ht;
+    tb->root = trie_hash_root;
+    tb->step = trie_hash_step;
+    tb->step2 = NULL;
+    tb->is_leaf = trie_hash_is_leaf;
+    tb->node_id = trie_hash_node_id;
+    tb->depth = trie_hash_depth;
+    tb->child_next = trie_hash_child_next;
+    tb->node_count = trie_hash_node_count;
+    tb->bytes = trie_hash_bytes;
+    tb->destroy = trie_hash_destroy;
+}
+
+static void trie_hash_copy(HashTrie* ht, const TrieNode* node, long id) {
+    ht->leaf[id] = (unsigned char)node->is_leaf;
+    for(int c = 0; c < MAX_CHILDREN; c++) {
+        if(node->children[c]) trie_hash_copy(ht, node->children[c], hash_trie_child(ht, id, (unsigned char)c));
+    }
+}
+
+void trie_backend_hash(TrieBackend* tb, const TrieNode* root) {
+    HashTrie* ht = (HashTrie*)malloc(sizeof(HashTrie));
+    hash_trie_init(ht, root->node_count);
+    ht->depth[0] = (unsigned short)root->depth;
+    trie_hash_copy(ht, root, 0);
+    trie_backend_hash_wrap(tb, ht);
+}
+
+typedef struct {
+    HashTrie* ht;
+    const char* const* keys;
+    long n;
+    _Atomic long next;
+    _Atomic int full;
+} HashTrieBuild;
+
+static void* hash_trie_build_worker(void* p) {
+    HashTrieBuild* b = (HashTrieBuild*)p;
+    long i;
+    while((i = atomic_fetch_add(&b->next, 1024)) < b->n) {
+        long end = (i + 1024 < b->n)? i + 1024 : b->n;
+        for(; i < end; i++) {
+            if(hash_trie_insert(b->ht, b->keys[i]) != 0) atomic_store(&b->full, 1);
+        }
+    }
+    return NULL;
+}
+
+// keys から threads 本で並列に作る (ノード id は挿入の順で決まる)。
+// 表は key の総バイト数で見積もって作り、挿入後に詰め直す。成功で 0
+int trie_backend_hash_from_keys(TrieBackend* tb, const char* const* keys, long n, int threads) {
+    long bound = 1;
+    for(long i = 0; i < n; i++) bound += (long)strnlen(keys[i], MAX_DEPTH);
+    HashTrie* ht = (HashTrie*)malloc(sizeof(HashTrie));
+    hash_trie_init(ht, bound);
+    HashTrieBuild b = { ht, keys, n, 0, 0 };
+    if(threads < 1) threads = 1;
+    pthread_t* th = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    for(int t = 1; t < threads; t++) pthread_create(&th[t], NULL, hash_trie_build_worker, &b);
+    hash_trie_build_worker(&b);
+    for(int t = 1; t < threads; t++) pthread_join(th[t], NULL);
+    free(th);
+    hash_trie_compact(ht);
+    trie_backend_hash_wrap(tb, ht);
+    return atomic_load(&b.full)? -1 : 0;
+}
+
+// ---- bitmap: 256 bit の占有ビットマップ + 32 bit の子 id の詰めた並び ----
+//   ノードは id で引くプールに並べ (ポインタを持たない)、子 byte の有無を
+//   bits で、子の id を kids[children + rank] で引く。rank は bits の byte より
+//   下の立っているビットの数 (64 bit 語ごとの累積 rank[] + popcount 1 回)。
+//   ノードは 48 バイト + 子 1 つあたり 4 バイト (TrieNode は 2 KB 強)。
+//   子の並びの長さは子の数を 2 の冪に切り上げたもので、溢れたら kids の末尾に
+//   倍の長さで移す (古い並びは使われずに残る)。TrieRef はノード id + 1
+typedef struct {
+    unsigned long long bits[4];
+    unsigned int children;      // kids の添字
+    unsigned char rank[4];      // bits[0..w-1] の立っているビットの数
+    unsigned short depth;
+    unsigned char leaf;
+} BitmapNode;
+
+typedef struct {
+    BitmapNode* nodes;
+    long n, cap;
+    unsigned int* kids;
+    long n_kids, kids_cap;
+} BitmapTrie;
+
+void bitmap_trie_init(BitmapTrie* t) {
+    t->cap = 1024;
+    t->nodes = (BitmapNode*)calloc(t->cap, sizeof(BitmapNode));
+    t->n = 1;   // 根 = 0
+    t->kids_cap = 1024;
+    t->kids = (unsigned int*)malloc(sizeof(unsigned int) * t->kids_cap);
+    t->n_kids = 0;
+}
+
+void bitmap_trie_free(BitmapTrie* t) {
+    free(t->nodes);
+    free(t->kids);
+    memset(t, 0, sizeof(*t));
+}
+
+static inline int bitmap_node_count(const BitmapNode* nd) {
+    return nd->rank[3] + __builtin_popcountll(nd->bits[3]);
+}
+
+// node のバイト byte の子の id (無ければ -1)
+static inline long bitmap_trie_find(const BitmapTrie* t, long node, unsigned char byte) {
+    const BitmapNode* nd = &t->nodes[node];
+    const int w = byte >> 6;
+    const unsigned long long bit = 1ull << (byte & 63);
+    if(!(nd->bits[w] & bit)) return -1;
+    return t->kids[nd->children + nd->rank[w] + __builtin_popcountll(nd->bits[w] & (bit - 1))];
+}
+
+static unsigned int bitmap_trie_alloc_kids(BitmapTrie* t, long len) {
+    if(t->n_kids + len > t->kids_cap) {
+        while(t->n_kids + len > t->kids_cap) t->kids_cap *= 2;
+        t->kids = (unsigned int*)realloc(t->kids, sizeof(unsigned int) * t->kids_cap);
+    }
+    unsigned int at = (unsigned int)t->n_kids;
+    t->n_kids += len;
+    return at;
+}
+
+// node の子 byte を返す。無ければ作る
+static long bitmap_trie_child(BitmapTrie* t, long node, unsigned char byte) {
+    long found = bitmap_trie_find(t, node, byte);
+    if(found >= 0) return found;
+    if(t->n == t->cap) {
+        t->nodes = (BitmapNode*)realloc(t->nodes, sizeof(BitmapNode) * t->cap * 2);
+        memset(t->nodes + t->cap, 0, sizeof(BitmapNode) * t->cap);
+        t->cap *= 2;
+    }
+    const long id = t->n++;
+    t->nodes[id].depth = (unsigned short)(t->nodes[node].depth + 1);
+
+    BitmapNode* nd = &t->nodes[node];
+    const int count = bitmap_node_count(nd);
+    const int w = byte >> 6;
+    const unsigned long long bit = 1ull << (byte & 63);
+    const int r = nd->rank[w] + __builtin_popcountll(nd->bits[w] & (bit - 1));
+    if((count & (count - 1)) == 0) {
+        // 並びが一杯 (長さは 2 の冪): 倍の長さで末尾に移す
+        unsigned int at = bitmap_trie_alloc_kids(t, count? 2 * count : 1);
+        memcpy(t->kids + at, t->kids + nd->children, sizeof(unsigned int) * r);
+        memcpy(t->kids + at + r + 1, t->kids + nd->children + r, sizeof(unsigned int) * (count - r));
+        nd->children = at;
+    } else {
+        memmove(t->kids + nd->children + r + 1, t->kids + nd->children + r, sizeof(unsigned int) * (count - r));
+    }
+    t->kids[nd->children + r] = (unsigned int)id;
+    nd->bits[w] |= bit;
+    for(int i = w + 1; i < 4; i++) nd->rank[i]++;
+    return id;
+}
+
+// key を挿入する (MAX_DEPTH バイトで打ち切り)
+void bitmap_trie_insert(BitmapTrie* t, const char* key) {
+    long cur = 0;
+    for(int i = 0; key[i] != '\0' && i < MAX_DEPTH; i++) cur = bitmap_trie_child(t, cur, (unsigned char)key[i]);
+    t->nodes[cur].leaf = 1;
+}
+
+size_t bitmap_trie_bytes(const BitmapTrie* t) {
+    return sizeof(*t) + (size_t)t->n * sizeof(BitmapNode) + (size_t)t->n_kids * sizeof(unsigned int);
+}
+
+static TrieRef trie_bitmap_root(const void* impl) {
+    (void)impl;
+    return 1;
+}
+
+static TrieRef trie_bitmap_step(const void* impl, TrieRef node, unsigned char byte) {
+    return (TrieRef)(bitmap_trie_find((const BitmapTrie*)impl, (long)node - 1, byte) + 1);
+}
+
+static int trie_bitmap_is_leaf(const void* impl, TrieRef node) {
+    return ((const BitmapTrie*)impl)->nodes[node - 1].leaf;
+}
+
+static long trie_bitmap_node_id(const void* impl, TrieRef node) {
+    (void)impl;
+    return (long)node - 1;
+}
+
+static int trie_bitmap_depth(const void* impl, TrieRef node) {
+    return ((const BitmapTrie*)impl)->nodes[node - 1].depth;
+}
+
+static int trie_bitmap_child_next(const void* impl, TrieRef node, int from, TrieRef* child) {
+    const BitmapTrie* t = (const BitmapTrie*)impl;
+    const BitmapNode* nd = &t->nodes[node - 1];
+    for(int w = from >> 6; w < 4; w++) {
+        unsigned long long m = nd->bits[w];
+        if(w == (from >> 6)) m &= ~0ull << (from & 63);
+        if(m) {
+            int b = w * 64 + __builtin_ctzll(m);
+            *child = (TrieRef)t->kids[nd->children + nd->rank[w] + __builtin_popcountll(nd->bits[w] & ((1ull << (b & 63)) - 1))] + 1;
+            return b;
+        }
+    }
+    return -1;
+}
+
+static long trie_bitmap_node_count(const void* impl) {
+    return ((const BitmapTrie*)impl)->n;
+}
+
+static size_t trie_bitmap_bytes(const void* impl) {
+    return bitmap_trie_bytes((const BitmapTrie*)impl);
+}
+
+static void trie_bitmap_destroy(void* impl) {
+    bitmap_trie_free((BitmapTrie*)impl);
+    free(impl);
+}
+
+// t の所有権は tb に移る (trie_backend_destroy で解放)
+void trie_backend_bitmap_wrap(TrieBackend* tb, BitmapTrie* t) {
+    tb->name = "bitmap";
+    tb->impl = t;
+    tb->root = trie_bitmap_root;
+    tb->step = trie_bitmap_step;
+    tb->step2 = NULL;
+    tb->is_leaf = trie_bitmap_is_leaf;
+    tb->node_id = trie_bitmap_node_id;
+    tb->depth = trie_bitmap_depth;
+    tb->child_next = trie_bitmap_child_next;
+    tb->node_count = trie_bitmap_node_count;
+    tb->bytes = trie_bitmap_bytes;
+    tb->destroy = trie_bitmap_destroy;
+}
+
+static void trie_bitmap_copy(BitmapTrie* t, const TrieNode* node, long id) {
+    t->nodes[id].leaf = (unsigned char)node->is_leaf;
+    for(int c = 0; c < MAX_CHILDREN; c++) {
+        if(node->children[c]) trie_bitmap_copy(t, node->children[c], bitmap_trie_child(t, id, (unsigned char)c));
+    }
+}
+
+void trie_backend_bitmap(TrieBackend* tb, const TrieNode* root) {
+    BitmapTrie* t = (BitmapTrie*)malloc(sizeof(BitmapTrie));
+    bitmap_trie_init(t);
+    t->nodes[0].depth = (unsigned short)root->depth;
+    trie_bitmap_copy(t, root, 0);
+    trie_backend_bitmap_wrap(tb, t);
+}
+
+// ---- stride: frozen に 2 バイトずつ進む遷移表を足したもの ----
+//   上から levels 段 (根からの深さ < levels) のノードについて、2 バイトの
+//   経路 (node, b0, b1) -> (子, 孫) を 1 つの開番地法の表に入れておき、
+//   step2 で 1 回の表引きで 2 段進む (依存するロードの鎖が半分になる)。
+//   表に無い経路 (key が 1 バイトで終わる, 孫が無い, levels より深い) は
+//   呼び出し側が step で 1 バイトずつ進む。子 (中間のノード) も返すので
+//   深度ごとの reservoir_step は 1 段ずつ行える。ノードの番号と並びは frozen と同じ。
+//   段数を決めずに作ると (levels <= 0)、表が frozen の配列 (小さな Trie では
+//   STRIDE_AUTO_MIN_BYTES) に収まる範囲で上から段を足す。浅い段は少ない項目を
+//   多くの key が通るので効き、深い段は項目が key の数ほど増えて表がキャッシュに
+//   載らなくなる (words では 3 段, 長い共通部分を持つ小さな Trie では全段になる)
+#define STRIDE_AUTO_MIN_BYTES (256 * 1024)
+
+typedef struct {
+    unsigned long long key;  // (node << 16 | b0 << 8 | b1) + 1, 0 は空き
+    unsigned int mid;        // 子のノード番号
+    unsigned int end;        // 孫のノード番号
+} StrideEntry;
+
+typedef struct {
+    FrozenTrie f;            // 先頭に置くので frozen の関数をそのまま使える
+    int levels;
+    long limit;              // 深さ < levels のノード数 (幅優先順なので番号 < limit が表の対象)
+    StrideEntry* table;
+    long mask;
+    long entries;
+} StrideTrie;
+
+static inline unsigned long long stride_key(long node, unsigned char b0, unsigned char b1) {
+    return (((unsigned long long)node << 16) | ((unsigned long long)b0 << 8) | b1) + 1;
+}
+
+static inline long stride_slot(unsigned long long key, long mask) {
+    key *= 0x9E3779B97F4A7C15ull;
+    return (long)((key ^ (key >> 31)) & (unsigned long long)mask);
+}
+
+static TrieRef trie_stride_step2(const void* impl, TrieRef node, unsigned char b0, unsigned char b1, TrieRef* mid) {
+    const StrideTrie* s = (const StrideTrie*)impl;
+    // 表より深いノードは表を引かずに外れにする (番号の比較だけで済む)
+    if((long)node - 1 >= s->limit) return TRIE_REF_NONE;
+    const unsigned long long key = stride_key((long)node - 1, b0, b1);
+    for(long i = stride_slot(key, s->mask); ; i = (i + 1) & s->mask) {
+        const StrideEntry* e = &s->table[i];
+        if(e->key == key) {
+            *mid = (TrieRef)e->mid + 1;
+            return (TrieRef)e->end + 1;
+        }
+        if(e->key == 0) return TRIE_REF_NONE;
+    }
+}
+
+static size_t trie_stride_bytes(const void* impl) {
+    const StrideTrie* s = (const StrideTrie*)impl;
+    return trie_frozen_bytes(&s->f) - sizeof(FrozenTrie) + sizeof(StrideTrie)
+         + (size_t)(s->mask + 1) * sizeof(StrideEntry);
+}
+
+static void trie_stride_destroy(void* impl) {
+    StrideTrie* s = (StrideTrie*)impl;
+    free(s->table);
+    free(s->f.first);
+    free(s->f.labels);
+    free(s->f.leaf);
+    free(s->f.depth);
+    free(s);
+}
+
+// count 個の経路を入れる表の大きさ (負荷率 1/2 以下の 2 の冪)
+static long stride_capacity(long count) {
+    long cap = 16;
+    while(cap < 2 * count) cap <<= 1;
+    return cap;
+}
+
+// 表の大きさが frozen の配列 (最低 STRIDE_AUTO_MIN_BYTES) を超えない最大の段数
+static int stride_auto_levels(const FrozenTrie* f) {
+    long at_depth[MAX_DEPTH + 2] = {0};  // 根からの深さごとのノード数
+    const int top = f->depth[0];
+    for(long u = 0; u < f->n; u++) {
+        int d = f->depth[u] - top;
+        if(d <= MAX_DEPTH + 1) at_depth[d]++;
+    }
+    size_t budget = trie_frozen_bytes(f);
+    if(budget < STRIDE_AUTO_MIN_BYTES) budget = STRIDE_AUTO_MIN_BYTES;
+    int levels = 1;
+    long count = at_depth[2];
+    while(levels < MAX_DEPTH && at_depth[levels + 2] > 0) {
+        long next = count + at_depth[levels + 2];
+        if((size_t)stride_capacity(next) * sizeof(StrideEntry) > budget) break;
+        count = next;
+        levels++;
+    }
+    return levels;
+}
+
+// levels <= 0 なら表の大きさから段数を決める (stride_auto_levels)。
+// 全ての深さに作るなら MAX_DEPTH を渡す
+void trie_backend_stride(TrieBackend* tb, const TrieNode* root, int levels) {
+    TrieBackend frozen;
+    trie_backend_frozen(&frozen, root);
+    StrideTrie* s = (StrideTrie*)calloc(1, sizeof(StrideTrie));
+    s->f = *(FrozenTrie*)frozen.impl;
+    free(frozen.impl);   // 配列は s->f に移した
+    const FrozenTrie* f = &s->f;
+    s->levels = (levels > 0)? levels : stride_auto_levels(f);
+    const int top = f->depth[0];
+
+    // 表に入る経路の数 = 根からの深さ 2 .. levels+1 のノードの数
+    long count = 0;
+    for(long u = 0; u < f->n; u++) count += (f->depth[u] - top >= 2 && f->depth[u] - top <= s->levels + 1);
+    long cap = stride_capacity(count);
+    s->mask = cap - 1;
+    s->table = (StrideEntry*)calloc(cap, sizeof(StrideEntry));
+    // 幅優先順なので深さ < levels のノードは先頭に並ぶ
+    for(long u = 0; u < f->n && f->depth[u] - top < s->levels; u++) {
+        s->limit = u + 1;
+        for(unsigned int e0 = f->first[u]; e0 < f->first[u + 1]; e0++) {
+            const long c = (long)e0 + 1;
+            for(unsigned int e1 = f->first[c]; e1 < f->first[c + 1]; e1++) {
+                const unsigned long long key = stride_key(u, f->labels[e0], f->labels[e1]);
+                long i = stride_slot(key, s->mask);
+                while(s->table[i].key != 0) i = (i + 1) & s->mask;
+                s->table[i].key = key;
+                s->table[i].mid = (unsigned int)c;
+                s->table[i].end = e1 + 1;
+                s->entries++;
+            }
+        }
+    }
+
+    *tb = frozen;
+    tb->name = "stride";
+    tb->impl = s;
+    tb->step2 = trie_stride_step2;
+    tb->bytes = trie_stride_bytes;
+    tb->destroy = trie_stride_destroy;
+}
+
+// ---- 登録表: 名前から作れるバックエンドの一覧 ----
+typedef struct {
+    const char* name;
+    void (*build)(TrieBackend* tb, TrieNode* root);
+} TrieBackendEntry;
+
+static void trie_backend_frozen_entry(TrieBackend* tb, TrieNode* root) {
+    trie_backend_frozen(tb, root);
+}
+
+static void trie_backend_hash_entry(TrieBackend* tb, TrieNode* root) {
+    trie_backend_hash(tb, root);
+}
+
+static void trie_backend_bitmap_entry(TrieBackend* tb, TrieNode* root) {
+    trie_backend_bitmap(tb, root);
+}
+
+static void trie_backend_stride_entry(TrieBackend* tb, TrieNode* root) {
+    trie_backend_stride(tb, root, 0);
+}
+
+static const TrieBackendEntry trie_backend_registry[] = {
+    { "pointer", trie_backend_pointer },
+    { "frozen",  trie_backend_frozen_entry },
+    { "hash",    trie_backend_hash_entry },
+    { "bitmap",  trie_backend_bitmap_entry },
+    { "stride",  trie_backend_stride_entry },
+};
+#define TRIE_BACKEND_COUNT ((int)(sizeof(trie_backend_registry) / sizeof(trie_backend_registry[0])))
+
+// name のバックエンドを root から作る。知らない名前なら -1
+int trie_backend_build(TrieBackend* tb, const char* name, TrieNode* root) {
+    for(int i = 0; i < TRIE_BACKEND_COUNT; i++) {
+        if(strcmp(trie_backend_registry[i].name, name) == 0) {
+            trie_backend_registry[i].build(tb, root);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void trie_backend_destroy(TrieBackend* tb) {
+    tb->destroy(tb->impl);
+    tb->impl = NULL;
+}
+
+// ---------------------------------------------------------
+// リザバー用の重み行列 W^(l) を深度ごとに用意
+//   reservoir_weights[l][ i*RESERVOIR_SIZE + j ]
+//   => depth l の RESERVOIR_SIZE×RESERVOIR_SIZE 行列
+// ---------------------------------------------------------
+static float** reservoir_weights = NULL;
+static int reservoir_depth_count = 0;
+
+// ---------------------------------------------------------
+// リザバー計算の近似設定 (精度と速度のトレードオフ)
+//   既定値は元の計算 (fp32 重み, expf による tanh, 振幅 0.01 のノイズ)。
+//   int8 / 疎行列 / 16 bit の重みは fp32 の重みから reservoir_set_config で作る
+// ---------------------------------------------------------
+typedef enum {
+    RES_WEIGHTS_F32 = 0,   // そのまま
+    RES_WEIGHTS_INT8,      // 行ごとのスケール付き int8 (重み帯域 1/4)
+    RES_WEIGHTS_SPARSE,    // 行ごとに絶対値の大きい density 割合だけ残した CSR
+    RES_WEIGHTS_F16,       // IEEE 半精度 (重み帯域 1/2, fp32 で積和)
+    RES_WEIGHTS_BF16       // bfloat16 (指数部は fp32 と同じ, 仮数 7 bit)
+} ReservoirWeightFormat;
+
+typedef struct {
+    float noise;                  // ノイズ振幅 (0 でノイズ無し)
+    int fast_tanh;                // 1 なら activate_tanh_fast
+    ReservoirWeightFormat format;
+    float density;                // RES_WEIGHTS_SPARSE で残す割合 (0, 1]
+    int drop_f32;                 // 1 なら F16 / BF16 に詰めた後で fp32 の元重みを解放する
+                                  // (重みの容量が半分になる。別の形式に戻すと 16 bit から
+                                  //  fp32 を復元するので、元の値には戻らない)
+} ReservoirConfig;
+
+static ReservoirConfig reservoir_config = { 0.01f, 0, RES_WEIGHTS_F32, 1.0f, 0 };
+
+typedef struct {
+    int row_ptr[RESERVOIR_SIZE + 1];
+    int* col;
+    float* val;
+} CsrMatrix;
+
+static signed char** reservoir_weights_q8 = NULL;  // [l][i*R + j]
+static float** reservoir_scale_q8 = NULL;          // [l][i] 行ごとのスケール
+static CsrMatrix* reservoir_weights_csr = NULL;    // [l]
+static unsigned short** reservoir_weights_h = NULL; // [l][i*R + j] fp16 / bf16
+
+static void reservoir_derived_free(void) {
+    for(int l = 0; l < reservoir_depth_count; l++) {
+        if(reservoir_weights_q8) free(reservoir_weights_q8[l]);
+        if(reservoir_scale_q8) free(reservoir_scale_q8[l]);
+        if(reservoir_weights_csr) {
+            free(reservoir_weights_csr[l].col);
+            free(reservoir_weights_csr[l].val);
+        }
+        if(reservoir_weights_h) free(reservoir_weights_h[l]);
+    }
+    free(reservoir_weights_q8);
+    free(reservoir_scale_q8);
+    free(reservoir_weights_csr);
+    free(reservoir_weights_h);
+    reservoir_weights_q8 = NULL;
+    reservoir_scale_q8 = NULL;
+    reservoir_weights_csr = NULL;
+    reservoir_weights_h = NULL;
+}
+
+static void reservoir_build_int8(void) {
+    reservoir_weights_q8 = (signed char**)calloc(reservoir_depth_count, sizeof(signed char*));
+    reservoir_scale_q8 = (float**)calloc(reservoir_depth_count, sizeof(float*));
+    for(int l = 0; l < reservoir_depth_count; l++) {
+        const float* W = reservoir_weights[l];
+        signed char* q = (signed char*)malloc(RESERVOIR_SIZE * RESERVOIR_SIZE);
+        float* sc = (float*)malloc(sizeof(float) * RESERVOIR_SIZE);
+        for(int i = 0; i < RESERVOIR_SIZE; i++) {
+            float max_abs = 0.0f;
+            for(int j = 0; j < RESERVOIR_SIZE; j++) {
+                float a = fabsf(W[i * RESERVOIR_SIZE + j]);
+                if(a > max_abs) max_abs = a;
+            }
+            sc[i] = (max_abs > 0.0f)? max_abs / 127.0f : 1.0f;
+            for(int j = 0; j < RESERVOIR_SIZE; j++) {
+                q[i * RESERVOIR_SIZE + j] = (signed char)lrintf(W[i * RESERVOIR_SIZE + j] / sc[i]);
+            }
+        }
+        reservoir_weights_q8[l] = q;
+        reservoir_scale_q8[l] = sc;
+    }
+}
+
+static void reservoir_build_half(int bf16) {
+    reservoir_weights_h = (unsigned short**)calloc(reservoir_depth_count, sizeof(unsigned short*));
+    for(int l = 0; l < reservoir_depth_count; l++) {
+        const float* W = reservoir_weights[l];
+        unsigned short* h = (unsigned short*)malloc(sizeof(unsigned short) * RESERVOIR_SIZE * RESERVOIR_SIZE);
+        for(int i = 0; i < RESERVOIR_SIZE * RESERVOIR_SIZE; i++) {
+            h[i] = bf16? float_to_bf16(W[i]) : float_to_half(W[i]);
+        }
+        reservoir_weights_h[l] = h;
+    }
+}
+
+// drop_f32 で解放した fp32 の重みを 16 bit の重みから作り直す
+static void reservoir_restore_f32(int bf16) {
+    for(int l = 0; l < reservoir_depth_count; l++) {
+        if(reservoir_weights[l]) continue;
+        const unsigned short* h = reservoir_weights_h[l];
+        float* W = (float*)malloc(sizeof(float) * RESERVOIR_SIZE * RESERVOIR_SIZE);
+        for(int i = 0; i < RESERVOIR_SIZE * RESERVOIR_SIZE; i++) {
+            W[i] = bf16? bf16_to_float(h[i]) : half_to_float(h[i]);
+        }
+        reservoir_weights[l] = W;
+    }
+}
+
+// 16 bit に詰めた後の fp32 の重みを解放する (reservoir_weights[l] は NULL になる)
+static void reservoir_drop_f32(void) {
+    for(int l = 0; l < reservoir_depth_count; l++) {
+        free(reservoir_weights[l]);
+        reservoir_weights[l] = NULL;
+    }
+}
+
+static int cmp_abs_desc(const void* a, const void* b) {
+    float x = fabsf(*(const float*)a), y = fabsf(*(const float*)b);
+    return (x < y) - (x > y);
+}
+
+static void reservoir_build_sparse(float density) {
+    int keep = (int)(density * RESERVOIR_SIZE + 0.5f);
+    if(keep < 1) keep = 1;
+    if(keep > RESERVOIR_SIZE) keep = RESERVOIR_SIZE;
+    reservoir_weights_csr = (CsrMatrix*)calloc(reservoir_depth_count, sizeof(CsrMatrix));
+    for(int l = 0; l < reservoir_depth_count; l++) {
+        const float* W = reservoir_weights[l];
+        CsrMatrix* m = &reservoir_weights_csr[l];
+        m->col = (int*)malloc(sizeof(int) * keep * RESERVOIR_SIZE);
+        m->val = (float*)malloc(sizeof(float) * keep * RESERVOIR_SIZE);
+        int nnz = 0;
+        for(int i = 0; i < RESERVOIR_SIZE; i++) {
+            // 行内で keep 番目に大きい絶対値をしきい値にする
+            float row[RESERVOIR_SIZE];
+            memcpy(row, W + i * RESERVOIR_SIZE, sizeof(row));
+            qsort(row, RESERVOIR_SIZE, sizeof(float), cmp_abs_desc);
+            float th = fabsf(row[keep - 1]);
+            m->row_ptr[i] = nnz;
+            for(int j = 0; j < RESERVOIR_SIZE && nnz - m->row_ptr[i] < keep; j++) {
+                float w = W[i * RESERVOIR_SIZE + j];
+                if(fabsf(w) >= th) {
+                    m->col[nnz] = j;
+                    m->val[nnz] = w;
+                    nnz++;
+                }
+            }
+        }
+        m->row_ptr[RESERVOIR_SIZE] = nnz;
+    }
+}
+
+// 近似設定を切り替える (必要な派生重みを作り直す)。
+// 重みの初期化後に呼ぶこと。初期化をやり直した場合も自動で作り直される
+void reservoir_set_config(const ReservoirConfig* cfg) {
+    // fp32 を解放済みなら、派生重みを作り直す前に今の 16 bit の重みから戻す
+    if(reservoir_weights && reservoir_weights_h) {
+        reservoir_restore_f32(reservoir_config.format == RES_WEIGHTS_BF16);
+    }
+    reservoir_config = *cfg;
+    if(reservoir_config.density <= 0.0f || reservoir_config.density > 1.0f) reservoir_config.density = 1.0f;
+    reservoir_derived_free();
+    if(reservoir_weights == NULL) return;
+    if(reservoir_config.format == RES_WEIGHTS_INT8) reservoir_build_int8();
+    if(reservoir_config.format == RES_WEIGHTS_SPARSE) reservoir_build_sparse(reservoir_config.density);
+    if(reservoir_config.format == RES_WEIGHTS_F16) reservoir_build_half(0);
+    if(reservoir_config.format == RES_WEIGHTS_BF16) reservoir_build_half(1);
+    if(reservoir_weights_h && reservoir_config.drop_f32) reservoir_drop_f32();
+}
+
+ReservoirConfig reservoir_get_config(void) {
+    return reservoir_config;
+}
+
+// -------------------------
+// リザバー重みの初期化
+//  - まず乱数で埋める
+//  - スペクトル半径を RHO 程度にするため、
+//    固有値計算は省略し、雑に(1/norm)でスケーリング
+// -------------------------
+void init_reservoir_weights_seeded(int depth_count, unsigned int seed) {
+    reservoir_derived_free();
+    reservoir_weights = (float**)malloc(sizeof(float*) * depth_count);
+    reservoir_depth_count = depth_count;
+    srand(seed);
+
+    for(int l = 0; l < depth_count; l++) {
+        reservoir_weights[l] = (float*)malloc(sizeof(float) * RESERVOIR_SIZE * RESERVOIR_SIZE);
+        // 乱数で初期化
+        float norm_sum = 0.0f;
+        for(int i = 0; i < RESERVOIR_SIZE * RESERVOIR_SIZE; i++) {
+            reservoir_weights[l][i] = rand_float();
+            norm_sum += fabsf(reservoir_weights[l][i]);
+        }
+        // 平均絶対値でスケーリングする簡易版
+        float avg_abs = norm_sum / (RESERVOIR_SIZE * RESERVOIR_SIZE);
+        float scale = (avg_abs > 1e-5f)? (RHO / avg_abs) : 1.0f;
+        for(int i = 0; i < RESERVOIR_SIZE * RESERVOIR_SIZE; i++) {
+            reservoir_weights[l][i] *= scale;
+        }
+    }
+    // 近似設定で使う派生重みを新しい重みから作り直す
+    reservoir_set_config(&reservoir_config);
+}
+
+// 時刻をシードにした初期化 (実行ごとに異なる重み)
+void init_reservoir_weights(int depth_count) {
+    init_reservoir_weights_seeded(depth_count, (unsigned int)time(NULL));
+}
+
+// -------------------------
+// int8 重みの行列 x ベクトル積 (行ごとのスケールを最後に掛ける)
+// -------------------------
+static void matvec_q8(const signed char* Q, const float* scale, const float* in, float* out) {
+    for(int i = 0; i < RESERVOIR_SIZE; i++) {
+        const signed char* q = Q + i * RESERVOIR_SIZE;
+        float sum = 0.0f;
+        for(int j = 0; j < RESERVOIR_SIZE; j++) {
+            sum += (float)q[j] * in[j];
+        }
+        out[i] = scale[i] * sum;
+    }
+}
+
+// -------------------------
+// 疎行列 (CSR) x ベクトル積
+// -------------------------
+static void matvec_csr(const CsrMatrix* m, const float* in, float* out) {
+    for(int i = 0; i < RESERVOIR_SIZE; i++) {
+        float sum = 0.0f;
+        for(int k = m->row_ptr[i]; k < m->row_ptr[i + 1]; k++) {
+            sum += m->val[k] * in[m->col[k]];
+        }
+        out[i] = sum;
+    }
+}
+
+// -------------------------
+// 前活性 pre (n 要素) にノイズを加えて tanh + alpha を適用し h_out に書く
+//   (pre は書き換える)
+// -------------------------
+static void reservoir_activate(float* pre, float* h_out, int n) {
+    const float noise = reservoir_config.noise;
+    // ノイズを加える (非常に小さい値)
+    PROF_BEGIN(t_noise);
+    if(noise != 0.0f) {
+        for(int i = 0; i < n; i++) {
+            pre[i] += noise * noise_float();
+        }
+    }
+    PROF_END(PROF_NOISE, t_noise);
+    // tanh + alpha
+    PROF_BEGIN(t_tanh);
+    if(reservoir_config.fast_tanh) {
+        for(int i = 0; i < n; i++) h_out[i] = ALPHA * activate_tanh_fast(pre[i]);
+    } else {
+        for(int i = 0; i < n; i++) h_out[i] = ALPHA * activate_tanh(pre[i]);
+    }
+    PROF_END(PROF_TANH, t_tanh);
+}
+
+// -------------------------
+// リザバー状態を1ステップ更新する
+//  h_{l+1} = alpha * tanh(W^(l) * h_l + noise)
+//  (Wl は fp32 の重み。ノイズと tanh は近似設定に従う)
+// -------------------------
+void reservoir_update(const float* Wl, float* h_inout) {
+    float tmp[RESERVOIR_SIZE];
+    // W^(l) * h(l)
+    PROF_BEGIN(t_mv);
+    matvec(Wl, h_inout, tmp);
+    PROF_END(PROF_MATVEC, t_mv);
+    reservoir_activate(tmp, h_inout, RESERVOIR_SIZE);
+}
+
+// -------------------------
+// 深度 l の重み (近似設定の格納形式) と in の積を out に書く
+// -------------------------
+static void reservoir_matvec(int l, const float* in, float* out) {
+    switch(reservoir_config.format) {
+    case RES_WEIGHTS_INT8:
+        matvec_q8(reservoir_weights_q8[l], reservoir_scale_q8[l], in, out);
+        break;
+    case RES_WEIGHTS_SPARSE:
+        matvec_csr(&reservoir_weights_csr[l], in, out);
+        break;
+    case RES_WEIGHTS_F16:
+    case RES_WEIGHTS_BF16:
+        matvec_half(reservoir_weights_h[l], reservoir_config.format == RES_WEIGHTS_BF16, in, out);
+        break;
+    default:
+        matvec(reservoir_weights[l], in, out);
+        break;
+    }
+}
+
+// -------------------------
+// 深度 l の重みで 1 ステップ更新する (重みの格納形式も近似設定に従う)
+// -------------------------
+void reservoir_step(int l, float* h_inout) {
+    float tmp[RESERVOIR_SIZE];
+    PROF_BEGIN(t_mv);
+    reservoir_matvec(l, h_inout, tmp);
+    PROF_END(PROF_MATVEC, t_mv);
+    reservoir_activate(tmp, h_inout, RESERVOIR_SIZE);
+}
+
+// -------------------------
+// (1) 文字列を1つ与え、Trieを深さ方向に進む
+// (2) 各深度ごとにリザバー状態を更新
+// => 最終的な状態ベクトル h(D) を得る
+//   Trie の表現には依存せず TrieBackend の step / depth だけを使う
+// -------------------------
+void trie_backend_forward(const TrieBackend* tb, const char* input, float* h_state) {
+    TrieRef cur = tb->root(tb->impl);
+    int length = (int)strlen(input);
+
+    // リザバー状態 h_state は呼び出し前にゼロクリアしておく想定
+
+    double t_span = trace_span_begin();
+    int i = 0;
+    while(i < length && i < MAX_DEPTH) {
+        if(tb->step2 && i + 1 < length && i + 1 < MAX_DEPTH) {
+            // 2 バイトを 1 回で辿れれば、途中のノードの深度でも 1 段ずつ更新する
+            TrieRef mid;
+            PROF_BEGIN(t_walk2);
+            TrieRef end = tb->step2(tb->impl, cur, (unsigned char)input[i], (unsigned char)input[i + 1], &mid);
+            PROF_END(PROF_TRIE_WALK, t_walk2);
+            if(end != TRIE_REF_NONE) {
+                reservoir_step(tb->depth(tb->impl, cur), h_state);
+                reservoir_step(tb->depth(tb->impl, mid), h_state);
+                cur = end;
+                i += 2;
+                continue;
+            }
+        }
+        unsigned char c = (unsigned char)input[i];
+        PROF_BEGIN(t_walk);
+        TrieRef next = tb->step(tb->impl, cur, c);
+        PROF_END(PROF_TRIE_WALK, t_walk);
+        if(next == TRIE_REF_NONE) {
+            // ノードが存在しなければ中断 (実運用なら生成 or 例外処理)
+            break;
+        }
+        // depth l に応じた重みで更新
+        int l = tb->depth(tb->impl, cur);  // 0,1,2... (最大MAX_DEPTH-1)
+        reservoir_step(l, h_state);
+
+        cur = next;
+        i++;
+    }
+    trace_span_end("trie_reservoir_forward", t_span, "steps", i);
+
+    // 入力を最後まで/最大深度まで辿った時点で h_state が「最終状態」
+    // ここでは何もしない
+}
+
+void trie_reservoir_forward(TrieNode* root, const char* input, float* h_state) {
+    TrieBackend tb;
+    trie_backend_pointer(&tb, root);
+    trie_backend_forward(&tb, input, h_state);
+}
+
+// -------------------------
+// key を辿ったときにリザバー更新が行われるステップ数 (実効深度) を返す
+//   trie_backend_forward と同じく、子が無い所/MAX_DEPTH で打ち切る
+// -------------------------
+int trie_backend_effective_depth(const TrieBackend* tb, const char* key) {
+    TrieRef cur = tb->root(tb->impl);
+    int d = 0;
+    while(key[d] != '\0' && d < MAX_DEPTH) {
+        if(tb->step2 && key[d + 1] != '\0' && d + 1 < MAX_DEPTH) {
+            TrieRef mid;
+            TrieRef end = tb->step2(tb->impl, cur, (unsigned char)key[d], (unsigned char)key[d + 1], &mid);
+            if(end != TRIE_REF_NONE) {
+                cur = end;
+                d += 2;
+                continue;
+            }
+        }
+        TrieRef next = tb->step(tb->impl, cur, (unsigned char)key[d]);
+        if(next == TRIE_REF_NONE) break;
+        cur = next;
+        d++;
+    }
+    return d;
+}
+
+// key の経路上のノードを path[0] (根) .. path[d] に書き、辿れた深さ d を返す。
+// step2 があれば 2 バイトずつ辿る (途中のノードも返るので path は step と同じ)
+int trie_backend_path(const TrieBackend* tb, const char* key, TrieRef* path) {
+    int d = 0;
+    path[0] = tb->root(tb->impl);
+    while(key[d] != '\0' && d < MAX_DEPTH) {
+        if(tb->step2 && key[d + 1] != '\0' && d + 1 < MAX_DEPTH) {
+            TrieRef end = tb->step2(tb->impl, path[d], (unsigned char)key[d], (unsigned char)key[d + 1], &path[d + 1]);
+            if(end != TRIE_REF_NONE) {
+                path[d + 2] = end;
+                d += 2;
+                continue;
+            }
+        }
+        TrieRef next = tb->step(tb->impl, path[d], (unsigned char)key[d]);
+        if(next == TRIE_REF_NONE) break;
+        path[++d] = next;
+    }
+    return d;
+}
+
+int trie_effective_depth(TrieNode* root, const char* key) {
+    TrieBackend tb;
+    trie_backend_pointer(&tb, root);
+    return trie_backend_effective_depth(&tb, key);
+}
+
+// -------------------------
+// バッチ版 forward
+//   H: n x RESERVOIR_SIZE (行 b が keys[b] の状態, 呼び出し前にゼロクリア想定)
+//   行を実効深度の降順に並べ替えておくと、深度ステップ l で更新が必要な行は
+//   常に先頭の連続区間になる。短い key が終わった行は区間から外れるので、
+//   各ステップの GEMM は稼働中の行だけを詰めた密な行列に対して行われる。
+//   戻り値は全行のリザバー更新ステップ数の合計
+//   W は深度ごとの fp32 重み、Wh は fp16 / bf16 の重み (NULL なら共有の派生行列)。
+//   どちらも NUMA の複製を使うため差し替えられる。int8 / 疎行列は共有の派生行列を
+//   行ごとに使う
+// -------------------------
+long trie_backend_forward_batch_w(const TrieBackend* tb, float* const* W, unsigned short* const* Wh,
+                                  const char* const* keys, int n, float* H) {
+    if(n <= 0) return 0;
+    int* depth = (int*)malloc(sizeof(int) * n);
+    int* order = (int*)malloc(sizeof(int) * n);
+    float* A = (float*)malloc(sizeof(float) * n * RESERVOIR_SIZE);
+    float* T = (float*)malloc(sizeof(float) * n * RESERVOIR_SIZE);
+
+    int count[MAX_DEPTH + 1] = {0};
+    long total_steps = 0;
+    double t_walk = trace_span_begin();
+    for(int b = 0; b < n; b++) {
+        depth[b] = trie_backend_effective_depth(tb, keys[b]);
+        count[depth[b]]++;
+        total_steps += depth[b];
+    }
+    trace_span_end("trie_walk", t_walk, "rows", n);
+    // active[l] = 深度 l より深い行の数 (= ステップ l で稼働する行数)
+    int active[MAX_DEPTH + 1];
+    int pos[MAX_DEPTH + 1];
+    active[MAX_DEPTH] = 0;
+    for(int d = MAX_DEPTH - 1; d >= 0; d--) {
+        active[d] = active[d + 1] + count[d + 1];
+    }
+    memcpy(pos, active, sizeof(pos));
+    for(int b = 0; b < n; b++) {
+        int k = pos[depth[b]]++;
+        order[k] = b;
+        memcpy(A + k * RESERVOIR_SIZE, H + b * RESERVOIR_SIZE, sizeof(float) * RESERVOIR_SIZE);
+    }
+
+    int root_depth = tb->depth(tb->impl, tb->root(tb->impl));
+    for(int step = 0; step < MAX_DEPTH && active[step] > 0; step++) {
+        int rows = active[step];
+        int l = root_depth + step;
+        double t_step = trace_span_begin();
+        PROF_BEGIN(t_mv);
+        if(reservoir_config.format == RES_WEIGHTS_F32) {
+            matmat(W[l], A, T, rows);
+        } else if(reservoir_config.format == RES_WEIGHTS_F16 || reservoir_config.format == RES_WEIGHTS_BF16) {
+            matmat_half(Wh? Wh[l] : reservoir_weights_h[l], reservoir_config.format == RES_WEIGHTS_BF16, A, T, rows);
+        } else {
+            // int8 / 疎行列は行ごとに処理する
+            for(int r = 0; r < rows; r++) {
+                reservoir_matvec(l, A + r * RESERVOIR_SIZE, T + r * RESERVOIR_SIZE);
+            }
+        }
+        PROF_END(PROF_MATVEC, t_mv);
+        reservoir_activate(T, A, rows * RESERVOIR_SIZE);
+        trace_span_end2("reservoir_step", t_step, "depth", l, "rows", rows);
+    }
+
+    for(int k = 0; k < n; k++) {
+        memcpy(H + order[k] * RESERVOIR_SIZE, A + k * RESERVOIR_SIZE, sizeof(float) * RESERVOIR_SIZE);
+    }
+    free(T);
+    free(A);
+    free(order);
+    free(depth);
+    return total_steps;
+}
+
+long trie_backend_forward_batch(const TrieBackend* tb, const char* const* keys, int n, float* H) {
+    return trie_backend_forward_batch_w(tb, reservoir_weights, NULL, keys, n, H);
+}
+
+long trie_reservoir_forward_batch(TrieNode* root, const char* const* keys, int n, float* H) {
+    TrieBackend tb;
+    trie_backend_pointer(&tb, root);
+    return trie_backend_forward_batch(&tb, keys, n, H);
+}
+
+// =========================================================
+// トークン列の Trie
+//   バイトではなく単語などのトークン id (0 .. TOKEN_MAX-1) の列で Trie を作る。
+//   子の配列は持たず、全ての辺を 1 つの線形探索ハッシュ表
+//   (親の id, トークン) -> 子の id に置く。ノードは id (根 = 0) で、
+//   深度と is_leaf だけを配列で持つ。リザバーとリードアウトはバイトの
+//   Trie と同じもの (reservoir_step / readout_forward) をそのまま使い、
+//   1 トークン 1 ステップ (MAX_DEPTH トークンまで) で進む
+// =========================================================
+#define TOKEN_BITS 20
+#define TOKEN_MAX (1u << TOKEN_BITS)
+
+typedef struct {
+    unsigned long long* keys;   // (親 << TOKEN_BITS | トークン) + 1, 0 = 空
+    int* child;
+    long mask;                  // 表の大きさ - 1
+    long edges;
+    int* depth;                 // ノード id -> 深度
+    unsigned char* is_leaf;
+    long n_nodes;
+    long cap_nodes;
+} TokenTrie;
+
+static inline unsigned long long token_edge_key(long parent, unsigned int token) {
+    return (((unsigned long long)parent << TOKEN_BITS) | token) + 1;
+}
+
+static inline long token_edge_slot(const TokenTrie* tt, unsigned long long key) {
+    unsigned long long x = key * 0x9E3779B97F4A7C15ull;
+    return (long)((x ^ (x >> 32)) & (unsigned long long)tt->mask);
+}
+
+void token_trie_init(TokenTrie* tt) {
+    memset(tt, 0, sizeof(*tt));
+    tt->mask = 1023;
+    tt->keys = (unsigned long long*)calloc(tt->mask + 1, sizeof(unsigned long long));
+    tt->child = (int*)malloc(sizeof(int) * (tt->mask + 1));
+    tt->cap_nodes = 1024;
+    tt->depth = (int*)malloc(sizeof(int) * tt->cap_nodes);
+    tt->is_leaf = (unsigned char*)calloc(tt->cap_nodes, 1);
+    tt->depth[0] = 0;
+    tt->n_nodes = 1;
+}
+
+void token_trie_free(TokenTrie* tt) {
+    free(tt->keys);
+    free(tt->child);
+    free(tt->depth);
+    free(tt->is_leaf);
+    memset(tt, 0, sizeof(*tt));
+}
+
+// 辺の表を 2 倍にして入れ直す
+static void token_trie_grow(TokenTrie* tt) {
+    unsigned long long* old_keys = tt->keys;
+    int* old_child = tt->child;
+    long old_size = tt->mask + 1;
+    tt->mask = old_size * 2 - 1;
+    tt->keys = (unsigned long long*)calloc(tt->mask + 1, sizeof(unsigned long long));
+    tt->child = (int*)malloc(sizeof(int) * (tt->mask + 1));
+    for(long i = 0; i < old_size; i++) {
+        if(old_keys[i] == 0) continue;
+        long s = token_edge_slot(tt, old_keys[i]);
+        while(tt->keys[s] != 0) s = (s + 1) & tt->mask;
+        tt->keys[s] = old_keys[i];
+        tt->child[s] = old_child[i];
+    }
+    free(old_keys);
+    free(old_child);
+}
+
+// node からトークン token で進んだ子の id (無ければ -1)
+static inline long token_trie_step(const TokenTrie* tt, long node, unsigned int token) {
+    unsigned long long key = token_edge_key(node, token);
+    for(long s = token_edge_slot(tt, key); tt->keys[s] != 0; s = (s + 1) & tt->mask) {
+        if(tt->keys[s] == key) return tt->child[s];
+    }
+    return -1;
+}
+
+// トークン列を挿入する (MAX_DEPTH トークンで打ち切り)。終端ノードの id を返す。
+// TOKEN_MAX 以上の id を含む列は何も挿入せずに -1 を返す
+long token_trie_insert(TokenTrie* tt, const unsigned int* tokens, int n) {
+    for(int i = 0; i < n && i < MAX_DEPTH; i++) {
+        if(tokens[i] >= TOKEN_MAX) return -1;
+    }
+    long cur = 0;
+    for(int i = 0; i < n && i < MAX_DEPTH; i++) {
+        unsigned int t = tokens[i];
+        unsigned long long key = token_edge_key(cur, t);
+        long s = token_edge_slot(tt, key);
+        while(tt->keys[s] != 0 && tt->keys[s] != key) s = (s + 1) & tt->mask;
+        if(tt->keys[s] == key) {
+            cur = tt->child[s];
+            continue;
+        }
+        if(tt->n_nodes == tt->cap_nodes) {
+            tt->cap_nodes *= 2;
+            tt->depth = (int*)realloc(tt->depth, sizeof(int) * tt->cap_nodes);
+            tt->is_leaf = (unsigned char*)realloc(tt->is_leaf, tt->cap_nodes);
+            memset(tt->is_leaf + tt->n_nodes, 0, tt->cap_nodes - tt->n_nodes);
+        }
+        long id = tt->n_nodes++;
+        tt->depth[id] = tt->depth[cur] + 1;
+        tt->keys[s] = key;
+        tt->child[s] = (int)id;
+        tt->edges++;
+        cur = id;
+        if(tt->edges * 2 > tt->mask + 1) token_trie_grow(tt);   // 負荷率 1/2 まで
+    }
+    tt->is_leaf[cur] = 1;
+    return cur;
+}
+
+// 辿れる所まで辿ったノードの id を返す。*steps に進んだトークン数を書く (NULL 可)。
+// TOKEN_MAX 以上の id は辺が無いものとしてそこで止まる
+long token_trie_find(const TokenTrie* tt, const unsigned int* tokens, int n, int* steps) {
+    long cur = 0;
+    int i = 0;
+    for(; i < n && i < MAX_DEPTH; i++) {
+        if(tokens[i] >= TOKEN_MAX) break;
+        long next = token_trie_step(tt, cur, tokens[i]);
+        if(next < 0) break;
+        cur = next;
+    }
+    if(steps) *steps = i;
+    return cur;
+}
+
+// trie_reservoir_forward のトークン版。h_state は呼び出し前にゼロクリアしておく。
+// 戻り値は進んだステップ数 (TOKEN_MAX 以上の id は find と同じく辞書外として止まる)
+int token_trie_forward(const TokenTrie* tt, const unsigned int* tokens, int n, float* h_state) {
+    long cur = 0;
+    int i = 0;
+    double t_span = trace_span_begin();
+    for(; i < n && i < MAX_DEPTH; i++) {
+        if(tokens[i] >= TOKEN_MAX) break;
+        PROF_BEGIN(t_walk);
+        long next = token_trie_step(tt, cur, tokens[i]);
+        PROF_END(PROF_TRIE_WALK, t_walk);
+        if(next < 0) break;
+        reservoir_step(tt->depth[cur], h_state);
+        cur = next;
+    }
+    trace_span_end("trie_reservoir_forward", t_span, "steps", i);
+    return i;
+}
+
+size_t token_trie_bytes(const TokenTrie* tt) {
+    return sizeof(*tt) + (size_t)(tt->mask + 1) * (sizeof(unsigned long long) + sizeof(int))
+         + (size_t)tt->cap_nodes * (sizeof(int) + 1);
+}
+
+// ---- 単語 -> トークン id の辞書 (空白区切り) ----
+typedef struct {
+    char** words;               // id -> 単語
+    unsigned int* slots;        // ハッシュ -> id + 1 (0 = 空)
+    long mask;
+    unsigned int n;
+} TokenDict;
+
+void token_dict_init(TokenDict* d) {
+    memset(d, 0, sizeof(*d));
+    d->mask = 1023;
+    d->slots = (unsigned int*)calloc(d->mask + 1, sizeof(unsigned int));
+}
+
+void token_dict_free(TokenDict* d) {
+    for(unsigned int i = 0; i < d->n; i++) free(d->words[i]);
+    free(d->words);
+    free(d->slots);
+    memset(d, 0, sizeof(*d));
+}
+
+static unsigned long long fnv1a(const char* s, size_t n);
+
+// 単語の id を返す。無ければ add が非 0 なら追加し, 0 なら -1
+static long token_dict_id(TokenDict* d, const char* w, size_t len, int add) {
+    long s = (long)(fnv1a(w, len) & (unsigned long long)d->mask);
+    while(d->slots[s]) {
+        const char* x = d->words[d->slots[s] - 1];
+        if(strncmp(x, w, len) == 0 && x[len] == '\0') return d->slots[s] - 1;
+        s = (s + 1) & d->mask;
+    }
+    if(!add || d->n >= TOKEN_MAX - 1) return -1;   // TOKEN_MAX - 1 は unknown 用
+    unsigned int id = d->n++;
+    if((id & (id - 1)) == 0) d->words = (char**)realloc(d->words, sizeof(char*) * (id? id * 2 : 1));
+    d->words[id] = (char*)malloc(len + 1);
+    memcpy(d->words[id], w, len);
+    d->words[id][len] = '\0';
+    d->slots[s] = id + 1;
+    if((long)d->n * 2 > d->mask + 1) {
+        // 負荷率 1/2 を超えたら 2 倍にして入れ直す
+        free(d->slots);
+        d->mask = d->mask * 2 + 1;
+        d->slots = (unsigned int*)calloc(d->mask + 1, sizeof(unsigned int));
+        for(unsigned int i = 0; i < d->n; i++) {
+            long t = (long)(fnv1a(d->words[i], strlen(d->words[i])) & (unsigned long long)d->mask);
+            while(d->slots[t]) t = (t + 1) & d->mask;
+            d->slots[t] = i + 1;
+        }
+    }
+    return id;
+}
+
+// text を空白で区切って id 列にし、out に最大 max 個書く。戻り値は個数。
+// 辞書に無い単語は add が非 0 なら追加し, 0 なら unknown (TOKEN_MAX - 1) にする
+int token_dict_encode(TokenDict* d, const char* text, unsigned int* out, int max, int add) {
+    int n = 0;
+    const char* p = text;
+    while(*p && n < max) {
+        while(*p == ' ' || *p == '\t') p++;
+        const char* b = p;
+        while(*p && *p != ' ' && *p != '\t') p++;
+        if(p == b) break;
+        long id = token_dict_id(d, b, (size_t)(p - b), add);
+        out[n++] = (id >= 0)? (unsigned int)id : TOKEN_MAX - 1;
+    }
+    return n;
+}
+
+// -------------------------
+// リードアウト部：単純な全結合＋softmax想定
+//   out_dim = 語彙数 (サンプルなので少数にしている)
+// -------------------------
+#ifndef OUT_DIM
+#define OUT_DIM 4   // 出力次元(例: 4語彙だとする)
+#endif
+static float readout_weights[OUT_DIM][RESERVOIR_SIZE]; // 語彙数 × リザバー次元
+
+// 初期化
+void init_readout() {
+    for(int i = 0; i < OUT_DIM; i++) {
+        for(int j = 0; j < RESERVOIR_SIZE; j++) {
+            readout_weights[i][j] = 0.01f * rand_float();
+        }
+    }
+}
+
+// 全結合 + softmax (重み W は OUT_DIM x RESERVOIR_SIZE の行優先配列)
+//   テナントごとのリードアウトヘッドなど、既定以外の重みにも使う
+void readout_forward_w(const float* W, const float* h_state, float* out_probs) {
+    PROF_BEGIN(t_ro);
+    // z = W * h_state
+    float sum_exp = 0.0f;
+    for(int i = 0; i < OUT_DIM; i++) {
+        float z = 0.0f;
+        for(int j = 0; j < RESERVOIR_SIZE; j++) {
+            z += W[i * RESERVOIR_SIZE + j] * h_state[j];
+        }
+        // ここでは簡易に exp(z)
+        out_probs[i] = expf(z);
+        sum_exp += out_probs[i];
+    }
+    // ソフトマックス正規化
+    for(int i = 0; i < OUT_DIM; i++) {
+        out_probs[i] /= sum_exp;
+    }
+    PROF_END(PROF_READOUT, t_ro);
+}
+
+// 既定のリードアウト重みでの全結合 + softmax
+void readout_forward(const float* h_state, float* out_probs) {
+    readout_forward_w(&readout_weights[0][0], h_state, out_probs);
+}
+
+// リードアウト部の単純学習 (クロスエントロピー誤差に対する勾配下降の例)
+void readout_train_w(float* W, const float* h_state, int gold_index, float lr) {
+    // 順伝搬
+    float probs[OUT_DIM];
+    readout_forward_w(W, h_state, probs);
+
+    // 勾配 = (pred - onehot(gold)) * h_state
+    for(int i = 0; i < OUT_DIM; i++) {
+        float grad = probs[i];
+        if(i == gold_index) {
+            grad -= 1.0f;
+        }
+        // パラメータ更新
+        for(int j = 0; j < RESERVOIR_SIZE; j++) {
+            W[i * RESERVOIR_SIZE + j] -= lr * grad * h_state[j];
+        }
+    }
+}
+
+void readout_train(const float* h_state, int gold_index, float lr) {
+    readout_train_w(&readout_weights[0][0], h_state, gold_index, lr);
+}
+
+// -------------------------
+// 16 bit のリードアウト重み (推論専用)
+//   学習は fp32 の重みで行い、終わった後に readout_pack_half で詰め直す
+// -------------------------
+typedef struct {
+    ReservoirWeightFormat format;   // RES_WEIGHTS_F16 / RES_WEIGHTS_BF16
+    unsigned short w[OUT_DIM * RESERVOIR_SIZE];
+} ReadoutHalf;
+
+void readout_pack_half(ReadoutHalf* out, const float* W, ReservoirWeightFormat format) {
+    out->format = format;
+    for(int i = 0; i < OUT_DIM * RESERVOIR_SIZE; i++) {
+        out->w[i] = (format == RES_WEIGHTS_BF16)? float_to_bf16(W[i]) : float_to_half(W[i]);
+    }
+}
+
+void readout_forward_half(const ReadoutHalf* Wh, const float* h_state, float* out_probs) {
+    PROF_BEGIN(t_ro);
+    const int bf16 = (Wh->format == RES_WEIGHTS_BF16);
+    float sum_exp = 0.0f;
+    for(int i = 0; i < OUT_DIM; i++) {
+        const unsigned short* w = Wh->w + i * RESERVOIR_SIZE;
+        float z = bf16? dot_bf16(w, h_state, RESERVOIR_SIZE) : dot_f16(w, h_state, RESERVOIR_SIZE);
+        out_probs[i] = expf(z);
+        sum_exp += out_probs[i];
+    }
+    for(int i = 0; i < OUT_DIM; i++) {
+        out_probs[i] /= sum_exp;
+    }
+    PROF_END(PROF_READOUT, t_ro);
+}
+
+// =========================================================
+// ノードごとのリザバー状態の保存 (圧縮形式)
+//   全ノードについて「根からそのノードまで辿った後の状態」を node_id 順に持つ。
+//   fp32 のままだと ノード数 x RESERVOIR_SIZE x 4 バイト (256 次元, 1000 万
+//   ノードで約 10 GB) になるので、次の形式で圧縮できる。
+//     STATE_F32  : そのまま (参照用)
+//     STATE_F16  : IEEE 半精度 (1/2)
+//     STATE_INT8 : ベクトルごとのスケール付き int8 (約 1/4)
+//     STATE_PQ   : 直積量子化。R 次元を pq_m 個の部分空間に分け、
+//                  部分空間ごとに 256 個の代表ベクトル (k-means で学習) の
+//                  番号 1 バイトで表す (pq_m バイト / ノード)
+//   node_state_decode は SIMD で fp32 に戻して readout_forward の入力にする。
+//   PQ は pq_readout_lut_build で「部分空間 x 代表 x 出力」の内積表を作れば、
+//   復号せずに表引きの和だけでリードアウトできる。
+// =========================================================
+typedef enum {
+    STATE_F32 = 0,
+    STATE_F16,
+    STATE_INT8,
+    STATE_PQ
+} StateCodec;
+
+#define PQ_CENTROIDS 256
+
+typedef struct {
+    StateCodec codec;
+    long n;                   // ノード数 (node_id の上限)
+    int pq_m;                 // STATE_PQ の部分空間数 (RESERVOIR_SIZE の約数)
+    size_t row_bytes;         // 1 ノードの符号のバイト数
+    unsigned char* codes;     // n x row_bytes
+    float* scale;             // STATE_INT8: n 個
+    float* codebook;          // STATE_PQ: pq_m x PQ_CENTROIDS x (R / pq_m)
+} NodeStateStore;
+
+const char* state_codec_name(StateCodec c) {
+    static const char* names[] = { "f32", "f16", "int8", "pq" };
+    return names[c];
+}
+
+// 全ノードを深さ優先で辿り、各ノードの状態で visit を呼ぶ。
+// 状態は親の状態から 1 ステップ更新して作る (深度ごとに 1 本の作業領域)
+typedef void (*NodeStateVisit)(void* ctx, long id, const float* h);
+
+static void node_state_walk(const void* src, NodeStateVisit visit, void* ctx) {
+    const TrieBackend* tb = (const TrieBackend*)src;
+    float h[MAX_DEPTH + 1][RESERVOIR_SIZE];
+    TrieRef node[MAX_DEPTH + 1];
+    int next_byte[MAX_DEPTH + 1];
+    int top = 0;
+    node[0] = tb->root(tb->impl);
+    next_byte[0] = 0;
+    memset(h[0], 0, sizeof(h[0]));
+    visit(ctx, tb->node_id(tb->impl, node[0]), h[0]);
+    while(top >= 0) {
+        TrieRef child;
+        int b = (next_byte[top] < MAX_CHILDREN)? tb->child_next(tb->impl, node[top], next_byte[top], &child) : -1;
+        if(b < 0 || top == MAX_DEPTH) {
+            top--;
+            continue;
+        }
+        next_byte[top] = b + 1;
+        memcpy(h[top + 1], h[top], sizeof(h[top]));
+        reservoir_step(tb->depth(tb->impl, node[top]), h[top + 1]);
+        top++;
+        node[top] = child;
+        next_byte[top] = 0;
+        visit(ctx, tb->node_id(tb->impl, child), h[top]);
+    }
+}
+
+// ---- PQ の学習 (部分空間ごとの k-means) ----
+typedef struct {
+    float* samples;       // cap x R
+    long cap;
+    long seen;
+    unsigned int rng;
+} PqTrainCtx;
+
+static unsigned int pq_rand(unsigned int* s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+// 学習用にノードの状態を一様に cap 個だけ残す (reservoir sampling)
+static void pq_collect_visit(void* p, long id, const float* h) {
+    (void)id;
+    PqTrainCtx* c = (PqTrainCtx*)p;
+    long slot = (c->seen < c->cap)? c->seen : (long)(pq_rand(&c->rng) % (unsigned long)(c->seen + 1));
+    if(slot < c->cap) memcpy(c->samples + slot * RESERVOIR_SIZE, h, sizeof(float) * RESERVOIR_SIZE);
+    c->seen++;
+}
+
+static float pq_dist2(const float* a, const float* b, int d) {
+    float s = 0.0f;
+    for(int i = 0; i < d; i++) {
+        float t = a[i] - b[i];
+        s += t * t;
+    }
+    return s;
+}
+
+static int pq_nearest(const float* cb, const float* x, int dsub) {
+    int best = 0;
+    float best_d = pq_dist2(cb, x, dsub);
+    for(int k = 1; k < PQ_CENTROIDS; k++) {
+        float d = pq_dist2(cb + k * dsub, x, dsub);
+        if(d < best_d) {
+            best_d = d;
+            best = k;
+        }
+    }
+    return best;
+}
+
+static void pq_train(float* codebook, int pq_m, const float* samples, long n, int iters, unsigned int seed) {
+    const int dsub = RESERVOIR_SIZE / pq_m;
+    float* sum = (float*)malloc(sizeof(float) * PQ_CENTROIDS * dsub);
+    long* cnt = (long*)malloc(sizeof(long) * PQ_CENTROIDS);
+    unsigned int rng = seed? seed : 1;
+    for(int m = 0; m < pq_m; m++) {
+        float* cb = codebook + (size_t)m * PQ_CENTROIDS * dsub;
+        // 初期値: ランダムな標本 (標本が足りなければ重複する)
+        for(int k = 0; k < PQ_CENTROIDS; k++) {
+            long i = (n > 0)? (long)(pq_rand(&rng) % (unsigned long)n) : 0;
+            if(n > 0) memcpy(cb + k * dsub, samples + i * RESERVOIR_SIZE + m * dsub, sizeof(float) * dsub);
+            else memset(cb + k * dsub, 0, sizeof(float) * dsub);
+        }
+        for(int it = 0; it < iters; it++) {
+            memset(sum, 0, sizeof(float) * PQ_CENTROIDS * dsub);
+            memset(cnt, 0, sizeof(long) * PQ_CENTROIDS);
+            for(long i = 0; i < n; i++) {
+                const float* x = samples + i * RESERVOIR_SIZE + m * dsub;
+                int k = pq_nearest(cb, x, dsub);
+                cnt[k]++;
+                for(int d = 0; d < dsub; d++) sum[k * dsub + d] += x[d];
+            }
+            for(int k = 0; k < PQ_CENTROIDS; k++) {
+                if(cnt[k] == 0) {
+                    // 空のクラスタは別の標本で置き直す
+                    long i = (n > 0)? (long)(pq_rand(&rng) % (unsigned long)n) : 0;
+                    if(n > 0) memcpy(cb + k * dsub, samples + i * RESERVOIR_SIZE + m * dsub, sizeof(float) * dsub);
+                    continue;
+                }
+                for(int d = 0; d < dsub; d++) cb[k * dsub + d] = sum[k * dsub + d] / (float)cnt[k];
+            }
+        }
+    }
+    free(cnt);
+    free(sum);
+}
+
+// ---- 符号化 ----
+static void node_state_encode(NodeStateStore* st, long id, const float* h) {
+    unsigned char* row = st->codes + (size_t)id * st->row_bytes;
+    switch(st->codec) {
+    case STATE_F32:
+        memcpy(row, h, sizeof(float) * RESERVOIR_SIZE);
+        break;
+    case STATE_F16: {
+        unsigned short* o = (unsigned short*)row;
+        for(int i = 0; i < RESERVOIR_SIZE; i++) o[i] = float_to_half(h[i]);
+        break;
+    }
+    case STATE_INT8: {
+        float max_abs = 0.0f;
+        for(int i = 0; i < RESERVOIR_SIZE; i++) if(fabsf(h[i]) > max_abs) max_abs = fabsf(h[i]);
+        float sc = (max_abs > 0.0f)? max_abs / 127.0f : 1.0f;
+        st->scale[id] = sc;
+        for(int i = 0; i < RESERVOIR_SIZE; i++) row[i] = (unsigned char)(signed char)lrintf(h[i] / sc);
+        break;
+    }
+    case STATE_PQ: {
+        const int dsub = RESERVOIR_SIZE / st->pq_m;
+        for(int m = 0; m < st->pq_m; m++) {
+            row[m] = (unsigned char)pq_nearest(st->codebook + (size_t)m * PQ_CENTROIDS * dsub, h + m * dsub, dsub);
+        }
+        break;
+    }
+    }
+}
+
+static void node_state_encode_visit(void* p, long id, const float* h) {
+    node_state_encode((NodeStateStore*)p, id, h);
+}
+
+void node_state_decode(const NodeStateStore* st, long id, float* out);
+
+// 保存済みの状態を id 順に visit に渡す (別形式への詰め直し用)
+static void node_state_store_walk(const void* src, NodeStateVisit visit, void* ctx) {
+    const NodeStateStore* from = (const NodeStateStore*)src;
+    float h[RESERVOIR_SIZE];
+    for(long id = 0; id < from->n; id++) {
+        node_state_decode(from, id, h);
+        visit(ctx, id, h);
+    }
+}
+
+// walk(src, ...) が列挙する n 個の状態を codec で保存する
+static int node_state_store_encode_all(NodeStateStore* st, long n,
+                                       void (*walk)(const void*, NodeStateVisit, void*), const void* src,
+                                       StateCodec codec, int pq_m, long train_samples) {
+    memset(st, 0, sizeof(*st));
+    st->codec = codec;
+    st->n = n;
+    switch(codec) {
+    case STATE_F32:  st->row_bytes = sizeof(float) * RESERVOIR_SIZE; break;
+    case STATE_F16:  st->row_bytes = sizeof(unsigned short) * RESERVOIR_SIZE; break;
+    case STATE_INT8: st->row_bytes = RESERVOIR_SIZE; break;
+    case STATE_PQ:
+        if(pq_m <= 0 || RESERVOIR_SIZE % pq_m != 0) return -1;
+        st->pq_m = pq_m;
+        st->row_bytes = (size_t)pq_m;
+        break;
+    }
+    st->codes = (unsigned char*)malloc(st->row_bytes * st->n);
+    if(codec == STATE_INT8) st->scale = (float*)malloc(sizeof(float) * st->n);
+    if(codec == STATE_PQ) {
+        PqTrainCtx tc;
+        tc.cap = (train_samples > 0)? train_samples : 16384;
+        tc.samples = (float*)malloc(sizeof(float) * RESERVOIR_SIZE * tc.cap);
+        tc.seen = 0;
+        tc.rng = 2463534242u;
+        walk(src, pq_collect_visit, &tc);
+        long n_train = (tc.seen < tc.cap)? tc.seen : tc.cap;
+        st->codebook = (float*)malloc(sizeof(float) * PQ_CENTROIDS * RESERVOIR_SIZE);
+        pq_train(st->codebook, pq_m, tc.samples, n_train, 10, 12345u);
+        free(tc.samples);
+    }
+    walk(src, node_state_encode_visit, st);
+    return 0;
+}
+
+// tb の全ノードの状態を codec で保存する。pq_m は STATE_PQ のときだけ使い、
+// 学習には最大 train_samples 個のノード状態を使う。成功で 0
+int node_state_store_build(NodeStateStore* st, const TrieBackend* tb, StateCodec codec,
+                           int pq_m, long train_samples) {
+    return node_state_store_encode_all(st, tb->node_count(tb->impl), node_state_walk, tb,
+                                       codec, pq_m, train_samples);
+}
+
+// 保存済みの状態 (ふつうは STATE_F32) を別の形式で詰め直す。
+// ノイズで状態が毎回変わるので、形式どうしの比較は同じ元から作る
+int node_state_store_recode(NodeStateStore* st, const NodeStateStore* from, StateCodec codec,
+                            int pq_m, long train_samples) {
+    return node_state_store_encode_all(st, from->n, node_state_store_walk, from,
+                                       codec, pq_m, train_samples);
+}
+
+void node_state_store_free(NodeStateStore* st) {
+    free(st->codes);
+    free(st->scale);
+    free(st->codebook);
+    memset(st, 0, sizeof(*st));
+}
+
+size_t node_state_store_bytes(const NodeStateStore* st) {
+    size_t b = st->row_bytes * st->n;
+    if(st->scale) b += sizeof(float) * st->n;
+    if(st->codebook) b += sizeof(float) * PQ_CENTROIDS * RESERVOIR_SIZE;
+    return b;
+}
+
+// ノード id の状態を fp32 に戻して out に書く
+void node_state_decode(const NodeStateStore* st, long id, float* out) {
+    const unsigned char* row = st->codes + (size_t)id * st->row_bytes;
+    int i = 0;
+    switch(st->codec) {
+    case STATE_F32:
+        memcpy(out, row, sizeof(float) * RESERVOIR_SIZE);
+        break;
+    case STATE_F16: {
+        const unsigned short* h = (const unsigned short*)row;
+#if defined(__F16C__) && defined(__AVX__)
+        for(; i + 8 <= RESERVOIR_SIZE; i += 8) {
+            _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h + i))));
+        }
+#endif
+        for(; i < RESERVOIR_SIZE; i++) out[i] = half_to_float(h[i]);
+        break;
+    }
+    case STATE_INT8: {
+        const signed char* q = (const signed char*)row;
+        const float sc = st->scale[id];
+#ifdef __AVX2__
+        const __m256 vs = _mm256_set1_ps(sc);
+        for(; i + 8 <= RESERVOIR_SIZE; i += 8) {
+            __m256i v = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(q + i)));
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), vs));
+        }
+#endif
+        for(; i < RESERVOIR_SIZE; i++) out[i] = sc * (float)q[i];
+        break;
+    }
+    case STATE_PQ: {
+        const int dsub = RESERVOIR_SIZE / st->pq_m;
+        for(int m = 0; m < st->pq_m; m++) {
+            const float* c = st->codebook + ((size_t)m * PQ_CENTROIDS + row[m]) * dsub;
+            memcpy(out + m * dsub, c, sizeof(float) * dsub);
+        }
+        break;
+    }
+    }
+}
+
+// ノード id の状態を復号してリードアウトする
+void node_state_readout(const NodeStateStore* st, long id, const float* W, float* out_probs) {
+    float h[RESERVOIR_SIZE];
+    node_state_decode(st, id, h);
+    readout_forward_w(W, h, out_probs);
+}
+
+// key を辿れる所まで辿ったノードの状態を out に書く (forward の代わり)
+void node_state_lookup(const NodeStateStore* st, const TrieBackend* tb, const char* key, float* out) {
+    TrieRef cur = tb->root(tb->impl);
+    for(int i = 0; key[i] != '\0' && i < MAX_DEPTH; i++) {
+        TrieRef next = tb->step(tb->impl, cur, (unsigned char)key[i]);
+        if(next == TRIE_REF_NONE) break;
+        cur = next;
+    }
+    node_state_decode(st, tb->node_id(tb->impl, cur), out);
+}
+
+// ---- PQ の符号のままリードアウト ----
+//   lut[(m * PQ_CENTROIDS + k) * OUT_DIM + o] = W[o] の部分空間 m と代表 k の内積
+//   z[o] = sum_m lut[m][code_m][o]
+typedef struct {
+    int pq_m;
+    float* lut;
+} PqReadoutLut;
+
+void pq_readout_lut_build(PqReadoutLut* lut, const NodeStateStore* st, const float* W) {
+    const int dsub = RESERVOIR_SIZE / st->pq_m;
+    lut->pq_m = st->pq_m;
+    lut->lut = (float*)malloc(sizeof(float) * st->pq_m * PQ_CENTROIDS * OUT_DIM);
+    for(int m = 0; m < st->pq_m; m++) {
+        for(int k = 0; k < PQ_CENTROIDS; k++) {
+            const float* c = st->codebook + ((size_t)m * PQ_CENTROIDS + k) * dsub;
+            for(int o = 0; o < OUT_DIM; o++) {
+                const float* w = W + o * RESERVOIR_SIZE + m * dsub;
+                float z = 0.0f;
+                for(int d = 0; d < dsub; d++) z += w[d] * c[d];
+                lut->lut[(m * PQ_CENTROIDS + k) * OUT_DIM + o] = z;
+            }
+        }
+    }
+}
+
+void pq_readout_lut_free(PqReadoutLut* lut) {
+    free(lut->lut);
+    lut->lut = NULL;
+}
+
+void pq_readout_forward(const PqReadoutLut* lut, const NodeStateStore* st, long id, float* out_probs) {
+    PROF_BEGIN(t_ro);
+    const unsigned char* code = st->codes + (size_t)id * st->row_bytes;
+    float z[OUT_DIM] = {0};
+    for(int m = 0; m < lut->pq_m; m++) {
+        const float* row = lut->lut + (m * PQ_CENTROIDS + code[m]) * OUT_DIM;
+        for(int o = 0; o < OUT_DIM; o++) z[o] += row[o];
+    }
+    float sum_exp = 0.0f;
+    for(int o = 0; o < OUT_DIM; o++) {
+        out_probs[o] = expf(z[o]);
+        sum_exp += out_probs[o];
+    }
+    for(int o = 0; o < OUT_DIM; o++) out_probs[o] /= sum_exp;
+    PROF_END(PROF_READOUT, t_ro);
+}
+
+// =========================================================
+// 有界のプレフィックス状態キャッシュ (node_id -> 状態, CLOCK 置換)
+//   全ノードの状態を持てない場合に、よく通るプレフィックスの状態だけを
+//   固定サイズのメモリに残す。trie_backend_forward_cached は辿った経路の
+//   最も深いキャッシュ済みの祖先から reservoir_step を再開し、
+//   計算したノードの状態をキャッシュに入れる。
+//   複数スレッドから使えるよう node_id のハッシュでシャードに分け、
+//   シャードごとに mutex, 線形探索の索引, CLOCK の針を持つ。
+// =========================================================
+#define PREFIX_CACHE_SHARDS 64
+#define PREFIX_CACHE_PINNED 2
+
+typedef struct {
+    pthread_mutex_t lock;
+    int slots;                 // このシャードの容量
+    int used;
+    int hand;                  // CLOCK の針
+    int index_mask;            // 索引の大きさ - 1 (2 のべき乗, 容量の 2 倍以上)
+    int* index;                // node_id のハッシュ -> スロット (-1 = 空)
+    long* slot_id;             // スロットの node_id
+    unsigned char* ref;        // 参照ビット (PREFIX_CACHE_PINNED なら追い出さない)
+    int pinned;                // 固定中のスロット数 (slots / 2 まで)
+    float* state;              // slots x RESERVOIR_SIZE
+} PrefixCacheShard;
+
+typedef struct {
+    PrefixCacheShard shard[PREFIX_CACHE_SHARDS];
+    long capacity;
+    _Atomic long forwards;       // trie_backend_forward_cached の呼び出し数
+    _Atomic long forward_hits;   // 祖先の状態を 1 つ以上使えた呼び出し数
+    _Atomic long probes;         // 索引の検索回数
+    _Atomic long probe_hits;
+    _Atomic long steps_saved;    // キャッシュで省いた reservoir_step
+    _Atomic long steps_computed;
+    _Atomic long inserts;
+    _Atomic long evictions;
+} PrefixStateCache;
+
+typedef struct {
+    long capacity, resident, pinned;
+    long forwards, forward_hits, probes, probe_hits;
+    long steps_saved, steps_computed, inserts, evictions;
+    double forward_hit_rate;     // forward_hits / forwards
+    double step_saving;          // steps_saved / (steps_saved + steps_computed)
+} PrefixCacheMetrics;
+
+static inline unsigned long long prefix_cache_hash(long id) {
+    unsigned long long x = (unsigned long long)id * 0x9E3779B97F4A7C15ull;
+    return x ^ (x >> 29);
+}
+
+// 容量 capacity 個 (全シャードの合計) の状態を持つキャッシュを作る
+void prefix_cache_init(PrefixStateCache* c, long capacity) {
+    memset(c, 0, sizeof(*c));
+    if(capacity < PREFIX_CACHE_SHARDS) capacity = PREFIX_CACHE_SHARDS;
+    c->capacity = capacity;
+    for(int s = 0; s < PREFIX_CACHE_SHARDS; s++) {
+        PrefixCacheShard* sh = &c->shard[s];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->slots = (int)(capacity / PREFIX_CACHE_SHARDS + (s < capacity % PREFIX_CACHE_SHARDS));
+        int isz = 1;
+        while(isz < sh->slots * 2) isz <<= 1;
+        sh->index_mask = isz - 1;
+        sh->index = (int*)malloc(sizeof(int) * isz);
+        for(int i = 0; i < isz; i++) sh->index[i] = -1;
+        sh->slot_id = (long*)malloc(sizeof(long) * sh->slots);
+        sh->ref = (unsigned char*)calloc(sh->slots, 1);
+        sh->state = (float*)malloc(sizeof(float) * RESERVOIR_SIZE * sh->slots);
+    }
+}
+
+void prefix_cache_free(PrefixStateCache* c) {
+    for(int s = 0; s < PREFIX_CACHE_SHARDS; s++) {
+        PrefixCacheShard* sh = &c->shard[s];
+        pthread_mutex_destroy(&sh->lock);
+        free(sh->index);
+        free(sh->slot_id);
+        free(sh->ref);
+        free(sh->state);
+    }
+    memset(c, 0, sizeof(*c));
+}
+
+size_t prefix_cache_bytes(const PrefixStateCache* c) {
+    size_t b = sizeof(*c);
+    for(int s = 0; s < PREFIX_CACHE_SHARDS; s++) {
+        const PrefixCacheShard* sh = &c->shard[s];
+        b += sizeof(int) * (sh->index_mask + 1)
+           + (sizeof(long) + 1 + sizeof(float) * RESERVOIR_SIZE) * (size_t)sh->slots;
+    }
+    return b;
+}
+
+// 索引で id の位置を探す (無ければ空きの位置)。シャードの lock を持って呼ぶ
+static int prefix_cache_find(const PrefixCacheShard* sh, long id, unsigned long long h) {
+    int i = (int)(h >> 6) & sh->index_mask;
+    while(sh->index[i] >= 0 && sh->slot_id[sh->index[i]] != id) i = (i + 1) & sh->index_mask;
+    return i;
+}
+
+// 線形探索の索引から位置 i を消し、後ろの要素を詰め直す (墓標を残さない)
+static void prefix_cache_unlink(PrefixCacheShard* sh, int i) {
+    int j = i;
+    for(;;) {
+        sh->index[i] = -1;
+        for(;;) {
+            j = (j + 1) & sh->index_mask;
+            if(sh->index[j] < 0) return;
+            int home = (int)(prefix_cache_hash(sh->slot_id[sh->index[j]]) >> 6) & sh->index_mask;
+            // home が (i, j] の外にあれば j は i に移せる
+            if(i <= j? (home <= i || home > j) : (home <= i && home > j)) break;
+        }
+        sh->index[i] = sh->index[j];
+        i = j;
+    }
+}
+
+// id の状態があれば out に写して 1 を返す
+int prefix_cache_lookup(PrefixStateCache* c, long id, float* out) {
+    unsigned long long h = prefix_cache_hash(id);
+    PrefixCacheShard* sh = &c->shard[h & (PREFIX_CACHE_SHARDS - 1)];
+    atomic_fetch_add_explicit(&c->probes, 1, memory_order_relaxed);
+    pthread_mutex_lock(&sh->lock);
+    int slot = sh->index[prefix_cache_find(sh, id, h)];
+    if(slot >= 0) {
+        if(sh->ref[slot] != PREFIX_CACHE_PINNED) sh->ref[slot] = 1;
+        memcpy(out, sh->state + (size_t)slot * RESERVOIR_SIZE, sizeof(float) * RESERVOIR_SIZE);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    if(slot >= 0) atomic_fetch_add_explicit(&c->probe_hits, 1, memory_order_relaxed);
+    return slot >= 0;
+}
+
+// id の状態を入れる (既にあれば上書き)。満杯なら CLOCK で 1 つ追い出す。
+// pin なら追い出されないよう固定する (シャードの半分まで。超えたら通常の挿入)
+static void prefix_cache_put(PrefixStateCache* c, long id, const float* state, int pin) {
+    unsigned long long h = prefix_cache_hash(id);
+    PrefixCacheShard* sh = &c->shard[h & (PREFIX_CACHE_SHARDS - 1)];
+    int evicted = 0;
+    pthread_mutex_lock(&sh->lock);
+    int pos = prefix_cache_find(sh, id, h);
+    int slot = sh->index[pos];
+    if(slot < 0) {
+        if(sh->used < sh->slots) {
+            slot = sh->used++;
+        } else {
+            // 参照ビットが立っていれば落として次へ, 落ちていれば追い出す (固定中は飛ばす)
+            while(sh->ref[sh->hand]) {
+                if(sh->ref[sh->hand] != PREFIX_CACHE_PINNED) sh->ref[sh->hand] = 0;
+                sh->hand = (sh->hand + 1) % sh->slots;
+            }
+            slot = sh->hand;
+            sh->hand = (sh->hand + 1) % sh->slots;
+            long old = sh->slot_id[slot];
+            prefix_cache_unlink(sh, prefix_cache_find(sh, old, prefix_cache_hash(old)));
+            pos = prefix_cache_find(sh, id, h);
+            evicted = 1;
+        }
+        sh->slot_id[slot] = id;
+        sh->index[pos] = slot;
+        sh->ref[slot] = 0;   // 入れただけでは参照扱いにしない (一度きりの経路を早く追い出す)
+    }
+    if(pin && sh->ref[slot] != PREFIX_CACHE_PINNED && sh->pinned < sh->slots / 2) {
+        sh->ref[slot] = PREFIX_CACHE_PINNED;
+        sh->pinned++;
+    }
+    memcpy(sh->state + (size_t)slot * RESERVOIR_SIZE, state, sizeof(float) * RESERVOIR_SIZE);
+    pthread_mutex_unlock(&sh->lock);
+    atomic_fetch_add_explicit(&c->inserts, 1, memory_order_relaxed);
+    if(evicted) atomic_fetch_add_explicit(&c->evictions, 1, memory_order_relaxed);
+}
+
+void prefix_cache_insert(PrefixStateCache* c, long id, const float* state) {
+    prefix_cache_put(c, id, state, 0);
+}
+
+// id の状態を入れて固定する。固定できる数を超えたら 0 を返す (状態は普通に入る)
+int prefix_cache_pin(PrefixStateCache* c, long id, const float* state) {
+    prefix_cache_put(c, id, state, 1);
+    unsigned long long h = prefix_cache_hash(id);
+    PrefixCacheShard* sh = &c->shard[h & (PREFIX_CACHE_SHARDS - 1)];
+    pthread_mutex_lock(&sh->lock);
+    int slot = sh->index[prefix_cache_find(sh, id, h)];
+    int pinned = (slot >= 0 && sh->ref[slot] == PREFIX_CACHE_PINNED);
+    pthread_mutex_unlock(&sh->lock);
+    return pinned;
+}
+
+// すべての固定を外す (状態は残り, 以後は CLOCK で追い出される)
+void prefix_cache_unpin_all(PrefixStateCache* c) {
+    for(int s = 0; s < PREFIX_CACHE_SHARDS; s++) {
+        PrefixCacheShard* sh = &c->shard[s];
+        pthread_mutex_lock(&sh->lock);
+        for(int i = 0; i < sh->used; i++) {
+            if(sh->ref[i] == PREFIX_CACHE_PINNED) sh->ref[i] = 1;
+        }
+        sh->pinned = 0;
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+// trie_backend_forward と同じ結果 (ノイズを除く) を、キャッシュ済みの最も深い祖先から
+// 計算し直して得る。根 (状態 0) はキャッシュしない
+void trie_backend_forward_cached(const TrieBackend* tb, PrefixStateCache* c, const char* input, float* h_state) {
+    TrieRef path[MAX_DEPTH + 1];
+    double t_span = trace_span_begin();
+    PROF_BEGIN(t_walk);
+    int d = trie_backend_path(tb, input, path);
+    PROF_END(PROF_TRIE_WALK, t_walk);
+
+    int start = 0;
+    for(int k = d; k > 0; k--) {
+        if(prefix_cache_lookup(c, tb->node_id(tb->impl, path[k]), h_state)) {
+            start = k;
+            break;
+        }
+    }
+    for(int k = start; k < d; k++) {
+        reservoir_step(tb->depth(tb->impl, path[k]), h_state);
+        prefix_cache_insert(c, tb->node_id(tb->impl, path[k + 1]), h_state);
+    }
+    atomic_fetch_add_explicit(&c->forwards, 1, memory_order_relaxed);
+    if(start > 0) atomic_fetch_add_explicit(&c->forward_hits, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->steps_saved, start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->steps_computed, d - start, memory_order_relaxed);
+    trace_span_end2("trie_reservoir_forward", t_span, "steps", d - start, "resumed_at", start);
+}
+
+void trie_reservoir_forward_cached(TrieNode* root, PrefixStateCache* c, const char* input, float* h_state) {
+    TrieBackend tb;
+    trie_backend_pointer(&tb, root);
+    trie_backend_forward_cached(&tb, c, input, h_state);
+}
+
+void prefix_cache_metrics(PrefixStateCache* c, PrefixCacheMetrics* m) {
+    memset(m, 0, sizeof(*m));
+    m->capacity = c->capacity;
+    for(int s = 0; s < PREFIX_CACHE_SHARDS; s++) {
+        pthread_mutex_lock(&c->shard[s].lock);
+        m->resident += c->shard[s].used;
+        m->pinned += c->shard[s].pinned;
+        pthread_mutex_unlock(&c->shard[s].lock);
+    }
+    m->forwards = atomic_load(&c->forwards);
+    m->forward_hits = atomic_load(&c->forward_hits);
+    m->probes = atomic_load(&c->probes);
+    m->probe_hits = atomic_load(&c->probe_hits);
+    m->steps_saved = atomic_load(&c->steps_saved);
+    m->steps_computed = atomic_load(&c->steps_computed);
+    m->inserts = atomic_load(&c->inserts);
+    m->evictions = atomic_load(&c->evictions);
+    m->forward_hit_rate = m->forwards? (double)m->forward_hits / m->forwards : 0.0;
+    long steps = m->steps_saved + m->steps_computed;
+    m->step_saving = steps? (double)m->steps_saved / steps : 0.0;
+}
+
+void prefix_cache_reset_metrics(PrefixStateCache* c) {
+    atomic_store(&c->forwards, 0);
+    atomic_store(&c->forward_hits, 0);
+    atomic_store(&c->probes, 0);
+    atomic_store(&c->probe_hits, 0);
+    atomic_store(&c->steps_saved, 0);
+    atomic_store(&c->steps_computed, 0);
+    atomic_store(&c->inserts, 0);
+    atomic_store(&c->evictions, 0);
+}
+
+// =========================================================
+// 疎なランダム射影 (Achlioptas / very sparse JL)
+//   RESERVOIR_SIZE 次元の状態を k 次元に落とす。成分は確率 1/(2s) で +1,
+//   1/(2s) で -1, 残りは 0 で、全体を sqrt(s / k) 倍する
+//   (s = 1: 密な ±1, s = 3: Achlioptas, s = sqrt(R): very sparse)。
+//   行列は (seed, 行, 列) のハッシュで決まるので、ファイルに残すのは seed だけでよい。
+//   メモリ上には rp_init が非零の位置と符号を行ごとに 8 の倍数へ詰め物して展開し
+//   (非零 1 つあたり 8 バイト, rp_bytes)、rp_project は gather (AVX-512 / AVX2) で
+//   非零の列だけ積和する。射影のたびに成分をハッシュから作り直すより速いため。
+//   射影した状態はリードアウト (rp_readout_*) や HNSW (hnsw_build_leaves) の入力にできる
+// =========================================================
+typedef struct {
+    int k;                 // 射影後の次元 (<= RESERVOIR_SIZE)
+    int s;                 // 疎さ (非零の割合は 1/s)
+    unsigned long long seed;
+    float scale;           // sqrt(s / k)
+    int* row_ptr;          // k + 1 (各行は 8 の倍数の長さ)
+    int* idx;              // 非零の列 (詰め物は 0)
+    float* sign;           // +1 / -1 (詰め物は 0)
+} RandomProjection;
+
+static inline unsigned long long rp_hash(unsigned long long x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// 行 j, 列 i の成分の符号 (+1 / -1 / 0)
+static inline int rp_entry(unsigned long long seed, int s, int j, int i) {
+    unsigned long long u = rp_hash(seed ^ rp_hash((unsigned long long)j * RESERVOIR_SIZE + i)) % (unsigned long long)(2 * s);
+    return (u == 0)? 1 : (u == 1)? -1 : 0;
+}
+
+// s <= 0 なら very sparse (s = sqrt(RESERVOIR_SIZE))
+void rp_init(RandomProjection* rp, int k, int s, unsigned long long seed) {
+    memset(rp, 0, sizeof(*rp));
+    if(k < 1) k = 1;
+    if(k > RESERVOIR_SIZE) k = RESERVOIR_SIZE;
+    if(s <= 0) s = (int)lrint(sqrt((double)RESERVOIR_SIZE));
+    if(s < 1) s = 1;
+    rp->k = k;
+    rp->s = s;
+    rp->seed = seed;
+    rp->scale = sqrtf((float)s / (float)k);
+    rp->row_ptr = (int*)malloc(sizeof(int) * (k + 1));
+    int total = 0;
+    for(int j = 0; j < k; j++) {
+        int nnz = 0;
+        for(int i = 0; i < RESERVOIR_SIZE; i++) nnz += (rp_entry(seed, s, j, i) != 0);
+        rp->row_ptr[j] = total;
+        total += (nnz + 7) & ~7;
+    }
+    rp->row_ptr[k] = total;
+    rp->idx = (int*)calloc(total + 1, sizeof(int));
+    rp->sign = (float*)calloc(total + 1, sizeof(float));
+    for(int j = 0; j < k; j++) {
+        int p = rp->row_ptr[j];
+        for(int i = 0; i < RESERVOIR_SIZE; i++) {
+            int e = rp_entry(seed, s, j, i);
+            if(e == 0) continue;
+            rp->idx[p] = i;
+            rp->sign[p++] = (float)e;
+        }
+    }
+}
+
+void rp_free(RandomProjection* rp) {
+    free(rp->row_ptr);
+    free(rp->idx);
+    free(rp->sign);
+    memset(rp, 0, sizeof(*rp));
+}
+
+size_t rp_bytes(const RandomProjection* rp) {
+    return sizeof(*rp) + sizeof(int) * (rp->k + 1) + (sizeof(int) + sizeof(float)) * (size_t)rp->row_ptr[rp->k];
+}
+
+// z (k 次元) = R h
+void rp_project(const RandomProjection* rp, const float* h, float* z) {
+    for(int j = 0; j < rp->k; j++) {
+        int p = rp->row_ptr[j];
+        const int end = rp->row_ptr[j + 1];
+        float sum = 0.0f;
+#if defined(__AVX512F__)
+        __m512 acc = _mm512_setzero_ps();
+        for(; p + 16 <= end; p += 16) {
+            __m512 x = _mm512_i32gather_ps(_mm512_loadu_si512((const void*)(rp->idx + p)), h, 4);
+            acc = _mm512_fmadd_ps(x, _mm512_loadu_ps(rp->sign + p), acc);
+        }
+        sum = _mm512_reduce_add_ps(acc);
+#endif
+#if defined(__AVX2__)
+        __m256 acc8 = _mm256_setzero_ps();
+        for(; p + 8 <= end; p += 8) {
+            __m256 x = _mm256_i32gather_ps(h, _mm256_loadu_si256((const __m256i*)(rp->idx + p)), 4);
+#ifdef __FMA__
+            acc8 = _mm256_fmadd_ps(x, _mm256_loadu_ps(rp->sign + p), acc8);
+#else
+            acc8 = _mm256_add_ps(acc8, _mm256_mul_ps(x, _mm256_loadu_ps(rp->sign + p)));
+#endif
+        }
+        __m128 s4 = _mm_add_ps(_mm256_castps256_ps128(acc8), _mm256_extractf128_ps(acc8, 1));
+        s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+        s4 = _mm_add_ss(s4, _mm_movehdup_ps(s4));
+        sum += _mm_cvtss_f32(s4);
+#endif
+        for(; p < end; p++) sum += rp->sign[p] * h[rp->idx[p]];
+        z[j] = sum * rp->scale;
+    }
+}
+
+// 射影した状態 (k 次元) を入力にするリードアウト (readout_forward_w と同じ全結合 + softmax)。
+// W は OUT_DIM x k
+void rp_readout_forward(const float* W, int k, const float* z, float* out_probs) {
+    PROF_BEGIN(t_ro);
+    float sum_exp = 0.0f;
+    for(int i = 0; i < OUT_DIM; i++) {
+        float a = 0.0f;
+        for(int j = 0; j < k; j++) a += W[i * k + j] * z[j];
+        out_probs[i] = expf(a);
+        sum_exp += out_probs[i];
+    }
+    for(int i = 0; i < OUT_DIM; i++) out_probs[i] /= sum_exp;
+    PROF_END(PROF_READOUT, t_ro);
+}
+
+void rp_readout_train(float* W, int k, const float* z, int gold_index, float lr) {
+    float probs[OUT_DIM];
+    rp_readout_forward(W, k, z, probs);
+    for(int i = 0; i < OUT_DIM; i++) {
+        float grad = probs[i] - (i == gold_index? 1.0f : 0.0f);
+        for(int j = 0; j < k; j++) W[i * k + j] -= lr * grad * z[j];
+    }
+}
+
+// =========================================================
+// 状態ベクトルの近似最近傍探索 (HNSW)
+//   葉 (登録 key) の最終状態を埋め込みとして、問い合わせ状態に近い語彙を引く。
+//   ランダム射影を渡すと射影後の k 次元で索引を作る (問い合わせも rp_project してから引く)
+//   - 距離は二乗ユークリッド (hnsw_l2sq, AVX-512 / AVX2+FMA / スカラー)
+//   - 層 0 の近傍は最大 2M, 上位層は M。近傍は Malkov らの選択ヒューリスティックで選ぶ
+//   - hnsw_build は層を乱数で先に決めてから threads 本で並列に挿入する
+//     (近傍リストはノード id でストライプした mutex, 入口の更新は全体の mutex)
+//   - 精度と速度は構築時の M / ef_construction と、検索時の ef で調整する
+//   - hnsw_save の形式はセクションを 64 バイト境界に並べた平坦なファイルで、
+//     hnsw_load は mmap してそのまま検索する (読み込んだ索引は検索専用。
+//     入口・層・近傍 id は読み込み時に範囲を検査する)
+//   - hnsw_search の作業領域はスレッドごとに持ち、hnsw_thread_release で解放する
+// =========================================================
+#define HNSW_MAX_LEVEL 16
+#define HNSW_LOCK_STRIPES 4096
+
+typedef struct {
+    int dim;               // ベクトルの次元 (RESERVOIR_SIZE, 射影したなら k)
+    int M;                 // 上位層の最大近傍数 (層 0 は 2M)
+    int ef_construction;
+    int max_level;         // 入口の層 (空なら -1)
+    long n;
+    long entry;            // 入口 (空なら -1)
+    float* vectors;        // n x dim
+    long* labels;          // 各ベクトルの名前 (hnsw_build_leaves では node_id)
+    int* levels;
+    int* link0;            // n x (1 + 2M): [近傍数, 近傍 id...]
+    long* upper_off;       // 上位層の近傍リストの先頭 (upper の添字, 層 1 が先頭), -1 = 無し
+    int* upper;            // 層ごとに (1 + M) 個
+    long upper_used;
+    pthread_mutex_t* locks;  // ストライプ (構築中のみ)
+    pthread_mutex_t global;
+    void* map;             // hnsw_load の mmap 領域 (NULL ならヒープ)
+    size_t map_bytes;
+} Hnsw;
+
+typedef struct {
+    float d;
+    int id;
+} HnswCand;
+
+typedef struct {
+    HnswCand* v;
+    int n, cap;
+} HnswHeap;
+
+// 二乗ユークリッド距離
+static float hnsw_l2sq(const float* a, const float* b, int n) {
+    int j = 0;
+    float sum = 0.0f;
+#ifdef __AVX512F__
+    __m512 acc = _mm512_setzero_ps();
+    for(; j + 16 <= n; j += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + j), _mm512_loadu_ps(b + j));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    sum = _mm512_reduce_add_ps(acc);
+#elif defined(__AVX__)
+    __m256 acc = _mm256_setzero_ps();
+    for(; j + 8 <= n; j += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + j), _mm256_loadu_ps(b + j));
+#ifdef __FMA__
+        acc = _mm256_fmadd_ps(d, d, acc);
+#else
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(d, d));
+#endif
+    }
+    __m128 s4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+    s4 = _mm_add_ss(s4, _mm_movehdup_ps(s4));
+    sum = _mm_cvtss_f32(s4);
+#endif
+    for(; j < n; j++) {
+        float d = a[j] - b[j];
+        sum += d * d;
+    }
+    return sum;
+}
+
+// ---- 二分ヒープ (max_heap なら d の最大が先頭) ----
+static void hnsw_heap_push(HnswHeap* h, HnswCand c, int max_heap) {
+    if(h->n == h->cap) {
+        h->cap = h->cap? h->cap * 2 : 64;
+        h->v = (HnswCand*)realloc(h->v, sizeof(HnswCand) * h->cap);
+    }
+    int i = h->n++;
+    h->v[i] = c;
+    while(i > 0) {
+        int p = (i - 1) / 2;
+        if(max_heap? h->v[p].d >= h->v[i].d : h->v[p].d <= h->v[i].d) break;
+        HnswCand t = h->v[p];
+        h->v[p] = h->v[i];
+        h->v[i] = t;
+        i = p;
+    }
+}
+
+static HnswCand hnsw_heap_pop(HnswHeap* h, int max_heap) {
+    HnswCand top = h->v[0];
+    h->v[0] = h->v[--h->n];
+    int i = 0;
+    for(;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if(l < h->n && (max_heap? h->v[l].d > h->v[m].d : h->v[l].d < h->v[m].d)) m = l;
+        if(r < h->n && (max_heap? h->v[r].d > h->v[m].d : h->v[r].d < h->v[m].d)) m = r;
+        if(m == i) break;
+        HnswCand t = h->v[i];
+        h->v[i] = h->v[m];
+        h->v[m] = t;
+        i = m;
+    }
+    return top;
+}
+
+// ---- 訪問済みの印 (スレッドごと, 世代番号で毎回の消去を省く) ----
+static _Thread_local unsigned* hnsw_visit_tag = NULL;
+static _Thread_local long hnsw_visit_cap = 0;
+static _Thread_local unsigned hnsw_visit_epoch = 0;
+
+static unsigned hnsw_visit_begin(long n) {
+    if(hnsw_visit_cap < n) {
+        free(hnsw_visit_tag);
+        hnsw_visit_tag = (unsigned*)calloc(n, sizeof(unsigned));
+        hnsw_visit_cap = n;
+        hnsw_visit_epoch = 0;
+    }
+    if(++hnsw_visit_epoch == 0) {
+        memset(hnsw_visit_tag, 0, sizeof(unsigned) * hnsw_visit_cap);
+        hnsw_visit_epoch = 1;
+    }
+    return hnsw_visit_epoch;
+}
+
+static void hnsw_visit_release(void) {
+    free(hnsw_visit_tag);
+    hnsw_visit_tag = NULL;
+    hnsw_visit_cap = 0;
+}
+
+// hnsw_search の作業領域 (スレッドごとに使い回す。hnsw_thread_release で解放)
+static _Thread_local HnswHeap hnsw_search_res, hnsw_search_cand;
+
+static inline int* hnsw_links(const Hnsw* ix, long id, int layer) {
+    if(layer == 0) return ix->link0 + (size_t)id * (1 + 2 * ix->M);
+    return ix->upper + ix->upper_off[id] + (size_t)(layer - 1) * (1 + ix->M);
+}
+
+static inline const float* hnsw_vec(const Hnsw* ix, long id) {
+    return ix->vectors + (size_t)id * ix->dim;
+}
+
+// 近傍リストを buf に写す (構築中はストライプの lock を取る)。戻り値は近傍数
+static int hnsw_copy_links(const Hnsw* ix, long id, int layer, int* buf) {
+    if(ix->locks) pthread_mutex_lock(&ix->locks[id % HNSW_LOCK_STRIPES]);
+    const int* l = hnsw_links(ix, id, layer);
+    int cnt = l[0];
+    memcpy(buf, l + 1, sizeof(int) * cnt);
+    if(ix->locks) pthread_mutex_unlock(&ix->locks[id % HNSW_LOCK_STRIPES]);
+    return cnt;
+}
+
+// 層 layer で ep から貪欲に辿り、最も近い 1 点を返す
+static long hnsw_greedy(const Hnsw* ix, const float* q, long ep, float* ep_d, int layer) {
+    int buf[1 + 2 * 64];
+    int* nb = (ix->M <= 64)? buf : (int*)malloc(sizeof(int) * (1 + 2 * ix->M));
+    long cur = ep;
+    float cur_d = *ep_d;
+    for(int changed = 1; changed; ) {
+        changed = 0;
+        int cnt = hnsw_copy_links(ix, cur, layer, nb);
+        for(int i = 0; i < cnt; i++) {
+            float d = hnsw_l2sq(q, hnsw_vec(ix, nb[i]), ix->dim);
+            if(d < cur_d) {
+                cur_d = d;
+                cur = nb[i];
+                changed = 1;
+            }
+        }
+    }
+    if(nb != buf) free(nb);
+    *ep_d = cur_d;
+    return cur;
+}
+
+// 層 layer で ep から幅 ef の探索をし、近い順に最大 ef 点を res (最大ヒープ) に残す
+static void hnsw_search_layer(const Hnsw* ix, const float* q, long ep, float ep_d, int ef, int layer,
+                              HnswHeap* res, HnswHeap* cand) {
+    int buf[1 + 2 * 64];
+    int* nb = (ix->M <= 64)? buf : (int*)malloc(sizeof(int) * (1 + 2 * ix->M));
+    unsigned tag = hnsw_visit_begin(ix->n);
+    res->n = 0;
+    cand->n = 0;
+    hnsw_visit_tag[ep] = tag;
+    hnsw_heap_push(res, (HnswCand){ ep_d, (int)ep }, 1);
+    hnsw_heap_push(cand, (HnswCand){ ep_d, (int)ep }, 0);
+    while(cand->n > 0) {
+        HnswCand c = hnsw_heap_pop(cand, 0);
+        if(c.d > res->v[0].d && res->n >= ef) break;
+        int cnt = hnsw_copy_links(ix, c.id, layer, nb);
+        for(int i = 0; i < cnt; i++) {
+            int e = nb[i];
+            if(hnsw_visit_tag[e] == tag) continue;
+            hnsw_visit_tag[e] = tag;
+            float d = hnsw_l2sq(q, hnsw_vec(ix, e), ix->dim);
+            if(res->n < ef || d < res->v[0].d) {
+                hnsw_heap_push(cand, (HnswCand){ d, e }, 0);
+                hnsw_heap_push(res, (HnswCand){ d, e }, 1);
+                if(res->n > ef) hnsw_heap_pop(res, 1);
+            }
+        }
+    }
+    if(nb != buf) free(nb);
+}
+
+static int hnsw_cmp_cand(const void* a, const void* b) {
+    float x = ((const HnswCand*)a)->d, y = ((const HnswCand*)b)->d;
+    return (x > y) - (x < y);
+}
+
+// 近い順の候補 c[0..n) から、既に選んだどれよりも基準点に近いものだけを最大 m 個選ぶ
+// (選んだ近傍が同じ方向に偏らないようにする)。選んだものを c の先頭に詰めて個数を返す
+static int hnsw_select(const Hnsw* ix, HnswCand* c, int n, int m) {
+    qsort(c, n, sizeof(HnswCand), hnsw_cmp_cand);
+    int kept = 0;
+    for(int i = 0; i < n && kept < m; i++) {
+        int good = 1;
+        for(int j = 0; j < kept; j++) {
+            if(hnsw_l2sq(hnsw_vec(ix, c[i].id), hnsw_vec(ix, c[j].id), ix->dim) < c[i].d) {
+                good = 0;
+                break;
+            }
+        }
+        if(good) c[kept++] = c[i];
+    }
+    return kept;
+}
+
+// e の近傍に q を加える。溢れたら e を基準に選び直す (e の lock を持って行う)
+static void hnsw_connect(Hnsw* ix, long e, long q, float d, int layer, HnswCand* scratch) {
+    const int maxm = layer? ix->M : 2 * ix->M;
+    pthread_mutex_lock(&ix->locks[e % HNSW_LOCK_STRIPES]);
+    int* l = hnsw_links(ix, e, layer);
+    int found = 0;
+    for(int i = 0; i < l[0]; i++) found |= (l[1 + i] == (int)q);
+    if(!found) {
+        if(l[0] < maxm) {
+            l[1 + l[0]++] = (int)q;
+        } else {
+            int n = 0;
+            for(int i = 0; i < l[0]; i++) {
+                scratch[n++] = (HnswCand){ hnsw_l2sq(hnsw_vec(ix, e), hnsw_vec(ix, l[1 + i]), ix->dim), l[1 + i] };
+            }
+            scratch[n++] = (HnswCand){ d, (int)q };
+            int kept = hnsw_select(ix, scratch, n, maxm);
+            l[0] = kept;
+            for(int i = 0; i < kept; i++) l[1 + i] = scratch[i].id;
+        }
+    }
+    pthread_mutex_unlock(&ix->locks[e % HNSW_LOCK_STRIPES]);
+}
+
+static void hnsw_insert(Hnsw* ix, long q, HnswHeap* res, HnswHeap* cand) {
+    const float* v = hnsw_vec(ix, q);
+    const int level = ix->levels[q];
+    pthread_mutex_lock(&ix->global);
+    long ep = ix->entry;
+    int top = ix->max_level;
+    int hold = (level > top);   // 入口になる点は挿入し終わるまで全体の lock を持つ
+    if(ep < 0) {
+        ix->entry = q;
+        ix->max_level = level;
+        pthread_mutex_unlock(&ix->global);
+        return;
+    }
+    if(!hold) pthread_mutex_unlock(&ix->global);
+
+    float ep_d = hnsw_l2sq(v, hnsw_vec(ix, ep), ix->dim);
+    for(int lc = top; lc > level; lc--) ep = hnsw_greedy(ix, v, ep, &ep_d, lc);
+    HnswCand* scratch = (HnswCand*)malloc(sizeof(HnswCand) * (2 * ix->M + 1 > ix->ef_construction? 2 * ix->M + 1 : ix->ef_construction));
+    for(int lc = (level < top)? level : top; lc >= 0; lc--) {
+        hnsw_search_layer(ix, v, ep, ep_d, ix->ef_construction, lc, res, cand);
+        int n = res->n;
+        memcpy(scratch, res->v, sizeof(HnswCand) * n);
+        int kept = hnsw_select(ix, scratch, n, ix->M);
+        ep = scratch[0].id;   // 次の層は最も近い点から
+        ep_d = scratch[0].d;
+        pthread_mutex_lock(&ix->locks[q % HNSW_LOCK_STRIPES]);
+        int* l = hnsw_links(ix, q, lc);
+        l[0] = kept;
+        for(int i = 0; i < kept; i++) l[1 + i] = scratch[i].id;
+        pthread_mutex_unlock(&ix->locks[q % HNSW_LOCK_STRIPES]);
+        HnswCand sel[2 * 64];
+        HnswCand* s = (kept <= 128)? sel : (HnswCand*)malloc(sizeof(HnswCand) * kept);
+        memcpy(s, scratch, sizeof(HnswCand) * kept);
+        for(int i = 0; i < kept; i++) hnsw_connect(ix, s[i].id, q, s[i].d, lc, scratch);
+        if(s != sel) free(s);
+    }
+    free(scratch);
+    if(hold) {
+        ix->entry = q;
+        ix->max_level = level;
+        pthread_mutex_unlock(&ix->global);
+    }
+}
+
+typedef struct {
+    Hnsw* ix;
+    _Atomic long next;
+} HnswBuildShared;
+
+static void* hnsw_build_worker(void* p) {
+    HnswBuildShared* sh = (HnswBuildShared*)p;
+    HnswHeap res = { NULL, 0, 0 }, cand = { NULL, 0, 0 };
+    long q;
+    while((q = atomic_fetch_add(&sh->next, 1)) < sh->ix->n) hnsw_insert(sh->ix, q, &res, &cand);
+    free(res.v);
+    free(cand.v);
+    hnsw_visit_release();
+    return NULL;
+}
+
+// X (n x dim) の索引を threads 本で作る。labels は NULL なら 0..n-1。
+// 同じ seed なら層の割り当ては同じ (threads > 1 では挿入順により近傍が変わる)
+void hnsw_build(Hnsw* ix, const float* X, int dim, const long* labels, long n,
+                int M, int ef_construction, int threads, unsigned int seed) {
+    memset(ix, 0, sizeof(*ix));
+    ix->dim = dim;
+    ix->M = (M >= 2)? M : 2;
+    ix->ef_construction = (ef_construction > ix->M)? ef_construction : ix->M;
+    ix->max_level = -1;
+    ix->entry = -1;
+    ix->n = n;
+    ix->vectors = (float*)malloc(sizeof(float) * ix->dim * (n > 0? n : 1));
+    memcpy(ix->vectors, X, sizeof(float) * ix->dim * n);
+    ix->labels = (long*)malloc(sizeof(long) * (n > 0? n : 1));
+    for(long i = 0; i < n; i++) ix->labels[i] = labels? labels[i] : i;
+
+    // 層は P(level >= l) = M^-l となるよう先に決め、上位層の領域を確保しておく
+    ix->levels = (int*)malloc(sizeof(int) * (n > 0? n : 1));
+    ix->upper_off = (long*)malloc(sizeof(long) * (n > 0? n : 1));
+    unsigned int rng = seed? seed : 1u;
+    const double mult = 1.0 / log((double)ix->M);
+    for(long i = 0; i < n; i++) {
+        double u = (pq_rand(&rng) + 1.0) / 4294967297.0;
+        int lv = (int)(-log(u) * mult);
+        ix->levels[i] = (lv < HNSW_MAX_LEVEL)? lv : HNSW_MAX_LEVEL;
+        ix->upper_off[i] = ix->levels[i]? ix->upper_used : -1;
+        ix->upper_used += (long)ix->levels[i] * (1 + ix->M);
+    }
+    ix->link0 = (int*)calloc((size_t)(n > 0? n : 1) * (1 + 2 * ix->M), sizeof(int));
+    ix->upper = (int*)calloc(ix->upper_used + 1, sizeof(int));
+    ix->locks = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t) * HNSW_LOCK_STRIPES);
+    for(int i = 0; i < HNSW_LOCK_STRIPES; i++) pthread_mutex_init(&ix->locks[i], NULL);
+    pthread_mutex_init(&ix->global, NULL);
+
+    double t_span = trace_span_begin();
+    if(threads < 1) threads = 1;
+    HnswBuildShared sh;
+    sh.ix = ix;
+    atomic_init(&sh.next, 0);
+    pthread_t* th = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    for(int t = 1; t < threads; t++) pthread_create(&th[t], NULL, hnsw_build_worker, &sh);
+    hnsw_build_worker(&sh);
+    for(int t = 1; t < threads; t++) pthread_join(th[t], NULL);
+    free(th);
+    trace_span_end("hnsw_build", t_span, "n", n);
+
+    for(int i = 0; i < HNSW_LOCK_STRIPES; i++) pthread_mutex_destroy(&ix->locks[i]);
+    free(ix->locks);
+    ix->locks = NULL;   // 以後は読むだけなので lock は取らない
+}
+
+// q に近い順に最大 k 点の label と距離を書く。ef (>= k) を上げると再現率が上がり遅くなる
+int hnsw_search(const Hnsw* ix, const float* q, int k, int ef, long* out_labels, float* out_dist) {
+    if(ix->entry < 0 || k <= 0) return 0;
+    if(ef < k) ef = k;
+    long ep = ix->entry;
+    float ep_d = hnsw_l2sq(q, hnsw_vec(ix, ep), ix->dim);
+    for(int lc = ix->max_level; lc > 0; lc--) ep = hnsw_greedy(ix, q, ep, &ep_d, lc);
+    HnswHeap* res = &hnsw_search_res;
+    hnsw_search_layer(ix, q, ep, ep_d, ef, 0, res, &hnsw_search_cand);
+    while(res->n > k) hnsw_heap_pop(res, 1);
+    int n = res->n;
+    for(int i = n - 1; i >= 0; i--) {
+        HnswCand c = hnsw_heap_pop(res, 1);
+        if(out_labels) out_labels[i] = ix->labels[c.id];
+        if(out_dist) out_dist[i] = c.d;
+    }
+    return n;
+}
+
+// 呼び出したスレッドの hnsw_search の作業領域 (ヒープと訪問済みの印, 訪問済みの印は
+// 索引のノード数 x 4 バイト) を解放する。検索したスレッドが終わる前に呼ぶ
+// (呼んだ後に検索しても作り直される)
+void hnsw_thread_release(void) {
+    free(hnsw_search_res.v);
+    free(hnsw_search_cand.v);
+    memset(&hnsw_search_res, 0, sizeof(hnsw_search_res));
+    memset(&hnsw_search_cand, 0, sizeof(hnsw_search_cand));
+    hnsw_visit_release();
+}
+
+// 全件と比べる厳密な k 近傍 (再現率の基準)
+int hnsw_search_exact(const Hnsw* ix, const float* q, int k, long* out_labels, float* out_dist) {
+    HnswHeap res = { NULL, 0, 0 };
+    for(long i = 0; i < ix->n; i++) {
+        float d = hnsw_l2sq(q, hnsw_vec(ix, i), ix->dim);
+        if(res.n < k || d < res.v[0].d) {
+            hnsw_heap_push(&res, (HnswCand){ d, (int)i }, 1);
+            if(res.n > k) hnsw_heap_pop(&res, 1);
+        }
+    }
+    int n = res.n;
+    for(int i = n - 1; i >= 0; i--) {
+        HnswCand c = hnsw_heap_pop(&res, 1);
+        if(out_labels) out_labels[i] = ix->labels[c.id];
+        if(out_dist) out_dist[i] = c.d;
+    }
+    free(res.v);
+    return n;
+}
+
+void hnsw_free(Hnsw* ix) {
+    if(ix->map) {
+        munmap(ix->map, ix->map_bytes);
+    } else {
+        free(ix->vectors);
+        free(ix->labels);
+        free(ix->levels);
+        free(ix->link0);
+        free(ix->upper_off);
+        free(ix->upper);
+        pthread_mutex_destroy(&ix->global);
+    }
+    memset(ix, 0, sizeof(*ix));
+}
+
+size_t hnsw_bytes(const Hnsw* ix) {
+    return sizeof(*ix) + (size_t)ix->n * (sizeof(float) * ix->dim + sizeof(long) + sizeof(int) + sizeof(long)
+                                          + sizeof(int) * (1 + 2 * ix->M))
+         + sizeof(int) * (size_t)ix->upper_used;
+}
+
+// ---- 葉の状態から作る ----
+static void hnsw_mark_leaves(const TrieBackend* tb, TrieRef node, unsigned char* leaf) {
+    if(tb->is_leaf(tb->impl, node)) leaf[tb->node_id(tb->impl, node)] = 1;
+    TrieRef child;
+    for(int b = tb->child_next(tb->impl, node, 0, &child); b >= 0; b = tb->child_next(tb->impl, node, b + 1, &child)) {
+        hnsw_mark_leaves(tb, child, leaf);
+    }
+}
+
+typedef struct {
+    const unsigned char* leaf;
+    const RandomProjection* rp;
+    int dim;
+    float* X;
+    long* labels;
+    long n;
+} HnswLeafCtx;
+
+static void hnsw_leaf_visit(void* p, long id, const float* h) {
+    HnswLeafCtx* c = (HnswLeafCtx*)p;
+    if(!c->leaf[id]) return;
+    if(c->rp) rp_project(c->rp, h, c->X + c->n * c->dim);
+    else memcpy(c->X + c->n * c->dim, h, sizeof(float) * RESERVOIR_SIZE);
+    c->labels[c->n++] = id;
+}
+
+// tb の葉 (登録 key の終端) の状態で索引を作る。label は葉の node_id。
+// rp が非 NULL なら射影した状態で作る
+void hnsw_build_leaves(Hnsw* ix, const TrieBackend* tb, const RandomProjection* rp,
+                       int M, int ef_construction, int threads, unsigned int seed) {
+    long nodes = tb->node_count(tb->impl);
+    unsigned char* leaf = (unsigned char*)calloc(nodes, 1);
+    hnsw_mark_leaves(tb, tb->root(tb->impl), leaf);
+    long n_leaf = 0;
+    for(long i = 0; i < nodes; i++) n_leaf += leaf[i];
+    const int dim = rp? rp->k : RESERVOIR_SIZE;
+    HnswLeafCtx c = { leaf, rp, dim, (float*)malloc(sizeof(float) * dim * (n_leaf + 1)),
+                      (long*)malloc(sizeof(long) * (n_leaf + 1)), 0 };
+    node_state_walk(tb, hnsw_leaf_visit, &c);
+    hnsw_build(ix, c.X, dim, c.labels, c.n, M, ef_construction, threads, seed);
+    free(c.labels);
+    free(c.X);
+    free(leaf);
+}
+
+// ---- 保存 / mmap で読み込み ----
+typedef struct {
+    char magic[8];          // "TRLMHN1"
+    int dim;
+    int M;
+    int ef_construction;
+    int max_level;
+    long n;
+    long entry;
+    long upper_used;
+} HnswFileHeader;
+
+#define HNSW_ALIGN(x) (((x) + 63) & ~(size_t)63)
+
+// 各セクションのファイル内オフセット (vectors, labels, levels, link0, upper_off, upper, 終端)
+static void hnsw_layout(const HnswFileHeader* h, size_t off[7]) {
+    off[0] = HNSW_ALIGN(sizeof(HnswFileHeader));
+    off[1] = HNSW_ALIGN(off[0] + sizeof(float) * h->dim * h->n);
+    off[2] = HNSW_ALIGN(off[1] + sizeof(long) * h->n);
+    off[3] = HNSW_ALIGN(off[2] + sizeof(int) * h->n);
+    off[4] = HNSW_ALIGN(off[3] + sizeof(int) * (1 + 2 * h->M) * h->n);
+    off[5] = HNSW_ALIGN(off[4] + sizeof(long) * h->n);
+    off[6] = off[5] + sizeof(int) * h->upper_used;
+}
+
+// pos から off まで 0 で埋めてから data を書く
+static int hnsw_write_at(FILE* fp, size_t* pos, size_t off, const void* data, size_t len) {
+    static const char zero[64] = {0};
+    while(*pos < off) {
+        size_t z = (off - *pos < sizeof(zero))? off - *pos : sizeof(zero);
+        if(fwrite(zero, 1, z, fp) != z) return 0;
+        *pos += z;
+    }
+    if(len > 0 && fwrite(data, 1, len, fp) != len) return 0;
+    *pos += len;
+    return 1;
+}
+
+// 成功で 0
+int hnsw_save(const Hnsw* ix, const char* path) {
+    FILE* fp = fopen(path, "wb");
+    if(!fp) return -1;
+    HnswFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "TRLMHN1", 8);
+    h.dim = ix->dim;
+    h.M = ix->M;
+    h.ef_construction = ix->ef_construction;
+    h.max_level = ix->max_level;
+    h.n = ix->n;
+    h.entry = ix->entry;
+    h.upper_used = ix->upper_used;
+    size_t off[7];
+    hnsw_layout(&h, off);
+    const void* sec[6] = { ix->vectors, ix->labels, ix->levels, ix->link0, ix->upper_off, ix->upper };
+    const size_t len[6] = { sizeof(float) * h.dim * h.n, sizeof(long) * h.n, sizeof(int) * h.n,
+                            sizeof(int) * (1 + 2 * h.M) * h.n, sizeof(long) * h.n, sizeof(int) * h.upper_used };
+    size_t pos = 0;
+    int ok = hnsw_write_at(fp, &pos, 0, &h, sizeof(h));
+    for(int s = 0; s < 6 && ok; s++) ok = hnsw_write_at(fp, &pos, off[s], sec[s], len[s]);
+    if(fclose(fp) != 0) ok = 0;
+    return ok? 0 : -1;
+}
+
+// 読み込んだ索引の入口・層・上位層の位置・近傍 id がすべて範囲内なら 1
+// (壊れたファイルで検索が範囲外を読まないよう、全リストを 1 回だけ検査する)
+static int hnsw_check(const Hnsw* ix) {
+    if(ix->n == 0) return ix->entry == -1 && ix->max_level == -1;
+    if(ix->entry < 0 || ix->entry >= ix->n) return 0;
+    if(ix->max_level < 0 || ix->max_level > HNSW_MAX_LEVEL || ix->levels[ix->entry] != ix->max_level) return 0;
+    for(long i = 0; i < ix->n; i++) {
+        int lv = ix->levels[i];
+        if(lv < 0 || lv > ix->max_level) return 0;
+        if(lv > 0) {
+            long o = ix->upper_off[i];
+            if(o < 0 || o > ix->upper_used || (long)lv * (1 + ix->M) > ix->upper_used - o) return 0;
+        }
+        for(int layer = 0; layer <= lv; layer++) {
+            const int* l = hnsw_links(ix, i, layer);
+            int max_cnt = layer? ix->M : 2 * ix->M;
+            if(l[0] < 0 || l[0] > max_cnt) return 0;
+            for(int j = 1; j <= l[0]; j++) {
+                if(l[j] < 0 || l[j] >= ix->n) return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// hnsw_save したファイルを mmap して検索できる状態にする。成功で 0
+// (次元が RESERVOIR_SIZE を超える, 壊れている, id や層が範囲外などは -1)
+int hnsw_load(Hnsw* ix, const char* path) {
+    memset(ix, 0, sizeof(*ix));
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return -1;
+    struct stat sb;
+    if(fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(HnswFileHeader)) {
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return -1;
+    const HnswFileHeader* h = (const HnswFileHeader*)map;
+    // 節の大きさを計算する前に、桁あふれしない範囲かを見る
+    // (1 ノードは少なくとも 1 バイト, 上位層の 1 要素は 4 バイト使う)
+    const long max_count = (long)sb.st_size;
+    if(memcmp(h->magic, "TRLMHN1", 8) != 0 || h->dim < 1 || h->dim > RESERVOIR_SIZE || h->M < 2
+       || h->M > 65536 || h->n < 0 || h->n > max_count || h->upper_used < 0 || h->upper_used > max_count) {
+        munmap(map, (size_t)sb.st_size);
+        return -1;
+    }
+    size_t off[7];
+    hnsw_layout(h, off);
+    if(off[6] > (size_t)sb.st_size) {
+        munmap(map, (size_t)sb.st_size);
+        return -1;
+    }
+    char* base = (char*)map;
+    ix->dim = h->dim;
+    ix->M = h->M;
+    ix->ef_construction = h->ef_construction;
+    ix->max_level = h->max_level;
+    ix->n = h->n;
+    ix->entry = h->entry;
+    ix->upper_used = h->upper_used;
+    ix->vectors = (float*)(base + off[0]);
+    ix->labels = (long*)(base + off[1]);
+    ix->levels = (int*)(base + off[2]);
+    ix->link0 = (int*)(base + off[3]);
+    ix->upper_off = (long*)(base + off[4]);
+    ix->upper = (int*)(base + off[5]);
+    ix->map = map;
+    ix->map_bytes = (size_t)sb.st_size;
+    if(!hnsw_check(ix)) {
+        hnsw_free(ix);
+        return -1;
+    }
+    return 0;
+}
+
+
+// =========================================================
+// 完全一致の近道: 葉の key の最小完全ハッシュ -> 事前計算した出力
+//   閉じた語彙では同じ key は (ノイズを除けば) 常に同じ出力になる。
+//   葉の key (先頭 MAX_DEPTH バイト) に BBHash 式の最小完全ハッシュを作り、
+//   key -> 行番号 0..n-1 から 32 bit の指紋と上位 k 件の出力 (任意で状態) を引く。
+//   - 段ごとに残りの key を gamma x 残りの数 のビット列に投げ、衝突しなかった key を
+//     その段で確定する (衝突した key は次の段へ)。行番号は全段を通した rank
+//   - ビット列は 64 バイトのブロック (累積 rank 1 語 + データ 7 語) に並べるので、
+//     rank は 1 ライン内の popcount で済む
+//   - 行は (指紋, 上位 k 件の確率と番号) で、キャッシュラインを跨がない大きさにする。
+//     既知の key はビット列の 1 ライン + 行の 1 ラインで答えられ、Trie は辿らない
+//   - 未登録の key もどこかの行に写り得るので、指紋が合わなければ外れ
+//     (誤って当たる確率は 2^-32)。外れは呼び出し側が通常の forward で処理する
+//   出力は作った時点の重みとノイズでの値の写しで、重みを学習し直したら作り直す
+//   (ノイズ 0 なら forward + readout_forward とビット単位で一致する)
+// =========================================================
+#define MPHF_BLOCK_BITS 448
+#define MPHF_MAX_LEVELS 32
+
+typedef struct {
+    long n;
+    int levels;
+    long size[MPHF_MAX_LEVELS];     // 段のビット数
+    long start[MPHF_MAX_LEVELS];    // 段の先頭 (全段を通したビット位置)
+    unsigned long long* blocks;     // 8 語ずつ: [0] = それまでの rank, [1..7] = データ
+    long n_blocks;
+    // どの段でも確定しなかった key (まれ): ハッシュ値 -> 行番号 の線形探索表
+    unsigned long long* rest_hash;
+    long* rest_row;
+    long rest_mask;                 // 表が無ければ -1
+} Mphf;
+
+static inline unsigned long long mphf_mix(unsigned long long x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline long mphf_pos(const Mphf* m, unsigned long long hv, int level) {
+    return m->start[level] + (long)(mphf_mix(hv + 0x9E3779B97F4A7C15ull * (level + 1)) % (unsigned long long)m->size[level]);
+}
+
+// key のハッシュ値 hashes[0..n-1] (互いに異なること) から作る。gamma はビット列の余裕 (>= 1)
+void mphf_build(Mphf* m, const unsigned long long* hashes, long n, double gamma) {
+    memset(m, 0, sizeof(*m));
+    m->n = n;
+    m->rest_mask = -1;
+    if(gamma < 1.0) gamma = 1.0;
+    unsigned long long* cur = (unsigned long long*)malloc(sizeof(unsigned long long) * (n > 0? n : 1));
+    memcpy(cur, hashes, sizeof(unsigned long long) * n);
+    long remaining = n, total = 0;
+    unsigned long long* flat = NULL;   // 全段のビット列
+    while(remaining > 0 && m->levels < MPHF_MAX_LEVELS) {
+        const int level = m->levels++;
+        long size = (long)(gamma * remaining) + 1;
+        size = (size + 63) & ~63L;
+        m->size[level] = size;
+        m->start[level] = total;
+        unsigned long long* seen = (unsigned long long*)calloc(size / 64, sizeof(unsigned long long));
+        unsigned long long* coll = (unsigned long long*)calloc(size / 64, sizeof(unsigned long long));
+        for(long i = 0; i < remaining; i++) {
+            long p = mphf_pos(m, cur[i], level) - total;
+            unsigned long long bit = 1ull << (p & 63);
+            if(seen[p >> 6] & bit) coll[p >> 6] |= bit;
+            seen[p >> 6] |= bit;
+        }
+        flat = (unsigned long long*)realloc(flat, sizeof(unsigned long long) * ((total + size) / 64));
+        for(long w = 0; w < size / 64; w++) flat[total / 64 + w] = seen[w] & ~coll[w];
+        long next = 0;
+        for(long i = 0; i < remaining; i++) {
+            long p = mphf_pos(m, cur[i], level) - total;
+            if(coll[p >> 6] & (1ull << (p & 63))) cur[next++] = cur[i];
+        }
+        remaining = next;
+        total += size;
+        free(seen);
+        free(coll);
+    }
+
+    // 448 bit ずつのブロックに詰め直して累積 rank を付ける
+    m->n_blocks = total / MPHF_BLOCK_BITS + 1;
+    m->blocks = (unsigned long long*)aligned_alloc(64, sizeof(unsigned long long) * 8 * m->n_blocks);
+    memset(m->blocks, 0, sizeof(unsigned long long) * 8 * m->n_blocks);
+    for(long w = 0; w < total / 64; w++) {
+        for(unsigned long long bits = flat[w]; bits; bits &= bits - 1) {
+            long p = w * 64 + __builtin_ctzll(bits);
+            long off = p % MPHF_BLOCK_BITS;
+            m->blocks[(p / MPHF_BLOCK_BITS) * 8 + 1 + off / 64] |= 1ull << (off & 63);
+        }
+    }
+    unsigned long long rank = 0;
+    for(long b = 0; b < m->n_blocks; b++) {
+        m->blocks[b * 8] = rank;
+        for(int w = 1; w < 8; w++) rank += (unsigned long long)__builtin_popcountll(m->blocks[b * 8 + w]);
+    }
+    free(flat);
+
+    if(remaining > 0) {
+        long cap = 4;
+        while(cap < remaining * 2) cap <<= 1;
+        m->rest_mask = cap - 1;
+        m->rest_hash = (unsigned long long*)calloc(cap, sizeof(unsigned long long));
+        m->rest_row = (long*)malloc(sizeof(long) * cap);
+        for(long i = 0; i < cap; i++) m->rest_row[i] = -1;
+        for(long i = 0; i < remaining; i++) {
+            long s = (long)(mphf_mix(cur[i]) & (unsigned long long)m->rest_mask);
+            while(m->rest_row[s] >= 0) s = (s + 1) & m->rest_mask;
+            m->rest_hash[s] = cur[i];
+            m->rest_row[s] = (long)rank + i;
+        }
+    }
+    free(cur);
+}
+
+void mphf_free(Mphf* m) {
+    free(m->blocks);
+    free(m->rest_hash);
+    free(m->rest_row);
+    memset(m, 0, sizeof(*m));
+}
+
+// 作った時の key なら 0..n-1 の一意な行番号。それ以外の key は -1 か任意の行番号
+long mphf_lookup(const Mphf* m, unsigned long long hv) {
+    for(int level = 0; level < m->levels; level++) {
+        const long p = mphf_pos(m, hv, level);
+        const unsigned long long* b = m->blocks + (p / MPHF_BLOCK_BITS) * 8;
+        const long off = p % MPHF_BLOCK_BITS;
+        const int w = (int)(off >> 6);
+        const unsigned long long bit = 1ull << (off & 63);
+        if(b[1 + w] & bit) {
+            long r = (long)b[0];
+            for(int i = 0; i < w; i++) r += __builtin_popcountll(b[1 + i]);
+            return r + __builtin_popcountll(b[1 + w] & (bit - 1));
+        }
+    }
+    if(m->rest_mask >= 0) {
+        for(long s = (long)(mphf_mix(hv) & (unsigned long long)m->rest_mask); m->rest_row[s] >= 0;
+            s = (s + 1) & m->rest_mask) {
+            if(m->rest_hash[s] == hv) return m->rest_row[s];
+        }
+    }
+    return -1;
+}
+
+size_t mphf_bytes(const Mphf* m) {
+    return sizeof(*m) + (size_t)m->n_blocks * 64
+         + (m->rest_mask >= 0? (size_t)(m->rest_mask + 1) * (sizeof(unsigned long long) + sizeof(long)) : 0);
+}
+
+// ---- 葉の key -> 上位 k 件 / 状態 ----
+typedef struct {
+    Mphf mph;
+    long n;                  // 葉 (行) の数
+    int k;
+    size_t row_bytes;        // 2 の冪 (64 以下) か 64 の倍数
+    unsigned char* rows;     // 行: unsigned int 指紋, float prob[k], unsigned short idx[k]
+    float* states;           // n x RESERVOIR_SIZE (NULL なら持たない)
+} ExactIndex;
+
+static inline unsigned long long exact_key_hash(const char* key, size_t* len) {
+    *len = strnlen(key, MAX_DEPTH);
+    return fnv1a(key, *len);
+}
+
+static inline unsigned int exact_fingerprint(unsigned long long hv) {
+    return (unsigned int)(mphf_mix(hv ^ 0x5bd1e9955bd1e995ull) >> 32);
+}
+
+// probs の上位 k 件 (確率の降順, 同じなら番号の小さい順) を idx / prob に書く
+int readout_top_k(const float* probs, int k, int* idx, float* prob) {
+    if(k > OUT_DIM) k = OUT_DIM;
+    if(k <= 0) return 0;
+    int n = 0;
+    for(int o = 0; o < OUT_DIM; o++) {
+        if(n == k && probs[o] <= prob[n - 1]) continue;
+        int p = (n < k)? n++ : n - 1;
+        while(p > 0 && prob[p - 1] < probs[o]) {
+            prob[p] = prob[p - 1];
+            idx[p] = idx[p - 1];
+            p--;
+        }
+        prob[p] = probs[o];
+        idx[p] = o;
+    }
+    return n;
+}
+
+typedef struct {
+    char* keys;
+    long n;
+    char buf[MAX_DEPTH + 1];
+} ExactLeafWalk;
+
+static void exact_collect_leaves(const TrieBackend* tb, TrieRef node, int len, ExactLeafWalk* w) {
+    if(len > 0 && tb->is_leaf(tb->impl, node)) {
+        if(w->keys) memcpy(w->keys + w->n * (MAX_DEPTH + 1), w->buf, MAX_DEPTH + 1);
+        w->n++;
+    }
+    if(len >= MAX_DEPTH) return;
+    TrieRef child;
+    for(int b = tb->child_next(tb->impl, node, 0, &child); b >= 0; b = tb->child_next(tb->impl, node, b + 1, &child)) {
+        w->buf[len] = (char)b;
+        w->buf[len + 1] = '\0';
+        exact_collect_leaves(tb, child, len + 1, w);
+    }
+}
+
+static inline unsigned char* exact_row(const ExactIndex* ex, long r) {
+    return ex->rows + (size_t)r * ex->row_bytes;
+}
+
+// tb の全ての葉について forward + readout_forward を計算して索引を作る。
+// k は行に持つ上位件数 (1..OUT_DIM), keep_states なら状態も持つ。戻り値は葉の数
+long exact_index_build(ExactIndex* ex, const TrieBackend* tb, int k, int keep_states) {
+    memset(ex, 0, sizeof(*ex));
+    if(k < 1) k = 1;
+    if(k > OUT_DIM) k = OUT_DIM;
+    ex->k = k;
+    size_t need = sizeof(unsigned int) + (size_t)k * (sizeof(float) + sizeof(unsigned short));
+    ex->row_bytes = 4;
+    while(ex->row_bytes < need && ex->row_bytes < 64) ex->row_bytes <<= 1;
+    if(ex->row_bytes < need) ex->row_bytes = (need + 63) & ~(size_t)63;
+
+    ExactLeafWalk w;
+    memset(&w, 0, sizeof(w));
+    exact_collect_leaves(tb, tb->root(tb->impl), 0, &w);
+    const long n = w.n;
+    w.keys = (char*)calloc((size_t)(n > 0? n : 1), MAX_DEPTH + 1);
+    w.n = 0;
+    exact_collect_leaves(tb, tb->root(tb->impl), 0, &w);
+
+    unsigned long long* hv = (unsigned long long*)malloc(sizeof(unsigned long long) * (n > 0? n : 1));
+    size_t len;
+    for(long i = 0; i < n; i++) hv[i] = exact_key_hash(w.keys + i * (MAX_DEPTH + 1), &len);
+    mphf_build(&ex->mph, hv, n, 2.0);
+
+    ex->n = n;
+    ex->rows = (unsigned char*)aligned_alloc(64, ((size_t)(n > 0? n : 1) * ex->row_bytes + 63) & ~(size_t)63);
+    memset(ex->rows, 0, (size_t)n * ex->row_bytes);
+    if(keep_states) ex->states = (float*)malloc(sizeof(float) * RESERVOIR_SIZE * (n > 0? n : 1));
+    float h[RESERVOIR_SIZE], probs[OUT_DIM], prob[OUT_DIM];
+    int idx[OUT_DIM];
+    for(long i = 0; i < n; i++) {
+        long r = mphf_lookup(&ex->mph, hv[i]);
+        memset(h, 0, sizeof(h));
+        trie_backend_forward(tb, w.keys + i * (MAX_DEPTH + 1), h);
+        readout_forward(h, probs);
+        readout_top_k(probs, k, idx, prob);
+        unsigned char* row = exact_row(ex, r);
+        unsigned int fp = exact_fingerprint(hv[i]);
+        memcpy(row, &fp, sizeof(fp));
+        memcpy(row + sizeof(unsigned int), prob, sizeof(float) * k);
+        for(int j = 0; j < k; j++) {
+            unsigned short s = (unsigned short)idx[j];
+            memcpy(row + sizeof(unsigned int) + sizeof(float) * k + sizeof(unsigned short) * j, &s, sizeof(s));
+        }
+        if(ex->states) memcpy(ex->states + (size_t)r * RESERVOIR_SIZE, h, sizeof(h));
+    }
+    free(hv);
+    free(w.keys);
+    return n;
+}
+
+void exact_index_free(ExactIndex* ex) {
+    mphf_free(&ex->mph);
+    free(ex->rows);
+    free(ex->states);
+    memset(ex, 0, sizeof(*ex));
+}
+
+size_t exact_index_bytes(const ExactIndex* ex) {
+    return sizeof(*ex) - sizeof(Mphf) + mphf_bytes(&ex->mph) + (size_t)ex->n * ex->row_bytes
+         + (ex->states? sizeof(float) * RESERVOIR_SIZE * (size_t)ex->n : 0);
+}
+
+// key (先頭 MAX_DEPTH バイト) が葉なら上位 k 件を idx / prob に、状態を持っていれば
+// state に写して 1 を返す (idx / prob / state は NULL 可)。外れなら 0
+int exact_lookup(const ExactIndex* ex, const char* key, int* idx, float* prob, float* state) {
+    size_t len;
+    const unsigned long long hv = exact_key_hash(key, &len);
+    const long r = mphf_lookup(&ex->mph, hv);
+    if(r < 0 || r >= ex->n) return 0;
+    const unsigned char* row = exact_row(ex, r);
+    unsigned int fp;
+    memcpy(&fp, row, sizeof(fp));
+    if(fp != exact_fingerprint(hv)) return 0;
+    if(prob) memcpy(prob, row + sizeof(unsigned int), sizeof(float) * ex->k);
+    if(idx) {
+        for(int j = 0; j < ex->k; j++) {
+            unsigned short s;
+            memcpy(&s, row + sizeof(unsigned int) + sizeof(float) * ex->k + sizeof(unsigned short) * j, sizeof(s));
+            idx[j] = s;
+        }
+    }
+    if(state && ex->states) memcpy(state, ex->states + (size_t)r * RESERVOIR_SIZE, sizeof(float) * RESERVOIR_SIZE);
+    return 1;
+}
+
+// 索引で引き、外れたら tb で forward + readout_forward して同じ形の上位 ex->k 件を出す。
+// 索引で答えたら 1, 通常の経路なら 0
+int exact_predict(const ExactIndex* ex, const TrieBackend* tb, const char* key, int* idx, float* prob) {
+    if(exact_lookup(ex, key, idx, prob, NULL)) return 1;
+    float h[RESERVOIR_SIZE], probs[OUT_DIM];
+    memset(h, 0, sizeof(h));
+    trie_backend_forward(tb, key, h);
+    readout_forward(h, probs);
+    readout_top_k(probs, ex->k, idx, prob);
+    return 0;
+}
+
+// -------------------------
+// リードアウト重みの保存/読み込み
+//   形式: ヘッダ (magic "TRLMRO1", OUT_DIM, RESERVOIR_SIZE) + float 配列
+//   成功で 0, 失敗 (ファイル無し/次元不一致など) で -1
+// -------------------------
+typedef struct {
+    char magic[8];
+    int out_dim;
+    int reservoir_size;
+} ReadoutFileHeader;
+
+int readout_save(const char* path, const float* W) {
+    FILE* fp = fopen(path, "wb");
+    if(!fp) return -1;
+    ReadoutFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "TRLMRO1", 8);
+    hdr.out_dim = OUT_DIM;
+    hdr.reservoir_size = RESERVOIR_SIZE;
+    int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+          && fwrite(W, sizeof(float), OUT_DIM * RESERVOIR_SIZE, fp) == OUT_DIM * RESERVOIR_SIZE;
+    fclose(fp);
+    return ok? 0 : -1;
+}
+
+int readout_load(const char* path, float* W) {
+    FILE* fp = fopen(path, "rb");
+    if(!fp) return -1;
+    ReadoutFileHeader hdr;
+    int ok = fread(&hdr, sizeof(hdr), 1, fp) == 1
+          && memcmp(hdr.magic, "TRLMRO1", 8) == 0
+          && hdr.out_dim == OUT_DIM
+          && hdr.reservoir_size == RESERVOIR_SIZE
+          && fread(W, sizeof(float), OUT_DIM * RESERVOIR_SIZE, fp) == OUT_DIM * RESERVOIR_SIZE;
+    fclose(fp);
+    return ok? 0 : -1;
+}
+
+// 文字列ハッシュ (FNV-1a 64bit)
+static unsigned long long fnv1a(const char* s, size_t n) {
+    unsigned long long h = 1469598103934665603ULL;
+    for(size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// =========================================================
+// マルチテナント: 共有 Trie + リザバー上に多数のリードアウトヘッド
+//   - Trie とリザバー重みはプロセス内で 1 つだけ持つ
+//   - テナントごとの差分はリードアウト重み (OUT_DIM x RESERVOIR_SIZE) のみで、
+//     dir/<tenant>.readout から初回参照時に読み込む
+//   - リザバー状態は先頭 MAX_DEPTH 文字だけで決まりテナントに依存しないので、
+//     key -> 状態のキャッシュを全テナントで共有する
+// =========================================================
+#define TENANT_NAME_MAX 64
+#define TENANT_BUCKETS 1024
+
+typedef struct ReadoutHead {
+    char name[TENANT_NAME_MAX];
+    float weights[OUT_DIM * RESERVOIR_SIZE];
+    unsigned long long last_used;
+    int pinned;                 // tenant_register で登録したもの (ファイルが無いので追い出さない)
+    struct ReadoutHead* next;   // ハッシュ連鎖
+} ReadoutHead;
+
+typedef struct {
+    unsigned long long hash;
+    char key[MAX_DEPTH + 1];
+    int valid;
+    float state[RESERVOIR_SIZE];
+} StateCacheEntry;
+
+typedef struct {
+    char dir[512];
+    ReadoutHead* buckets[TENANT_BUCKETS];
+    int resident;               // メモリ上のヘッド数
+    int max_resident;           // 超えたら最も古く使われたヘッドを追い出す (0 で無制限)
+    unsigned long long tick;
+    long long loads;
+    long long evictions;
+    // テナント共有の状態キャッシュ (直接マップ)
+    StateCacheEntry* states;
+    int state_slots;            // 2 の冪
+    long long state_hits;
+    long long state_misses;
+} TenantRegistry;
+
+void tenant_registry_init(TenantRegistry* reg, const char* dir, int max_resident, int state_slots) {
+    memset(reg, 0, sizeof(*reg));
+    snprintf(reg->dir, sizeof(reg->dir), "%s", dir? dir : ".");
+    reg->max_resident = max_resident;
+    int slots = 1;
+    while(slots < state_slots) slots <<= 1;
+    reg->state_slots = (state_slots > 0)? slots : 0;
+    if(reg->state_slots > 0) {
+        reg->states = (StateCacheEntry*)calloc(reg->state_slots, sizeof(StateCacheEntry));
+    }
+}
+
+void tenant_registry_free(TenantRegistry* reg) {
+    for(int b = 0; b < TENANT_BUCKETS; b++) {
+        ReadoutHead* h = reg->buckets[b];
+        while(h) {
+            ReadoutHead* next = h->next;
+            free(h);
+            h = next;
+        }
+    }
+    free(reg->states);
+    memset(reg, 0, sizeof(*reg));
+}
+
+static ReadoutHead** tenant_slot(TenantRegistry* reg, const char* name) {
+    ReadoutHead** pp = &reg->buckets[fnv1a(name, strlen(name)) % TENANT_BUCKETS];
+    while(*pp && strcmp((*pp)->name, name) != 0) pp = &(*pp)->next;
+    return pp;
+}
+
+static void tenant_evict_lru(TenantRegistry* reg) {
+    ReadoutHead** victim = NULL;
+    for(int b = 0; b < TENANT_BUCKETS; b++) {
+        for(ReadoutHead** pp = &reg->buckets[b]; *pp; pp = &(*pp)->next) {
+            if(!(*pp)->pinned && (!victim || (*pp)->last_used < (*victim)->last_used)) victim = pp;
+        }
+    }
+    if(!victim) return;
+    ReadoutHead* h = *victim;
+    *victim = h->next;
+    free(h);
+    reg->resident--;
+    reg->evictions++;
+}
+
+static ReadoutHead* tenant_insert(TenantRegistry* reg, const char* name) {
+    if(strlen(name) >= TENANT_NAME_MAX) return NULL;
+    if(reg->max_resident > 0 && reg->resident >= reg->max_resident) tenant_evict_lru(reg);
+    ReadoutHead* h = (ReadoutHead*)calloc(1, sizeof(ReadoutHead));
+    snprintf(h->name, sizeof(h->name), "%s", name);
+    ReadoutHead** pp = tenant_slot(reg, name);
+    h->next = NULL;
+    *pp = h;
+    reg->resident++;
+    return h;
+}
+
+// メモリ上の重みをテナントとして登録する (ファイルからは読まない)
+ReadoutHead* tenant_register(TenantRegistry* reg, const char* name, const float* W) {
+    ReadoutHead* h = *tenant_slot(reg, name);
+    if(!h) h = tenant_insert(reg, name);
+    if(!h) return NULL;
+    memcpy(h->weights, W, sizeof(h->weights));
+    h->pinned = 1;
+    h->last_used = ++reg->tick;
+    return h;
+}
+
+// テナントのヘッドを返す。未ロードなら dir/<name>.readout から読み込む。
+// ファイルが無い/壊れている場合は NULL
+ReadoutHead* tenant_get(TenantRegistry* reg, const char* name) {
+    ReadoutHead* h = *tenant_slot(reg, name);
+    if(!h) {
+        char path[1024];
+        float W[OUT_DIM * RESERVOIR_SIZE];
+        snprintf(path, sizeof(path), "%s/%s.readout", reg->dir, name);
+        if(strchr(name, '/') || readout_load(path, W) != 0) return NULL;
+        h = tenant_insert(reg, name);
+        if(!h) return NULL;
+        memcpy(h->weights, W, sizeof(W));
+        reg->loads++;
+    }
+    h->last_used = ++reg->tick;
+    return h;
+}
+
+// 共有状態キャッシュの参照。ヒットしたら state にコピーして 1 を返す
+int tenant_state_lookup(TenantRegistry* reg, const char* key, float* state) {
+    if(reg->state_slots == 0) return 0;
+    size_t n = strnlen(key, MAX_DEPTH);
+    unsigned long long h = fnv1a(key, n);
+    StateCacheEntry* e = &reg->states[h & (reg->state_slots - 1)];
+    if(e->valid && e->hash == h && strncmp(e->key, key, n) == 0 && e->key[n] == '\0') {
+        memcpy(state, e->state, sizeof(e->state));
+        reg->state_hits++;
+        return 1;
+    }
+    reg->state_misses++;
+    return 0;
+}
+
+void tenant_state_insert(TenantRegistry* reg, const char* key, const float* state) {
+    if(reg->state_slots == 0) return;
+    size_t n = strnlen(key, MAX_DEPTH);
+    unsigned long long h = fnv1a(key, n);
+    StateCacheEntry* e = &reg->states[h & (reg->state_slots - 1)];
+    e->hash = h;
+    memcpy(e->key, key, n);
+    e->key[n] = '\0';
+    memcpy(e->state, state, sizeof(e->state));
+    e->valid = 1;
+}
+
+// 1 リクエストをテナント指定で推論する。テナントが見つからなければ -1
+int tenant_forward(TenantRegistry* reg, TrieNode* root, const char* tenant,
+                   const char* key, float* out_probs) {
+    ReadoutHead* head = tenant_get(reg, tenant);
+    if(!head) return -1;
+    float h_state[RESERVOIR_SIZE];
+    if(!tenant_state_lookup(reg, key, h_state)) {
+        memset(h_state, 0, sizeof(h_state));
+        trie_reservoir_forward(root, key, h_state);
+        tenant_state_insert(reg, key, h_state);
+    }
+    readout_forward_w(head->weights, h_state, out_probs);
+    return 0;
+}
+
+// =========================================================
+// ヘビーヒッター追跡とキャッシュの温め
+//   - HeavyHitters: Space-Saving (容量 capacity 個のカウンタ, 最小ヒープ + 索引)
+//     で、サービング中に見た key (と prefix_stride バイトごとのプレフィックス) の
+//     上位を追跡する。key は MAX_DEPTH バイトで切る (それより先は状態に効かない)
+//   - HotSet: 上位 K 件の状態とリードアウト結果を事前計算した表。
+//     HotSetHandle で読み書きロック越しに差し替える
+//   - hot_refresh: 上位 K 件から HotSet を作り直して公開し、プレフィックスの
+//     状態をプレフィックスキャッシュに固定 (pin) する。HotRefresher が
+//     これを一定間隔でバックグラウンド実行する
+//   - hh_save / hh_load: 上位の一覧を "count<TAB>key" で保存し、再起動後に
+//     読み込んでトラフィックを受ける前に温める
+// =========================================================
+typedef struct {
+    char key[MAX_DEPTH + 1];
+    long long count;
+    long long error;   // Space-Saving の過大評価の上限
+} HeavyHitter;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int capacity;
+    int n;
+    int prefix_stride;     // 0 なら key のみ, k > 0 なら長さ k, 2k, ... のプレフィックスも数える
+    HeavyHitter* items;
+    int* heap;             // count の最小ヒープ (items の添字)
+    int* heap_pos;         // items の添字 -> heap 上の位置
+    int* index;            // ハッシュ索引 (-1 = 空), 線形探索
+    int index_mask;
+    long long observed;
+} HeavyHitters;
+
+void hh_init(HeavyHitters* hh, int capacity, int prefix_stride) {
+    memset(hh, 0, sizeof(*hh));
+    pthread_mutex_init(&hh->lock, NULL);
+    hh->capacity = (capacity > 0)? capacity : 1;
+    hh->prefix_stride = prefix_stride;
+    hh->items = (HeavyHitter*)calloc(hh->capacity, sizeof(HeavyHitter));
+    hh->heap = (int*)malloc(sizeof(int) * hh->capacity);
+    hh->heap_pos = (int*)malloc(sizeof(int) * hh->capacity);
+    int isz = 1;
+    while(isz < hh->capacity * 2) isz <<= 1;
+    hh->index_mask = isz - 1;
+    hh->index = (int*)malloc(sizeof(int) * isz);
+    for(int i = 0; i < isz; i++) hh->index[i] = -1;
+}
+
+void hh_free(HeavyHitters* hh) {
+    pthread_mutex_destroy(&hh->lock);
+    free(hh->items);
+    free(hh->heap);
+    free(hh->heap_pos);
+    free(hh->index);
+    memset(hh, 0, sizeof(*hh));
+}
+
+static int hh_index_find(const HeavyHitters* hh, const char* key, size_t len, unsigned long long h) {
+    int i = (int)h & hh->index_mask;
+    while(hh->index[i] >= 0) {
+        const char* k = hh->items[hh->index[i]].key;
+        if(strncmp(k, key, len) == 0 && k[len] == '\0') break;
+        i = (i + 1) & hh->index_mask;
+    }
+    return i;
+}
+
+static void hh_index_remove(HeavyHitters* hh, int i) {
+    int j = i;
+    for(;;) {
+        hh->index[i] = -1;
+        for(;;) {
+            j = (j + 1) & hh->index_mask;
+            if(hh->index[j] < 0) return;
+            const char* k = hh->items[hh->index[j]].key;
+            int home = (int)fnv1a(k, strlen(k)) & hh->index_mask;
+            if(i <= j? (home <= i || home > j) : (home <= i && home > j)) break;
+        }
+        hh->index[i] = hh->index[j];
+        i = j;
+    }
+}
+
+static void hh_heap_swap(HeavyHitters* hh, int a, int b) {
+    int t = hh->heap[a];
+    hh->heap[a] = hh->heap[b];
+    hh->heap[b] = t;
+    hh->heap_pos[hh->heap[a]] = a;
+    hh->heap_pos[hh->heap[b]] = b;
+}
+
+static void hh_heap_down(HeavyHitters* hh, int i) {
+    for(;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if(l < hh->n && hh->items[hh->heap[l]].count < hh->items[hh->heap[m]].count) m = l;
+        if(r < hh->n && hh->items[hh->heap[r]].count < hh->items[hh->heap[m]].count) m = r;
+        if(m == i) return;
+        hh_heap_swap(hh, i, m);
+        i = m;
+    }
+}
+
+static void hh_heap_up(HeavyHitters* hh, int i) {
+    while(i > 0) {
+        int p = (i - 1) / 2;
+        if(hh->items[hh->heap[p]].count <= hh->items[hh->heap[i]].count) return;
+        hh_heap_swap(hh, i, p);
+        i = p;
+    }
+}
+
+// lock を持って呼ぶ
+static void hh_add_locked(HeavyHitters* hh, const char* key, size_t len, long long w) {
+    unsigned long long h = fnv1a(key, len);
+    int pos = hh_index_find(hh, key, len, h);
+    int it = hh->index[pos];
+    if(it >= 0) {
+        hh->items[it].count += w;
+        hh_heap_down(hh, hh->heap_pos[it]);
+        return;
+    }
+    long long base = 0;
+    if(hh->n < hh->capacity) {
+        it = hh->n;
+        hh->heap[hh->n] = it;
+        hh->heap_pos[it] = hh->n;
+        hh->n++;
+    } else {
+        // 最小のカウンタを新しい key に付け替える (誤差はその最小値まで)
+        it = hh->heap[0];
+        HeavyHitter* old = &hh->items[it];
+        hh_index_remove(hh, hh_index_find(hh, old->key, strlen(old->key), fnv1a(old->key, strlen(old->key))));
+        base = old->count;
+        pos = hh_index_find(hh, key, len, h);
+    }
+    HeavyHitter* e = &hh->items[it];
+    memcpy(e->key, key, len);
+    e->key[len] = '\0';
+    e->count = base + w;
+    e->error = base;
+    hh->index[pos] = it;
+    hh_heap_up(hh, hh->heap_pos[it]);
+    hh_heap_down(hh, hh->heap_pos[it]);
+}
+
+// サービングで見た key を 1 回数える (prefix_stride に従ってプレフィックスも)
+void hh_observe(HeavyHitters* hh, const char* key) {
+    size_t len = strnlen(key, MAX_DEPTH);
+    pthread_mutex_lock(&hh->lock);
+    hh->observed++;
+    if(hh->prefix_stride > 0) {
+        for(size_t p = hh->prefix_stride; p < len; p += hh->prefix_stride) hh_add_locked(hh, key, p, 1);
+    }
+    hh_add_locked(hh, key, len, 1);
+    pthread_mutex_unlock(&hh->lock);
+}
+
+static int hh_cmp_count_desc(const void* a, const void* b) {
+    long long x = ((const HeavyHitter*)a)->count, y = ((const HeavyHitter*)b)->count;
+    return (x < y) - (x > y);
+}
+
+// 上位 k 件を count の降順で out に写す。戻り値は件数
+int hh_top(HeavyHitters* hh, int k, HeavyHitter* out) {
+    pthread_mutex_lock(&hh->lock);
+    HeavyHitter* all = (HeavyHitter*)malloc(sizeof(HeavyHitter) * (hh->n > 0? hh->n : 1));
+    memcpy(all, hh->items, sizeof(HeavyHitter) * hh->n);
+    int n = hh->n;
+    pthread_mutex_unlock(&hh->lock);
+    qsort(all, n, sizeof(HeavyHitter), hh_cmp_count_desc);
+    if(k > n) k = n;
+    memcpy(out, all, sizeof(HeavyHitter) * k);
+    free(all);
+    return k;
+}
+
+// 上位 k 件を "count<TAB>key" の行で保存する。成功で 0
+int hh_save(HeavyHitters* hh, const char* path, int k) {
+    HeavyHitter* top = (HeavyHitter*)malloc(sizeof(HeavyHitter) * (k > 0? k : 1));
+    int n = hh_top(hh, k, top);
+    FILE* fp = fopen(path, "w");
+    if(!fp) {
+        free(top);
+        return -1;
+    }
+    for(int i = 0; i < n; i++) fprintf(fp, "%lld\t%s\n", top[i].count, top[i].key);
+    free(top);
+    return fclose(fp) == 0? 0 : -1;
+}
+
+static char* read_key_line(FILE* fp);
+
+// hh_save の一覧を count 付きで取り込む。戻り値は読み込んだ件数 (開けなければ -1)
+long hh_load(HeavyHitters* hh, const char* path) {
+    FILE* fp = fopen(path, "r");
+    if(!fp) return -1;
+    long n = 0;
+    char* line;
+    while((line = read_key_line(fp)) != NULL) {
+        char* tab = strchr(line, '\t');
+        if(tab) {
+            long long c = atoll(line);
+            const char* key = tab + 1;
+            pthread_mutex_lock(&hh->lock);
+            hh_add_locked(hh, key, strnlen(key, MAX_DEPTH), c > 0? c : 1);
+            pthread_mutex_unlock(&hh->lock);
+            n++;
+        }
+        free(line);
+    }
+    fclose(fp);
+    return n;
+}
+
+// ---- 事前計算した上位 K 件 ----
+typedef struct {
+    char key[MAX_DEPTH + 1];
+    float state[RESERVOIR_SIZE];
+    float probs[OUT_DIM];      // 既定のリードアウト重みでの出力
+} HotEntry;
+
+typedef struct {
+    int n;
+    int mask;
+    int* index;                // ハッシュ -> entries の添字 (-1 = 空)
+    HotEntry* entries;
+} HotSet;
+
+typedef struct {
+    pthread_rwlock_t lock;
+    HotSet* cur;               // NULL なら空
+    _Atomic long hits;
+    _Atomic long lookups;
+    _Atomic long refreshes;
+} HotSetHandle;
+
+static void hot_set_free(HotSet* hs) {
+    if(!hs) return;
+    free(hs->index);
+    free(hs->entries);
+    free(hs);
+}
+
+void hot_handle_init(HotSetHandle* h) {
+    memset(h, 0, sizeof(*h));
+    pthread_rwlock_init(&h->lock, NULL);
+}
+
+void hot_handle_free(HotSetHandle* h) {
+    hot_set_free(h->cur);
+    pthread_rwlock_destroy(&h->lock);
+    h->cur = NULL;
+}
+
+// key が上位 K 件にあれば状態と出力を写して 1 を返す (state / probs は NULL 可)
+int hot_lookup(HotSetHandle* h, const char* key, float* state, float* probs) {
+    size_t len = strnlen(key, MAX_DEPTH);
+    unsigned long long hv = fnv1a(key, len);
+    int found = 0;
+    atomic_fetch_add_explicit(&h->lookups, 1, memory_order_relaxed);
+    pthread_rwlock_rdlock(&h->lock);
+    const HotSet* hs = h->cur;
+    if(hs && hs->n > 0) {
+        for(int i = (int)hv & hs->mask; hs->index[i] >= 0; i = (i + 1) & hs->mask) {
+            const HotEntry* e = &hs->entries[hs->index[i]];
+            if(strncmp(e->key, key, len) == 0 && e->key[len] == '\0') {
+                if(state) memcpy(state, e->state, sizeof(e->state));
+                if(probs) memcpy(probs, e->probs, sizeof(e->probs));
+                found = 1;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&h->lock);
+    if(found) atomic_fetch_add_explicit(&h->hits, 1, memory_order_relaxed);
+    return found;
+}
+
+// 上位 k 件の状態と出力を計算して h に公開する。cache が非 NULL なら
+// 各 key の経路上のすべてのプレフィックス (根を除く) の状態を node_id で
+// cache に固定する (以前の固定は外す。固定できるのはシャードの半分まで)。
+// 戻り値は公開した件数
+int hot_refresh(HotSetHandle* h, HeavyHitters* hh, int k, TrieNode* root, PrefixStateCache* cache) {
+    HeavyHitter* top = (HeavyHitter*)malloc(sizeof(HeavyHitter) * (k > 0? k : 1));
+    int n = hh_top(hh, k, top);
+    HotSet* hs = (HotSet*)calloc(1, sizeof(HotSet));
+    int isz = 1;
+    while(isz < n * 2 + 2) isz <<= 1;
+    hs->mask = isz - 1;
+    hs->index = (int*)malloc(sizeof(int) * isz);
+    for(int i = 0; i < isz; i++) hs->index[i] = -1;
+    hs->entries = (HotEntry*)malloc(sizeof(HotEntry) * (n > 0? n : 1));
+    hs->n = n;
+
+    TrieBackend tb;
+    trie_backend_pointer(&tb, root);
+    if(cache) prefix_cache_unpin_all(cache);
+    for(int e = 0; e < n; e++) {
+        HotEntry* he = &hs->entries[e];
+        memcpy(he->key, top[e].key, sizeof(he->key));
+        memset(he->state, 0, sizeof(he->state));
+        // 1 バイトずつ辿って状態を更新し (trie_backend_forward と同じ計算)、
+        // 途中の各ノードの状態をそのノードに固定する
+        TrieRef cur = tb.root(tb.impl);
+        for(int d = 0; he->key[d] != '\0' && d < MAX_DEPTH; d++) {
+            TrieRef next = tb.step(tb.impl, cur, (unsigned char)he->key[d]);
+            if(next == TRIE_REF_NONE) break;
+            reservoir_step(tb.depth(tb.impl, cur), he->state);
+            if(cache) prefix_cache_pin(cache, tb.node_id(tb.impl, next), he->state);
+            cur = next;
+        }
+        readout_forward(he->state, he->probs);
+        size_t len = strlen(he->key);
+        int i = (int)fnv1a(he->key, len) & hs->mask;
+        while(hs->index[i] >= 0) i = (i + 1) & hs->mask;
+        hs->index[i] = e;
+    }
+    free(top);
+
+    pthread_rwlock_wrlock(&h->lock);
+    HotSet* old = h->cur;
+    h->cur = hs;
+    pthread_rwlock_unlock(&h->lock);
+    hot_set_free(old);
+    atomic_fetch_add_explicit(&h->refreshes, 1, memory_order_relaxed);
+    return n;
+}
+
+// ---- 一定間隔で hot_refresh するバックグラウンドスレッド ----
+typedef struct {
+    HotSetHandle* hot;
+    HeavyHitters* hh;
+    TrieNode* root;
+    PrefixStateCache* cache;   // NULL 可
+    int k;
+    double interval;           // 秒
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+} HotRefresher;
+
+static void* hot_refresher_main(void* p) {
+    HotRefresher* r = (HotRefresher*)p;
+    trace_set_thread_name("hot-refresh");
+    pthread_mutex_lock(&r->lock);
+    while(!r->stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        double t = ts.tv_sec + ts.tv_nsec * 1e-9 + r->interval;
+        ts.tv_sec = (time_t)t;
+        ts.tv_nsec = (long)((t - (double)ts.tv_sec) * 1e9);
+        pthread_cond_timedwait(&r->cond, &r->lock, &ts);
+        if(r->stop) break;
+        pthread_mutex_unlock(&r->lock);
+        double t0 = trace_span_begin();
+        int n = hot_refresh(r->hot, r->hh, r->k, r->root, r->cache);
+        trace_span_end("hot_refresh", t0, "entries", n);
+        pthread_mutex_lock(&r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+void hot_refresher_start(HotRefresher* r, HotSetHandle* hot, HeavyHitters* hh, TrieNode* root,
+                         PrefixStateCache* cache, int k, double interval) {
+    memset(r, 0, sizeof(*r));
+    r->hot = hot;
+    r->hh = hh;
+    r->root = root;
+    r->cache = cache;
+    r->k = k;
+    r->interval = (interval > 0.0)? interval : 1.0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    pthread_create(&r->thread, NULL, hot_refresher_main, r);
+}
+
+void hot_refresher_stop(HotRefresher* r) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+}
+
+// =========================================================
+// 推論サービング: 締切付きリクエストの EDF スケジューリング
+//   - 各リクエストは絶対時刻の締切 (deadline) を持つ
+//   - バッチャは締切の早い順 (Earliest Deadline First) に取り出す
+//   - 締切に間に合わない見込みのリクエストは早期に棄却 (shed) する
+//   - バッチの処理時間の p99 が目標を超えたらバッチサイズを縮める (AIMD)
+// =========================================================
+
+typedef enum {
+    TRLM_STATUS_PENDING = 0,     // キュー待ち
+    TRLM_STATUS_OK,              // 推論完了 (probs が有効)
+    TRLM_STATUS_SHED_QUEUE_FULL, // 受付時にキュー満杯で棄却
+    TRLM_STATUS_SHED_DEADLINE,   // 締切に間に合わない見込みで棄却
+    TRLM_STATUS_UNKNOWN_TENANT   // 指定テナントのリードアウトが無い
+} TrlmStatus;
+
+typedef struct ServeRequest {
+    const char* key;        // 入力文字列 (呼び出し側が保持)
+    const char* tenant;     // テナント名 (NULL なら既定のリードアウト)
+    double deadline;        // 締切 (now_seconds() 基準の絶対時刻)
+    double enqueue_time;    // 受付時刻 (sched_submit が設定)
+    double finish_time;     // 完了/棄却時刻
+    int steps;              // 実効深度 (sched_submit が設定, 推定コストに使う)
+    TrlmStatus status;
+    float probs[OUT_DIM];   // 出力確率 (status == OK のときのみ有効)
+} ServeRequest;
+
+#define SCHED_MAX_QUEUE 1024   // キューの最大長
+#define SCHED_LAT_WINDOW 256   // p99 を計算する直近レイテンシの窓
+
+typedef struct {
+    ServeRequest* heap[SCHED_MAX_QUEUE]; // deadline をキーとする最小ヒープ
+    int size;
+    int batch_size;        // 現在のバッチサイズ (適応的に変化)
+    int max_batch;
+    double p99_target;     // バッチ処理時間の目標 p99 (秒)
+    double step_cost;      // 1 深度ステップあたりの推定時間 (秒, EWMA)
+    TenantRegistry* tenants; // テナント指定リクエスト用 (NULL なら既定のみ)
+    HeavyHitters* heavy;     // 処理した key を数える (NULL なら数えない)
+    HotSetHandle* hot;       // 事前計算した上位 key (NULL なら使わない)
+    PrefixStateCache* prefix; // 表に無い key をキャッシュ済みの祖先の状態から計算する
+                              // (NULL ならバッチ GEMM。hot_refresh がプレフィックスを固定する)
+    float lat_window[SCHED_LAT_WINDOW];  // 受付から完了まで (メトリクス用)
+    int lat_count;
+    int lat_pos;
+    float svc_window[SCHED_LAT_WINDOW];  // バッチの処理時間 (AIMD の判定用)
+    int svc_count;
+    int svc_pos;
+    // メトリクス
+    long long submitted;
+    long long served;
+    long long shed_queue_full;
+    long long shed_deadline;
+    int max_queue_depth;
+} Scheduler;
+
+// 外部公開用のメトリクスのスナップショット
+typedef struct {
+    int queue_depth;
+    int max_queue_depth;
+    int batch_size;
+    long long submitted;
+    long long served;
+    long long shed_queue_full;
+    long long shed_deadline;
+    double p99_latency;    // 直近窓での p99 (秒)
+    double p99_service;    // 直近窓でのバッチ処理時間の p99 (秒, AIMD が見る値)
+    double step_cost;
+} SchedMetrics;
+
+void sched_init(Scheduler* s, int max_batch, double p99_target) {
+    memset(s, 0, sizeof(*s));
+    s->max_batch = (max_batch > 0)? max_batch : 1;
+    s->batch_size = s->max_batch;
+    s->p99_target = p99_target;
+    s->step_cost = 1e-6;   // 初回実行までの仮の見積もり
+}
+
+// リクエスト1件の推定処理時間 (深度ステップ数 + リードアウト1回分)。
+// ステップ数は forward が実際に進む実効深度で、step_cost の EWMA と同じ数え方
+static double sched_estimate_cost(const Scheduler* s, const ServeRequest* r) {
+    return (r->steps + 1) * s->step_cost;
+}
+
+static void sched_heap_swap(Scheduler* s, int a, int b) {
+    ServeRequest* t = s->heap[a];
+    s->heap[a] = s->heap[b];
+    s->heap[b] = t;
+}
+
+static void sched_heap_push(Scheduler* s, ServeRequest* r) {
+    int i = s->size++;
+    s->heap[i] = r;
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(s->heap[parent]->deadline <= s->heap[i]->deadline) break;
+        sched_heap_swap(s, parent, i);
+        i = parent;
+    }
+}
+
+static ServeRequest* sched_heap_pop(Scheduler* s) {
+    ServeRequest* top = s->heap[0];
+    s->heap[0] = s->heap[--s->size];
+    int i = 0;
+    for(;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if(l < s->size && s->heap[l]->deadline < s->heap[m]->deadline) m = l;
+        if(r < s->size && s->heap[r]->deadline < s->heap[m]->deadline) m = r;
+        if(m == i) break;
+        sched_heap_swap(s, i, m);
+        i = m;
+    }
+    return top;
+}
+
+// リクエストを受け付ける。棄却した場合は 0 を返し r->status に理由が入る
+int sched_submit(Scheduler* s, TrieNode* root, ServeRequest* r) {
+    double now = now_seconds();
+    r->enqueue_time = now;
+    r->status = TRLM_STATUS_PENDING;
+    r->steps = trie_effective_depth(root, r->key);
+    s->submitted++;
+    if(s->size >= SCHED_MAX_QUEUE) {
+        r->status = TRLM_STATUS_SHED_QUEUE_FULL;
+        r->finish_time = now;
+        s->shed_queue_full++;
+        return 0;
+    }
+    // 単独で即実行しても間に合わないものは受付時点で棄却
+    if(now + sched_estimate_cost(s, r) > r->deadline) {
+        r->status = TRLM_STATUS_SHED_DEADLINE;
+        r->finish_time = now;
+        s->shed_deadline++;
+        return 0;
+    }
+    sched_heap_push(s, r);
+    if(s->size > s->max_queue_depth) s->max_queue_depth = s->size;
+    return 1;
+}
+
+static int cmp_float_asc(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+static double sched_window_p99(const float* window, int count) {
+    if(count == 0) return 0.0;
+    float sorted[SCHED_LAT_WINDOW];
+    memcpy(sorted, window, sizeof(float) * count);
+    qsort(sorted, count, sizeof(float), cmp_float_asc);
+    int idx = (int)(0.99 * (count - 1) + 0.5);
+    return sorted[idx];
+}
+
+static double sched_p99(const Scheduler* s) {
+    return sched_window_p99(s->lat_window, s->lat_count);
+}
+
+static void sched_record_latency(Scheduler* s, double latency, double service) {
+    s->lat_window[s->lat_pos] = (float)latency;
+    s->lat_pos = (s->lat_pos + 1) % SCHED_LAT_WINDOW;
+    if(s->lat_count < SCHED_LAT_WINDOW) s->lat_count++;
+    s->svc_window[s->svc_pos] = (float)service;
+    s->svc_pos = (s->svc_pos + 1) % SCHED_LAT_WINDOW;
+    if(s->svc_count < SCHED_LAT_WINDOW) s->svc_count++;
+}
+
+// キューから EDF 順に最大 batch_size 件を取り出して処理する。
+// バッチの全件はバッチの終了時刻に完了するので、足すと採用済みの最も早い締切を
+// 過ぎるリクエストはキューに残して次のバッチに回す。
+// 戻り値は処理 (完了 + 棄却) した件数
+int sched_dispatch(Scheduler* s, TrieNode* root) {
+    ServeRequest* batch[SCHED_MAX_QUEUE];
+    int n = 0, handled = 0;
+    double now = now_seconds();
+    double planned = now;          // バッチ全体の完了見込み
+    double earliest = HUGE_VAL;    // 採用済みの最も早い締切
+
+    while(s->size > 0 && n < s->batch_size) {
+        ServeRequest* r = sched_heap_pop(s);
+        double cost = sched_estimate_cost(s, r);
+        if(planned + cost > r->deadline) {
+            // 実行しても締切を過ぎるので計算資源を使わずに棄却
+            handled++;
+            r->status = TRLM_STATUS_SHED_DEADLINE;
+            r->finish_time = now;
+            s->shed_deadline++;
+            continue;
+        }
+        if(planned + cost > earliest) {
+            // 足すと先に採用した分が締切を過ぎるのでここで打ち切る
+            sched_heap_push(s, r);
+            break;
+        }
+        handled++;
+        planned += cost;
+        if(r->deadline < earliest) earliest = r->deadline;
+        batch[n++] = r;
+    }
+    if(n == 0) return handled;
+    trace_unit_begin();
+    double t_dispatch = trace_span_begin();
+
+    // 上位 key の事前計算 / テナント共有の状態キャッシュにある key は forward を省略する。
+    // 既定のリードアウトなら事前計算の出力をそのまま返す
+    const char* keys[SCHED_MAX_QUEUE];
+    int miss[SCHED_MAX_QUEUE];
+    unsigned char hot_done[SCHED_MAX_QUEUE];
+    int n_miss = 0;
+    float* H = (float*)calloc((size_t)n * RESERVOIR_SIZE, sizeof(float));
+    for(int b = 0; b < n; b++) {
+        hot_done[b] = 0;
+        if(s->heavy) hh_observe(s->heavy, batch[b]->key);
+        if(s->hot && hot_lookup(s->hot, batch[b]->key, H + b * RESERVOIR_SIZE, batch[b]->probs)) {
+            hot_done[b] = (batch[b]->tenant == NULL || s->tenants == NULL);
+            continue;
+        }
+        if(s->tenants && tenant_state_lookup(s->tenants, batch[b]->key, H + b * RESERVOIR_SIZE)) continue;
+        keys[n_miss] = batch[b]->key;
+        miss[n_miss++] = b;
+    }
+    float* M = (float*)calloc((size_t)n_miss * RESERVOIR_SIZE + 1, sizeof(float));
+    long long steps = n;
+    if(s->prefix) {
+        // 共有プレフィックスの状態を再利用する (1 key ずつ, 計算したステップだけ数える)
+        long before = atomic_load(&s->prefix->steps_computed);
+        for(int k = 0; k < n_miss; k++) {
+            trie_reservoir_forward_cached(root, s->prefix, keys[k], M + k * RESERVOIR_SIZE);
+        }
+        steps += atomic_load(&s->prefix->steps_computed) - before;
+    } else if(n_miss > 0) {
+        steps += trie_reservoir_forward_batch(root, keys, n_miss, M);
+    }
+    for(int k = 0; k < n_miss; k++) {
+        memcpy(H + miss[k] * RESERVOIR_SIZE, M + k * RESERVOIR_SIZE, sizeof(float) * RESERVOIR_SIZE);
+        if(s->tenants) tenant_state_insert(s->tenants, keys[k], M + k * RESERVOIR_SIZE);
+    }
+    free(M);
+    double t_readout = trace_span_begin();
+    for(int b = 0; b < n; b++) {
+        const float* W = &readout_weights[0][0];
+        if(hot_done[b]) {
+            batch[b]->status = TRLM_STATUS_OK;
+            continue;
+        }
+        if(batch[b]->tenant && s->tenants) {
+            ReadoutHead* head = tenant_get(s->tenants, batch[b]->tenant);
+            if(!head) {
+                batch[b]->status = TRLM_STATUS_UNKNOWN_TENANT;
+                continue;
+            }
+            W = head->weights;
+        }
+        readout_forward_w(W, H + b * RESERVOIR_SIZE, batch[b]->probs);
+        batch[b]->status = TRLM_STATUS_OK;
+    }
+    trace_span_end("readout", t_readout, "rows", n);
+    free(H);
+    trace_span_end("dispatch", t_dispatch, "rows", n);
+    trace_unit_end();
+    double done = now_seconds();
+
+    // 実測からステップコストを更新 (EWMA)
+    double observed = (done - now) / (double)steps;
+    s->step_cost = 0.8 * s->step_cost + 0.2 * observed;
+
+    // バッチ単位で結果を返すので、全件の完了時刻はバッチ終了時刻
+    for(int b = 0; b < n; b++) {
+        batch[b]->finish_time = done;
+        if(batch[b]->status != TRLM_STATUS_OK) continue;
+        sched_record_latency(s, done - batch[b]->enqueue_time, done - now);
+        s->served++;
+    }
+
+    // 処理時間の p99 が目標を超えたらバッチを半減、余裕があれば 1 ずつ戻す。
+    // キュー待ちはバッチを縮めても減らない (過負荷ではむしろ増える) ので判定に含めない。
+    // 半減は窓が新しいバッチサイズの標本で埋まってからにし、1 回の遅いバッチで
+    // 何度も縮めない
+    double svc_p99 = sched_window_p99(s->svc_window, s->svc_count);
+    if(svc_p99 > s->p99_target) {
+        if(s->svc_count == SCHED_LAT_WINDOW && s->batch_size > 1) {
+            s->batch_size /= 2;
+            s->svc_count = 0;
+            s->svc_pos = 0;
+        }
+    } else if(s->svc_count > 0 && svc_p99 < 0.8 * s->p99_target && s->batch_size < s->max_batch) {
+        s->batch_size++;
+    }
+    return handled;
+}
+
+SchedMetrics sched_metrics(const Scheduler* s) {
+    SchedMetrics m;
+    m.queue_depth = s->size;
+    m.max_queue_depth = s->max_queue_depth;
+    m.batch_size = s->batch_size;
+    m.submitted = s->submitted;
+    m.served = s->served;
+    m.shed_queue_full = s->shed_queue_full;
+    m.shed_deadline = s->shed_deadline;
+    m.p99_latency = sched_p99(s);
+    m.p99_service = sched_window_p99(s->svc_window, s->svc_count);
+    m.step_cost = s->step_cost;
+    return m;
+}
+
+// =========================================================
+// 実効深度ごとのバケット化バッチャ
+//   受付時に key の実効深度を求めて同じ深度のバケットに入れ、
+//   バッチは 1 つのバケットからだけ作る。バッチ内の全行が同じ
+//   ステップ数で終わるので、途中で遊ぶレーンが発生しない。
+//   pipeline_score (bucket) が chunk ごとのバッチ分けに使う。
+// =========================================================
+typedef struct {
+    const char* key;
+    int tag;               // 呼び出し側の識別子 (結果の書き戻し先など)
+} BatchItem;
+
+typedef struct {
+    BatchItem* items[MAX_DEPTH + 1];   // 深度ごとの FIFO
+    int count[MAX_DEPTH + 1];
+    int cap[MAX_DEPTH + 1];
+    int pending;
+} DepthBatcher;
+
+void depth_batcher_init(DepthBatcher* b) {
+    memset(b, 0, sizeof(*b));
+}
+
+void depth_batcher_free(DepthBatcher* b) {
+    for(int d = 0; d <= MAX_DEPTH; d++) free(b->items[d]);
+    memset(b, 0, sizeof(*b));
+}
+
+void depth_batcher_add(DepthBatcher* b, TrieNode* root, const char* key, int tag) {
+    int d = trie_effective_depth(root, key);
+    if(b->count[d] == b->cap[d]) {
+        b->cap[d] = b->cap[d]? b->cap[d] * 2 : 64;
+        b->items[d] = (BatchItem*)realloc(b->items[d], sizeof(BatchItem) * b->cap[d]);
+    }
+    b->items[d][b->count[d]].key = key;
+    b->items[d][b->count[d]].tag = tag;
+    b->count[d]++;
+    b->pending++;
+}
+
+// max_batch 件以上溜まっているバケットがあれば 1
+int depth_batcher_full(const DepthBatcher* b, int max_batch) {
+    for(int d = 0; d <= MAX_DEPTH; d++) {
+        if(b->count[d] >= max_batch) return 1;
+    }
+    return 0;
+}
+
+// 最も多く溜まっているバケット (同数なら深い方) から最大 max_batch 件を
+// 受付順に取り出す。戻り値は件数、out_depth にそのバケットの深度が入る
+int depth_batcher_next(DepthBatcher* b, int max_batch, BatchItem* out, int* out_depth) {
+    int best = -1;
+    for(int d = MAX_DEPTH; d >= 0; d--) {
+        if(b->count[d] > 0 && (best < 0 || b->count[d] > b->count[best])) best = d;
+    }
+    if(best < 0) return 0;
+    int n = (b->count[best] < max_batch)? b->count[best] : max_batch;
+    memcpy(out, b->items[best], sizeof(BatchItem) * n);
+    memmove(b->items[best], b->items[best] + n, sizeof(BatchItem) * (b->count[best] - n));
+    b->count[best] -= n;
+    b->pending -= n;
+    if(out_depth) *out_depth = best;
+    return n;
+}
+
+// -------------------------
+// 1 行 1 key のテキストを読む (改行は取り除く)。EOF で NULL
 // -------------------------
-typedef struct TrieNode {
-    struct TrieNode* children[MAX_CHILDREN];
-    // 固定深度管理 (rootのdepth=0, 1, 2, ..., D-1)
-    int depth;
-    // 子があるかどうかのフラグ
-    int is_leaf;
-} TrieNode;
+static char* read_key_line(FILE* fp) {
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len = getline(&line, &cap, fp);
+    if(len < 0) {
+        free(line);
+        return NULL;
+    }
+    while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+    return line;
+}
 
-// -------------------------
-// Trieノード作成
-// -------------------------
-TrieNode* create_trie_node(int depth) {
-    TrieNode* node = (TrieNode*)calloc(1, sizeof(TrieNode));
-    node->depth = depth;
-    node->is_leaf = 0;
-    for(int i = 0; i < MAX_CHILDREN; i++) {
-        node->children[i] = NULL;
+// ファイルの全行を Trie に挿入する。戻り値は挿入した key 数
+long trie_insert_file(TrieNode* root, FILE* fp) {
+    long n = 0;
+    char* line;
+    while((line = read_key_line(fp)) != NULL) {
+        if(line[0] != '\0') {
+            trie_insert(root, line);
+            n++;
+        }
+        free(line);
     }
-    return node;
+    return n;
 }
 
-// -------------------------
-// Trie への挿入 (深度MAX_DEPTHで打ち切る)
-// -------------------------
-void trie_insert(TrieNode* root, const char* str) {
-    TrieNode* cur = root;
-    int length = (int)strlen(str);
-    for(int i = 0; i < length && i < MAX_DEPTH; i++) {
-        unsigned char c = (unsigned char)str[i];
-        if(cur->children[c] == NULL) {
-            cur->children[c] = create_trie_node(cur->depth + 1);
+// =========================================================
+// NUMA: トポロジ検出, 読み取り専用モデルのノード別複製, ワーカーの固定
+//   /sys/devices/system/node/nodeN/cpulist からノードと CPU を読む
+//   (読めなければ全 CPU を持つ 1 ノードとみなす)。
+//   複製はそのノードに固定したスレッドで確保・書き込みする (first-touch)
+//   ので、ページはノードのローカルメモリに載る。複製するのは
+//   frozen の Trie, バッチ推論が読む形式のリザバー重み (fp32 か fp16 / bf16),
+//   リードアウト重み。int8 / 疎行列の派生行列は複製せず共有のものを使う。
+// =========================================================
+#define NUMA_MAX_NODES 16
+#define NUMA_MAX_CPUS 1024
+
+typedef struct {
+    int n_nodes;
+    int node_id[NUMA_MAX_NODES];    // sysfs 上のノード番号
+    int n_cpus[NUMA_MAX_NODES];
+    int* cpus[NUMA_MAX_NODES];      // ノードに属する CPU 番号
+} NumaTopology;
+
+// "0-3,8-11" 形式の CPU リストを読む。戻り値は個数
+static int numa_parse_cpulist(const char* s, int* out, int max) {
+    int n = 0;
+    while(*s && *s != '\n') {
+        char* end;
+        long a = strtol(s, &end, 10);
+        if(end == s) break;
+        long b = a;
+        s = end;
+        if(*s == '-') {
+            b = strtol(s + 1, &end, 10);
+            s = end;
         }
-        cur = cur->children[c];
+        for(long c = a; c <= b && n < max; c++) out[n++] = (int)c;
+        if(*s == ',') s++;
     }
-    cur->is_leaf = 1;
+    return n;
 }
 
-// ---------------------------------------------------------
-// リザバー用の重み行列 W^(l) を深度ごとに用意
-//   reservoir_weights[l][ i*RESERVOIR_SIZE + j ]
-//   => depth l の RESERVOIR_SIZE×RESERVOIR_SIZE 行列
-// ---------------------------------------------------------
-static float** reservoir_weights = NULL;
+void numa_topology_detect(NumaTopology* t) {
+    memset(t, 0, sizeof(*t));
+    for(int node = 0; node < 256 && t->n_nodes < NUMA_MAX_NODES; node++) {
+        char path[128], buf[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* fp = fopen(path, "r");
+        if(!fp) continue;
+        int ok = fgets(buf, sizeof(buf), fp) != NULL;
+        fclose(fp);
+        if(!ok) continue;
+        int* cpus = (int*)malloc(sizeof(int) * NUMA_MAX_CPUS);
+        int n = numa_parse_cpulist(buf, cpus, NUMA_MAX_CPUS);
+        if(n == 0) {  // メモリだけのノード
+            free(cpus);
+            continue;
+        }
+        t->node_id[t->n_nodes] = node;
+        t->n_cpus[t->n_nodes] = n;
+        t->cpus[t->n_nodes] = cpus;
+        t->n_nodes++;
+    }
+    if(t->n_nodes == 0) {
+        long n = 1;
+#ifdef __linux__
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        if(n < 1) n = 1;
+#endif
+        t->n_nodes = 1;
+        t->n_cpus[0] = (int)n;
+        t->cpus[0] = (int*)malloc(sizeof(int) * n);
+        for(int c = 0; c < n; c++) t->cpus[0][c] = c;
+    }
+}
 
-// -------------------------
-// リザバー重みの初期化
-//  - まず乱数で埋める
-//  - スペクトル半径を RHO 程度にするため、
-//    固有値計算は省略し、雑に(1/norm)でスケーリング
-// -------------------------
-void init_reservoir_weights(int depth_count) {
-    reservoir_weights = (float**)malloc(sizeof(float*) * depth_count);
-    srand((unsigned int)time(NULL));
+void numa_topology_free(NumaTopology* t) {
+    for(int i = 0; i < t->n_nodes; i++) free(t->cpus[i]);
+    memset(t, 0, sizeof(*t));
+}
 
-    for(int l = 0; l < depth_count; l++) {
-        reservoir_weights[l] = (float*)malloc(sizeof(float) * RESERVOIR_SIZE * RESERVOIR_SIZE);
-        // 乱数で初期化
-        float norm_sum = 0.0f;
-        for(int i = 0; i < RESERVOIR_SIZE * RESERVOIR_SIZE; i++) {
-            reservoir_weights[l][i] = rand_float();
-            norm_sum += fabsf(reservoir_weights[l][i]);
+// 呼び出しスレッドをノード (添字) の CPU 群に固定する。成功で 0
+int numa_pin_thread(const NumaTopology* t, int node_index) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int i = 0; i < t->n_cpus[node_index]; i++) {
+        if(t->cpus[node_index][i] < CPU_SETSIZE) CPU_SET(t->cpus[node_index][i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0? 0 : -1;
+#else
+    (void)t;
+    (void)node_index;
+    return -1;
+#endif
+}
+
+typedef struct {
+    int node;               // sysfs 上のノード番号
+    TrieBackend trie;       // frozen
+    float** weights;        // fp32 形式なら reservoir_depth_count 個の R x R (他は NULL)
+    unsigned short** weights_h;  // fp16 / bf16 形式なら同じく 16 bit の R x R (他は NULL)
+    float* readout;         // OUT_DIM x R
+    size_t bytes;
+} NumaReplica;
+
+typedef struct {
+    const NumaTopology* topo;
+    int index;
+    TrieNode* root;
+    NumaReplica* out;
+} NumaBuildJob;
+
+static void* numa_replica_build_worker(void* p) {
+    NumaBuildJob* job = (NumaBuildJob*)p;
+    NumaReplica* r = job->out;
+    numa_pin_thread(job->topo, job->index);
+    r->node = job->topo->node_id[job->index];
+    trie_backend_frozen(&r->trie, job->root);
+    // バッチ推論が読む形式の重みだけを複製する (int8 / 疎行列は共有のまま)
+    r->weights = NULL;
+    r->weights_h = NULL;
+    r->bytes = r->trie.bytes(r->trie.impl) + sizeof(readout_weights);
+    if(reservoir_config.format == RES_WEIGHTS_F32) {
+        const size_t mat = sizeof(float) * RESERVOIR_SIZE * RESERVOIR_SIZE;
+        r->weights = (float**)malloc(sizeof(float*) * reservoir_depth_count);
+        for(int l = 0; l < reservoir_depth_count; l++) {
+            r->weights[l] = (float*)malloc(mat);
+            memcpy(r->weights[l], reservoir_weights[l], mat);
         }
-        // 平均絶対値でスケーリングする簡易版
-        float avg_abs = norm_sum / (RESERVOIR_SIZE * RESERVOIR_SIZE);
-        float scale = (avg_abs > 1e-5f)? (RHO / avg_abs) : 1.0f;
-        for(int i = 0; i < RESERVOIR_SIZE * RESERVOIR_SIZE; i++) {
-            reservoir_weights[l][i] *= scale;
+        r->bytes += reservoir_depth_count * mat;
+    } else if(reservoir_weights_h) {
+        const size_t mat = sizeof(unsigned short) * RESERVOIR_SIZE * RESERVOIR_SIZE;
+        r->weights_h = (unsigned short**)malloc(sizeof(unsigned short*) * reservoir_depth_count);
+        for(int l = 0; l < reservoir_depth_count; l++) {
+            r->weights_h[l] = (unsigned short*)malloc(mat);
+            memcpy(r->weights_h[l], reservoir_weights_h[l], mat);
         }
+        r->bytes += reservoir_depth_count * mat;
     }
+    r->readout = (float*)malloc(sizeof(readout_weights));
+    memcpy(r->readout, readout_weights, sizeof(readout_weights));
+    return NULL;
 }
 
-// -------------------------
-// リザバー状態を1ステップ更新する
-//  h_{l+1} = alpha * tanh(W^(l) * h_l + noise)
-// -------------------------
-void reservoir_update(const float* Wl, float* h_inout) {
-    static float tmp[RESERVOIR_SIZE];
-    // W^(l) * h(l)
-    matvec(Wl, h_inout, tmp);
-    // ノイズを加える (非常に小さい値)
-    for(int i = 0; i < RESERVOIR_SIZE; i++) {
-        tmp[i] += 0.01f * rand_float(); 
+// ノードごとに複製を作る (ノード数だけ並列に)。out は t->n_nodes 個
+void numa_replicas_build(NumaReplica* out, const NumaTopology* t, TrieNode* root) {
+    pthread_t th[NUMA_MAX_NODES];
+    NumaBuildJob jobs[NUMA_MAX_NODES];
+    for(int i = 0; i < t->n_nodes; i++) {
+        jobs[i] = (NumaBuildJob){ t, i, root, &out[i] };
+        pthread_create(&th[i], NULL, numa_replica_build_worker, &jobs[i]);
     }
-    // tanh + alpha
-    for(int i = 0; i < RESERVOIR_SIZE; i++) {
-        float z = activate_tanh(tmp[i]);
-        h_inout[i] = ALPHA * z;
+    for(int i = 0; i < t->n_nodes; i++) pthread_join(th[i], NULL);
+}
+
+void numa_replicas_free(NumaReplica* r, int n) {
+    for(int i = 0; i < n; i++) {
+        trie_backend_destroy(&r[i].trie);
+        for(int l = 0; l < reservoir_depth_count; l++) {
+            if(r[i].weights) free(r[i].weights[l]);
+            if(r[i].weights_h) free(r[i].weights_h[l]);
+        }
+        free(r[i].weights);
+        free(r[i].weights_h);
+        free(r[i].readout);
     }
 }
 
-// -------------------------
-// (1) 文字列を1つ与え、Trieを深さ方向に進む
-// (2) 各深度ごとにリザバー状態を更新
-// => 最終的な状態ベクトル h(D) を得る
-// -------------------------
-void trie_reservoir_forward(TrieNode* root, const char* input, float* h_state) {
-    TrieNode* cur = root;
-    int length = (int)strlen(input);
+// =========================================================
+// バッチ推論パイプライン (ファイル -> ファイル)
+//   読み込み (メインスレッド) -> 並列推論 (ワーカー) -> 書き出し (メインスレッド)
+//   を chunk 単位で繰り返す。ワーカーは chunk 内のバッチを atomic カウンタで
+//   取り合い、各バッチを trie_reservoir_forward_batch で処理する。
+//   bucket を立てると chunk の行を DepthBatcher で実効深度ごとに分け、
+//   同じ深度の行だけでバッチを作る (バッチ内の行が同じステップ数で終わるので、
+//   深い段の GEMM も行数が減らない)。
+//   numa を立てるとノードごとにモデルの複製を作り、ワーカー t をノード
+//   t % ノード数 に固定して、そのノードの複製でバッチを処理する。
+//   立てなければ同じ frozen 表現の Trie を 1 つ作って全ワーカーで共有する。
+//   出力は入力と同じ順に 1 行 1 key: "key\tp0 p1 ..."
+// =========================================================
+// バッチの詰まり具合 (pipeline_score が加算する)。
+// row_steps / gemm_steps が 1 回の深度ステップの GEMM の平均行数
+typedef struct {
+    _Atomic long batches;
+    _Atomic long gemm_steps;   // バッチごとの最大実効深度の合計 (= GEMM の回数)
+    _Atomic long row_steps;    // 行ごとの実効深度の合計
+} PipelineStats;
 
-    // リザバー状態 h_state は呼び出し前にゼロクリアしておく想定
+typedef struct {
+    TrieNode* root;
+    int threads;       // ワーカー数
+    int batch;         // 1 バッチの行数
+    int numa;          // 1: NUMA ノードごとに複製してワーカーを固定する
+    int bucket;        // 1: 実効深度ごとのバケットからバッチを作る
+    PipelineStats* stats;  // NULL でなければバッチの詰まり具合を数える
+    unsigned int seed;     // ノイズの種 (バッチごとに先頭行の通し番号から決めるので、
+                           // 同じ入力・設定なら実行ごとに同じ出力になる)
+} PipelineConfig;
 
-    for(int i = 0; i < length && i < MAX_DEPTH; i++) {
-        unsigned char c = (unsigned char)input[i];
-        if(cur->children[c] == NULL) {
-            // ノードが存在しなければ中断 (実運用なら生成 or 例外処理)
+typedef struct {
+    const PipelineConfig* cfg;
+    const NumaTopology* topo;  // numa 無効なら NULL
+    NumaReplica* replicas;     // topo->n_nodes 個
+    TrieBackend trie;          // numa 無効時に全ワーカーで共有する Trie (複製と同じ frozen 表現)
+    char** lines;
+    float* probs;              // chunk x OUT_DIM
+    int n;                     // 現在の chunk の行数
+    long base;                 // 現在の chunk の先頭行の通し番号
+    int* order;                // バッチに並べた行番号 (chunk 個)
+    int* batch_off;            // バッチ j は order[batch_off[j] .. batch_off[j+1]-1]
+    int n_batches;
+    _Atomic int next;          // 次に取るバッチの番号
+    int stop;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+} PipelineShared;
+
+typedef struct {
+    PipelineShared* sh;
+    int id;
+} PipelineWorker;
+
+static void* pipeline_worker(void* p) {
+    PipelineWorker* w = (PipelineWorker*)p;
+    PipelineShared* sh = w->sh;
+    const int batch = sh->cfg->batch;
+    char name[32];
+    snprintf(name, sizeof(name), "worker-%d", w->id);
+    trace_set_thread_name(name);
+    // 使うモデル: 既定は共有の Trie と重み, numa なら固定先ノードの複製
+    const TrieBackend* tb = &sh->trie;
+    float* const* W = reservoir_weights;
+    unsigned short* const* Wh = NULL;
+    const float* RO = &readout_weights[0][0];
+    if(sh->topo) {
+        int node = w->id % sh->topo->n_nodes;
+        numa_pin_thread(sh->topo, node);
+        tb = &sh->replicas[node].trie;
+        W = sh->replicas[node].weights;
+        Wh = sh->replicas[node].weights_h;
+        RO = sh->replicas[node].readout;
+    }
+    float* H = (float*)malloc(sizeof(float) * batch * RESERVOIR_SIZE);
+    const char** keys = (const char**)malloc(sizeof(char*) * batch);
+
+    for(;;) {
+        pthread_barrier_wait(&sh->start);
+        if(sh->stop) break;
+        for(;;) {
+            int j = atomic_fetch_add(&sh->next, 1);
+            if(j >= sh->n_batches) break;
+            const int* rows_of = sh->order + sh->batch_off[j];
+            int rows = sh->batch_off[j + 1] - sh->batch_off[j];
+            trace_unit_begin();
+            for(int r = 0; r < rows; r++) keys[r] = sh->lines[rows_of[r]];
+            noise_seed(sh->cfg->seed + (unsigned int)(sh->base + sh->batch_off[j]) * 2654435761u);
+            memset(H, 0, sizeof(float) * rows * RESERVOIR_SIZE);
+            long steps = trie_backend_forward_batch_w(tb, W, Wh, keys, rows, H);
+            if(sh->cfg->stats) {
+                int deepest = 0;
+                for(int r = 0; r < rows; r++) {
+                    int d = trie_backend_effective_depth(tb, keys[r]);
+                    if(d > deepest) deepest = d;
+                }
+                atomic_fetch_add(&sh->cfg->stats->batches, 1);
+                atomic_fetch_add(&sh->cfg->stats->gemm_steps, deepest);
+                atomic_fetch_add(&sh->cfg->stats->row_steps, steps);
+            }
+            double t_ro = trace_span_begin();
+            for(int r = 0; r < rows; r++) {
+                readout_forward_w(RO, H + r * RESERVOIR_SIZE, sh->probs + rows_of[r] * OUT_DIM);
+            }
+            trace_span_end("readout", t_ro, "rows", rows);
+            trace_unit_end();
+        }
+        pthread_barrier_wait(&sh->done);
+    }
+    free(keys);
+    free(H);
+    return NULL;
+}
+
+// in の全行を推論して out に書く。戻り値は処理した行数
+long pipeline_score(const PipelineConfig* cfg, FILE* in, FILE* out) {
+    const int threads = (cfg->threads > 0)? cfg->threads : 1;
+    const int chunk = threads * cfg->batch * 4;
+    PipelineShared sh;
+    memset(&sh, 0, sizeof(sh));
+    sh.cfg = cfg;
+    NumaTopology topo;
+    NumaReplica replicas[NUMA_MAX_NODES];
+    if(cfg->numa) {
+        numa_topology_detect(&topo);
+        numa_replicas_build(replicas, &topo, cfg->root);
+        sh.topo = &topo;
+        sh.replicas = replicas;
+    } else {
+        // 複製と同じ frozen 表現を 1 つ作って共有する (numa 有無の差を複製と固定だけにする)
+        trie_backend_frozen(&sh.trie, cfg->root);
+    }
+    sh.lines = (char**)malloc(sizeof(char*) * chunk);
+    sh.probs = (float*)malloc(sizeof(float) * chunk * OUT_DIM);
+    sh.order = (int*)malloc(sizeof(int) * chunk);
+    sh.batch_off = (int*)malloc(sizeof(int) * (chunk + 1));
+    DepthBatcher db;
+    depth_batcher_init(&db);
+    BatchItem* items = (BatchItem*)malloc(sizeof(BatchItem) * cfg->batch);
+    pthread_barrier_init(&sh.start, NULL, threads + 1);
+    pthread_barrier_init(&sh.done, NULL, threads + 1);
+
+    trace_set_thread_name("io");
+    pthread_t* th = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    PipelineWorker* ws = (PipelineWorker*)malloc(sizeof(PipelineWorker) * threads);
+    for(int t = 0; t < threads; t++) {
+        ws[t].sh = &sh;
+        ws[t].id = t;
+        pthread_create(&th[t], NULL, pipeline_worker, &ws[t]);
+    }
+
+    long total = 0;
+    for(;;) {
+        trace_unit_begin();
+        double t_read = trace_span_begin();
+        int n = 0;
+        char* line;
+        while(n < chunk && (line = read_key_line(in)) != NULL) sh.lines[n++] = line;
+        trace_span_end("read", t_read, "rows", n);
+        if(n == 0) {
+            trace_unit_end();
             break;
         }
-        // depth l に応じた重みで更新
-        int l = cur->depth;  // 0,1,2... (最大MAX_DEPTH-1)
-        reservoir_update(reservoir_weights[l], h_state);
 
-        cur = cur->children[c];
+        sh.n = n;
+        sh.base = total;
+        sh.n_batches = 0;
+        sh.batch_off[0] = 0;
+        if(cfg->bucket) {
+            // 満杯のバケットは 1 バケット 1 バッチにし、残りの端数はまとめて
+            // batch 行ずつに切る (端数ごとに小さなバッチを作らない)
+            for(int i = 0; i < n; i++) depth_batcher_add(&db, cfg->root, sh.lines[i], i);
+            int rows, pos = 0;
+            while(depth_batcher_full(&db, cfg->batch)) {
+                rows = depth_batcher_next(&db, cfg->batch, items, NULL);
+                for(int r = 0; r < rows; r++) sh.order[pos++] = items[r].tag;
+                sh.batch_off[++sh.n_batches] = pos;
+            }
+            const int full_end = pos;
+            while((rows = depth_batcher_next(&db, cfg->batch, items, NULL)) > 0) {
+                for(int r = 0; r < rows; r++) sh.order[pos++] = items[r].tag;
+            }
+            for(int b0 = full_end; b0 < pos; b0 += cfg->batch) {
+                sh.batch_off[++sh.n_batches] = (pos - b0 < cfg->batch)? pos : b0 + cfg->batch;
+            }
+        } else {
+            for(int i = 0; i < n; i++) sh.order[i] = i;
+            for(int b0 = 0; b0 < n; b0 += cfg->batch) {
+                sh.batch_off[++sh.n_batches] = (n - b0 < cfg->batch)? n : b0 + cfg->batch;
+            }
+        }
+        atomic_store(&sh.next, 0);
+        pthread_barrier_wait(&sh.start);
+        pthread_barrier_wait(&sh.done);
+
+        double t_write = trace_span_begin();
+        for(int i = 0; i < n; i++) {
+            fprintf(out, "%s\t", sh.lines[i]);
+            for(int k = 0; k < OUT_DIM; k++) {
+                fprintf(out, (k + 1 < OUT_DIM)? "%.6f " : "%.6f\n", sh.probs[i * OUT_DIM + k]);
+            }
+            free(sh.lines[i]);
+        }
+        trace_span_end("write", t_write, "rows", n);
+        trace_unit_end();
+        total += n;
     }
 
-    // 入力を最後まで/最大深度まで辿った時点で h_state が「最終状態」
-    // ここでは何もしない
+    sh.stop = 1;
+    pthread_barrier_wait(&sh.start);
+    for(int t = 0; t < threads; t++) pthread_join(th[t], NULL);
+    pthread_barrier_destroy(&sh.start);
+    pthread_barrier_destroy(&sh.done);
+    free(ws);
+    free(th);
+    free(items);
+    depth_batcher_free(&db);
+    free(sh.batch_off);
+    free(sh.order);
+    free(sh.probs);
+    free(sh.lines);
+    if(cfg->numa) {
+        numa_replicas_free(replicas, topo.n_nodes);
+        numa_topology_free(&topo);
+    } else {
+        trie_backend_destroy(&sh.trie);
+    }
+    return total;
 }
 
-// -------------------------
-// リードアウト部：単純な全結合＋softmax想定
-//   out_dim = 語彙数 (サンプルなので少数にしている)
-// -------------------------
-#define OUT_DIM 4   // 出力次元(例: 4語彙だとする)
-static float readout_weights[OUT_DIM][RESERVOIR_SIZE]; // 語彙数 × リザバー次元
+// =========================================================
+// 状態の一括書き出し (NumPy .npy)
+//   key ファイル (1 行 "key" または "key<TAB>label") の各行の状態を
+//     STATES.npy: float32 (N, RESERVOIR_SIZE)  最終状態
+//                 per_depth なら (N, MAX_DEPTH, RESERVOIR_SIZE)。[i, d] は d + 1 ステップ後
+//                 の状態で、実効深度より先は最終状態を繰り返す
+//     LABELS.npy: int32 (N,)  TAB の後の整数 (無ければ -1)
+//   に書く。入力は mmap して EXPORT_CHUNK_BYTES ごとの行境界で区切り、
+//   1 パス目で各区間の行数を数えて書き込み先の行を決め、出力は先に大きさを
+//   決めて mmap (MAP_SHARED) しておく。2 パス目は各スレッドが区間を取り、
+//   互いに重ならない行に lock 無しで直接書く。
+//   ノイズの種は区間内のバッチ (per_depth なら行) ごとに行番号から決めるので、
+//   スレッド数によらず同じ出力になる
+// =========================================================
+#define EXPORT_CHUNK_BYTES (4 << 20)
+#define EXPORT_BATCH 64
 
-// 初期化
-void init_readout() {
-    for(int i = 0; i < OUT_DIM; i++) {
-        for(int j = 0; j < RESERVOIR_SIZE; j++) {
-            readout_weights[i][j] = 0.01f * rand_float();
+typedef struct {
+    TrieNode* root;
+    int threads;
+    int per_depth;          // 1 なら深度ごとの状態も書く
+    unsigned int seed;
+} ExportConfig;
+
+typedef struct {
+    const char* begin;
+    const char* end;
+    long rows;              // 区間の行数
+    long first_row;         // 区間の先頭行の番号
+} ExportChunk;
+
+typedef struct {
+    const ExportConfig* cfg;
+    TrieBackend tb;
+    ExportChunk* chunks;
+    int n_chunks;
+    _Atomic int next;
+    float* states;          // 出力の mmap (ヘッダの後)
+    int* labels;
+    int pass;               // 1: 行数を数える, 2: 書く
+} ExportShared;
+
+// .npy (version 1.0) のヘッダを書く。ヘッダの長さ (64 の倍数) を返す
+static size_t npy_header(char* buf, size_t cap, const char* descr, const long* shape, int ndim) {
+    char dict[256];
+    int n = snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (", descr);
+    for(int i = 0; i < ndim; i++) n += snprintf(dict + n, sizeof(dict) - n, (i + 1 < ndim)? "%ld, " : "%ld", shape[i]);
+    if(ndim == 1) dict[n++] = ',';   // 1 次元はタプルの末尾に ',' が要る
+    n += snprintf(dict + n, sizeof(dict) - n, "), }");
+    size_t total = (10 + (size_t)n + 1 + 63) & ~(size_t)63;   // magic(6) + version(2) + 長さ(2) + dict + '\n'
+    if(total > cap) return 0;
+    memcpy(buf, "\x93NUMPY\x01\x00", 8);
+    unsigned short hlen = (unsigned short)(total - 10);
+    buf[8] = (char)(hlen & 0xff);
+    buf[9] = (char)(hlen >> 8);
+    memcpy(buf + 10, dict, n);
+    memset(buf + 10 + n, ' ', total - 10 - n - 1);
+    buf[total - 1] = '\n';
+    return total;
+}
+
+// ヘッダ + bytes の .npy を作って mmap する。データ部の先頭を返す (失敗で NULL)
+static void* npy_create(const char* path, const char* descr, const long* shape, int ndim, size_t bytes,
+                        void** map, size_t* map_bytes) {
+    char hdr[256];
+    size_t hlen = npy_header(hdr, sizeof(hdr), descr, shape, ndim);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || hlen == 0) {
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+    *map_bytes = hlen + bytes;
+    if(ftruncate(fd, (off_t)*map_bytes) != 0) {
+        close(fd);
+        return NULL;
+    }
+    *map = mmap(NULL, *map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(*map == MAP_FAILED) return NULL;
+    memcpy(*map, hdr, hlen);
+    return (char*)*map + hlen;
+}
+
+// 行 (改行を含まない) から key を取り出して buf に入れ、label を返す
+static int export_parse_line(const char* line, const char* end, char* buf) {
+    const char* tab = memchr(line, '\t', end - line);
+    const char* kend = tab? tab : end;
+    if(kend > line && kend[-1] == '\r') kend--;
+    size_t len = kend - line;
+    if(len > MAX_DEPTH) len = MAX_DEPTH;   // MAX_DEPTH より先は状態に効かない
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    if(!tab) return -1;
+    char num[32];
+    size_t nl = end - tab - 1;
+    if(nl >= sizeof(num)) nl = sizeof(num) - 1;
+    memcpy(num, tab + 1, nl);
+    num[nl] = '\0';
+    char* stop;
+    long v = strtol(num, &stop, 10);
+    return (stop == num)? -1 : (int)v;
+}
+
+static void export_chunk(ExportShared* sh, ExportChunk* c) {
+    if(sh->pass == 1) {
+        long rows = 0;
+        for(const char* p = c->begin; p < c->end; ) {
+            const char* nl = memchr(p, '\n', c->end - p);
+            rows++;
+            p = nl? nl + 1 : c->end;
+        }
+        c->rows = rows;
+        return;
+    }
+    const int per_depth = sh->cfg->per_depth;
+    char keybuf[EXPORT_BATCH][MAX_DEPTH + 1];
+    const char* keys[EXPORT_BATCH];
+    long row = c->first_row;
+    const char* p = c->begin;
+    while(p < c->end) {
+        int n = 0;
+        long batch_row = row;
+        while(n < EXPORT_BATCH && p < c->end) {
+            const char* nl = memchr(p, '\n', c->end - p);
+            const char* e = nl? nl : c->end;
+            sh->labels[row + n] = export_parse_line(p, e, keybuf[n]);
+            keys[n] = keybuf[n];
+            n++;
+            p = nl? nl + 1 : c->end;
         }
+        if(!per_depth) {
+            float* H = sh->states + (size_t)batch_row * RESERVOIR_SIZE;
+            memset(H, 0, sizeof(float) * RESERVOIR_SIZE * n);
+            noise_seed(sh->cfg->seed + (unsigned int)batch_row * 2654435761u);
+            trie_backend_forward_batch(&sh->tb, keys, n, H);
+        } else {
+            for(int b = 0; b < n; b++) {
+                float* out = sh->states + (size_t)(batch_row + b) * MAX_DEPTH * RESERVOIR_SIZE;
+                float h[RESERVOIR_SIZE] = {0};
+                noise_seed(sh->cfg->seed + (unsigned int)(batch_row + b) * 2654435761u);
+                TrieRef path[MAX_DEPTH + 1];
+                const int len = trie_backend_path(&sh->tb, keys[b], path);
+                int d = 0;
+                for(; d < len; d++) {
+                    reservoir_step(sh->tb.depth(sh->tb.impl, path[d]), h);
+                    memcpy(out + (size_t)d * RESERVOIR_SIZE, h, sizeof(h));
+                }
+                for(; d < MAX_DEPTH; d++) memcpy(out + (size_t)d * RESERVOIR_SIZE, h, sizeof(h));
+            }
+        }
+        row += n;
     }
 }
 
-// 全結合 + softmax
-void readout_forward(const float* h_state, float* out_probs) {
-    // z = W * h_state
-    float sum_exp = 0.0f;
-    for(int i = 0; i < OUT_DIM; i++) {
-        float z = 0.0f;
-        for(int j = 0; j < RESERVOIR_SIZE; j++) {
-            z += readout_weights[i][j] * h_state[j];
+static void* export_worker(void* p) {
+    ExportShared* sh = (ExportShared*)p;
+    trace_set_thread_name("export");
+    int i;
+    while((i = atomic_fetch_add(&sh->next, 1)) < sh->n_chunks) export_chunk(sh, &sh->chunks[i]);
+    return NULL;
+}
+
+static void export_run(ExportShared* sh, int pass) {
+    int threads = (sh->cfg->threads > 0)? sh->cfg->threads : 1;
+    if(threads > sh->n_chunks) threads = (sh->n_chunks > 0)? sh->n_chunks : 1;
+    sh->pass = pass;
+    atomic_store(&sh->next, 0);
+    pthread_t* th = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    for(int t = 1; t < threads; t++) pthread_create(&th[t], NULL, export_worker, sh);
+    export_worker(sh);
+    for(int t = 1; t < threads; t++) pthread_join(th[t], NULL);
+    free(th);
+}
+
+// keys_path の各行の状態を states_path / labels_path (.npy) に書く。
+// 戻り値は書いた行数 (失敗で -1)
+long export_states_npy(const ExportConfig* cfg, const char* keys_path, const char* states_path, const char* labels_path) {
+    int fd = open(keys_path, O_RDONLY);
+    if(fd < 0) return -1;
+    struct stat sb;
+    if(fstat(fd, &sb) != 0) {
+        close(fd);
+        return -1;
+    }
+    size_t in_bytes = (size_t)sb.st_size;
+    const char* in = NULL;
+    if(in_bytes > 0) {
+        void* m = mmap(NULL, in_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(m == MAP_FAILED) {
+            close(fd);
+            return -1;
         }
-        // ここでは簡易に exp(z)
-        out_probs[i] = expf(z);
-        sum_exp += out_probs[i];
+        madvise(m, in_bytes, MADV_SEQUENTIAL);
+        in = (const char*)m;
     }
-    // ソフトマックス正規化
-    for(int i = 0; i < OUT_DIM; i++) {
-        out_probs[i] /= sum_exp;
+    close(fd);
+
+    // 区間は入力の大きさだけで決める (スレッド数で出力が変わらないように)
+    ExportShared sh;
+    memset(&sh, 0, sizeof(sh));
+    sh.cfg = cfg;
+    trie_backend_pointer(&sh.tb, cfg->root);
+    int cap = (int)(in_bytes / EXPORT_CHUNK_BYTES) + 2;
+    sh.chunks = (ExportChunk*)calloc(cap, sizeof(ExportChunk));
+    for(const char* p = in; p && p < in + in_bytes; ) {
+        const char* e = (in + in_bytes - p > EXPORT_CHUNK_BYTES)? p + EXPORT_CHUNK_BYTES : in + in_bytes;
+        const char* nl = (e < in + in_bytes)? memchr(e, '\n', in + in_bytes - e) : NULL;
+        if(e < in + in_bytes) e = nl? nl + 1 : in + in_bytes;
+        sh.chunks[sh.n_chunks].begin = p;
+        sh.chunks[sh.n_chunks].end = e;
+        sh.n_chunks++;
+        p = e;
+    }
+    double t_span = trace_span_begin();
+    export_run(&sh, 1);
+    long n = 0;
+    for(int i = 0; i < sh.n_chunks; i++) {
+        sh.chunks[i].first_row = n;
+        n += sh.chunks[i].rows;
     }
+
+    long shape[3] = { n, cfg->per_depth? MAX_DEPTH : RESERVOIR_SIZE, RESERVOIR_SIZE };
+    size_t row_floats = (size_t)RESERVOIR_SIZE * (cfg->per_depth? MAX_DEPTH : 1);
+    void *smap = NULL, *lmap = NULL;
+    size_t sbytes = 0, lbytes = 0;
+    sh.states = (float*)npy_create(states_path, "<f4", shape, cfg->per_depth? 3 : 2,
+                                   sizeof(float) * row_floats * n, &smap, &sbytes);
+    sh.labels = (int*)npy_create(labels_path, "<i4", &n, 1, sizeof(int) * n, &lmap, &lbytes);
+    long result = -1;
+    if(sh.states && sh.labels) {
+        export_run(&sh, 2);
+        result = n;
+    }
+    trace_span_end("export", t_span, "rows", n);
+    if(sh.states) munmap(smap, sbytes);
+    if(sh.labels) munmap(lmap, lbytes);
+    if(in) munmap((void*)in, in_bytes);
+    free(sh.chunks);
+    return result;
 }
 
-// リードアウト部の単純学習 (クロスエントロピー誤差に対する勾配下降の例)
-void readout_train(const float* h_state, int gold_index, float lr) {
-    // 順伝搬
-    float probs[OUT_DIM];
-    readout_forward(h_state, probs);
+// =========================================================
+// メモリ使用量と構造統計
+//   - Trie ノードのバイト数 (種類別), 深度ごとのリザバー重み, リードアウト,
+//     状態キャッシュ, パイプラインの I/O バッファ
+//   - 深度ごとのノード数, 子の数 (fanout) のヒストグラム, 葉の数, 平均 key 長
+//   Trie の走査は根の子ごとにタスクを分けて複数スレッドで行う
+// =========================================================
+typedef enum {
+    NODE_KIND_INTERNAL = 0,   // 子あり, key の終端ではない
+    NODE_KIND_LEAF,           // 子なし (子ポインタ配列は全て NULL)
+    NODE_KIND_LEAF_INTERNAL,  // key の終端かつ子あり
+    NODE_KIND_COUNT
+} NodeKind;
 
-    // 勾配 = (pred - onehot(gold)) * h_state
-    for(int i = 0; i < OUT_DIM; i++) {
-        float grad = probs[i];
-        if(i == gold_index) {
-            grad -= 1.0f;
+static const char* const node_kind_names[NODE_KIND_COUNT] = {
+    "internal", "leaf", "leaf+internal"
+};
+
+typedef struct {
+    long nodes;
+    long leaves;                         // is_leaf が立っているノード数 (= 異なる key 数)
+    long leaf_depth_sum;                 // 平均 key 長 = leaf_depth_sum / leaves (MAX_DEPTH で打ち切り)
+    long nodes_per_depth[MAX_DEPTH + 1];
+    long fanout_hist[MAX_CHILDREN + 1];  // 子の数ごとのノード数
+    long kind_nodes[NODE_KIND_COUNT];
+    size_t kind_bytes[NODE_KIND_COUNT];
+} TrieStats;
+
+typedef struct {
+    TrieStats trie;
+    size_t trie_bytes;
+    size_t reservoir_bytes_per_depth;    // 1 深度分の重み行列
+    size_t reservoir_bytes;              // 全深度の合計
+    int reservoir_depths;
+    size_t readout_bytes;                // 既定 + 常駐テナントのリードアウト
+    size_t state_cache_bytes;
+    size_t io_buffer_bytes;
+    size_t total_bytes;
+} ModelStats;
+
+static void trie_stats_visit(const TrieNode* node, TrieStats* st) {
+    int fanout = 0;
+    for(int i = 0; i < MAX_CHILDREN; i++) {
+        if(node->children[i]) {
+            fanout++;
+            trie_stats_visit(node->children[i], st);
         }
-        // パラメータ更新
-        for(int j = 0; j < RESERVOIR_SIZE; j++) {
-            readout_weights[i][j] -= lr * grad * h_state[j];
+    }
+    NodeKind kind = (fanout == 0)? NODE_KIND_LEAF
+                  : node->is_leaf? NODE_KIND_LEAF_INTERNAL : NODE_KIND_INTERNAL;
+    st->nodes++;
+    st->nodes_per_depth[(node->depth <= MAX_DEPTH)? node->depth : MAX_DEPTH]++;
+    st->fanout_hist[fanout]++;
+    st->kind_nodes[kind]++;
+    st->kind_bytes[kind] += sizeof(TrieNode);
+    if(node->is_leaf) {
+        st->leaves++;
+        st->leaf_depth_sum += node->depth;
+    }
+}
+
+static void trie_stats_merge(TrieStats* dst, const TrieStats* src) {
+    dst->nodes += src->nodes;
+    dst->leaves += src->leaves;
+    dst->leaf_depth_sum += src->leaf_depth_sum;
+    for(int d = 0; d <= MAX_DEPTH; d++) dst->nodes_per_depth[d] += src->nodes_per_depth[d];
+    for(int f = 0; f <= MAX_CHILDREN; f++) dst->fanout_hist[f] += src->fanout_hist[f];
+    for(int k = 0; k < NODE_KIND_COUNT; k++) {
+        dst->kind_nodes[k] += src->kind_nodes[k];
+        dst->kind_bytes[k] += src->kind_bytes[k];
+    }
+}
+
+typedef struct {
+    TrieNode* const* tasks;  // 根の子 (部分木) の一覧
+    int n_tasks;
+    _Atomic int next;
+} TrieStatsShared;
+
+typedef struct {
+    TrieStatsShared* sh;
+    TrieStats local;
+} TrieStatsWorker;
+
+static void* trie_stats_worker(void* p) {
+    TrieStatsWorker* w = (TrieStatsWorker*)p;
+    int i;
+    while((i = atomic_fetch_add(&w->sh->next, 1)) < w->sh->n_tasks) {
+        trie_stats_visit(w->sh->tasks[i], &w->local);
+    }
+    return NULL;
+}
+
+// root 以下の構造統計を threads スレッドで集計する
+void trie_stats_collect(const TrieNode* root, int threads, TrieStats* out) {
+    memset(out, 0, sizeof(*out));
+    TrieNode* tasks[MAX_CHILDREN];
+    int n_tasks = 0, fanout = 0;
+    for(int i = 0; i < MAX_CHILDREN; i++) {
+        if(root->children[i]) tasks[n_tasks++] = root->children[i];
+    }
+    fanout = n_tasks;
+    if(threads < 1) threads = 1;
+    if(threads > n_tasks) threads = (n_tasks > 0)? n_tasks : 1;
+
+    TrieStatsShared sh = { tasks, n_tasks, 0 };
+    TrieStatsWorker* ws = (TrieStatsWorker*)calloc(threads, sizeof(TrieStatsWorker));
+    pthread_t* th = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    for(int t = 0; t < threads; t++) {
+        ws[t].sh = &sh;
+        if(t > 0) pthread_create(&th[t], NULL, trie_stats_worker, &ws[t]);
+    }
+    trie_stats_worker(&ws[0]);   // 呼び出しスレッドも 1 本分働く
+    for(int t = 0; t < threads; t++) {
+        if(t > 0) pthread_join(th[t], NULL);
+        trie_stats_merge(out, &ws[t].local);
+    }
+    free(th);
+    free(ws);
+
+    // 根自身
+    NodeKind kind = (fanout == 0)? NODE_KIND_LEAF
+                  : root->is_leaf? NODE_KIND_LEAF_INTERNAL : NODE_KIND_INTERNAL;
+    out->nodes++;
+    out->nodes_per_depth[root->depth]++;
+    out->fanout_hist[fanout]++;
+    out->kind_nodes[kind]++;
+    out->kind_bytes[kind] += sizeof(TrieNode);
+    if(root->is_leaf) {
+        out->leaves++;
+        out->leaf_depth_sum += root->depth;
+    }
+}
+
+// モデル全体のメモリ使用量を集計する (reg, pipe は NULL 可)
+void model_stats_collect(ModelStats* st, const TrieNode* root, int depth_count,
+                         const TenantRegistry* reg, const PipelineConfig* pipe, int threads) {
+    memset(st, 0, sizeof(*st));
+    trie_stats_collect(root, threads, &st->trie);
+    for(int k = 0; k < NODE_KIND_COUNT; k++) st->trie_bytes += st->trie.kind_bytes[k];
+
+    st->reservoir_depths = depth_count;
+    st->reservoir_bytes_per_depth = sizeof(float) * RESERVOIR_SIZE * RESERVOIR_SIZE;
+    st->reservoir_bytes = sizeof(float*) * depth_count;
+    // drop_f32 で解放した fp32 の重みは数えない
+    for(int l = 0; l < depth_count; l++) {
+        int dropped = reservoir_weights && l < reservoir_depth_count && reservoir_weights[l] == NULL;
+        if(!dropped) st->reservoir_bytes += st->reservoir_bytes_per_depth;
+    }
+    // 近似設定用の派生重み (int8 / CSR / 16 bit)
+    if(reservoir_weights_h) {
+        st->reservoir_bytes += (size_t)reservoir_depth_count * sizeof(unsigned short) * RESERVOIR_SIZE * RESERVOIR_SIZE;
+    }
+    if(reservoir_weights_q8) {
+        st->reservoir_bytes += (size_t)reservoir_depth_count * (RESERVOIR_SIZE * RESERVOIR_SIZE + sizeof(float) * RESERVOIR_SIZE);
+    }
+    if(reservoir_weights_csr) {
+        for(int l = 0; l < reservoir_depth_count; l++) {
+            st->reservoir_bytes += sizeof(CsrMatrix)
+                                 + (size_t)reservoir_weights_csr[l].row_ptr[RESERVOIR_SIZE] * (sizeof(int) + sizeof(float));
+        }
+    }
+
+    st->readout_bytes = sizeof(readout_weights);
+    if(reg) {
+        st->readout_bytes += sizeof(ReadoutHead) * reg->resident;
+        st->state_cache_bytes = sizeof(StateCacheEntry) * reg->state_slots;
+    }
+    if(pipe) {
+        int t = (pipe->threads > 0)? pipe->threads : 1;
+        size_t chunk = (size_t)t * pipe->batch * 4;
+        st->io_buffer_bytes = chunk * (sizeof(char*) + sizeof(float) * OUT_DIM)
+                            + (size_t)t * pipe->batch * RESERVOIR_SIZE * sizeof(float);
+    }
+    st->total_bytes = st->trie_bytes + st->reservoir_bytes + st->readout_bytes
+                    + st->state_cache_bytes + st->io_buffer_bytes;
+}
+
+void model_stats_print(FILE* fp, const ModelStats* st) {
+    const TrieStats* t = &st->trie;
+    fprintf(fp, "== memory ==\n");
+    fprintf(fp, "%-28s %14zu bytes\n", "trie nodes", st->trie_bytes);
+    for(int k = 0; k < NODE_KIND_COUNT; k++) {
+        fprintf(fp, "  %-26s %14zu bytes (%ld nodes x %zu)\n", node_kind_names[k],
+                t->kind_bytes[k], t->kind_nodes[k], sizeof(TrieNode));
+    }
+    fprintf(fp, "%-28s %14zu bytes (%d depths x %zu)\n", "reservoir weights",
+            st->reservoir_bytes, st->reservoir_depths, st->reservoir_bytes_per_depth);
+    fprintf(fp, "%-28s %14zu bytes\n", "readout", st->readout_bytes);
+    fprintf(fp, "%-28s %14zu bytes\n", "state caches", st->state_cache_bytes);
+    fprintf(fp, "%-28s %14zu bytes\n", "I/O buffers", st->io_buffer_bytes);
+    fprintf(fp, "%-28s %14zu bytes\n", "total", st->total_bytes);
+
+    fprintf(fp, "== trie ==\n");
+    fprintf(fp, "nodes %ld, leaves (keys) %ld, avg key length %.2f (capped at %d)\n",
+            t->nodes, t->leaves, t->leaves? (double)t->leaf_depth_sum / t->leaves : 0.0, MAX_DEPTH);
+    fprintf(fp, "nodes per depth:\n");
+    for(int d = 0; d <= MAX_DEPTH; d++) {
+        if(t->nodes_per_depth[d]) fprintf(fp, "  depth %2d: %ld\n", d, t->nodes_per_depth[d]);
+    }
+    fprintf(fp, "fanout histogram (children: nodes):\n");
+    for(int f = 0; f <= MAX_CHILDREN; f++) {
+        if(t->fanout_hist[f]) fprintf(fp, "  %3d: %ld\n", f, t->fanout_hist[f]);
+    }
+}
+
+// ベンチマーク等から本ファイルを #include する場合は TRLM_NO_MAIN を定義して
+// サブコマンドと main を外す
+#ifndef TRLM_NO_MAIN
+
+// -------------------------
+// サブコマンド: score
+//   trlm score VOCAB INPUT OUTPUT [--threads N] [--batch N] [--seed N]
+//                                 [--trace PATH] [--trace-sample N] [--numa 0|1] [--bucket 0|1]
+//                                 [--readout PATH]
+//   VOCAB の各行で Trie を作り、INPUT の各行の出力確率を OUTPUT に書く。
+//   リードアウト重みは --readout の readout_save 形式のファイルから読む。リザバー重みは
+//   --seed (既定 42) から決まるので、学習した時と同じ種を渡す。--readout が無ければ
+//   未学習の乱数重みで計算し、その旨を警告する (出力に意味は無い)
+// -------------------------
+static int cmd_score(int argc, char** argv) {
+    if(argc < 4) {
+        fprintf(stderr, "usage: trlm score VOCAB INPUT OUTPUT [--threads N] [--batch N] [--seed N]"
+                        " [--trace PATH] [--trace-sample N] [--numa 0|1] [--bucket 0|1]"
+                        " [--readout PATH]\n");
+        return 1;
+    }
+    PipelineConfig cfg = { NULL, 4, 64, 0, 0, NULL, 42 };
+    unsigned int seed = 42;
+    const char* trace_path = NULL;
+    const char* readout_path = NULL;
+    int trace_sample = 1;
+    for(int i = 4; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "--threads") == 0) cfg.threads = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "--batch") == 0) cfg.batch = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "--seed") == 0) seed = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+        else if(strcmp(argv[i], "--trace") == 0) trace_path = argv[i + 1];
+        else if(strcmp(argv[i], "--trace-sample") == 0) trace_sample = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "--numa") == 0) cfg.numa = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "--bucket") == 0) cfg.bucket = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "--readout") == 0) readout_path = argv[i + 1];
+    }
+    cfg.seed = seed;
+    if(cfg.batch < 1) cfg.batch = 1;
+
+    init_reservoir_weights_seeded(MAX_DEPTH, seed);
+    init_readout();
+    if(readout_path) {
+        if(readout_load(readout_path, &readout_weights[0][0]) != 0) {
+            fprintf(stderr, "score: cannot load readout %s\n", readout_path);
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "score: warning: no --readout given; using untrained random readout"
+                        " weights, output probabilities are not meaningful\n");
+    }
+
+    FILE* vf = fopen(argv[1], "r");
+    FILE* in = fopen(argv[2], "r");
+    FILE* out = fopen(argv[3], "w");
+    if(!vf || !in || !out) {
+        fprintf(stderr, "score: cannot open input/output files\n");
+        if(vf) fclose(vf);
+        if(in) fclose(in);
+        if(out) fclose(out);
+        return 1;
+    }
+    cfg.root = create_trie_node(0);
+    long n_vocab = trie_insert_file(cfg.root, vf);
+    fclose(vf);
+
+    if(trace_path) trace_start(trace_sample);
+    double t0 = now_seconds();
+    long n = pipeline_score(&cfg, in, out);
+    double dt = now_seconds() - t0;
+    if(trace_path && trace_stop(trace_path) != 0) {
+        fprintf(stderr, "score: cannot write trace %s\n", trace_path);
+    }
+    fprintf(stderr, "score: vocab=%ld rows=%ld %.3fs (%.0f rows/s)\n", n_vocab, n, dt, n / dt);
+
+    fclose(in);
+    fclose(out);
+    trie_free(cfg.root);
+    return 0;
+}
+
+// -------------------------
+// サブコマンド: stats
+//   trlm stats VOCAB [--threads N] [--batch N]
+//   VOCAB から Trie を作り、メモリ使用量と構造統計を表示する
+//   (--threads / --batch は集計スレッド数と score 用 I/O バッファの見積もり)
+// -------------------------
+static int cmd_stats(int argc, char** argv) {
+    if(argc < 2) {
+        fprintf(stderr, "usage: trlm stats VOCAB [--threads N] [--batch N]\n");
+        return 1;
+    }
+    PipelineConfig cfg = { NULL, 4, 64, 0, 0, NULL, 42 };
+    for(int i = 2; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "--threads") == 0) cfg.threads = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "--batch") == 0) cfg.batch = atoi(argv[i + 1]);
+    }
+    FILE* vf = fopen(argv[1], "r");
+    if(!vf) {
+        fprintf(stderr, "stats: cannot open %s\n", argv[1]);
+        return 1;
+    }
+    cfg.root = create_trie_node(0);
+    long n_lines = 0, len_sum = 0;
+    char* line;
+    while((line = read_key_line(vf)) != NULL) {
+        if(line[0] != '\0') {
+            trie_insert(cfg.root, line);
+            n_lines++;
+            len_sum += (long)strlen(line);
         }
+        free(line);
+    }
+    fclose(vf);
+
+    double t0 = now_seconds();
+    ModelStats st;
+    model_stats_collect(&st, cfg.root, MAX_DEPTH, NULL, &cfg, cfg.threads);
+    double dt = now_seconds() - t0;
+    printf("keys in file %ld, avg raw key length %.2f\n", n_lines, n_lines? (double)len_sum / n_lines : 0.0);
+    model_stats_print(stdout, &st);
+    printf("(collected in %.3f s with %d threads)\n", dt, cfg.threads);
+    trie_free(cfg.root);
+    return 0;
+}
+
+// -------------------------
+// サブコマンド: export
+//   trlm export VOCAB KEYS STATES.npy LABELS.npy [--threads N] [--seed N] [--per-depth 0|1]
+//   VOCAB の各行で Trie を作り、KEYS の各行の状態と label を .npy に書く
+// -------------------------
+static int cmd_export(int argc, char** argv) {
+    if(argc < 5) {
+        fprintf(stderr, "usage: trlm export VOCAB KEYS STATES.npy LABELS.npy [--threads N] [--seed N]"
+                        " [--per-depth 0|1]\n");
+        return 1;
+    }
+    ExportConfig cfg = { NULL, 4, 0, 42 };
+    for(int i = 5; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "--threads") == 0) cfg.threads = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "--seed") == 0) cfg.seed = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+        else if(strcmp(argv[i], "--per-depth") == 0) cfg.per_depth = atoi(argv[i + 1]);
+    }
+    FILE* vf = fopen(argv[1], "r");
+    if(!vf) {
+        fprintf(stderr, "export: cannot open %s\n", argv[1]);
+        return 1;
+    }
+    cfg.root = create_trie_node(0);
+    long n_vocab = trie_insert_file(cfg.root, vf);
+    fclose(vf);
+    init_reservoir_weights_seeded(MAX_DEPTH, cfg.seed);
+
+    double t0 = now_seconds();
+    long n = export_states_npy(&cfg, argv[2], argv[3], argv[4]);
+    double dt = now_seconds() - t0;
+    trie_free(cfg.root);
+    if(n < 0) {
+        fprintf(stderr, "export: cannot read %s or write %s / %s\n", argv[2], argv[3], argv[4]);
+        return 1;
     }
+    size_t row_bytes = sizeof(float) * RESERVOIR_SIZE * (cfg.per_depth? MAX_DEPTH : 1);
+    fprintf(stderr, "export: vocab=%ld rows=%ld %.3fs (%.0f rows/s, %.1f MB/s)\n", n_vocab, n, dt,
+            n / dt, n * (double)row_bytes / dt / 1e6);
+    return 0;
 }
 
 // -------------------------
 // メイン関数
 // -------------------------
-int main(void) {
+int main(int argc, char** argv) {
+    // サブコマンド (引数無しなら以下のサンプルを実行)
+    if(argc >= 2 && strcmp(argv[1], "score") == 0) return cmd_score(argc - 1, argv + 1);
+    if(argc >= 2 && strcmp(argv[1], "stats") == 0) return cmd_stats(argc - 1, argv + 1);
+    if(argc >= 2 && strcmp(argv[1], "export") == 0) return cmd_export(argc - 1, argv + 1);
+
     // 1. Trie 構築 (サンプル文字列をいくつか挿入)
     TrieNode* root = create_trie_node(0);
     trie_insert(root, "hello");
@@ -289,16 +6341,14 @@ int main(void) {
     }
 
     // 6. 後始末 (メモリ解放など)
-    // 実際には Trie ノードの再帰解放が必要
-    // サンプルでは省略
-
     if(reservoir_weights) {
         for(int l = 0; l < MAX_DEPTH; l++) {
             if(reservoir_weights[l]) free(reservoir_weights[l]);
         }
         free(reservoir_weights);
     }
-    // TrieNode の解放(省略) ...
+    trie_free(root);
 
     return 0;
 }
+#endif // TRLM_NO_MAIN